@@ -0,0 +1,113 @@
+#include <gtest/gtest.h>
+#include <cstring>
+#include <fcntl.h>
+
+#include "environment-variables.hh"
+#include "eval-cache.hh"
+#include "file-system.hh"
+#include "tests/libexpr.hh"
+
+namespace nix::eval_cache {
+
+class EvalCacheTest : public LibExprTest
+{
+protected:
+    AutoDelete tmpDir{createTempDir(), true};
+    Hash fingerprint = hashString(HashAlgorithm::SHA256, "eval-cache-test");
+
+    EvalCacheTest()
+    {
+        setEnv("NIX_CACHE_HOME", (tmpDir.path() / "cache").string().c_str());
+    }
+
+    ~EvalCacheTest()
+    {
+        unsetenv("NIX_CACHE_HOME");
+    }
+
+    Path cacheFile()
+    {
+        return (tmpDir.path() / "cache" / "eval-cache-v6" / (fingerprint.to_string(HashFormat::Base16, false) + ".attrs")).string();
+    }
+
+    /**
+     * Evaluate the string attribute `name` of `expr` through a new
+     * evaluation cache, which writes it to the cache file when it goes
+     * away.
+     */
+    std::string evalString(const std::string & expr, std::string_view name)
+    {
+        auto cache = std::make_shared<EvalCache>(std::cref(fingerprint), state, [&]() {
+            auto v = state.allocValue();
+            *v = eval(expr);
+            return v;
+        });
+        return cache->getRoot()->getAttr(name)->getString();
+    }
+
+    /**
+     * Look up the string attribute `name` through a new evaluation
+     * cache, which must not have to evaluate anything.
+     */
+    std::string cachedString(std::string_view name)
+    {
+        auto cache = std::make_shared<EvalCache>(std::cref(fingerprint), state, []() -> Value * {
+            throw Error("the attribute is not in the evaluation cache");
+        });
+        return cache->getRoot()->getAttr(name)->getString();
+    }
+
+    /**
+     * The number of segments in the cache file, according to their
+     * headers.
+     */
+    size_t countSegments()
+    {
+        auto contents = readFile(cacheFile());
+        size_t n = 0;
+        for (size_t offset = 0; offset + 16 <= contents.size(); ++n) {
+            uint64_t size;
+            std::memcpy(&size, contents.data() + offset + 8, sizeof(size));
+            if (!size) break;
+            offset += size;
+        }
+        return n;
+    }
+};
+
+TEST_F(EvalCacheTest, writeAfterTruncatedSegment)
+{
+    ASSERT_EQ(evalString("{ a = \"x\"; }", "a"), "x");
+
+    /* Simulate a process that was killed while appending a segment. */
+    auto contents = readFile(cacheFile());
+    {
+        AutoCloseFD fd = toDescriptor(open(cacheFile().c_str(), O_WRONLY | O_APPEND | O_CLOEXEC));
+        ASSERT_TRUE(fd);
+        writeFull(fd.get(), contents.substr(0, contents.size() / 2));
+    }
+
+    ASSERT_EQ(evalString("{ b = \"y\"; }", "b"), "y");
+
+    ASSERT_EQ(cachedString("a"), "x");
+    ASSERT_EQ(cachedString("b"), "y");
+}
+
+TEST_F(EvalCacheTest, compaction)
+{
+    std::string expr = "{";
+    for (int i = 0; i < 20; ++i)
+        expr += fmt(" a%d = \"%d\";", i, i);
+    expr += " }";
+
+    /* Each cache appends a segment. */
+    for (int i = 0; i < 20; ++i)
+        ASSERT_EQ(evalString(expr, fmt("a%d", i)), std::to_string(i));
+
+    ASSERT_LT(countSegments(), 16);
+
+    for (int i = 0; i < 20; ++i)
+        ASSERT_EQ(cachedString(fmt("a%d", i)), std::to_string(i));
+}
+
+}
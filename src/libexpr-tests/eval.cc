@@ -1,7 +1,10 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <thread>
 
 #include "eval.hh"
+#include "finally.hh"
+#include "print.hh"
 #include "tests/libexpr.hh"
 
 namespace nix {
@@ -138,6 +141,34 @@ TEST(nix_isAllowedURI, non_scheme_colon) {
     ASSERT_FALSE(isAllowedURI("https://foo/bar:baz", allowed));
 }
 
+TEST(SymbolTable, createsSymbolsConcurrently) {
+    SymbolTable symbols;
+    const int nrSymbols = 10000;
+
+    std::vector<std::vector<Symbol>> created(4);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < created.size(); ++t)
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < nrSymbols; ++i)
+                created[t].push_back(symbols.create(fmt("s%d", i)));
+        });
+    for (auto & thread : threads)
+        thread.join();
+
+    ASSERT_EQ(symbols.size(), nrSymbols);
+    for (auto & c : created)
+        ASSERT_EQ(c, created[0]);
+    for (int i = 0; i < nrSymbols; ++i)
+        ASSERT_EQ(std::string_view(symbols[created[0][i]]), fmt("s%d", i));
+
+    /* Symbols that don't fit in a chunk of the arena. */
+    std::string huge(16 << 20, 'x');
+    auto s = symbols.create(huge);
+    ASSERT_EQ(symbols.create(huge), s);
+    ASSERT_EQ(std::string_view(symbols[s]), huge);
+    ASSERT_EQ(std::string_view(symbols[symbols.create("next")]), "next");
+}
+
 class EvalStateTest : public LibExprTest {};
 
 TEST_F(EvalStateTest, getBuiltins_ok) {
@@ -161,4 +192,166 @@ TEST_F(EvalStateTest, getBuiltin_fail) {
     ASSERT_THROW(state.getBuiltin("nonexistent"), EvalError);
 }
 
+TEST_F(EvalStateTest, parseCache) {
+    AutoDelete tmpDir(createTempDir(), true);
+    setEnv("NIX_CACHE_HOME", (tmpDir.path() / "cache").string().c_str());
+    Finally restoreEnv([]() { unsetenv("NIX_CACHE_HOME"); });
+
+    std::string text = R"(
+        let
+          x = { y = 1; };
+          inherit (x) y;
+          /** Adds two numbers. */
+          f = { a, b ? 2, ... }@args: a + b;
+        in rec {
+          pos = (builtins.unsafeGetAttrPos "y" x).line;
+          sum = f { a = y; };
+          str = "${toString sum}-${baseNameOf ./foo}";
+          list = [ 1.5 null (-3) (x ? y) (!true || false) ];
+          attrs = { "${str}" = with x; y; };
+          dir = toString ./.;
+        }
+    )";
+
+    /* The second time, the file is read from the cache, even though
+       it's in a different directory. */
+    std::string results[2];
+    for (size_t n = 0; n < 2; ++n) {
+        auto dir = tmpDir.path() / fmt("dir%d", n);
+        createDirs(dir.string());
+        auto file = dir / "default.nix";
+        writeFile(file.string(), text);
+
+        auto e = state.parseExprFromFile(state.rootPath(CanonPath(file.string())));
+        auto & v = *state.allocValue();
+        state.eval(e, v);
+        state.forceValueDeep(v);
+        std::ostringstream str;
+        e->show(state.symbols, str);
+        str << " = ";
+        printValue(state, str, v);
+
+        ASSERT_THAT(str.str(), testing::HasSubstr("dir = \"" + dir.string() + "\";"));
+        results[n] = replaceStrings(str.str(), dir.string(), "DIR");
+    }
+
+    auto cacheDir = tmpDir.path() / "cache" / "parse-cache-v2";
+    ASSERT_EQ(std::distance(std::filesystem::directory_iterator(cacheDir), {}), 2); // the entry and `last-evicted`
+    ASSERT_EQ(results[0], results[1]);
+    ASSERT_THAT(results[1], testing::HasSubstr("pos = 3;"));
+    ASSERT_THAT(results[1], testing::HasSubstr("str = \"3-foo\";"));
+}
+
+class BytecodeTest : public LibExprTest
+{
+protected:
+    BytecodeTest()
+        : bytecodeState({}, store, fetchSettings, bytecodeSettings, nullptr)
+    {
+        bytecodeSettings.evalBytecode = true;
+    }
+
+    /**
+     * Evaluate `input` deeply, and print the result or the error.
+     */
+    static std::string evalToString(EvalState & state, std::string input)
+    {
+        try {
+            auto & v = *state.allocValue();
+            state.eval(state.parseExprFromString(input, state.rootPath(CanonPath::root)), v);
+            state.forceValueDeep(v);
+            std::ostringstream str;
+            printValue(state, str, v);
+            return str.str();
+        } catch (Error & e) {
+            std::ostringstream str;
+            showErrorInfo(str, e.info(), true);
+            return str.str();
+        }
+    }
+
+    /**
+     * Check that the bytecode gives the same results as the
+     * tree-walking evaluator.
+     */
+    void check(std::string input)
+    {
+        ASSERT_EQ(evalToString(bytecodeState, input), evalToString(state, input)) << input;
+    }
+
+    bool bytecodeReadOnlyMode = true;
+    EvalSettings bytecodeSettings{bytecodeReadOnlyMode};
+    EvalState bytecodeState;
+};
+
+TEST_F(BytecodeTest, matchesTreeWalker) {
+    for (auto & input : {
+        "let x = { a.b = 1; c = null; }; in [ x.a.b (x.a.c or 2) (x.c.d or 3) (x ? a.b) (x ? a.c) ]",
+        "let f = n: if n == 0 then [] else [ n ] ++ f (n - 1); in f 5",
+        "let t = true; f = false; in [ (t && f) (t || f) (f -> t) (!t) (t && !f || f) (1 != 2) ([1] == [1]) ]",
+        "let lib = { attrByPath = p: d: s: if p == [] then s else if s ? ${builtins.head p} then lib.attrByPath (builtins.tail p) d s.${builtins.head p} else d; }; in lib.attrByPath [ \"a\" \"b\" ] 0 { a.b = 42; }",
+        "let x = 1; in with { y = 2; }; assert x + y == 3; if y > x then \"yes\" else \"no\"",
+        "let x = { a = 1; }; in x.b",
+        "let x = { a = 1; }; in x.a.b",
+        "if 1 then 2 else 3",
+        "!(1 == 1) || 2",
+        "true && (throw \"oops\")",
+        "let x = 1; in assert x == 2; x",
+        "assert false -> true; let s = { a = { b = { c = throw \"deep\"; }; }; }; in s.a.b.c",
+    })
+        check(input);
+}
+
+class ParallelEvalTest : public LibExprTest
+{
+protected:
+    ParallelEvalTest()
+        : parallelState({}, store, fetchSettings, parallelSettings(), nullptr)
+    {
+    }
+
+    EvalSettings & parallelSettings()
+    {
+        evalSettings.evalCores = 4;
+        return evalSettings;
+    }
+
+    Value & evalDeep(std::string input)
+    {
+        auto & v = *parallelState.allocValue();
+        parallelState.eval(parallelState.parseExprFromString(input, parallelState.rootPath(CanonPath::root)), v);
+        parallelState.forceValueDeep(v);
+        return v;
+    }
+
+    EvalState parallelState;
+};
+
+TEST_F(ParallelEvalTest, forceValueDeep) {
+    /* Many values are shared between attributes, so threads often
+       force the same thunk. */
+    auto & v = evalDeep(R"(
+        let
+          tree = n: if n == 0 then [ shared ] else [ (tree (n - 1)) (tree (n - 1)) ];
+          shared = builtins.foldl' (x: y: x + y) 0 (builtins.genList (x: x) 1000);
+        in {
+          a = tree 10;
+          b = builtins.listToAttrs (map (n: { name = "x${toString n}"; value = shared + n; }) (builtins.genList (x: x) 1000));
+        }
+    )");
+
+    ASSERT_EQ(v.attrs()->size(), 2);
+    auto b = v.attrs()->get(parallelState.symbols.create("b"));
+    ASSERT_NE(b, nullptr);
+    ASSERT_EQ(b->value->attrs()->size(), 1000);
+    auto x999 = b->value->attrs()->get(parallelState.symbols.create("x999"));
+    ASSERT_NE(x999, nullptr);
+    ASSERT_EQ(x999->value->integer().value, 499500 + 999);
+}
+
+TEST_F(ParallelEvalTest, detectsInfiniteRecursion) {
+    /* The threads forcing `a` and `b` wait for each other. */
+    ASSERT_THROW(evalDeep("let x = { a = x.b; b = x.a; }; in x"), InfiniteRecursionError);
+}
+
 } // namespace nix
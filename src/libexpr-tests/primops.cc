@@ -219,6 +219,21 @@ namespace nix {
         ASSERT_THAT(*key->value, IsIntEq(123));
     }
 
+    TEST_F(PrimOpTest, listToAttrsLarge) {
+        /* Large enough to have a hash index. */
+        auto v = eval("builtins.listToAttrs (builtins.genList (n: { name = \"a${toString (n * 7 % 1000)}\"; value = n; }) 2000)");
+        ASSERT_THAT(v, IsAttrsOfSize(1000));
+        for (auto n : {0, 1, 499, 999}) {
+            auto attr = v.attrs()->get(createSymbol(fmt("a%d", n).c_str()));
+            ASSERT_NE(attr, nullptr);
+            /* The first occurrence of a name wins. */
+            state.forceValue(*attr->value, noPos);
+            ASSERT_THAT(*attr->value, IsIntEq(n * 143 % 1000));
+        }
+        ASSERT_EQ(v.attrs()->get(createSymbol("a1000")), nullptr);
+        ASSERT_EQ(v.attrs()->find(createSymbol("b")), v.attrs()->end());
+    }
+
     TEST_F(PrimOpTest, intersectAttrs) {
         auto v = eval("builtins.intersectAttrs { a = 1; b = 2; } { b = 3; c = 4; }");
         ASSERT_THAT(v, IsAttrsOfSize(1));
@@ -636,8 +651,8 @@ namespace nix {
         auto v = eval("derivation");
         ASSERT_EQ(v.type(), nFunction);
         ASSERT_TRUE(v.isLambda());
-        ASSERT_NE(v.payload.lambda.fun, nullptr);
-        ASSERT_TRUE(v.payload.lambda.fun->hasFormals());
+        ASSERT_NE(v.lambda().fun, nullptr);
+        ASSERT_TRUE(v.lambda().fun->hasFormals());
     }
 
     TEST_F(PrimOpTest, currentTime) {
@@ -736,6 +751,21 @@ namespace nix {
         ASSERT_EQ(v.string_view(), "foo%bar%baz");
     }
 
+    TEST_F(PrimOpTest, concatStringsSepLarge) {
+        auto v = eval(R"(
+            let
+              lines = builtins.genList (n: "line ${toString n}") 1000;
+              text = builtins.concatStringsSep "\n" lines;
+            in
+              builtins.concatStringsSep "\n" [ text text ]
+        )");
+        ASSERT_EQ(v.type(), nString);
+        std::string text;
+        for (int n = 0; n < 1000; ++n)
+            text += (n ? "\n" : "") + std::string("line ") + std::to_string(n);
+        ASSERT_EQ(v.string_view(), text + "\n" + text);
+    }
+
     TEST_F(PrimOpTest, split1) {
         // v = [ "" [ "a" ] "c" ]
         auto v = eval("builtins.split \"(a)b\" \"abc\"");
@@ -0,0 +1,65 @@
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <vector>
+
+#include "temporary-arena.hh"
+
+namespace nix {
+
+TEST(TemporaryArena, reusesFreedMemory)
+{
+    auto & arena = TemporaryArena::get();
+
+    auto p1 = static_cast<char *>(arena.allocate(100));
+    auto p2 = static_cast<char *>(arena.allocate(200));
+    ASSERT_GE(p2, p1 + 100);
+
+    /* p1 is below p2, so it can't be reused yet. */
+    arena.deallocate(p1, 100);
+    auto p3 = static_cast<char *>(arena.allocate(100));
+    ASSERT_GT(p3, p2);
+
+    /* Now everything has been freed. */
+    arena.deallocate(p3, 100);
+    arena.deallocate(p2, 200);
+    auto p4 = arena.allocate(100);
+    ASSERT_EQ(p4, p1);
+    arena.deallocate(p4, 100);
+}
+
+TEST(TemporaryArena, spansChunks)
+{
+    auto & arena = TemporaryArena::get();
+
+    auto first = arena.allocate(16);
+    arena.deallocate(first, 16);
+
+    std::vector<std::pair<char *, size_t>> allocs;
+    for (size_t n = 0; n < 100; ++n) {
+        size_t size = n == 50 ? 1 << 20 : 10000 + n;
+        auto p = static_cast<char *>(arena.allocate(size));
+        std::memset(p, (int) n, size);
+        allocs.emplace_back(p, size);
+    }
+
+    for (size_t n = 0; n < allocs.size(); ++n) {
+        auto [p, size] = allocs[n];
+        ASSERT_EQ(p[0], (char) n);
+        ASSERT_EQ(p[size - 1], (char) n);
+    }
+
+    /* Freed memory is cleared. */
+    arena.deallocate(allocs[10].first, allocs[10].second);
+    ASSERT_EQ(allocs[10].first[0], 0);
+
+    for (size_t n = allocs.size(); n-- > 0; )
+        if (n != 10)
+            arena.deallocate(allocs[n].first, allocs[n].second);
+
+    auto p = arena.allocate(16);
+    ASSERT_EQ(p, first);
+    arena.deallocate(p, 16);
+}
+
+}
@@ -71,6 +71,80 @@ namespace nix {
         ASSERT_THAT(*b->value, IsIntEq(2));
     }
 
+    TEST_F(TrivialExpressionTest, updateAttrsLayered) {
+        /* Small updates of a large set are layered on top of it, and
+           deep stacks of layers are flattened. */
+        auto v = eval(R"(
+            let
+              big = builtins.listToAttrs (builtins.genList (n: { name = "a${toString n}"; value = n; }) 100);
+            in
+              builtins.foldl' (s: n: s // { "a${toString (n * 5)}" = -n; "b${toString n}" = n; }) big (builtins.genList (n: n) 20)
+        )");
+        ASSERT_THAT(v, IsAttrsOfSize(120));
+
+        for (auto [name, value] : std::vector<std::pair<std::string, int>>{{"a0", 0}, {"a3", 3}, {"a5", -1}, {"a90", -18}, {"a99", 99}, {"b19", 19}}) {
+            auto attr = v.attrs()->get(createSymbol(name.c_str()));
+            ASSERT_NE(attr, nullptr);
+            state.forceValue(*attr->value, noPos);
+            ASSERT_THAT(*attr->value, IsIntEq(value));
+        }
+        ASSERT_EQ(v.attrs()->get(createSymbol("a100")), nullptr);
+
+        size_t n = 0;
+        const Attr * prev = nullptr;
+        for (auto & attr : *v.attrs()) {
+            if (prev) ASSERT_LT(prev->name, attr.name);
+            prev = &attr;
+            n++;
+        }
+        ASSERT_EQ(n, 120);
+    }
+
+    TEST_F(TrivialExpressionTest, selectDifferentShapes) {
+        /* The same select sites see attribute sets with different
+           layouts, some of them layered, so their cached positions
+           are often wrong. */
+        auto v = eval(R"(
+            let
+              big = builtins.listToAttrs (builtins.genList (n: { name = "a${toString n}"; value = n; }) 40);
+              sets = [ { x = 1; } { a = 0; x = 2; } { a = 0; b = 0; x = 3; } (big // { x = 4; }) (big // { a39 = 5; x = 6; }) { y = 7; } ];
+              get = s: s.x or s.a39 or s.y;
+            in
+              map get (sets ++ sets)
+        )");
+        ASSERT_EQ(v.listSize(), 12);
+        int expected[] = {1, 2, 3, 4, 6, 7};
+        for (size_t n = 0; n < 12; ++n) {
+            state.forceValue(*v.listElems()[n], noPos);
+            ASSERT_THAT(*v.listElems()[n], IsIntEq(expected[n % 6]));
+        }
+    }
+
+    TEST_F(TrivialExpressionTest, repeatedConcatenation) {
+        /* Large results are ropes that refer to the accumulator, which
+           is only flattened once its contents are needed. */
+        auto v = eval(R"(
+            let
+              s = builtins.foldl' (s: n: "${s}${toString n},") "" (builtins.genList (n: n) 10000);
+            in
+              [ s (builtins.stringLength s) (builtins.substring 0 10 s) (s + "end") ]
+        )");
+        ASSERT_EQ(v.listSize(), 4);
+        auto & s = *v.listElems()[0];
+        state.forceValue(s, noPos);
+        ASSERT_NE(s.stringRope(), nullptr);
+        std::string expected;
+        for (int n = 0; n < 10000; ++n)
+            expected += std::to_string(n) + ",";
+        ASSERT_EQ(s.string_view(), expected);
+        state.forceValue(*v.listElems()[1], noPos);
+        ASSERT_THAT(*v.listElems()[1], IsIntEq((int64_t) expected.size()));
+        state.forceValue(*v.listElems()[2], noPos);
+        ASSERT_THAT(*v.listElems()[2], IsStringEq("0,1,2,3,4,"));
+        state.forceValue(*v.listElems()[3], noPos);
+        ASSERT_THAT(*v.listElems()[3], IsStringEq(expected + "end"));
+    }
+
     TEST_F(TrivialExpressionTest, hasAttrOpFalse) {
         auto v = eval("{} ? a");
         ASSERT_THAT(v, IsFalse());
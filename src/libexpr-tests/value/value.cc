@@ -22,4 +22,65 @@ TEST_F(ValueTest, vInt)
     ASSERT_EQ(true, vInt.isValid());
 }
 
+TEST_F(ValueTest, isCompact)
+{
+    if (sizeof(void *) == 8)
+        ASSERT_EQ(sizeof(Value), 16);
+}
+
+TEST_F(ValueTest, roundTrips)
+{
+    Value v;
+
+    v.mkInt(std::numeric_limits<NixInt::Inner>::min());
+    ASSERT_EQ(nInt, v.type());
+    ASSERT_EQ(std::numeric_limits<NixInt::Inner>::min(), v.integer().value);
+
+    v.mkBool(true);
+    ASSERT_EQ(nBool, v.type());
+    ASSERT_TRUE(v.boolean());
+
+    v.mkFloat(-1.5);
+    ASSERT_EQ(nFloat, v.type());
+    ASSERT_EQ(-1.5, v.fpoint());
+
+    v.mkNull();
+    ASSERT_EQ(nNull, v.type());
+
+    const char * context[] = {"foo", nullptr};
+    v.mkString("bar", context);
+    ASSERT_EQ(nString, v.type());
+    ASSERT_EQ("bar", v.string_view());
+    ASSERT_EQ(context, v.context());
+}
+
+TEST_F(ValueTest, functionsAndThunks)
+{
+    alignas(8) static char env[8], expr[8];
+    Value v, left, right;
+
+    v.mkThunk((Env *) env, (Expr *) expr);
+    ASSERT_TRUE(v.isThunk());
+    ASSERT_EQ((Env *) env, v.thunk().env);
+    ASSERT_EQ((Expr *) expr, v.thunk().expr);
+    ASSERT_TRUE(v.markPending(tThunk, true));
+    ASSERT_TRUE(v.isBlackhole());
+    ASSERT_EQ((Env *) env, v.thunk().env);
+    ASSERT_FALSE(v.markPending(tThunk, true));
+
+    v.mkLambda((Env *) env, (ExprLambda *) expr);
+    ASSERT_TRUE(v.isLambda());
+    ASSERT_EQ((Env *) env, v.lambda().env);
+    ASSERT_EQ((ExprLambda *) expr, v.lambda().fun);
+
+    v.mkPrimOpApp(&left, &right);
+    ASSERT_TRUE(v.isPrimOpApp());
+    ASSERT_EQ(&left, v.primOpApp().left);
+    ASSERT_EQ(&right, v.primOpApp().right);
+
+    v.mkApp(&left, &right);
+    ASSERT_TRUE(v.isApp());
+    ASSERT_EQ(&right, v.app().right);
+}
+
 } // namespace nix
@@ -19,7 +19,42 @@ Bindings * EvalState::allocBindings(size_t capacity)
         throw Error("attribute set of size %d is too big", capacity);
     nrAttrsets++;
     nrAttrsInAttrsets += capacity;
-    return new (allocBytes(sizeof(Bindings) + sizeof(Attr) * capacity)) Bindings((Bindings::size_t) capacity);
+    return new (allocBytes(
+            sizeof(Bindings)
+            + sizeof(Attr) * capacity
+            + sizeof(uint32_t) * Bindings::indexSlots(capacity)))
+        Bindings((Bindings::size_t) capacity);
+}
+
+
+Bindings * EvalState::allocLayeredBindings(const Bindings & base, const Bindings & update)
+{
+    assert(update.size() < Bindings::indexThreshold);
+
+    /* Put the new layer on top of the flattened base, if there is
+       one. */
+    auto baseLayer = &base;
+    if (base.baseLayer)
+        if (auto flat = base.flattened().load(std::memory_order_acquire))
+            baseLayer = flat;
+
+    auto capacity = update.size();
+    nrAttrsets++;
+    nrAttrsInAttrsets += capacity;
+    auto bindings = new (allocBytes(sizeof(Bindings) + sizeof(Attr) * capacity + sizeof(std::atomic<Bindings *>)))
+        Bindings((Bindings::size_t) capacity);
+    new (&bindings->flattened()) std::atomic<Bindings *>(nullptr);
+
+    auto size = baseLayer->size();
+    for (auto & attr : update) {
+        bindings->push_back(attr);
+        if (!baseLayer->get(attr.name)) size++;
+    }
+
+    bindings->baseLayer = baseLayer;
+    bindings->size_ = size;
+
+    return bindings;
 }
 
 
@@ -37,9 +72,89 @@ Value & BindingsBuilder::alloc(std::string_view name, PosIdx pos)
 }
 
 
+std::atomic<uint64_t> Bindings::nrFlattened{0};
+
+
+Bindings * Bindings::flatten() const
+{
+    auto & cache = flattened();
+    if (auto flat = cache.load(std::memory_order_acquire)) return flat;
+
+    /* Collect the layers from top to bottom, stopping at a layer that
+       has already been flattened. */
+    std::vector<const Bindings *> layers;
+    for (auto layer = this; layer; layer = layer->baseLayer) {
+        if (layer != this && layer->baseLayer)
+            if (auto flat = layer->flattened().load(std::memory_order_acquire)) {
+                layers.push_back(flat);
+                break;
+            }
+        layers.push_back(layer);
+    }
+
+    auto flat = new (allocBytes(sizeof(Bindings) + sizeof(Attr) * size_ + sizeof(uint32_t) * indexSlots(size_)))
+        Bindings(size_);
+    flat->pos = pos;
+
+    /* Merge the layers, preferring attributes from higher layers. */
+    std::vector<const Attr *> next, ends;
+    for (auto layer : layers) {
+        next.push_back(&layer->attrs[0]);
+        ends.push_back(&layer->attrs[layer->layerSize()]);
+    }
+
+    while (true) {
+        const Attr * attr = nullptr;
+        for (size_t n = 0; n < layers.size(); ++n)
+            if (next[n] != ends[n] && (!attr || next[n]->name < attr->name))
+                attr = next[n];
+        if (!attr) break;
+        flat->push_back(*attr);
+        auto name = attr->name;
+        for (size_t n = 0; n < layers.size(); ++n)
+            if (next[n] != ends[n] && next[n]->name == name) ++next[n];
+    }
+
+    assert(flat->size_ == size_);
+    flat->buildIndex();
+
+    Bindings * expected = nullptr;
+    if (!cache.compare_exchange_strong(expected, flat, std::memory_order_acq_rel))
+        /* Another thread beat us to it. */
+        return expected;
+
+    nrFlattened++;
+    return flat;
+}
+
+
 void Bindings::sort()
 {
-    if (size_) std::sort(begin(), end());
+    /* Attribute sets are often built in order already, e.g. from the
+       sorted attributes of an `ExprAttrs`. */
+    if (size_ && !std::is_sorted(begin(), end()))
+        std::sort(begin(), end());
+    buildIndex();
+}
+
+
+void Bindings::buildIndex()
+{
+    auto slots = indexSlots(capacity_);
+    if (!slots) return;
+
+    auto idx = index();
+    std::fill_n(idx, slots, 0);
+
+    /* Insert in order, so that like the binary search, lookups find
+       the first of duplicate attributes. */
+    for (size_t n = 0; n < size_; ++n) {
+        auto i = indexSlot(attrs[n].name, slots);
+        while (idx[i]) i = (i + 1) & (slots - 1);
+        idx[i] = n + 1;
+    }
+
+    indexSize_ = slots;
 }
 
 
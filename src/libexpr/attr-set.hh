@@ -5,6 +5,8 @@
 #include "symbol-table.hh"
 
 #include <algorithm>
+#include <atomic>
+#include <bit>
 
 namespace nix {
 
@@ -43,6 +45,19 @@ static_assert(sizeof(Attr) == 2 * sizeof(uint32_t) + sizeof(Value *),
  * by its size and its capacity, the capacity being the number of Attr
  * elements allocated after this structure, while the size corresponds to
  * the number of elements already inserted in this structure.
+ *
+ * Large attribute sets also have a hash index after the attributes,
+ * which maps symbols to positions in the attribute array, so that
+ * lookups don't need a binary search.
+ *
+ * A *layered* attribute set, created by `//` with a small right-hand
+ * side, only stores the attributes of that right-hand side, and
+ * refers to the attribute set that they update as its base layer.
+ * Lookups go through the layers from top to bottom. Since iteration
+ * needs a single sorted array, the first iteration flattens the
+ * layers into an ordinary attribute set, which is then cached after
+ * the attributes (in place of the hash index, which layered sets
+ * don't have).
  */
 class Bindings
 {
@@ -50,13 +65,111 @@ public:
     typedef uint32_t size_t;
     PosIdx pos;
 
+    /**
+     * The smallest capacity for which an attribute set gets a hash
+     * index. Below this, a binary search touches only a few cache
+     * lines anyway.
+     */
+    static constexpr size_t indexThreshold = 32;
+
+    /**
+     * The maximum number of layers of an attribute set, to bound the
+     * cost of lookups.
+     */
+    static constexpr size_t maxLayers = 8;
+
+    /**
+     * The number of attribute sets that have been flattened.
+     */
+    static std::atomic<uint64_t> nrFlattened;
+
 private:
+    /**
+     * For a layered attribute set, `size_` is the number of attributes
+     * of all layers together, while `capacity_` is the number of
+     * attributes in the top layer.
+     */
     size_t size_, capacity_;
+
+    /**
+     * The number of slots of the hash index, or 0 if the index hasn't
+     * been built (yet).
+     */
+    size_t indexSize_ = 0;
+
+    /**
+     * The attribute set that this layered attribute set updates, or
+     * `nullptr` if this is an ordinary attribute set.
+     */
+    const Bindings * baseLayer = nullptr;
+
     Attr attrs[0];
 
     Bindings(size_t capacity) : size_(0), capacity_(capacity) { }
     Bindings(const Bindings & bindings) = delete;
 
+    /**
+     * The hash index, an open addressing table of 1-based positions
+     * in `attrs`, with 0 denoting an empty slot.
+     */
+    uint32_t * index() { return reinterpret_cast<uint32_t *>(&attrs[capacity_]); }
+    const uint32_t * index() const { return reinterpret_cast<const uint32_t *>(&attrs[capacity_]); }
+
+    /**
+     * The flattened version of a layered attribute set, or `nullptr`
+     * if it hasn't been iterated yet.
+     */
+    std::atomic<Bindings *> & flattened() const
+    {
+        return *reinterpret_cast<std::atomic<Bindings *> *>(const_cast<Attr *>(&attrs[capacity_]));
+    }
+
+    /**
+     * Return the flattened version of a layered attribute set,
+     * creating it if necessary.
+     */
+    Bindings * flatten() const;
+
+    static size_t indexSlot(Symbol name, size_t slots)
+    {
+        /* Symbols are consecutive integers, so scramble them. */
+        return (uint64_t) std::hash<Symbol>{}(name) * 0x9e3779b97f4a7c15ULL >> 32 & (slots - 1);
+    }
+
+    /**
+     * The number of attributes in this layer.
+     */
+    size_t layerSize() const
+    {
+        return baseLayer ? capacity_ : size_;
+    }
+
+    const Attr * lookupInLayer(Symbol name) const
+    {
+        if (indexSize_) {
+            auto idx = index();
+            for (auto i = indexSlot(name, indexSize_); idx[i]; i = (i + 1) & (indexSize_ - 1)) {
+                auto & attr = attrs[idx[i] - 1];
+                if (attr.name == name) return &attr;
+            }
+            return nullptr;
+        }
+
+        Attr key(name, 0);
+        auto end = &attrs[layerSize()];
+        auto i = std::lower_bound(&attrs[0], end, key);
+        if (i != end && i->name == name) return &*i;
+        return nullptr;
+    }
+
+    const Attr * lookup(Symbol name) const
+    {
+        for (auto layer = this; layer; layer = layer->baseLayer)
+            if (auto attr = layer->lookupInLayer(name))
+                return attr;
+        return nullptr;
+    }
+
 public:
     size_t size() const { return size_; }
 
@@ -66,46 +179,105 @@ public:
 
     typedef const Attr * const_iterator;
 
+    /**
+     * The number of hash index slots allocated for an attribute set
+     * of the given capacity. This keeps the load factor at or below
+     * 1/2.
+     */
+    static size_t indexSlots(size_t capacity)
+    {
+        return capacity < indexThreshold ? 0 : std::bit_ceil(2 * capacity);
+    }
+
     void push_back(const Attr & attr)
     {
-        assert(size_ < capacity_);
+        assert(!baseLayer && size_ < capacity_);
         attrs[size_++] = attr;
+        indexSize_ = 0;
     }
 
+    /**
+     * Note: on a layered attribute set, comparing the result with
+     * `end()` flattens it, so use `get()` where possible.
+     */
     const_iterator find(Symbol name) const
     {
-        Attr key(name, 0);
-        const_iterator i = std::lower_bound(begin(), end(), key);
-        if (i != end() && i->name == name) return i;
-        return end();
+        auto attr = lookup(name);
+        return attr ? attr : end();
     }
 
     const Attr * get(Symbol name) const
     {
-        Attr key(name, 0);
-        const_iterator i = std::lower_bound(begin(), end(), key);
-        if (i != end() && i->name == name) return &*i;
-        return nullptr;
+        return lookup(name);
     }
 
-    iterator begin() { return &attrs[0]; }
-    iterator end() { return &attrs[size_]; }
+    /**
+     * Like `get(Symbol)`, but first try the attribute at position
+     * `cachedPos` of the top layer, and afterwards store the position
+     * of the result there. Attribute sets created by the same code
+     * usually have the same attributes, so a lookup site that keeps
+     * its own `cachedPos` mostly avoids searching. Sets `hit` to
+     * whether `cachedPos` was right.
+     *
+     * `cachedPos` may be shared between threads.
+     */
+    const Attr * get(Symbol name, uint32_t & cachedPos, bool & hit) const
+    {
+        std::atomic_ref cached(cachedPos);
+        auto i = cached.load(std::memory_order_relaxed);
+        /* Names are unique within a layer, and the top layer takes
+           precedence, so a match is always the right attribute. */
+        if (i < layerSize() && attrs[i].name == name) {
+            hit = true;
+            return &attrs[i];
+        }
+        hit = false;
+        auto attr = lookup(name);
+        if (attr && attr >= &attrs[0] && attr < &attrs[layerSize()])
+            cached.store(attr - &attrs[0], std::memory_order_relaxed);
+        return attr;
+    }
 
-    const_iterator begin() const { return &attrs[0]; }
-    const_iterator end() const { return &attrs[size_]; }
+    iterator begin() { return baseLayer ? flatten()->begin() : &attrs[0]; }
+    iterator end() { return baseLayer ? flatten()->end() : &attrs[size_]; }
+
+    const_iterator begin() const { return baseLayer ? flatten()->begin() : &attrs[0]; }
+    const_iterator end() const { return baseLayer ? flatten()->end() : &attrs[size_]; }
 
     Attr & operator[](size_t pos)
     {
-        return attrs[pos];
+        return baseLayer ? (*flatten())[pos] : attrs[pos];
     }
 
     const Attr & operator[](size_t pos) const
     {
-        return attrs[pos];
+        return baseLayer ? (*flatten())[pos] : attrs[pos];
+    }
+
+    /**
+     * The number of layers of this attribute set, which is 1 for an
+     * ordinary attribute set.
+     */
+    size_t layers() const
+    {
+        size_t n = 1;
+        for (auto layer = baseLayer; layer; layer = layer->baseLayer) n++;
+        return n;
     }
 
+    /**
+     * Sort the attributes by symbol, and build the hash index.
+     */
     void sort();
 
+    /**
+     * Build the hash index, if this attribute set is large enough to
+     * have one. The attributes must not change afterwards, except by
+     * `push_back()`, which drops the index until this is called
+     * again.
+     */
+    void buildIndex();
+
     size_t capacity() const { return capacity_; }
 
     /**
@@ -115,8 +287,8 @@ public:
     {
         std::vector<const Attr *> res;
         res.reserve(size_);
-        for (size_t n = 0; n < size_; n++)
-            res.emplace_back(&attrs[n]);
+        for (auto & attr : *this)
+            res.emplace_back(&attr);
         std::sort(res.begin(), res.end(), [&](const Attr * a, const Attr * b) {
             std::string_view sa = symbols[a->name], sb = symbols[b->name];
             return sa < sb;
@@ -173,6 +345,7 @@ public:
 
     Bindings * alreadySorted()
     {
+        bindings->buildIndex();
         return bindings;
     }
 
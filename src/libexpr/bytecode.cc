@@ -0,0 +1,332 @@
+#include "bytecode.hh"
+#include "eval.hh"
+
+namespace nix {
+
+void ExprBytecode::eval(EvalState & state, Env & env, Value & v)
+{
+    if (state.debugRepl)
+        expr->eval(state, env, v);
+    else
+        state.evalBytecode(code, env, v);
+}
+
+namespace {
+
+using Op = Bytecode::Op;
+
+/**
+ * Whether evaluating `e` is strict in its subexpressions, so that it
+ * can be compiled to bytecode.
+ */
+static bool isStrict(Expr * e)
+{
+    return dynamic_cast<ExprIf *>(e)
+        || dynamic_cast<ExprAssert *>(e)
+        || dynamic_cast<ExprOpNot *>(e)
+        || dynamic_cast<ExprOpEq *>(e)
+        || dynamic_cast<ExprOpNEq *>(e)
+        || dynamic_cast<ExprOpAnd *>(e)
+        || dynamic_cast<ExprOpOr *>(e)
+        || dynamic_cast<ExprOpImpl *>(e)
+        || dynamic_cast<ExprSelect *>(e)
+        || dynamic_cast<ExprOpHasAttr *>(e);
+}
+
+struct Compiler
+{
+    Bytecode code;
+    size_t depth = 0;
+
+    uint32_t here() const
+    {
+        return code.instrs.size();
+    }
+
+    /**
+     * Append an instruction. The returned reference is only valid
+     * until the next one is appended.
+     */
+    Bytecode::Instr & emit(Op op, Expr * expr = nullptr, uint32_t arg = 0)
+    {
+        Bytecode::Instr & i = code.instrs.emplace_back(Bytecode::Instr{.op = op, .arg = arg});
+        i.expr = expr;
+        return i;
+    }
+
+    void push()
+    {
+        code.maxStack = std::max(code.maxStack, ++depth);
+    }
+
+    /**
+     * Compile `e`, leaving its value on the stack.
+     */
+    void compile(Expr * e)
+    {
+        if (auto e2 = dynamic_cast<ExprInt *>(e))
+            constant(e2->v);
+
+        else if (auto e2 = dynamic_cast<ExprFloat *>(e))
+            constant(e2->v);
+
+        else if (auto e2 = dynamic_cast<ExprString *>(e))
+            constant(e2->v);
+
+        else if (auto e2 = dynamic_cast<ExprPath *>(e))
+            constant(e2->v);
+
+        else if (auto e2 = dynamic_cast<ExprVar *>(e)) {
+            if (!e2->fromWith && e2->level <= UINT16_MAX) {
+                emit(Op::Local, e2, e2->displ).level = e2->level;
+                push();
+            } else
+                evalTree(e);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprSelect *>(e)) {
+            compile(e2->e);
+            for (auto & i : e2->attrPath)
+                if (!i.symbol) rewrite(i.expr);
+            if (e2->def) rewrite(e2->def);
+            emit(Op::Select, e2);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpHasAttr *>(e)) {
+            compile(e2->e);
+            for (auto & i : e2->attrPath)
+                if (!i.symbol) rewrite(i.expr);
+            emit(Op::HasAttr, e2);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprIf *>(e)) {
+            compileBool(e2->cond, e2->pos, "while evaluating a branch condition");
+            auto jumpToElse = here();
+            emit(Op::JumpIfFalse);
+            depth--;
+            compile(e2->then);
+            auto jumpToEnd = here();
+            emit(Op::Jump);
+            depth--;
+            code.instrs[jumpToElse].arg = here();
+            compile(e2->else_);
+            code.instrs[jumpToEnd].arg = here();
+        }
+
+        else if (auto e2 = dynamic_cast<ExprAssert *>(e)) {
+            compileBool(e2->cond, e2->pos, "in the condition of the assert statement");
+            emit(Op::AssertTrue, e2);
+            depth--;
+            compile(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpNot *>(e)) {
+            compileBool(e2->e, e2->getPos(), "in the argument of the not operator");
+            emit(Op::Not);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpEq *>(e)) {
+            compile(e2->e1);
+            compile(e2->e2);
+            emit(Op::Eq, e2);
+            depth--;
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpNEq *>(e)) {
+            compile(e2->e1);
+            compile(e2->e2);
+            emit(Op::NEq, e2);
+            depth--;
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpAnd *>(e))
+            shortCircuit(e2, Op::JumpIfFalse, false,
+                "in the left operand of the AND (&&) operator",
+                "in the right operand of the AND (&&) operator");
+
+        else if (auto e2 = dynamic_cast<ExprOpOr *>(e))
+            shortCircuit(e2, Op::JumpIfTrue, true,
+                "in the left operand of the OR (||) operator",
+                "in the right operand of the OR (||) operator");
+
+        else if (auto e2 = dynamic_cast<ExprOpImpl *>(e))
+            shortCircuit(e2, Op::JumpIfFalse, true,
+                "in the left operand of the IMPL (->) operator",
+                "in the right operand of the IMPL (->) operator");
+
+        else {
+            rewriteChildren(e);
+            evalTree(e);
+        }
+    }
+
+    void constant(const Value & v)
+    {
+        emit(Op::Const).value = &v;
+        push();
+    }
+
+    void evalTree(Expr * e)
+    {
+        emit(Op::Eval, e);
+        push();
+    }
+
+    /**
+     * Compile `e` as an argument of `EvalState::evalBool()`.
+     */
+    void compileBool(Expr * e, PosIdx pos, std::string_view errorCtx)
+    {
+        auto trace = code.traces.size();
+        code.traces.push_back({.start = here(), .end = 0, .pos = pos, .errorCtx = errorCtx});
+        compile(e);
+        emit(Op::CheckBool, e, trace);
+        code.traces[trace].end = here();
+    }
+
+    /**
+     * Compile `e1 && e2`, `e1 || e2` or `e1 -> e2`: if `e1` makes the
+     * `jump`, the result is `shortValue`, otherwise it's `e2`.
+     */
+    template<typename E>
+    void shortCircuit(E * e, Op jump, bool shortValue, std::string_view errorCtx1, std::string_view errorCtx2)
+    {
+        compileBool(e->e1, e->pos, errorCtx1);
+        auto jumpToShort = here();
+        emit(jump);
+        depth--;
+        compileBool(e->e2, e->pos, errorCtx2);
+        auto jumpToEnd = here();
+        emit(Op::Jump);
+        depth--;
+        code.instrs[jumpToShort].arg = here();
+        emit(Op::PushBool, nullptr, shortValue);
+        push();
+        code.instrs[jumpToEnd].arg = here();
+    }
+
+    /**
+     * Compile `e` if it is strict, and otherwise the strict
+     * expressions inside it.
+     */
+    static void rewrite(Expr * & e)
+    {
+        if (!e) return;
+        if (isStrict(e)) {
+            Compiler compiler;
+            compiler.compile(e);
+            assert(compiler.depth == 1);
+            e = new ExprBytecode(e, std::move(compiler.code));
+        } else
+            rewriteChildren(e);
+    }
+
+    static void rewriteChildren(Expr * e)
+    {
+        if (auto e2 = dynamic_cast<ExprSelect *>(e)) {
+            rewrite(e2->e);
+            for (auto & i : e2->attrPath)
+                if (!i.symbol) rewrite(i.expr);
+            rewrite(e2->def);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpHasAttr *>(e)) {
+            rewrite(e2->e);
+            for (auto & i : e2->attrPath)
+                if (!i.symbol) rewrite(i.expr);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprAttrs *>(e)) {
+            for (auto & [name, def] : e2->attrs)
+                /* `inherit (x) a` is printed by looking at its
+                   `ExprSelect`, so leave that in place. */
+                if (def.kind != ExprAttrs::AttrDef::Kind::InheritedFrom)
+                    rewrite(def.e);
+            if (e2->inheritFromExprs)
+                for (auto & from : *e2->inheritFromExprs)
+                    rewrite(from);
+            for (auto & def : e2->dynamicAttrs) {
+                rewrite(def.nameExpr);
+                rewrite(def.valueExpr);
+            }
+        }
+
+        else if (auto e2 = dynamic_cast<ExprList *>(e)) {
+            for (auto & elem : e2->elems)
+                rewrite(elem);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprLambda *>(e)) {
+            if (e2->formals)
+                for (auto & formal : e2->formals->formals)
+                    rewrite(formal.def);
+            rewrite(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprCall *>(e)) {
+            rewrite(e2->fun);
+            for (auto & arg : e2->args)
+                rewrite(arg);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprLet *>(e)) {
+            rewriteChildren(e2->attrs);
+            rewrite(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprWith *>(e)) {
+            rewrite(e2->attrs);
+            rewrite(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprIf *>(e)) {
+            rewrite(e2->cond);
+            rewrite(e2->then);
+            rewrite(e2->else_);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprAssert *>(e)) {
+            rewrite(e2->cond);
+            rewrite(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpNot *>(e))
+            rewrite(e2->e);
+
+        else if (auto e2 = dynamic_cast<ExprConcatStrings *>(e)) {
+            for (auto & [pos, e3] : *e2->es)
+                rewrite(e3);
+        }
+
+        else if (!rewriteBinOp<ExprOpEq>(e)
+            && !rewriteBinOp<ExprOpNEq>(e)
+            && !rewriteBinOp<ExprOpAnd>(e)
+            && !rewriteBinOp<ExprOpOr>(e)
+            && !rewriteBinOp<ExprOpImpl>(e)
+            && !rewriteBinOp<ExprOpUpdate>(e)
+            && !rewriteBinOp<ExprOpConcatLists>(e))
+        {
+            /* Constants, variables and `__curPos` have no
+               subexpressions. */
+        }
+    }
+
+    template<typename E>
+    static bool rewriteBinOp(Expr * e)
+    {
+        auto e2 = dynamic_cast<E *>(e);
+        if (!e2) return false;
+        rewrite(e2->e1);
+        rewrite(e2->e2);
+        return true;
+    }
+};
+
+}
+
+void compileBytecode(Expr * e)
+{
+    Compiler::rewriteChildren(e);
+}
+
+}
@@ -0,0 +1,123 @@
+#pragma once
+///@file
+
+#include <vector>
+
+#include "nixexpr.hh"
+
+namespace nix {
+
+/**
+ * A compiled form of an expression whose evaluation is strict in its
+ * subexpressions: conditionals, assertions, Boolean operators,
+ * comparisons, attribute selections and `?` tests, together with the
+ * variables and constants they operate on. It runs on a small stack
+ * machine (`EvalState::evalBytecode()`) rather than through virtual
+ * `Expr::eval()` calls. Other subexpressions, such as function calls
+ * and attribute sets, are evaluated by the tree-walking evaluator.
+ */
+struct Bytecode
+{
+    enum class Op : uint8_t {
+        /** Push `*value`. */
+        Const,
+        /** Push the local variable `arg` in the environment `level` levels up (`expr` is the `ExprVar`). */
+        Local,
+        /** Push the result of evaluating `expr` with the tree-walking evaluator. */
+        Eval,
+        /** Select the attribute path of `expr` (an `ExprSelect`, including its `or` default) from the top of the stack. */
+        Select,
+        /** Replace the top of the stack by whether it has the attribute path of `expr` (an `ExprOpHasAttr`). */
+        HasAttr,
+        /** Check that the top of the stack, the result of evaluating `expr`, is a Boolean. `arg` is the index of its trace. */
+        CheckBool,
+        /** Negate the Boolean at the top of the stack. */
+        Not,
+        /** Replace the top two values by whether they are equal (`expr` is the `ExprOpEq`). */
+        Eq,
+        /** Replace the top two values by whether they differ (`expr` is the `ExprOpNEq`). */
+        NEq,
+        /** Continue at `arg`. */
+        Jump,
+        /** Pop a Boolean, and continue at `arg` if it's false. */
+        JumpIfFalse,
+        /** Pop a Boolean, and continue at `arg` if it's true. */
+        JumpIfTrue,
+        /** Push the Boolean `arg`. */
+        PushBool,
+        /** Pop a Boolean, and fail the assertion `expr` (an `ExprAssert`) if it's false. */
+        AssertTrue,
+    };
+
+    struct Instr
+    {
+        Op op;
+        uint16_t level = 0;
+        uint32_t arg = 0;
+        union {
+            Expr * expr;
+            const Value * value;
+        };
+    };
+
+    static_assert(sizeof(Instr) <= 16);
+
+    /**
+     * A range of instructions that evaluates a subexpression to a
+     * Boolean. Errors thrown by these instructions get a trace, just
+     * like in `EvalState::evalBool()`.
+     */
+    struct Trace
+    {
+        uint32_t start, end;
+        PosIdx pos;
+        std::string_view errorCtx;
+    };
+
+    std::vector<Instr> instrs;
+
+    /**
+     * Ranges that are nested in another range come after it.
+     */
+    std::vector<Trace> traces;
+
+    size_t maxStack = 0;
+};
+
+/**
+ * An expression that has been compiled to bytecode. `expr` is the
+ * original expression, which is used for printing and positions, and
+ * is evaluated instead of the bytecode by the debugger.
+ */
+struct ExprBytecode : Expr
+{
+    Expr * expr;
+    Bytecode code;
+
+    ExprBytecode(Expr * expr, Bytecode && code) : expr(expr), code(std::move(code)) { };
+
+    void show(const SymbolTable & symbols, std::ostream & str) const override
+    {
+        expr->show(symbols, str);
+    }
+
+    void bindVars(EvalState & es, const std::shared_ptr<const StaticEnv> & env) override
+    {
+        /* Variables are resolved before compiling. */
+        unreachable();
+    }
+
+    void eval(EvalState & state, Env & env, Value & v) override;
+
+    PosIdx getPos() const override { return expr->getPos(); }
+};
+
+/**
+ * Compile the strict subexpressions of `e`, whose variables must have
+ * been bound, to bytecode, replacing them in the tree by
+ * `ExprBytecode`s. `e` itself is left in place, so callers that
+ * inspect the type of a parsed expression are unaffected.
+ */
+void compileBytecode(Expr * e);
+
+}
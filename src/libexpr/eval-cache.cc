@@ -1,12 +1,24 @@
 #include "users.hh"
 #include "eval-cache.hh"
-#include "sqlite.hh"
 #include "eval.hh"
 #include "eval-inline.hh"
 #include "store-api.hh"
+#include "file-system.hh"
+#include "pathlocks.hh"
 // Need specialization involving `SymbolStr` just in this one module.
 #include "strings-inline.hh"
 
+#include <bit>
+#include <chrono>
+#include <cstring>
+#include <unordered_set>
+
+#ifndef _WIN32
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
 namespace nix::eval_cache {
 
 CachedEvalError::CachedEvalError(ref<AttrCursor> cursor, Symbol attr)
@@ -28,122 +40,606 @@ void CachedEvalError::force()
     throw EvalError(state, "evaluation of cached failed attribute '%s' unexpectedly succeeded", cursor->getAttrPathStr(attr));
 }
 
-static const char * schema = R"sql(
-create table if not exists Attributes (
-    parent      integer not null,
-    name        text,
-    type        integer not null,
-    value       text,
-    context     text,
-    primary key (parent, name)
-);
-)sql";
+/**
+ * The evaluation cache of a fingerprint is stored in
+ * `eval-cache-v6/<fingerprint>.attrs`. This file consists of
+ * *segments*, each of which is appended in a single write by a process
+ * that has computed new attributes. A segment consists of a
+ * `SegmentHeader`, a record for each attribute, and a hash table that
+ * maps attribute IDs to the offsets of their records. The file is
+ * mapped into memory, so looking up an attribute is a hash table probe
+ * in each segment, from the newest to the oldest, so that later
+ * records of an attribute replace earlier ones.
+ *
+ * An attribute ID is a hash of the ID of its parent and its name, so
+ * every process assigns the same IDs to the same attribute paths, and
+ * segments are independent of each other.
+ */
+static constexpr uint64_t segmentMagic = 0x0a3643564558494e; // "NIXEVC6\n"
+
+struct SegmentHeader
+{
+    uint64_t magic;
+    /**
+     * The size of the segment, including this header.
+     */
+    uint64_t size;
+    /**
+     * The offset of the hash table from the start of the segment.
+     */
+    uint64_t indexOffset;
+    /**
+     * The number of slots of the hash table, a power of 2. Each slot
+     * is the offset of a record, or 0.
+     */
+    uint64_t indexSlots;
+};
+
+/**
+ * The header of a record, followed by the name of the attribute, its
+ * value and its string context, padded to a multiple of 8 bytes.
+ *
+ * The value of an attribute set or a list of strings is its elements,
+ * each followed by a null byte, as is each element of a string
+ * context. The value of a Boolean or an integer is a 64-bit integer.
+ */
+struct RecordHeader
+{
+    AttrId id, parent;
+    uint32_t type;
+    uint32_t nameLen, valueLen, contextLen;
+};
+
+static_assert(sizeof(SegmentHeader) % 8 == 0 && sizeof(RecordHeader) % 8 == 0);
+
+static uint64_t align8(uint64_t n)
+{
+    return (n + 7) & ~7ULL;
+}
+
+static AttrId attrId(AttrId parent, std::string_view name)
+{
+    /* FNV-1a, which is stable across platforms and Nix versions. */
+    uint64_t h = 0xcbf29ce484222325ULL;
+    auto add = [&](unsigned char c) { h = (h ^ c) * 0x100000001b3ULL; };
+    for (int i = 0; i < 8; ++i) add(parent >> (8 * i));
+    for (auto c : name) add(c);
+    /* 0 means "no attribute". */
+    return h ? h : 1;
+}
+
+struct Record
+{
+    AttrId id, parent;
+    AttrType type;
+    std::string_view name, value, context;
+};
+
+/**
+ * A segment of a cache file, which has been checked by
+ * `parseSegments()`.
+ */
+struct Segment
+{
+    std::string_view data;
+
+    const SegmentHeader & header() const
+    {
+        return *reinterpret_cast<const SegmentHeader *>(data.data());
+    }
+
+    /**
+     * The record at `offset`, or nothing if the segment is corrupt.
+     */
+    std::optional<Record> record(uint64_t offset) const
+    {
+        auto end = header().indexOffset;
+        if (offset < sizeof(SegmentHeader) || offset % 8 || offset > end || end - offset < sizeof(RecordHeader))
+            return std::nullopt;
+        auto & r = *reinterpret_cast<const RecordHeader *>(data.data() + offset);
+        if ((uint64_t) r.nameLen + r.valueLen + r.contextLen > end - offset - sizeof(RecordHeader))
+            return std::nullopt;
+        auto p = data.data() + offset + sizeof(RecordHeader);
+        return Record{
+            .id = r.id,
+            .parent = r.parent,
+            .type = (AttrType) r.type,
+            .name = {p, r.nameLen},
+            .value = {p + r.nameLen, r.valueLen},
+            .context = {p + r.nameLen + r.valueLen, r.contextLen},
+        };
+    }
+
+    std::optional<Record> lookup(AttrId id) const
+    {
+        auto & h = header();
+        auto index = reinterpret_cast<const uint64_t *>(data.data() + h.indexOffset);
+        auto mask = h.indexSlots - 1;
+        for (uint64_t n = 0, i = id & mask; n < h.indexSlots && index[i]; ++n, i = (i + 1) & mask) {
+            auto r = record(index[i]);
+            if (!r) break;
+            if (r->id == id) return r;
+        }
+        return std::nullopt;
+    }
+
+    template<typename F>
+    void forEachRecord(F && f) const
+    {
+        for (uint64_t offset = sizeof(SegmentHeader); offset < header().indexOffset; ) {
+            auto r = record(offset);
+            if (!r) break;
+            f(*r);
+            offset += align8(sizeof(RecordHeader) + r->name.size() + r->value.size() + r->context.size());
+        }
+    }
+};
+
+/**
+ * Split the contents of a cache file into segments, ignoring a corrupt
+ * or incomplete tail.
+ */
+static std::vector<Segment> parseSegments(std::string_view data)
+{
+    std::vector<Segment> segments;
+    while (data.size() >= sizeof(SegmentHeader)) {
+        auto & h = *reinterpret_cast<const SegmentHeader *>(data.data());
+        if (h.magic != segmentMagic
+            || h.size > data.size()
+            || h.size % 8
+            || h.indexOffset < sizeof(SegmentHeader)
+            || h.indexOffset % 8
+            || h.indexOffset > h.size
+            || !std::has_single_bit(h.indexSlots)
+            || h.indexSlots != (h.size - h.indexOffset) / 8
+            || (h.size - h.indexOffset) % 8)
+            break;
+        segments.push_back({data.substr(0, h.size)});
+        data.remove_prefix(h.size);
+    }
+    return segments;
+}
+
+/**
+ * Serialise `records`, which must have distinct IDs, as a segment.
+ */
+static std::string makeSegment(const std::vector<Record> & records)
+{
+    std::string s(sizeof(SegmentHeader), 0);
+
+    std::vector<std::pair<AttrId, uint64_t>> offsets;
+    offsets.reserve(records.size());
+
+    for (auto & r : records) {
+        offsets.emplace_back(r.id, s.size());
+        RecordHeader h{
+            .id = r.id,
+            .parent = r.parent,
+            .type = r.type,
+            .nameLen = (uint32_t) r.name.size(),
+            .valueLen = (uint32_t) r.value.size(),
+            .contextLen = (uint32_t) r.context.size(),
+        };
+        s.append(reinterpret_cast<const char *>(&h), sizeof(h));
+        s.append(r.name);
+        s.append(r.value);
+        s.append(r.context);
+        s.resize(align8(s.size()), 0);
+    }
+
+    /* Keep the load factor at or below 1/2. */
+    uint64_t slots = std::bit_ceil(std::max<uint64_t>(2 * records.size(), 1));
+    std::vector<uint64_t> index(slots, 0);
+    for (auto & [id, offset] : offsets) {
+        auto i = id & (slots - 1);
+        while (index[i]) i = (i + 1) & (slots - 1);
+        index[i] = offset;
+    }
+
+    SegmentHeader h{
+        .magic = segmentMagic,
+        .size = s.size() + slots * sizeof(uint64_t),
+        .indexOffset = s.size(),
+        .indexSlots = slots,
+    };
+    std::memcpy(s.data(), &h, sizeof(h));
+    s.append(reinterpret_cast<const char *>(index.data()), slots * sizeof(uint64_t));
+
+    return s;
+}
+
+/**
+ * The contents of a file, mapped into memory where possible.
+ */
+struct MappedFile
+{
+    std::string_view data;
+
+#ifndef _WIN32
+    /**
+     * The identity of the file, to detect when it has been replaced.
+     */
+    dev_t dev = 0;
+    ino_t ino = 0;
+#else
+    std::string contents;
+#endif
+
+    MappedFile(const Path & path)
+    {
+#ifndef _WIN32
+        AutoCloseFD fd = toDescriptor(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!fd) {
+            if (errno == ENOENT) return;
+            throw SysError("opening '%s'", path);
+        }
+        struct stat st;
+        if (fstat(fd.get(), &st))
+            throw SysError("getting status of '%s'", path);
+        dev = st.st_dev;
+        ino = st.st_ino;
+        if (!st.st_size) return;
+        /* Cache files are only ever appended to or replaced, so the
+           mapping stays valid. */
+        auto p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd.get(), 0);
+        if (p == MAP_FAILED)
+            throw SysError("mapping '%s'", path);
+        data = {static_cast<const char *>(p), (size_t) st.st_size};
+#else
+        if (pathExists(path)) {
+            contents = readFile(path);
+            data = contents;
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+#ifndef _WIN32
+        if (!data.empty())
+            munmap(const_cast<char *>(data.data()), data.size());
+#endif
+    }
+
+    /**
+     * Whether `path` has been appended to or replaced since it was
+     * mapped.
+     */
+    bool isStale(const Path & path) const
+    {
+#ifndef _WIN32
+        struct stat st;
+        if (stat(path.c_str(), &st)) return false;
+        return st.st_dev != dev || st.st_ino != ino || (size_t) st.st_size != data.size();
+#else
+        std::error_code ec;
+        auto size = std::filesystem::file_size(path, ec);
+        return !ec && size != data.size();
+#endif
+    }
+};
 
+/**
+ * The evaluation cache of a fingerprint. Several processes can use
+ * the same cache file at the same time: each of them appends the
+ * attributes it has computed every few seconds, and picks up the
+ * attributes appended by the others when it doesn't find an
+ * attribute.
+ */
 struct AttrDb
 {
-    std::atomic_bool failed{false};
+    /**
+     * Above this number of segments, the cache file is compacted into
+     * a single segment, to bound the cost of lookups.
+     */
+    static constexpr size_t maxSegments = 16;
+
+    /**
+     * Pending attributes are written when there are this many of them,
+     * or when the last write was `writeInterval` ago.
+     */
+    static constexpr size_t maxPending = 10000;
+    static constexpr std::chrono::seconds writeInterval{5};
+
+    /**
+     * How often a failed lookup checks whether the cache file has
+     * changed.
+     */
+    static constexpr std::chrono::milliseconds refreshInterval{500};
 
     const StoreDirConfig & cfg;
 
-    struct State
+    SymbolTable & symbols;
+
+    const Path path;
+
+    /**
+     * An attribute that has been set by this process.
+     */
+    struct PendingRecord
     {
-        SQLite db;
-        SQLiteStmt insertAttribute;
-        SQLiteStmt insertAttributeWithContext;
-        SQLiteStmt queryAttribute;
-        SQLiteStmt queryAttributes;
-        std::unique_ptr<SQLiteTxn> txn;
+        AttrId parent;
+        AttrType type;
+        std::string name, value, context;
+
+        Record view(AttrId id) const
+        {
+            return {.id = id, .parent = parent, .type = type, .name = name, .value = value, .context = context};
+        }
     };
 
-    std::unique_ptr<Sync<State>> _state;
+    struct State
+    {
+        /**
+         * The cache file as it was when it was last mapped.
+         */
+        std::unique_ptr<MappedFile> file;
+
+        std::vector<Segment> segments;
+
+        /**
+         * The attributes that have been set since they were last
+         * written.
+         */
+        std::unordered_map<AttrId, PendingRecord> pending;
+
+        std::chrono::steady_clock::time_point lastWrite, lastRefresh;
+
+        /**
+         * Whether writing failed, in which case no further writes are
+         * attempted.
+         */
+        bool failed = false;
+    };
 
-    SymbolTable & symbols;
+    Sync<State> _state;
 
     AttrDb(
         const StoreDirConfig & cfg,
         const Hash & fingerprint,
         SymbolTable & symbols)
         : cfg(cfg)
-        , _state(std::make_unique<Sync<State>>())
         , symbols(symbols)
+        , path(getCacheDir() + "/eval-cache-v6/" + fingerprint.to_string(HashFormat::Base16, false) + ".attrs")
     {
-        auto state(_state->lock());
+        auto state(_state.lock());
+        state->file = std::make_unique<MappedFile>(path);
+        state->segments = parseSegments(state->file->data);
+        state->lastWrite = state->lastRefresh = std::chrono::steady_clock::now();
+    }
 
-        Path cacheDir = getCacheDir() + "/eval-cache-v5";
-        createDirs(cacheDir);
+    ~AttrDb()
+    {
+        try {
+            auto state(_state.lock());
+            if (!state->failed)
+                write(*state);
+        } catch (...) {
+            ignoreExceptionInDestructor();
+        }
+    }
+
+    /**
+     * Map the cache file again if it has changed since it was mapped,
+     * but unless `force` is set, only if that was longer than
+     * `refreshInterval` ago. Returns whether it has been mapped again.
+     */
+    bool refresh(State & state, bool force = false)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (!force && now - state.lastRefresh < refreshInterval) return false;
+        state.lastRefresh = now;
+
+        if (!state.file->isStale(path)) return false;
+
+        try {
+            auto file = std::make_unique<MappedFile>(path);
+            state.segments = parseSegments(file->data);
+            state.file = std::move(file);
+        } catch (Error & e) {
+            debug("not reloading evaluation cache '%s': %s", path, e.msg());
+            return false;
+        }
+        debug("reloaded evaluation cache '%s'", path);
+        return true;
+    }
+
+    /**
+     * Append the pending attributes to the cache file as a new segment,
+     * or if the file has too many segments, replace it by a file that
+     * has all attributes in one segment.
+     */
+    void write(State & state)
+    {
+        if (state.pending.empty()) return;
 
-        Path dbPath = cacheDir + "/" + fingerprint.to_string(HashFormat::Base16, false) + ".sqlite";
+        createDirs(dirOf(path));
 
-        state->db = SQLite(dbPath);
-        state->db.isCache();
-        state->db.exec(schema);
+        /* Compaction must not lose the segments that other processes
+           append, so writers take turns. */
+        auto lockFd = openLockFile(path + ".lock", true);
+        lockFile(lockFd.get(), ltWrite, true);
 
-        state->insertAttribute.create(state->db,
-            "insert or replace into Attributes(parent, name, type, value) values (?, ?, ?, ?)");
+        refresh(state, true);
 
-        state->insertAttributeWithContext.create(state->db,
-            "insert or replace into Attributes(parent, name, type, value, context) values (?, ?, ?, ?, ?)");
+        std::vector<Record> records;
+        for (auto & [id, r] : state.pending) {
+            /* Don't hide an attribute that another process has
+               evaluated. */
+            if (r.type == AttrType::Placeholder)
+                if (auto r2 = lookupInSegments(state, id); r2 && r2->parent == r.parent && r2->name == r.name)
+                    continue;
+            records.push_back(r.view(id));
+        }
 
-        state->queryAttribute.create(state->db,
-            "select rowid, type, value, context from Attributes where parent = ? and name = ?");
+        /* Also compact if the file has a corrupt or incomplete tail,
+           e.g. because a process was killed while appending to it,
+           since segments appended after it could not be found. */
+        uint64_t parsedSize = 0;
+        for (auto & segment : state.segments)
+            parsedSize += segment.data.size();
+
+        bool compact = state.segments.size() >= maxSegments || parsedSize != state.file->data.size();
+        if (compact) {
+            std::unordered_set<AttrId> seen;
+            for (auto & r : records)
+                seen.insert(r.id);
+            for (auto segment = state.segments.rbegin(); segment != state.segments.rend(); ++segment)
+                segment->forEachRecord([&](const Record & r) {
+                    if (seen.insert(r.id).second)
+                        records.push_back(r);
+                });
+        }
 
-        state->queryAttributes.create(state->db,
-            "select name from Attributes where parent = ?");
+        auto segment = makeSegment(records);
+
+        if (compact) {
+            debug("compacting evaluation cache '%s'", path);
+            Path tmp = fmt("%s.tmp.%d", path, getpid());
+            AutoDelete del(tmp, false);
+            writeFile(tmp, segment);
+            std::filesystem::rename(tmp, path);
+            del.cancel();
+        } else {
+            AutoCloseFD fd = toDescriptor(open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT
+#ifndef _WIN32
+                | O_CLOEXEC
+#endif
+                , 0666));
+            if (!fd)
+                throw SysError("opening '%s'", path);
+            writeFull(fd.get(), segment);
+        }
 
-        state->txn = std::make_unique<SQLiteTxn>(state->db);
+        state.lastWrite = std::chrono::steady_clock::now();
+
+        /* Our own attributes are now in the file, but keep those that
+           we can't see there. */
+        refresh(state, true);
+        std::erase_if(state.pending, [&](auto & i) {
+            auto & [id, r] = i;
+            auto r2 = lookupInSegments(state, id);
+            return r2 && r2->parent == r.parent && r2->name == r.name
+                && (r.type == AttrType::Placeholder
+                    || (r2->type == r.type && r2->value == r.value && r2->context == r.context));
+        });
     }
 
-    ~AttrDb()
+    std::optional<Record> lookupInSegments(const State & state, AttrId id)
     {
-        try {
-            auto state(_state->lock());
-            if (!failed && state->txn->active)
-                state->txn->commit();
-            state->txn.reset();
-        } catch (...) {
-            ignoreExceptionInDestructor();
+        for (auto segment = state.segments.rbegin(); segment != state.segments.rend(); ++segment)
+            if (auto r = segment->lookup(id))
+                return r;
+        return std::nullopt;
+    }
+
+    std::optional<Record> lookup(const State & state, AttrId id)
+    {
+        auto i = state.pending.find(id);
+        if (i == state.pending.end())
+            return lookupInSegments(state, id);
+        /* Prefer an attribute that another process has evaluated
+           over our own placeholder. */
+        if (i->second.type == AttrType::Placeholder)
+            if (auto r = lookupInSegments(state, id);
+                r && r->type != AttrType::Placeholder && r->parent == i->second.parent && r->name == i->second.name)
+                return r;
+        return i->second.view(id);
+    }
+
+    AttrId set(AttrKey key, AttrType type, std::string value = "", std::string context = "")
+    {
+        std::string_view name = symbols[key.second];
+        auto id = attrId(key.first, name);
+        /* Don't cache what doesn't fit in a record. */
+        if (value.size() > UINT32_MAX || context.size() > UINT32_MAX)
+            return id;
+        auto state(_state.lock());
+        state->pending.insert_or_assign(id, PendingRecord{
+            .parent = key.first,
+            .type = type,
+            .name = std::string(name),
+            .value = std::move(value),
+            .context = std::move(context),
+        });
+        if (!state->failed
+            && (state->pending.size() >= maxPending
+                || std::chrono::steady_clock::now() - state->lastWrite >= writeInterval))
+        {
+            try {
+                write(*state);
+            } catch (Error &) {
+                ignoreExceptionExceptInterrupt();
+                /* Keep the pending attributes, since cursors may
+                   refer to them. */
+                state->failed = true;
+            }
         }
+        return id;
     }
 
-    template<typename F>
-    AttrId doSQLite(F && fun)
+    static std::string encodeStrings(auto && strings)
     {
-        if (failed) return 0;
-        try {
-            return fun();
-        } catch (SQLiteError &) {
-            ignoreExceptionExceptInterrupt();
-            failed = true;
-            return 0;
+        std::string s;
+        for (auto & i : strings) {
+            s.append(i);
+            s.push_back(0);
         }
+        return s;
     }
 
-    AttrId setAttrs(
-        AttrKey key,
-        const std::vector<Symbol> & attrs)
+    static std::string encodeInt(int64_t n)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
+        return std::string(reinterpret_cast<const char *>(&n), sizeof(n));
+    }
 
-            state->insertAttribute.use()
-                (key.first)
-                (symbols[key.second])
-                (AttrType::FullAttrs)
-                (0, false).exec();
+    static std::vector<std::string_view> decodeStrings(std::string_view s)
+    {
+        std::vector<std::string_view> res;
+        while (!s.empty()) {
+            auto end = s.find('\0');
+            if (end == s.npos)
+                throw Error("unterminated string in evaluation cache");
+            res.push_back(s.substr(0, end));
+            s.remove_prefix(end + 1);
+        }
+        return res;
+    }
 
-            AttrId rowId = state->db.getLastInsertedRowId();
-            assert(rowId);
+    static int64_t decodeInt(std::string_view s)
+    {
+        int64_t n;
+        if (s.size() != sizeof(n))
+            throw Error("invalid integer in evaluation cache");
+        std::memcpy(&n, s.data(), sizeof(n));
+        return n;
+    }
 
-            for (auto & attr : attrs)
-                state->insertAttribute.use()
-                    (rowId)
-                    (symbols[attr])
-                    (AttrType::Placeholder)
-                    (0, false).exec();
+    AttrId setAttrs(
+        AttrKey key,
+        const std::vector<Symbol> & attrs)
+    {
+        std::vector<std::string_view> names;
+        for (auto & attr : attrs)
+            names.push_back(symbols[attr]);
+        auto id = set(key, AttrType::FullAttrs, encodeStrings(names));
+
+        /* Make sure that the attributes have an entry, so that their
+           children can be looked up. */
+        for (auto & attr : attrs) {
+            std::string_view name = symbols[attr];
+            bool exists = ({
+                auto state(_state.lock());
+                auto r = lookup(*state, attrId(id, name));
+                r && r->parent == id && r->name == name;
+            });
+            if (!exists)
+                setPlaceholder({id, attr});
+        }
 
-            return rowId;
-        });
+        return id;
     }
 
     AttrId setString(
@@ -151,192 +647,102 @@ struct AttrDb
         std::string_view s,
         const char * * context = nullptr)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            if (context) {
-                std::string ctx;
-                for (const char * * p = context; *p; ++p) {
-                    if (p != context) ctx.push_back(' ');
-                    ctx.append(*p);
-                }
-                state->insertAttributeWithContext.use()
-                    (key.first)
-                    (symbols[key.second])
-                    (AttrType::String)
-                    (s)
-                    (ctx).exec();
-            } else {
-                state->insertAttribute.use()
-                    (key.first)
-                    (symbols[key.second])
-                    (AttrType::String)
-                (s).exec();
+        std::string ctx;
+        if (context)
+            for (const char * * p = context; *p; ++p) {
+                ctx.append(*p);
+                ctx.push_back(0);
             }
-
-            return state->db.getLastInsertedRowId();
-        });
+        return set(key, AttrType::String, std::string(s), std::move(ctx));
     }
 
     AttrId setBool(
         AttrKey key,
         bool b)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (symbols[key.second])
-                (AttrType::Bool)
-                (b ? 1 : 0).exec();
-
-            return state->db.getLastInsertedRowId();
-        });
+        return set(key, AttrType::Bool, encodeInt(b ? 1 : 0));
     }
 
     AttrId setInt(
         AttrKey key,
-        int n)
+        NixInt::Inner n)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (symbols[key.second])
-                (AttrType::Int)
-                (n).exec();
-
-            return state->db.getLastInsertedRowId();
-        });
+        return set(key, AttrType::Int, encodeInt(n));
     }
 
     AttrId setListOfStrings(
         AttrKey key,
         const std::vector<std::string> & l)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (symbols[key.second])
-                (AttrType::ListOfStrings)
-                (dropEmptyInitThenConcatStringsSep("\t", l)).exec();
-
-            return state->db.getLastInsertedRowId();
-        });
+        return set(key, AttrType::ListOfStrings, encodeStrings(l));
     }
 
     AttrId setPlaceholder(AttrKey key)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (symbols[key.second])
-                (AttrType::Placeholder)
-                (0, false).exec();
-
-            return state->db.getLastInsertedRowId();
-        });
+        return set(key, AttrType::Placeholder);
     }
 
     AttrId setMissing(AttrKey key)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (symbols[key.second])
-                (AttrType::Missing)
-                (0, false).exec();
-
-            return state->db.getLastInsertedRowId();
-        });
+        return set(key, AttrType::Missing);
     }
 
     AttrId setMisc(AttrKey key)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (symbols[key.second])
-                (AttrType::Misc)
-                (0, false).exec();
-
-            return state->db.getLastInsertedRowId();
-        });
+        return set(key, AttrType::Misc);
     }
 
     AttrId setFailed(AttrKey key)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (symbols[key.second])
-                (AttrType::Failed)
-                (0, false).exec();
-
-            return state->db.getLastInsertedRowId();
-        });
+        return set(key, AttrType::Failed);
     }
 
     std::optional<std::pair<AttrId, AttrValue>> getAttr(AttrKey key)
     {
-        auto state(_state->lock());
+        std::string_view name = symbols[key.second];
+        auto id = attrId(key.first, name);
 
-        auto queryAttribute(state->queryAttribute.use()(key.first)(symbols[key.second]));
-        if (!queryAttribute.next()) return {};
+        auto state(_state.lock());
 
-        auto rowId = (AttrId) queryAttribute.getInt(0);
-        auto type = (AttrType) queryAttribute.getInt(1);
+        auto r = lookup(*state, id);
+        /* Another process may have evaluated the attribute. */
+        if ((!r || r->type == AttrType::Placeholder) && refresh(*state))
+            r = lookup(*state, id);
+        /* Different attribute paths can have the same ID, but it's
+           unlikely enough to just treat them as uncached. */
+        if (!r || r->parent != key.first || r->name != name) return {};
 
-        switch (type) {
+        switch (r->type) {
             case AttrType::Placeholder:
-                return {{rowId, placeholder_t()}};
+                return {{id, placeholder_t()}};
             case AttrType::FullAttrs: {
-                // FIXME: expensive, should separate this out.
                 std::vector<Symbol> attrs;
-                auto queryAttributes(state->queryAttributes.use()(rowId));
-                while (queryAttributes.next())
-                    attrs.emplace_back(symbols.create(queryAttributes.getStr(0)));
-                return {{rowId, attrs}};
+                for (auto & name : decodeStrings(r->value))
+                    attrs.emplace_back(symbols.create(name));
+                return {{id, attrs}};
             }
             case AttrType::String: {
                 NixStringContext context;
-                if (!queryAttribute.isNull(3))
-                    for (auto & s : tokenizeString<std::vector<std::string>>(queryAttribute.getStr(3), ";"))
-                        context.insert(NixStringContextElem::parse(s));
-                return {{rowId, string_t{queryAttribute.getStr(2), context}}};
+                for (auto & s : decodeStrings(r->context))
+                    context.insert(NixStringContextElem::parse(s));
+                return {{id, string_t{std::string(r->value), context}}};
             }
             case AttrType::Bool:
-                return {{rowId, queryAttribute.getInt(2) != 0}};
+                return {{id, decodeInt(r->value) != 0}};
             case AttrType::Int:
-                return {{rowId, int_t{NixInt{queryAttribute.getInt(2)}}}};
-            case AttrType::ListOfStrings:
-                return {{rowId, tokenizeString<std::vector<std::string>>(queryAttribute.getStr(2), "\t")}};
+                return {{id, int_t{NixInt{decodeInt(r->value)}}}};
+            case AttrType::ListOfStrings: {
+                std::vector<std::string> l;
+                for (auto & s : decodeStrings(r->value))
+                    l.emplace_back(s);
+                return {{id, l}};
+            }
             case AttrType::Missing:
-                return {{rowId, missing_t()}};
+                return {{id, missing_t()}};
             case AttrType::Misc:
-                return {{rowId, misc_t()}};
+                return {{id, misc_t()}};
             case AttrType::Failed:
-                return {{rowId, failed_t()}};
+                return {{id, failed_t()}};
             default:
                 throw Error("unexpected type in evaluation cache");
         }
@@ -350,7 +756,7 @@ static std::shared_ptr<AttrDb> makeAttrDb(
 {
     try {
         return std::make_shared<AttrDb>(cfg, fingerprint, symbols);
-    } catch (SQLiteError &) {
+    } catch (Error &) {
         ignoreExceptionExceptInterrupt();
         return nullptr;
     }
@@ -368,11 +774,12 @@ EvalCache::EvalCache(
 
 Value * EvalCache::getRootValue()
 {
-    if (!value) {
+    auto value(this->value.lock());
+    if (!*value) {
         debug("getting root value");
-        value = allocRootValue(rootLoader());
+        *value = allocRootValue(rootLoader());
     }
-    return *value;
+    return **value;
 }
 
 ref<AttrCursor> EvalCache::getRoot()
@@ -388,7 +795,7 @@ AttrCursor::AttrCursor(
     : root(root), parent(parent), cachedValue(std::move(cachedValue))
 {
     if (value)
-        _value = allocRootValue(value);
+        *_value.lock() = allocRootValue(value);
 }
 
 AttrKey AttrCursor::getKey()
@@ -404,18 +811,19 @@ AttrKey AttrCursor::getKey()
 
 Value & AttrCursor::getValue()
 {
-    if (!_value) {
+    auto value(_value.lock());
+    if (!*value) {
         if (parent) {
             auto & vParent = parent->first->getValue();
             root->state.forceAttrs(vParent, noPos, "while searching for an attribute");
             auto attr = vParent.attrs()->get(parent->second);
             if (!attr)
                 throw Error("attribute '%s' is unexpectedly missing", getAttrPathStr());
-            _value = allocRootValue(attr->value);
+            *value = allocRootValue(attr->value);
         } else
-            _value = allocRootValue(root->getRootValue());
+            *value = allocRootValue(root->getRootValue());
     }
-    return **_value;
+    return ***value;
 }
 
 std::vector<Symbol> AttrCursor::getAttrPath() const
@@ -37,7 +37,12 @@ class EvalCache : public std::enable_shared_from_this<EvalCache>
     EvalState & state;
     typedef std::function<Value *()> RootLoader;
     RootLoader rootLoader;
-    RootValue value;
+
+    /**
+     * The root value. Cursors may be used from several evaluator
+     * threads, so it is only loaded once under a lock.
+     */
+    Sync<RootValue> value;
 
     Value * getRootValue();
 
@@ -92,7 +97,12 @@ class AttrCursor : public std::enable_shared_from_this<AttrCursor>
     ref<EvalCache> root;
     typedef std::optional<std::pair<std::shared_ptr<AttrCursor>, Symbol>> Parent;
     Parent parent;
-    RootValue _value;
+
+    /**
+     * The value of this attribute, if it has been looked up. Children
+     * of this cursor may look it up from several threads.
+     */
+    Sync<RootValue> _value;
     std::optional<std::pair<AttrId, AttrValue>> cachedValue;
 
     AttrKey getKey();
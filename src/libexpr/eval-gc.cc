@@ -5,6 +5,9 @@
 #include "serialise.hh"
 #include "eval-gc.hh"
 
+#include <atomic>
+#include <chrono>
+
 #if HAVE_BOEHMGC
 
 #  include <pthread.h>
@@ -24,6 +27,54 @@
 
 namespace nix {
 
+struct GCSettings : Config
+{
+    Setting<uint64_t> initialHeapSize{this, 0, "gc-initial-heap-size",
+        R"(
+          The initial size of the heap of the evaluator's garbage
+          collector. A bigger heap means fewer collections. `0` (the
+          default) means 25% of physical memory, up to 384 MiB. The
+          [`GC_INITIAL_HEAP_SIZE`](@docroot@/command-ref/env-common.md#env-GC_INITIAL_HEAP_SIZE)
+          environment variable takes precedence over this setting.
+        )"};
+
+    Setting<uint64_t> maxHeapSize{this, 0, "gc-max-heap-size",
+        R"(
+          The maximum size of the heap of the evaluator's garbage
+          collector. Evaluation fails if it needs more memory than this.
+          `0` (the default) means no limit.
+        )"};
+
+    Setting<unsigned int> freeSpaceDivisor{this, 0, "gc-free-space-divisor",
+        R"(
+          How often the evaluator's garbage collector runs: it collects
+          after roughly 1/*N*th of the live heap has been allocated,
+          where *N* is this setting. Higher values use less memory but
+          collect more often. `0` (the default) uses the collector's
+          default, which is 3.
+        )"};
+
+    Setting<bool> incremental{this, false, "gc-incremental",
+        R"(
+          Whether the evaluator's garbage collector works incrementally
+          and generationally. It then collects in small steps, mostly
+          looking at objects that changed since the previous step,
+          which shortens pauses but adds the cost of tracking writes to
+          the heap.
+        )"};
+
+    Setting<unsigned int> markers{this, 0, "gc-markers",
+        R"(
+          The number of threads that the evaluator's garbage collector
+          uses to find live objects. `0` (the default) means one per
+          CPU core. `1` disables parallel marking.
+        )"};
+};
+
+static GCSettings gcSettings;
+
+static GlobalConfig::Register rGCSettings(&gcSettings);
+
 #if HAVE_BOEHMGC
 /* Called when the Boehm GC runs out of memory. */
 static void * oomHandler(size_t requested)
@@ -32,6 +83,33 @@ static void * oomHandler(size_t requested)
     throw std::bad_alloc();
 }
 
+static std::atomic<uint64_t> gcPauses{0};
+static std::atomic<std::chrono::nanoseconds::rep> gcPauseTime{0}, gcMaxPauseTime{0};
+
+/* Called by the collector with its lock held, so collections don't
+   overlap. */
+static void onCollectionEvent(GC_EventType event)
+{
+    static std::chrono::steady_clock::time_point stopped;
+
+    switch (event) {
+    case GC_EVENT_PRE_STOP_WORLD:
+        stopped = std::chrono::steady_clock::now();
+        break;
+    case GC_EVENT_POST_START_WORLD: {
+        auto pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - stopped).count();
+        gcPauses++;
+        gcPauseTime += pause;
+        if (pause > gcMaxPauseTime)
+            gcMaxPauseTime = pause;
+        break;
+    }
+    default:
+        break;
+    }
+}
+
 static inline void initGCReal()
 {
     /* Initialise the Boehm garbage collector. */
@@ -48,30 +126,59 @@ static inline void initGCReal()
        start of something. */
     GC_start_performance_measurement();
 
+    /* This must be set before the marker threads are started. */
+    if (gcSettings.markers)
+        GC_set_markers_count(gcSettings.markers);
+
     GC_INIT();
 
+    /* Values store their type in the low bits of pointers (see
+       `Value`), so the collector must recognise those as pointers to
+       the start of the object. */
+    if (sizeof(void *) == 8)
+        for (size_t tag = 1; tag < 8; ++tag)
+            GC_register_displacement(tag);
+
+    /* Allow threads other than the main thread to allocate, see
+       registerGCThread(). */
+    GC_allow_register_threads();
+
     GC_set_oom_fn(oomHandler);
 
-    /* Set the initial heap size to something fairly big (25% of
-       physical RAM, up to a maximum of 384 MiB) so that in most cases
-       we don't need to garbage collect at all.  (Collection has a
-       fairly significant overhead.)  The heap size can be overridden
-       through libgc's GC_INITIAL_HEAP_SIZE environment variable.  We
-       should probably also provide a nix.conf setting for this.  Note
-       that GC_expand_hp() causes a lot of virtual, but not physical
+    GC_set_on_collection_event(onCollectionEvent);
+
+    if (gcSettings.freeSpaceDivisor)
+        GC_set_free_space_divisor(gcSettings.freeSpaceDivisor);
+
+    if (gcSettings.maxHeapSize)
+        GC_set_max_heap_size(gcSettings.maxHeapSize);
+
+    if (gcSettings.incremental)
+        GC_enable_incremental();
+
+    /* Set the initial heap size to something fairly big (by default
+       25% of physical RAM, up to a maximum of 384 MiB) so that in most
+       cases we don't need to garbage collect at all.  (Collection has
+       a fairly significant overhead.)  The heap size can be overridden
+       through the gc-initial-heap-size setting or libgc's
+       GC_INITIAL_HEAP_SIZE environment variable.  Note that
+       GC_expand_hp() causes a lot of virtual, but not physical
        (resident) memory to be allocated.  This might be a problem on
        systems that don't overcommit. */
     if (!getEnv("GC_INITIAL_HEAP_SIZE")) {
-        size_t size = 32 * 1024 * 1024;
+        size_t size = gcSettings.initialHeapSize;
+        if (!size) {
+            size = 32 * 1024 * 1024;
 #  if HAVE_SYSCONF && defined(_SC_PAGESIZE) && defined(_SC_PHYS_PAGES)
-        size_t maxSize = 384 * 1024 * 1024;
-        long pageSize = sysconf(_SC_PAGESIZE);
-        long pages = sysconf(_SC_PHYS_PAGES);
-        if (pageSize != -1)
-            size = (pageSize * pages) / 4; // 25% of RAM
-        if (size > maxSize)
-            size = maxSize;
+            size_t maxSize = 384 * 1024 * 1024;
+            long pageSize = sysconf(_SC_PAGESIZE);
+            long pages = sysconf(_SC_PHYS_PAGES);
+            if (pageSize != -1)
+                size = (pageSize * pages) / 4; // 25% of RAM
+            if (size > maxSize)
+                size = maxSize;
 #  endif
+        }
         debug("setting initial heap size to %1% bytes", size);
         GC_expand_hp(size);
     }
@@ -85,6 +192,19 @@ size_t getGCCycles()
     return static_cast<size_t>(GC_get_gc_no()) - gcCyclesAfterInit;
 }
 
+GCStatistics getGCStatistics()
+{
+    assertGCInitialized();
+    GC_prof_stats_s stats;
+    GC_get_prof_stats(&stats, sizeof(stats));
+    return {
+        .pauses = gcPauses,
+        .pauseTime = gcPauseTime * 1e-9,
+        .maxPauseTime = gcMaxPauseTime * 1e-9,
+        .reclaimedBytes = stats.reclaimed_bytes_before_gc + stats.bytes_reclaimed_since_gc,
+    };
+}
+
 #endif
 
 static bool gcInitialised = false;
@@ -114,4 +234,29 @@ void assertGCInitialized()
     assert(gcInitialised);
 }
 
+void registerGCThread()
+{
+#if HAVE_BOEHMGC
+    struct Registration
+    {
+        Registration()
+        {
+            GC_stack_base sb;
+            if (GC_get_stack_base(&sb) != GC_SUCCESS)
+                throw Error("cannot determine the stack of the current thread");
+            GC_register_my_thread(&sb);
+        }
+
+        ~Registration()
+        {
+            GC_unregister_my_thread();
+        }
+    };
+
+    if (GC_thread_is_registered()) return;
+
+    static thread_local Registration registration;
+#endif
+}
+
 } // namespace nix
@@ -2,6 +2,7 @@
 ///@file
 
 #include <cstddef>
+#include <cstdint>
 
 #if HAVE_BOEHMGC
 
@@ -43,11 +44,35 @@ void initGC();
  */
 void assertGCInitialized();
 
+/**
+ * Make sure that the calling thread is known to the garbage
+ * collector, so that it can allocate and its stack is scanned for
+ * pointers. It is unregistered again when it exits.
+ */
+void registerGCThread();
+
 #ifdef HAVE_BOEHMGC
 /**
  * The number of GC cycles since initGC().
  */
 size_t getGCCycles();
+
+struct GCStatistics
+{
+    /**
+     * The number of times the collector stopped the evaluator, and
+     * the total and longest time it stopped it for, in seconds.
+     */
+    uint64_t pauses;
+    double pauseTime, maxPauseTime;
+
+    /**
+     * The number of bytes freed by all collections.
+     */
+    uint64_t reclaimedBytes;
+};
+
+GCStatistics getGCStatistics();
 #endif
 
 } // namespace nix
@@ -25,6 +25,40 @@ inline void * allocBytes(size_t n)
 }
 
 
+#if HAVE_BOEHMGC
+/**
+ * Caches of GC'd objects for `EvalState::allocValue()` and
+ * `EvalState::allocEnv()`. There is one per thread, so that
+ * allocation doesn't need a lock. It lives in uncollectable memory,
+ * so that the garbage collector sees the cached objects.
+ */
+struct GCAllocCache
+{
+    /**
+     * Allocation cache for GC'd Value objects.
+     */
+    void * values = nullptr;
+
+    /**
+     * Allocation cache for size-1 Env objects.
+     */
+    void * env1 = nullptr;
+};
+
+extern thread_local GCAllocCache * gcAllocCache;
+
+GCAllocCache & initGCAllocCache();
+
+[[gnu::always_inline]]
+inline GCAllocCache & getGCAllocCache()
+{
+    if (!gcAllocCache) [[unlikely]]
+        return initGCAllocCache();
+    return *gcAllocCache;
+}
+#endif
+
+
 [[gnu::always_inline]]
 Value * EvalState::allocValue()
 {
@@ -33,15 +67,16 @@ Value * EvalState::allocValue()
        GC_malloc_many returns a linked list of objects of the given size, where the first word
        of each object is also the pointer to the next object in the list. This also means that we
        have to explicitly clear the first word of every object we take. */
-    if (!*valueAllocCache) {
-        *valueAllocCache = GC_malloc_many(sizeof(Value));
-        if (!*valueAllocCache) throw std::bad_alloc();
+    auto & valueAllocCache = getGCAllocCache().values;
+    if (!valueAllocCache) {
+        valueAllocCache = GC_malloc_many(sizeof(Value));
+        if (!valueAllocCache) throw std::bad_alloc();
     }
 
     /* GC_NEXT is a convenience macro for accessing the first word of an object.
        Take the first list item, advance the list to the next item, and clear the next pointer. */
-    void * p = *valueAllocCache;
-    *valueAllocCache = GC_NEXT(p);
+    void * p = valueAllocCache;
+    valueAllocCache = GC_NEXT(p);
     GC_NEXT(p) = nullptr;
 #else
     void * p = allocBytes(sizeof(Value));
@@ -63,13 +98,14 @@ Env & EvalState::allocEnv(size_t size)
 #if HAVE_BOEHMGC
     if (size == 1) {
         /* see allocValue for explanations. */
-        if (!*env1AllocCache) {
-            *env1AllocCache = GC_malloc_many(sizeof(Env) + sizeof(Value *));
-            if (!*env1AllocCache) throw std::bad_alloc();
+        auto & env1AllocCache = getGCAllocCache().env1;
+        if (!env1AllocCache) {
+            env1AllocCache = GC_malloc_many(sizeof(Env) + sizeof(Value *));
+            if (!env1AllocCache) throw std::bad_alloc();
         }
 
-        void * p = *env1AllocCache;
-        *env1AllocCache = GC_NEXT(p);
+        void * p = env1AllocCache;
+        env1AllocCache = GC_NEXT(p);
         GC_NEXT(p) = nullptr;
         env = (Env *) p;
     } else
@@ -85,25 +121,52 @@ Env & EvalState::allocEnv(size_t size)
 [[gnu::always_inline]]
 void EvalState::forceValue(Value & v, const PosIdx pos)
 {
-    if (v.isThunk()) {
-        Env * env = v.payload.thunk.env;
-        assert(env || v.isBlackhole());
-        Expr * expr = v.payload.thunk.expr;
+    auto type = v.getInternalTypeAtomic();
+    if (type == tThunk) {
+        Env * env = v.thunk().env;
+        Expr * expr = v.thunk().expr;
+        assert(env);
+        if (!v.markPending(tThunk, parallel)) [[unlikely]]
+            return waitOnThunk(v, pos);
         try {
-            v.mkBlackhole();
             //checkInterrupt();
-            if (env) [[likely]]
-                expr->eval(*this, *env, v);
-            else
-                ExprBlackHole::throwInfiniteRecursionError(*this, v);
+            expr->eval(*this, *env, v);
         } catch (...) {
             v.mkThunk(env, expr);
-            tryFixupBlackHolePos(v, pos);
+            finishThunk(v);
+            throw;
+        }
+        finishThunk(v);
+    }
+    else if (type == tApp) {
+        Value * left = v.app().left;
+        Value * right = v.app().right;
+        if (!v.markPending(tApp, parallel)) [[unlikely]]
+            return waitOnThunk(v, pos);
+        try {
+            callFunction(*left, *right, v, pos);
+        } catch (...) {
+            v.mkApp(left, right);
+            finishThunk(v);
             throw;
         }
+        finishThunk(v);
+    }
+    else if (type == tPending) [[unlikely]]
+        waitOnThunk(v, pos);
+}
+
+
+[[gnu::always_inline]]
+inline void EvalState::finishThunk(Value & v)
+{
+    if (parallel) {
+        /* Pairs with the fence in waitOnThunk(): either we see the
+           waiter, or it sees the final value. */
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (nrThunkWaiters.load(std::memory_order_relaxed)) [[unlikely]]
+            wakeThunkWaiters(v);
     }
-    else if (v.isApp())
-        callFunction(*v.payload.app.left, *v.payload.app.right, v, pos);
 }
 
 
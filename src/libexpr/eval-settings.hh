@@ -197,6 +197,28 @@ struct EvalSettings : Config
             Intermediate results are not cached.
         )"};
 
+    Setting<bool> useParseCache{this, true, "parse-cache",
+        R"(
+          Whether to cache the result of parsing Nix files on disk, in
+          `~/.cache/nix/parse-cache-v2`, so that files that haven't
+          changed don't need to be parsed again by later invocations of
+          Nix. Entries are keyed by the contents of the file and the
+          version of Nix, so they never become stale, and identical
+          files in different locations share an entry. Entries that
+          haven't been used for 30 days are deleted.
+        )"};
+
+    Setting<bool> evalBytecode{this, false, "eval-bytecode",
+        R"(
+          If set to true, compile conditionals, Boolean operators,
+          comparisons and attribute selections in parsed Nix
+          expressions to bytecode, which is run by a small stack machine
+          instead of the tree-walking evaluator. The results, including
+          errors, are the same either way.
+
+          The bytecode is not used in the debugger.
+        )"};
+
     Setting<bool> ignoreExceptionsDuringTry{this, false, "ignore-try",
         R"(
           If set to true, ignore exceptions inside 'tryEval' calls when evaluating nix expressions in
@@ -209,6 +231,14 @@ struct EvalSettings : Config
     Setting<unsigned int> maxCallDepth{this, 10000, "max-call-depth",
         "The maximum function call depth to allow before erroring."};
 
+    Setting<unsigned int> evalCores{this, 1, "eval-cores",
+        R"(
+          The number of threads used to evaluate values that are needed in bulk, such as the outputs checked by [`nix flake check`](@docroot@/command-ref/new-cli/nix3-flake-check.md), the packages visited by [`nix search`](@docroot@/command-ref/new-cli/nix3-search.md), and the result of [`nix eval`](@docroot@/command-ref/new-cli/nix3-eval.md).
+          If set to 0, one thread per CPU core is used.
+
+          Parallel evaluation is not used in the debugger, or when `NIX_COUNT_CALLS` is set.
+        )"};
+
     Setting<bool> builtinsTraceDebugger{this, false, "debugger-on-trace",
         R"(
           If set to true and the `--debugger` flag is given, the following functions
@@ -20,8 +20,13 @@
 #include "fetch-to-store.hh"
 #include "tarball.hh"
 #include "parser-tab.hh"
+#include "parallel-eval.hh"
+#include "parse-cache.hh"
+#include "bytecode.hh"
+#include "string-rope.hh"
 
 #include <algorithm>
+#include <array>
 #include <iostream>
 #include <sstream>
 #include <cstring>
@@ -30,6 +35,7 @@
 #include <sys/time.h>
 #include <fstream>
 #include <functional>
+#include <unordered_set>
 
 #include <nlohmann/json.hpp>
 #include <boost/container/small_vector.hpp>
@@ -74,6 +80,32 @@ RootValue allocRootValue(Value * v)
     return std::allocate_shared<Value *>(traceable_allocator<Value *>(), v);
 }
 
+#if HAVE_BOEHMGC
+thread_local GCAllocCache * gcAllocCache = nullptr;
+
+GCAllocCache & initGCAllocCache()
+{
+    struct Owner
+    {
+        ~Owner()
+        {
+            /* Let the cached objects be collected. */
+            GC_FREE(gcAllocCache);
+            gcAllocCache = nullptr;
+        }
+    };
+
+    static thread_local Owner owner;
+
+    gcAllocCache = new (GC_MALLOC_UNCOLLECTABLE(sizeof(GCAllocCache))) GCAllocCache;
+    return *gcAllocCache;
+}
+#endif
+
+thread_local int EvalState::trylevel = 0;
+
+thread_local size_t EvalState::callDepth = 0;
+
 // Pretty print types for assertion errors
 std::ostream & operator << (std::ostream & os, const ValueType t) {
     os << showType(t);
@@ -95,7 +127,7 @@ void Value::print(EvalState & state, std::ostream & str, PrintOptions options)
 const Value * getPrimOp(const Value &v) {
     const Value * primOp = &v;
     while (primOp->isPrimOpApp()) {
-        primOp = primOp->payload.primOpApp.left;
+        primOp = primOp->primOpApp().left;
     }
     assert(primOp->isPrimOp());
     return primOp;
@@ -126,15 +158,16 @@ std::string showType(const Value & v)
     // Allow selecting a subset of enum values
     #pragma GCC diagnostic push
     #pragma GCC diagnostic ignored "-Wswitch-enum"
-    switch (v.internalType) {
-        case tString: return v.payload.string.context ? "a string with context" : "a string";
+    switch (v.getInternalType()) {
+        case tString: return v.context() ? "a string with context" : "a string";
         case tPrimOp:
-            return fmt("the built-in function '%s'", std::string(v.payload.primOp->name));
+            return fmt("the built-in function '%s'", std::string(v.primOp()->name));
         case tPrimOpApp:
-            return fmt("the partially applied built-in function '%s'", std::string(getPrimOp(v)->payload.primOp->name));
+            return fmt("the partially applied built-in function '%s'", std::string(getPrimOp(v)->primOp()->name));
         case tExternal: return v.external()->showType();
-        case tThunk: return v.isBlackhole() ? "a black hole" : "a thunk";
+        case tThunk: return "a thunk";
         case tApp: return "a function application";
+        case tPending: return "a black hole";
     default:
         return std::string(showType(v.type()));
     }
@@ -146,10 +179,10 @@ PosIdx Value::determinePos(const PosIdx pos) const
     // Allow selecting a subset of enum values
     #pragma GCC diagnostic push
     #pragma GCC diagnostic ignored "-Wswitch-enum"
-    switch (internalType) {
+    switch (getInternalType()) {
         case tAttrs: return attrs()->pos;
-        case tLambda: return payload.lambda.fun->pos;
-        case tApp: return payload.app.left->determinePos(pos);
+        case tLambda: return lambda().fun->pos;
+        case tApp: return app().left->determinePos(pos);
         default: return pos;
     }
     #pragma GCC diagnostic pop
@@ -157,14 +190,16 @@ PosIdx Value::determinePos(const PosIdx pos) const
 
 bool Value::isTrivial() const
 {
+    auto internalType = getInternalType();
     return
         internalType != tApp
+        && internalType != tPending
         && internalType != tPrimOpApp
         && (internalType != tThunk
-            || (dynamic_cast<ExprAttrs *>(payload.thunk.expr)
-                && ((ExprAttrs *) payload.thunk.expr)->dynamicAttrs.empty())
-            || dynamic_cast<ExprLambda *>(payload.thunk.expr)
-            || dynamic_cast<ExprList *>(payload.thunk.expr));
+            || (dynamic_cast<ExprAttrs *>(thunk().expr)
+                && ((ExprAttrs *) thunk().expr)->dynamicAttrs.empty())
+            || dynamic_cast<ExprLambda *>(thunk().expr)
+            || dynamic_cast<ExprList *>(thunk().expr));
 }
 
 
@@ -296,11 +331,10 @@ EvalState::EvalState(
     , buildStore(buildStore ? buildStore : store)
     , debugRepl(nullptr)
     , debugStop(false)
-    , trylevel(0)
     , regexCache(makeRegexCache())
+    , thunkWaiters(std::make_unique<ThunkWaiters>())
+    , parallel(settings.evalCores != 1)
 #if HAVE_BOEHMGC
-    , valueAllocCache(std::allocate_shared<void *>(traceable_allocator<void *>(), nullptr))
-    , env1AllocCache(std::allocate_shared<void *>(traceable_allocator<void *>(), nullptr))
     , baseEnvP(std::allocate_shared<Env *>(traceable_allocator<Env *>(), &allocEnv(BASE_ENV_SIZE)))
     , baseEnv(**baseEnvP)
 #else
@@ -475,7 +509,7 @@ void EvalState::addConstant(const std::string & name, Value * v, Constant info)
         /* Install value the base environment. */
         staticBaseEnv->vars.emplace_back(symbols.create(name), baseEnvDispl);
         baseEnv.values[baseEnvDispl++] = v;
-        getBuiltins().payload.attrs->push_back(Attr(symbols.create(name2), v));
+        const_cast<Bindings *>(getBuiltins().attrs())->push_back(Attr(symbols.create(name2), v));
     }
 }
 
@@ -497,9 +531,9 @@ std::ostream & operator<<(std::ostream & output, const PrimOp & primOp)
 
 const PrimOp * Value::primOpAppPrimOp() const
 {
-    Value * left = payload.primOpApp.left;
+    Value * left = primOpApp().left;
     while (left && !left->isPrimOp()) {
-        left = left->payload.primOpApp.left;
+        left = left->primOpApp().left;
     }
 
     if (!left)
@@ -511,7 +545,7 @@ const PrimOp * Value::primOpAppPrimOp() const
 void Value::mkPrimOp(PrimOp * p)
 {
     p->check();
-    finishValue(tPrimOp, { .primOp = p });
+    setSingle(tPrimOp, reinterpret_cast<uintptr_t>(p));
 }
 
 
@@ -543,7 +577,7 @@ Value * EvalState::addPrimOp(PrimOp && primOp)
     else {
         staticBaseEnv->vars.emplace_back(envName, baseEnvDispl);
         baseEnv.values[baseEnvDispl++] = v;
-        getBuiltins().payload.attrs->push_back(Attr(symbols.create(primOp.name), v));
+        const_cast<Bindings *>(getBuiltins().attrs())->push_back(Attr(symbols.create(primOp.name), v));
     }
 
     return v;
@@ -580,7 +614,7 @@ std::optional<EvalState::Doc> EvalState::getDoc(Value & v)
             };
     }
     if (v.isLambda()) {
-        auto exprLambda = v.payload.lambda.fun;
+        auto exprLambda = v.lambda().fun;
 
         std::ostringstream s;
         std::string name;
@@ -658,7 +692,7 @@ void printStaticEnvBindings(const SymbolTable & st, const StaticEnv & se)
 // just for the current level of Env, not the whole chain.
 void printWithBindings(const SymbolTable & st, const Env & env)
 {
-    if (!env.values[0]->isThunk()) {
+    if (env.values[0]->type() != nThunk) {
         std::cout << "with: ";
         std::cout << ANSI_MAGENTA;
         auto j = env.values[0]->attrs()->begin();
@@ -714,7 +748,7 @@ void mapStaticEnvBindings(const SymbolTable & st, const StaticEnv & se, const En
     if (env.up && se.up) {
         mapStaticEnvBindings(st, *se.up, *env.up, vm);
 
-        if (se.isWith && !env.values[0]->isThunk()) {
+        if (se.isWith && env.values[0]->type() != nThunk) {
             // add 'with' bindings.
             for (auto & j : *env.values[0]->attrs())
                 vm.insert_or_assign(std::string(st[j.name]), j.value);
@@ -855,7 +889,7 @@ void Value::mkString(std::string_view s)
 }
 
 
-static const char * * encodeContext(const NixStringContext & context)
+const char * * encodeContext(const NixStringContext & context)
 {
     if (!context.empty()) {
         size_t n = 0;
@@ -913,7 +947,7 @@ inline Value * EvalState::lookupVar(Env * env, const ExprVar & var, bool noEval)
 
 ListBuilder::ListBuilder(EvalState & state, size_t size)
     : size(size)
-    , elems(size <= 2 ? inlineElems : (Value * *) allocBytes(size * sizeof(Value *)))
+    , elems(size <= maxInlineElems ? inlineElems : (Value * *) allocBytes(size * sizeof(Value *)))
 {
     state.nrListElems += size;
 }
@@ -1074,29 +1108,40 @@ Value * ExprPath::maybeThunk(EvalState & state, Env & env)
 
 void EvalState::evalFile(const SourcePath & path, Value & v, bool mustBeTrivial)
 {
-    FileEvalCache::iterator i;
-    if ((i = fileEvalCache.find(path)) != fileEvalCache.end()) {
-        v = i->second;
-        return;
+    {
+        auto cache(fileEvalCache.lock());
+        if (auto i = cache->find(path); i != cache->end()) {
+            v = i->second;
+            return;
+        }
     }
 
     auto resolvedPath = resolveExprPath(path);
-    if ((i = fileEvalCache.find(resolvedPath)) != fileEvalCache.end()) {
-        v = i->second;
-        return;
+
+    {
+        auto cache(fileEvalCache.lock());
+        if (auto i = cache->find(resolvedPath); i != cache->end()) {
+            v = i->second;
+            return;
+        }
     }
 
+    /* Note: with parallel evaluation, several threads may evaluate
+       the same file at the same time. That's harmless, since they
+       get the same result. */
     printTalkative("evaluating file '%1%'", resolvedPath);
     Expr * e = nullptr;
 
-    auto j = fileParseCache.find(resolvedPath);
-    if (j != fileParseCache.end())
-        e = j->second;
+    {
+        auto cache(fileParseCache.lock());
+        if (auto j = cache->find(resolvedPath); j != cache->end())
+            e = j->second;
+    }
 
-    if (!e)
+    if (!e) {
         e = parseExprFromFile(resolvedPath);
-
-    fileParseCache.emplace(resolvedPath, e);
+        fileParseCache.lock()->emplace(resolvedPath, e);
+    }
 
     try {
         auto dts = debugRepl
@@ -1119,15 +1164,16 @@ void EvalState::evalFile(const SourcePath & path, Value & v, bool mustBeTrivial)
         throw;
     }
 
-    fileEvalCache.emplace(resolvedPath, v);
-    if (path != resolvedPath) fileEvalCache.emplace(path, v);
+    auto cache(fileEvalCache.lock());
+    cache->emplace(resolvedPath, v);
+    if (path != resolvedPath) cache->emplace(path, v);
 }
 
 
 void EvalState::resetFileCache()
 {
-    fileEvalCache.clear();
-    fileParseCache.clear();
+    fileEvalCache.lock()->clear();
+    fileParseCache.lock()->clear();
 }
 
 
@@ -1390,11 +1436,16 @@ static std::string showAttrPath(EvalState & state, Env & env, const AttrPath & a
 void ExprSelect::eval(EvalState & state, Env & env, Value & v)
 {
     Value vTmp;
+    e->eval(state, env, vTmp);
+    evalPath(state, env, vTmp, v);
+}
+
+
+void ExprSelect::evalPath(EvalState & state, Env & env, Value & vTmp, Value & v)
+{
     PosIdx pos2;
     Value * vAttrs = &vTmp;
 
-    e->eval(state, env, vTmp);
-
     try {
         auto dts = state.debugRepl
             ? makeDebugTraceStacker(
@@ -1408,26 +1459,32 @@ void ExprSelect::eval(EvalState & state, Env & env, Value & v)
 
         for (auto & i : attrPath) {
             state.nrLookups++;
-            const Attr * j;
             auto name = getName(i, state, env);
             if (def) {
                 state.forceValue(*vAttrs, pos);
-                if (vAttrs->type() != nAttrs ||
-                    !(j = vAttrs->attrs()->get(name)))
-                {
+                if (vAttrs->type() != nAttrs) {
                     def->eval(state, env, v);
                     return;
                 }
-            } else {
+            } else
                 state.forceAttrs(*vAttrs, pos, "while selecting an attribute");
-                if (!(j = vAttrs->attrs()->get(name))) {
-                    std::set<std::string> allAttrNames;
-                    for (auto & attr : *vAttrs->attrs())
-                        allAttrNames.insert(std::string(state.symbols[attr.name]));
-                    auto suggestions = Suggestions::bestMatches(allAttrNames, state.symbols[name]);
-                    state.error<EvalError>("attribute '%1%' missing", state.symbols[name])
-                        .atPos(pos).withSuggestions(suggestions).withFrame(env, *this).debugThrow();
+            bool hit;
+            auto j = vAttrs->attrs()->get(name, i.cachedPos, hit);
+            if (hit)
+                state.nrSelectCacheHits++;
+            else
+                state.nrSelectCacheMisses++;
+            if (!j) {
+                if (def) {
+                    def->eval(state, env, v);
+                    return;
                 }
+                std::set<std::string> allAttrNames;
+                for (auto & attr : *vAttrs->attrs())
+                    allAttrNames.insert(std::string(state.symbols[attr.name]));
+                auto suggestions = Suggestions::bestMatches(allAttrNames, state.symbols[name]);
+                state.error<EvalError>("attribute '%1%' missing", state.symbols[name])
+                    .atPos(pos).withSuggestions(suggestions).withFrame(env, *this).debugThrow();
             }
             vAttrs = j->value;
             pos2 = j->pos;
@@ -1470,9 +1527,14 @@ Symbol ExprSelect::evalExceptFinalSelect(EvalState & state, Env & env, Value & a
 void ExprOpHasAttr::eval(EvalState & state, Env & env, Value & v)
 {
     Value vTmp;
-    Value * vAttrs = &vTmp;
-
     e->eval(state, env, vTmp);
+    evalPath(state, env, vTmp, v);
+}
+
+
+void ExprOpHasAttr::evalPath(EvalState & state, Env & env, Value & vTmp, Value & v)
+{
+    Value * vAttrs = &vTmp;
 
     for (auto & i : attrPath) {
         state.forceValue(*vAttrs, getPos());
@@ -1525,13 +1587,13 @@ void EvalState::callFunction(Value & fun, std::span<Value *> args, Value & vRes,
 
         if (vCur.isLambda()) {
 
-            ExprLambda & lambda(*vCur.payload.lambda.fun);
+            ExprLambda & lambda(*vCur.lambda().fun);
 
             auto size =
                 (!lambda.arg ? 0 : 1) +
                 (lambda.hasFormals() ? lambda.formals->formals.size() : 0);
             Env & env2(allocEnv(size));
-            env2.up = vCur.payload.lambda.env;
+            env2.up = vCur.lambda().env;
 
             Displacement displ = 0;
 
@@ -1561,7 +1623,7 @@ void EvalState::callFunction(Value & fun, std::span<Value *> args, Value & vRes,
                                              symbols[i.name])
                                     .atPos(lambda.pos)
                                     .withTrace(pos, "from call site")
-                                    .withFrame(*fun.payload.lambda.env, lambda)
+                                    .withFrame(*fun.lambda().env, lambda)
                                     .debugThrow();
                         }
                         env2.values[displ++] = i.def->maybeThunk(*this, env2);
@@ -1588,7 +1650,7 @@ void EvalState::callFunction(Value & fun, std::span<Value *> args, Value & vRes,
                                 .atPos(lambda.pos)
                                 .withTrace(pos, "from call site")
                                 .withSuggestions(suggestions)
-                                .withFrame(*fun.payload.lambda.env, lambda)
+                                .withFrame(*fun.lambda().env, lambda)
                                 .debugThrow();
                         }
                     unreachable();
@@ -1660,7 +1722,7 @@ void EvalState::callFunction(Value & fun, std::span<Value *> args, Value & vRes,
             Value * primOp = &vCur;
             while (primOp->isPrimOpApp()) {
                 argsDone++;
-                primOp = primOp->payload.primOpApp.left;
+                primOp = primOp->primOpApp().left;
             }
             assert(primOp->isPrimOp());
             auto arity = primOp->primOp()->arity;
@@ -1676,8 +1738,8 @@ void EvalState::callFunction(Value & fun, std::span<Value *> args, Value & vRes,
 
                 Value * vArgs[maxPrimOpArity];
                 auto n = argsDone;
-                for (Value * arg = &vCur; arg->isPrimOpApp(); arg = arg->payload.primOpApp.left)
-                    vArgs[--n] = arg->payload.primOpApp.right;
+                for (Value * arg = &vCur; arg->isPrimOpApp(); arg = arg->primOpApp().left)
+                    vArgs[--n] = arg->primOpApp().right;
 
                 for (size_t i = 0; i < argsLeft; ++i)
                     vArgs[argsDone + i] = args[i];
@@ -1776,8 +1838,8 @@ void EvalState::autoCallFunction(const Bindings & args, Value & fun, Value & res
     forceValue(fun, pos);
 
     if (fun.type() == nAttrs) {
-        auto found = fun.attrs()->find(sFunctor);
-        if (found != fun.attrs()->end()) {
+        auto found = fun.attrs()->get(sFunctor);
+        if (found) {
             Value * v = allocValue();
             callFunction(*found->value, fun, *v, pos);
             forceValue(*v, pos);
@@ -1785,14 +1847,14 @@ void EvalState::autoCallFunction(const Bindings & args, Value & fun, Value & res
         }
     }
 
-    if (!fun.isLambda() || !fun.payload.lambda.fun->hasFormals()) {
+    if (!fun.isLambda() || !fun.lambda().fun->hasFormals()) {
         res = fun;
         return;
     }
 
-    auto attrs = buildBindings(std::max(static_cast<uint32_t>(fun.payload.lambda.fun->formals->formals.size()), args.size()));
+    auto attrs = buildBindings(std::max(static_cast<uint32_t>(fun.lambda().fun->formals->formals.size()), args.size()));
 
-    if (fun.payload.lambda.fun->formals->ellipsis) {
+    if (fun.lambda().fun->formals->ellipsis) {
         // If the formals have an ellipsis (eg the function accepts extra args) pass
         // all available automatic arguments (which includes arguments specified on
         // the command line via --arg/--argstr)
@@ -1800,7 +1862,7 @@ void EvalState::autoCallFunction(const Bindings & args, Value & fun, Value & res
             attrs.insert(v);
     } else {
         // Otherwise, only pass the arguments that the function accepts
-        for (auto & i : fun.payload.lambda.fun->formals->formals) {
+        for (auto & i : fun.lambda().fun->formals->formals) {
             auto j = args.get(i.name);
             if (j) {
                 attrs.insert(*j);
@@ -1810,7 +1872,7 @@ Nix attempted to evaluate a function as a top level expression; in
 this case it must have its arguments supplied either by default
 values, or passed explicitly with '--arg' or '--argstr'. See
 https://nixos.org/manual/nix/stable/language/constructs.html#functions.)", symbols[i.name])
-                    .atPos(i.pos).withFrame(*fun.payload.lambda.env, *fun.payload.lambda.fun).debugThrow();
+                    .atPos(i.pos).withFrame(*fun.lambda().env, *fun.lambda().fun).debugThrow();
             }
         }
     }
@@ -1838,25 +1900,30 @@ void ExprIf::eval(EvalState & state, Env & env, Value & v)
 
 void ExprAssert::eval(EvalState & state, Env & env, Value & v)
 {
-    if (!state.evalBool(env, cond, pos, "in the condition of the assert statement")) {
-        std::ostringstream out;
-        cond->show(state.symbols, out);
-        auto exprStr = toView(out);
+    if (!state.evalBool(env, cond, pos, "in the condition of the assert statement"))
+        fail(state, env);
+    body->eval(state, env, v);
+}
 
-        if (auto eq = dynamic_cast<ExprOpEq *>(cond)) {
-            try {
-                Value v1; eq->e1->eval(state, env, v1);
-                Value v2; eq->e2->eval(state, env, v2);
-                state.assertEqValues(v1, v2, eq->pos, "in an equality assertion");
-            } catch (AssertionError & e) {
-                e.addTrace(state.positions[pos], "while evaluating the condition of the assertion '%s'", exprStr);
-                throw;
-            }
-        }
 
-        state.error<AssertionError>("assertion '%1%' failed", exprStr).atPos(pos).withFrame(env, *this).debugThrow();
+void ExprAssert::fail(EvalState & state, Env & env)
+{
+    std::ostringstream out;
+    cond->show(state.symbols, out);
+    auto exprStr = toView(out);
+
+    if (auto eq = dynamic_cast<ExprOpEq *>(cond)) {
+        try {
+            Value v1; eq->e1->eval(state, env, v1);
+            Value v2; eq->e2->eval(state, env, v2);
+            state.assertEqValues(v1, v2, eq->pos, "in an equality assertion");
+        } catch (AssertionError & e) {
+            e.addTrace(state.positions[pos], "while evaluating the condition of the assertion '%s'", exprStr);
+            throw;
+        }
     }
-    body->eval(state, env, v);
+
+    state.error<AssertionError>("assertion '%1%' failed", exprStr).atPos(pos).withFrame(env, *this).debugThrow();
 }
 
 
@@ -1900,6 +1967,113 @@ void ExprOpImpl::eval(EvalState & state, Env & env, Value & v)
 }
 
 
+void EvalState::evalBytecode(const Bytecode & code, Env & env, Value & v)
+{
+    using Op = Bytecode::Op;
+
+    SmallTemporaryValueVector<8> stack(code.maxStack);
+    Value * sp = stack.data();
+    uint32_t pc = 0;
+
+    try {
+        while (pc < code.instrs.size()) {
+            auto & i = code.instrs[pc];
+
+            switch (i.op) {
+
+            case Op::Const:
+                *sp++ = *i.value;
+                break;
+
+            case Op::Local: {
+                /* Like `ExprVar::eval()`. */
+                auto env2 = &env;
+                for (auto l = i.level; l; --l, env2 = env2->up) ;
+                auto v2 = env2->values[i.arg];
+                forceValue(*v2, static_cast<ExprVar *>(i.expr)->pos);
+                *sp++ = *v2;
+                break;
+            }
+
+            case Op::Eval:
+                i.expr->eval(*this, env, *sp++);
+                break;
+
+            case Op::Select:
+                static_cast<ExprSelect *>(i.expr)->evalPath(*this, env, sp[-1], sp[-1]);
+                break;
+
+            case Op::HasAttr:
+                static_cast<ExprOpHasAttr *>(i.expr)->evalPath(*this, env, sp[-1], sp[-1]);
+                break;
+
+            case Op::CheckBool:
+                if (sp[-1].type() != nBool)
+                    error<TypeError>(
+                        "expected a Boolean but found %1%: %2%",
+                        showType(sp[-1]),
+                        ValuePrinter(*this, sp[-1], errorPrintOptions)
+                    ).atPos(code.traces[i.arg].pos).withFrame(env, *i.expr).debugThrow();
+                break;
+
+            case Op::Not:
+                sp[-1].mkBool(!sp[-1].boolean());
+                break;
+
+            case Op::Eq:
+                sp--;
+                sp[-1].mkBool(eqValues(sp[-1], *sp, static_cast<ExprOpEq *>(i.expr)->pos, "while testing two values for equality"));
+                break;
+
+            case Op::NEq:
+                sp--;
+                sp[-1].mkBool(!eqValues(sp[-1], *sp, static_cast<ExprOpNEq *>(i.expr)->pos, "while testing two values for inequality"));
+                break;
+
+            case Op::Jump:
+                pc = i.arg;
+                continue;
+
+            case Op::JumpIfFalse:
+                if (!(--sp)->boolean()) {
+                    pc = i.arg;
+                    continue;
+                }
+                break;
+
+            case Op::JumpIfTrue:
+                if ((--sp)->boolean()) {
+                    pc = i.arg;
+                    continue;
+                }
+                break;
+
+            case Op::PushBool:
+                (sp++)->mkBool(i.arg);
+                break;
+
+            case Op::AssertTrue:
+                if (!(--sp)->boolean())
+                    static_cast<ExprAssert *>(i.expr)->fail(*this, env);
+                break;
+            }
+
+            pc++;
+        }
+    } catch (Error & e) {
+        /* Add the traces that `evalBool()` would have added, innermost
+           first. */
+        for (auto t = code.traces.rbegin(); t != code.traces.rend(); ++t)
+            if (pc >= t->start && pc < t->end)
+                e.addTrace(positions[t->pos], t->errorCtx);
+        throw;
+    }
+
+    assert(sp == stack.data() + 1);
+    v = stack[0];
+}
+
+
 void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
 {
     Value v1, v2;
@@ -1911,6 +2085,18 @@ void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
     if (v1.attrs()->size() == 0) { v = v2; return; }
     if (v2.attrs()->size() == 0) { v = v1; return; }
 
+    /* If a few attributes of a large set are updated, don't copy the
+       set, but put the new attributes on top of it. */
+    if (v1.attrs()->size() >= Bindings::indexThreshold
+        && v2.attrs()->size() < Bindings::indexThreshold
+        && v1.attrs()->layers() < Bindings::maxLayers)
+    {
+        v.mkAttrs(state.allocLayeredBindings(*v1.attrs(), *v2.attrs()));
+        state.nrOpUpdatesLayered++;
+        state.nrOpUpdateValuesCopied += v2.attrs()->size();
+        return;
+    }
+
     auto attrs = state.buildBindings(v1.attrs()->size() + v2.attrs()->size());
 
     /* Merge the sets, preferring values from the second set.  Make
@@ -1988,25 +2174,14 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
     bool first = !forceString;
     ValueType firstType = nString;
 
+    StringRopeBuilder rope;
+
     const auto str = [&] {
         std::string result;
         result.reserve(sSize);
         for (const auto & part : s) result += *part;
         return result;
     };
-    /* c_str() is not str().c_str() because we want to create a string
-       Value. allocating a GC'd string directly and moving it into a
-       Value lets us avoid an allocation and copy. */
-    const auto c_str = [&] {
-        char * result = allocString(sSize + 1);
-        char * tmp = result;
-        for (const auto & part : s) {
-            memcpy(tmp, part->data(), part->size());
-            tmp += part->size();
-        }
-        *tmp = 0;
-        return result;
-    };
 
     // List of returned strings. References to these Values must NOT be persisted.
     SmallTemporaryValueVector<conservativeStackReservation> values(es->size());
@@ -2046,16 +2221,24 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
                 nf += vTmp.fpoint();
             } else
                 state.error<EvalError>("cannot add %1% to a float", showType(vTmp)).atPos(i_pos).withFrame(env, *this).debugThrow();
+        } else if (firstType == nString && vTmp.type() == nString) {
+            /* Share the contents of strings rather than copying them. */
+            copyContext(vTmp, context);
+            rope.add(vTmp);
         } else {
-            if (s.empty()) s.reserve(es->size());
             /* skip canonization of first path, which would only be not
             canonized in the first place if it's coming from a ./${foo} type
             path */
             auto part = state.coerceToString(i_pos, vTmp, context,
                                              "while evaluating a path segment",
                                              false, firstType == nString, !first);
-            sSize += part->size();
-            s.emplace_back(std::move(part));
+            if (firstType == nString)
+                rope.add(std::move(part));
+            else {
+                if (s.empty()) s.reserve(es->size());
+                sSize += part->size();
+                s.emplace_back(std::move(part));
+            }
         }
 
         first = false;
@@ -2070,7 +2253,7 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
             state.error<EvalError>("a string that refers to a store path cannot be appended to a path").atPos(pos).withFrame(env, *this).debugThrow();
         v.mkPath(state.rootPath(CanonPath(str())));
     } else
-        v.mkStringMove(c_str(), context);
+        rope.finish(v, context);
 }
 
 
@@ -2090,25 +2273,64 @@ void ExprBlackHole::eval(EvalState & state, [[maybe_unused]] Env & env, Value &
         .debugThrow();
 }
 
-// always force this to be separate, otherwise forceValue may inline it and take
-// a massive perf hit
-[[gnu::noinline]]
-void EvalState::tryFixupBlackHolePos(Value & v, PosIdx pos)
+void EvalState::forceValueDeep(Value & v)
 {
-    if (!v.isBlackhole())
+    ParallelEval parallelEval(*this);
+
+    if (parallelEval.isParallel()) {
+        /* Force every attribute and list element in a separate work
+           item. Since work items don't run on the stack of their
+           parent, keep track of the attributes leading to each value
+           for error traces. */
+        struct AttrTrace
+        {
+            std::shared_ptr<const AttrTrace> parent;
+            PosIdx pos;
+            Symbol name;
+        };
+
+        std::array<Sync<std::unordered_set<const Value *>>, 64> seen;
+
+        auto needsWork = [](Value & v) {
+            auto type = v.getInternalTypeAtomic();
+            return type == tThunk || type == tApp || type == tPending
+                || type == tAttrs || type == tList1 || type == tList2 || type == tListN;
+        };
+
+        std::function<void(Value & v, std::shared_ptr<const AttrTrace> trace)> recurse;
+
+        recurse = [&](Value & v, std::shared_ptr<const AttrTrace> trace) {
+            if (!seen[std::hash<const Value *>{}(&v) % seen.size()].lock()->insert(&v).second) return;
+
+            try {
+                forceValue(v, v.determinePos(noPos));
+            } catch (Error & e) {
+                for (auto t = trace.get(); t; t = t->parent.get())
+                    addErrorTrace(e, t->pos, "while evaluating the attribute '%1%'", symbols[t->name]);
+                throw;
+            }
+
+            if (v.type() == nAttrs) {
+                for (auto & i : *v.attrs())
+                    if (needsWork(*i.value))
+                        parallelEval.enqueue(
+                            [&recurse, value{i.value}, trace{std::make_shared<const AttrTrace>(trace, i.pos, i.name)}]() {
+                                recurse(*value, trace);
+                            });
+            }
+
+            else if (v.isList()) {
+                for (auto v2 : v.listItems())
+                    if (needsWork(*v2))
+                        parallelEval.enqueue([&recurse, v2, trace]() { recurse(*v2, trace); });
+            }
+        };
+
+        parallelEval.enqueue([&]() { recurse(v, nullptr); });
+        parallelEval.process();
         return;
-    auto e = std::current_exception();
-    try {
-        std::rethrow_exception(e);
-    } catch (InfiniteRecursionError & e) {
-        e.atPos(positions[pos]);
-    } catch (...) {
     }
-}
-
 
-void EvalState::forceValueDeep(Value & v)
-{
     std::set<const Value *> seen;
 
     std::function<void(Value & v)> recurse;
@@ -2123,7 +2345,7 @@ void EvalState::forceValueDeep(Value & v)
                 try {
                     // If the value is a thunk, we're evaling. Otherwise no trace necessary.
                     auto dts = debugRepl && i.value->isThunk()
-                        ? makeDebugTraceStacker(*this, *i.value->payload.thunk.expr, *i.value->payload.thunk.env, positions[i.pos],
+                        ? makeDebugTraceStacker(*this, *i.value->thunk().expr, *i.value->thunk().env, positions[i.pos],
                             "while evaluating the attribute '%1%'", symbols[i.name])
                         : nullptr;
 
@@ -2206,7 +2428,7 @@ bool EvalState::forceBool(Value & v, const PosIdx pos, std::string_view errorCtx
 
 bool EvalState::isFunctor(Value & fun)
 {
-    return fun.type() == nAttrs && fun.attrs()->find(sFunctor) != fun.attrs()->end();
+    return fun.type() == nAttrs && fun.attrs()->get(sFunctor);
 }
 
 
@@ -2247,8 +2469,8 @@ std::string_view EvalState::forceString(Value & v, const PosIdx pos, std::string
 
 void copyContext(const Value & v, NixStringContext & context)
 {
-    if (v.payload.string.context)
-        for (const char * * p = v.payload.string.context; *p; ++p)
+    if (v.context())
+        for (const char * * p = v.context(); *p; ++p)
             context.insert(NixStringContextElem::parse(*p));
 }
 
@@ -2285,8 +2507,8 @@ bool EvalState::isDerivation(Value & v)
 std::optional<std::string> EvalState::tryAttrsToString(const PosIdx pos, Value & v,
     NixStringContext & context, bool coerceMore, bool copyToStore)
 {
-    auto i = v.attrs()->find(sToString);
-    if (i != v.attrs()->end()) {
+    auto i = v.attrs()->get(sToString);
+    if (i) {
         Value v1;
         callFunction(*i->value, v, v1, pos);
         return coerceToString(pos, v1, context,
@@ -2318,7 +2540,7 @@ BackedStringView EvalState::coerceToString(
             !canonicalizePath && !copyToStore
             ? // FIXME: hack to preserve path literals that end in a
               // slash, as in /foo/${x}.
-              v.payload.path.path
+              v.pathStr()
             : copyToStore
             ? store->printStorePath(copyPathToStore(context, v.path()))
             : std::string(v.path().path.abs());
@@ -2328,8 +2550,8 @@ BackedStringView EvalState::coerceToString(
         auto maybeString = tryAttrsToString(pos, v, context, coerceMore, copyToStore);
         if (maybeString)
             return std::move(*maybeString);
-        auto i = v.attrs()->find(sOutPath);
-        if (i == v.attrs()->end()) {
+        auto i = v.attrs()->get(sOutPath);
+        if (!i) {
             error<TypeError>(
                 "cannot coerce %1% to a string: %2%",
                 showType(v),
@@ -2436,8 +2658,8 @@ SourcePath EvalState::coerceToPath(const PosIdx pos, Value & v, NixStringContext
     /* Similarly, handle __toString where the result may be a path
        value. */
     if (v.type() == nAttrs) {
-        auto i = v.attrs()->find(sToString);
-        if (i != v.attrs()->end()) {
+        auto i = v.attrs()->get(sToString);
+        if (i) {
             Value v1;
             callFunction(*i->value, v, v1, pos);
             return coerceToPath(pos, v1, context, errorCtx);
@@ -2585,14 +2807,14 @@ void EvalState::assertEqValues(Value & v1, Value & v2, const PosIdx pos, std::st
         return;
 
     case nPath:
-        if (v1.payload.path.accessor != v2.payload.path.accessor) {
+        if (v1.pathAccessor() != v2.pathAccessor()) {
             error<AssertionError>(
                 "path '%s' is not equal to path '%s' because their accessors are different",
                 ValuePrinter(*this, v1, errorPrintOptions),
                 ValuePrinter(*this, v2, errorPrintOptions))
                 .debugThrow();
         }
-        if (strcmp(v1.payload.path.path, v2.payload.path.path) != 0) {
+        if (strcmp(v1.pathStr(), v2.pathStr()) != 0) {
             error<AssertionError>(
                 "path '%s' is not equal to path '%s'",
                 ValuePrinter(*this, v1, errorPrintOptions),
@@ -2759,8 +2981,8 @@ bool EvalState::eqValues(Value & v1, Value & v2, const PosIdx pos, std::string_v
         case nPath:
             return
                 // FIXME: compare accessors by their fingerprint.
-                v1.payload.path.accessor == v2.payload.path.accessor
-                && strcmp(v1.payload.path.path, v2.payload.path.path) == 0;
+                v1.pathAccessor() == v2.pathAccessor()
+                && strcmp(v1.pathStr(), v2.pathStr()) == 0;
 
         case nNull:
             return true;
@@ -2860,6 +3082,7 @@ void EvalState::printStatistics()
         ms * 0.001;
     });
     auto gcCycles = getGCCycles();
+    auto gcStats = getGCStatistics();
 #endif
 
     auto outPath = getEnv("NIX_SHOW_STATS_PATH").value_or("-");
@@ -2913,9 +3136,19 @@ void EvalState::printStatistics()
     };
     topObj["nrOpUpdates"] = nrOpUpdates;
     topObj["nrOpUpdateValuesCopied"] = nrOpUpdateValuesCopied;
+    topObj["nrOpUpdatesLayered"] = nrOpUpdatesLayered;
+    topObj["nrAttrsetsFlattened"] = Bindings::nrFlattened.load();
+    topObj["nrStringRopes"] = StringRope::nrRopes.load();
+    topObj["nrStringRopesFlattened"] = StringRope::nrFlattened.load();
+    topObj["temporaries"] = {
+        {"bytes", TemporaryArena::nrBytes.load()},
+        {"arenaBytes", TemporaryArena::nrChunkBytes.load()},
+    };
     topObj["nrThunks"] = nrThunks;
     topObj["nrAvoided"] = nrAvoided;
     topObj["nrLookups"] = nrLookups;
+    topObj["nrSelectCacheHits"] = nrSelectCacheHits;
+    topObj["nrSelectCacheMisses"] = nrSelectCacheMisses;
     topObj["nrPrimOpCalls"] = nrPrimOpCalls;
     topObj["nrFunctionCalls"] = nrFunctionCalls;
 #if HAVE_BOEHMGC
@@ -2923,6 +3156,10 @@ void EvalState::printStatistics()
         {"heapSize", heapSize},
         {"totalBytes", totalBytes},
         {"cycles", gcCycles},
+        {"pauses", gcStats.pauses},
+        {"pauseTime", gcStats.pauseTime},
+        {"maxPauseTime", gcStats.maxPauseTime},
+        {"reclaimedBytes", gcStats.reclaimedBytes},
     };
 #endif
 
@@ -2968,7 +3205,7 @@ void EvalState::printStatistics()
         // XXX: overrides earlier assignment
         topObj["symbols"] = json::array();
         auto &list = topObj["symbols"];
-        symbols.dump([&](const std::string & s) { list.emplace_back(s); });
+        symbols.dump([&](std::string_view s) { list.emplace_back(s); });
     }
     if (outPath == "-") {
         std::cerr << topObj.dump(2) << std::endl;
@@ -3084,15 +3321,18 @@ SourcePath EvalState::findFile(const LookupPath & lookupPath, const std::string_
 std::optional<SourcePath> EvalState::resolveLookupPathPath(const LookupPath::Path & value0, bool initAccessControl)
 {
     auto & value = value0.s;
-    auto i = lookupPathResolved.find(value);
-    if (i != lookupPathResolved.end()) return i->second;
+    {
+        auto resolved(lookupPathResolved.lock());
+        auto i = resolved->find(value);
+        if (i != resolved->end()) return i->second;
+    }
 
     auto finish = [&](std::optional<SourcePath> res) {
         if (res)
             debug("resolved search path element '%s' to '%s'", value, *res);
         else
             debug("failed to resolve search path element '%s'", value);
-        lookupPathResolved.emplace(value, res);
+        lookupPathResolved.lock()->emplace(value, res);
         return res;
     };
 
@@ -3154,18 +3394,38 @@ Expr * EvalState::parse(
     const SourcePath & basePath,
     std::shared_ptr<StaticEnv> & staticEnv)
 {
-    DocCommentMap tmpDocComments; // Only used when not origin is not a SourcePath
-    DocCommentMap *docComments = &tmpDocComments;
+    DocCommentMap docComments;
 
-    if (auto sourcePath = std::get_if<SourcePath>(&origin)) {
-        auto [it, _] = positionToDocComment.try_emplace(*sourcePath);
-        docComments = &it->second;
+    auto origin2 = positions.addOrigin(origin, length);
+
+    /* Only files are worth caching. */
+    std::optional<Hash> cacheKey;
+    ParseCache parseCache{symbols, positions, rootFS};
+    Expr * result = nullptr;
+
+    if (settings.useParseCache && std::holds_alternative<SourcePath>(origin)) {
+        cacheKey = ParseCache::key(std::string_view(text, length), settings);
+        result = parseCache.read(*cacheKey, origin2, basePath, docComments);
     }
 
-    auto result = parseExprFromBuf(text, length, origin, basePath, symbols, settings, positions, *docComments, rootFS, exprSymbols);
+    if (!result) {
+        PathLiteralMap pathLiterals;
+        result = parseExprFromBuf(text, length, origin2, basePath, symbols, settings, positions, docComments, rootFS, exprSymbols,
+            cacheKey ? &pathLiterals : nullptr);
+        if (cacheKey)
+            parseCache.write(*cacheKey, result, origin2, pathLiterals, docComments);
+    }
+
+    if (auto sourcePath = std::get_if<SourcePath>(&origin)) {
+        auto positionToDocComment(this->positionToDocComment.lock());
+        (*positionToDocComment)[*sourcePath].merge(docComments);
+    }
 
     result->bindVars(*this, staticEnv);
 
+    if (settings.evalBytecode)
+        compileBytecode(result);
+
     return result;
 }
 
@@ -3176,8 +3436,9 @@ DocComment EvalState::getDocCommentForPos(PosIdx pos)
     if (!path)
         return {};
 
-    auto table = positionToDocComment.find(*path);
-    if (table == positionToDocComment.end())
+    auto positionToDocComment(this->positionToDocComment.lock());
+    auto table = positionToDocComment->find(*path);
+    if (table == positionToDocComment->end())
         return {};
 
     auto it = table->second.find(pos);
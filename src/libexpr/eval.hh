@@ -16,6 +16,7 @@
 #include "repl-exit-status.hh"
 #include "ref.hh"
 
+#include <atomic>
 #include <map>
 #include <optional>
 #include <functional>
@@ -31,6 +32,7 @@ constexpr size_t maxPrimOpArity = 8;
 
 class Store;
 namespace fetchers { struct Settings; }
+struct Bytecode;
 struct EvalSettings;
 class EvalState;
 class StorePath;
@@ -161,6 +163,11 @@ std::unique_ptr<ValMap> mapStaticEnvBindings(const SymbolTable & st, const Stati
 
 void copyContext(const Value & v, NixStringContext & context);
 
+/**
+ * Encode `context` in the format of `Value::context()`.
+ */
+const char * * encodeContext(const NixStringContext & context);
+
 
 std::string printValue(EvalState & state, Value & v);
 std::ostream & operator << (std::ostream & os, const ValueType t);
@@ -283,7 +290,7 @@ public:
     ReplExitStatus (* debugRepl)(ref<EvalState> es, const ValMap & extraEnv);
     bool debugStop;
     bool inDebugger = false;
-    int trylevel;
+    static thread_local int trylevel;
     std::list<DebugTrace> debugTraces;
     std::map<const Expr*, const std::shared_ptr<const StaticEnv>> exprEnvs;
     const std::shared_ptr<const StaticEnv> getStaticEnv(const Expr & expr) const
@@ -331,43 +338,52 @@ private:
      * A cache from path names to parse trees.
      */
     typedef std::unordered_map<SourcePath, Expr *, std::hash<SourcePath>, std::equal_to<SourcePath>, traceable_allocator<std::pair<const SourcePath, Expr *>>> FileParseCache;
-    FileParseCache fileParseCache;
+    Sync<FileParseCache> fileParseCache;
 
     /**
      * A cache from path names to values.
      */
     typedef std::unordered_map<SourcePath, Value, std::hash<SourcePath>, std::equal_to<SourcePath>, traceable_allocator<std::pair<const SourcePath, Value>>> FileEvalCache;
-    FileEvalCache fileEvalCache;
+    Sync<FileEvalCache> fileEvalCache;
 
     /**
      * Associate source positions of certain AST nodes with their preceding doc comment, if they have one.
      * Grouped by file.
      */
-    std::unordered_map<SourcePath, DocCommentMap> positionToDocComment;
+    Sync<std::unordered_map<SourcePath, DocCommentMap>> positionToDocComment;
 
     LookupPath lookupPath;
 
-    std::map<std::string, std::optional<SourcePath>> lookupPathResolved;
+    Sync<std::map<std::string, std::optional<SourcePath>>> lookupPathResolved;
 
     /**
      * Cache used by prim_match().
      */
     std::shared_ptr<RegexCache> regexCache;
 
-#if HAVE_BOEHMGC
+    struct ThunkWaiters;
+
     /**
-     * Allocation cache for GC'd Value objects.
+     * Threads waiting for values that other threads are evaluating.
      */
-    std::shared_ptr<void *> valueAllocCache;
+    std::unique_ptr<ThunkWaiters> thunkWaiters;
 
     /**
-     * Allocation cache for size-1 Env objects.
+     * The number of threads in `thunkWaiters`, so that finishing a
+     * value doesn't need a lock if nobody is waiting.
      */
-    std::shared_ptr<void *> env1AllocCache;
-#endif
+    std::atomic<size_t> nrThunkWaiters{0};
+
+    friend class ParallelEval;
 
 public:
 
+    /**
+     * Whether values may be forced by several threads at the same
+     * time, i.e. `eval-cores` is not 1.
+     */
+    const bool parallel;
+
     EvalState(
         const LookupPath & _lookupPath,
         ref<Store> store,
@@ -476,6 +492,11 @@ public:
     inline bool evalBool(Env & env, Expr * e, const PosIdx pos, std::string_view errorCtx);
     inline void evalAttrs(Env & env, Expr * e, Value & v, const PosIdx pos, std::string_view errorCtx);
 
+    /**
+     * Run an expression compiled by `compileBytecode()`.
+     */
+    void evalBytecode(const Bytecode & code, Env & env, Value & v);
+
     /**
      * If `v` is a thunk, enter it and overwrite `v` with the result
      * of the evaluation of the thunk.  If `v` is a delayed function
@@ -484,7 +505,25 @@ public:
      */
     inline void forceValue(Value & v, const PosIdx pos);
 
-    void tryFixupBlackHolePos(Value & v, PosIdx pos);
+private:
+
+    /**
+     * Wait until another thread has finished evaluating `v`, then
+     * force it. In a single thread, this is an infinite recursion.
+     */
+    [[gnu::noinline]]
+    void waitOnThunk(Value & v, const PosIdx pos);
+
+    /**
+     * Wake up the threads waiting for `v`, now that this thread has
+     * finished or abandoned evaluating it.
+     */
+    inline void finishThunk(Value & v);
+
+    [[gnu::noinline]]
+    void wakeThunkWaiters(Value & v);
+
+public:
 
     /**
      * Force a value, then recursively force list elements and
@@ -678,7 +717,7 @@ private:
     /**
      * Current Nix call stack depth, used with `max-call-depth` setting to throw stack overflow hopefully before we run out of system stack.
      */
-    size_t callDepth = 0;
+    static thread_local size_t callDepth;
 
 public:
 
@@ -726,6 +765,12 @@ public:
 
     Bindings * allocBindings(size_t capacity);
 
+    /**
+     * Allocate a layered attribute set containing the attributes of
+     * `update` on top of those of `base`. `update` must be small.
+     */
+    Bindings * allocLayeredBindings(const Bindings & base, const Bindings & update);
+
     BindingsBuilder buildBindings(size_t capacity)
     {
         return BindingsBuilder(*this, allocBindings(capacity));
@@ -858,11 +903,14 @@ private:
     unsigned long nrValues = 0;
     unsigned long nrListElems = 0;
     unsigned long nrLookups = 0;
+    unsigned long nrSelectCacheHits = 0;
+    unsigned long nrSelectCacheMisses = 0;
     unsigned long nrAttrsets = 0;
     unsigned long nrAttrsInAttrsets = 0;
     unsigned long nrAvoided = 0;
     unsigned long nrOpUpdates = 0;
     unsigned long nrOpUpdateValuesCopied = 0;
+    unsigned long nrOpUpdatesLayered = 0;
     unsigned long nrListConcats = 0;
     unsigned long nrPrimOpCalls = 0;
     unsigned long nrFunctionCalls = 0;
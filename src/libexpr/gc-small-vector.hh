@@ -3,14 +3,17 @@
 #include <boost/container/small_vector.hpp>
 
 #include "value.hh"
+#include "temporary-arena.hh"
 
 namespace nix {
 
 /**
  * A GC compatible vector that may used a reserved portion of `nItems` on the stack instead of allocating on the heap.
+ * Larger vectors are allocated from the `TemporaryArena` of the current thread, so they must be destroyed by the
+ * function that created them.
  */
 template <typename T, size_t nItems>
-using SmallVector = boost::container::small_vector<T, nItems, traceable_allocator<T>>;
+using SmallVector = boost::container::small_vector<T, nItems, TemporaryAllocator<T>>;
 
 /**
  * A vector of value pointers. See `SmallVector`.
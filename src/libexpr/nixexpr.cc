@@ -638,11 +638,87 @@ Pos PosTable::operator[](PosIdx p) const
 
 /* Symbol table. */
 
-size_t SymbolTable::totalSize() const
+SymbolTable::~SymbolTable()
 {
-    size_t n = 0;
-    dump([&] (const std::string & s) { n += s.size(); });
-    return n;
+    for (auto & chunk : chunks)
+        free(chunk.load());
+}
+
+uint32_t SymbolTable::store(std::string_view s, uint32_t hash)
+{
+    auto arena(arena_.lock());
+
+    auto size = (sizeof(SymbolEntry) + s.size() + 1 + alignment - 1) / alignment * alignment;
+
+    /* Offset 0 is never used, so that no symbol has ID 0. A symbol
+       that doesn't fit in a chunk gets a chunk of its own, which is
+       then full. */
+    if (!arena->nrChunks || arena->chunkSizes.back() + size > chunkSize) {
+        if (arena->nrChunks == maxChunks)
+            throw Error("the symbol table is full");
+        auto chunk = (char *) malloc(std::max(chunkSize, alignment + size));
+        if (!chunk) throw std::bad_alloc();
+        chunks[arena->nrChunks++].store(chunk, std::memory_order_release);
+        arena->chunkSizes.push_back(alignment);
+    }
+
+    auto chunkIdx = arena->nrChunks - 1;
+    auto offset = arena->chunkSizes.back();
+
+    auto e = reinterpret_cast<SymbolEntry *>(chunks[chunkIdx].load(std::memory_order_relaxed) + offset);
+    e->hash = hash;
+    e->size = s.size();
+    memcpy(e->data, s.data(), s.size());
+    e->data[s.size()] = 0;
+
+    arena->chunkSizes.back() += size;
+    arena->nrSymbols++;
+    arena->totalSize += s.size();
+
+    return (chunkIdx << offsetBits) | (offset / alignment);
+}
+
+uint32_t SymbolTable::insert(Shard & shard, std::string_view s, uint32_t hash)
+{
+    if (auto id = lookup(shard, s, hash))
+        return id;
+
+    /* Keep the load factor at or below 1/2. */
+    if (2 * (shard.count + 1) > shard.ids.size()) {
+        std::vector<uint32_t> ids(2 * shard.ids.size(), 0);
+        auto mask = ids.size() - 1;
+        for (auto id : shard.ids) {
+            if (!id) continue;
+            auto i = entry(id).hash & mask;
+            while (ids[i]) i = (i + 1) & mask;
+            ids[i] = id;
+        }
+        shard.ids = std::move(ids);
+    }
+
+    auto id = store(s, hash);
+
+    auto mask = shard.ids.size() - 1;
+    auto i = hash & mask;
+    while (shard.ids[i]) i = (i + 1) & mask;
+    shard.ids[i] = id;
+    shard.count++;
+
+    return id;
+}
+
+void SymbolTable::dump(std::function<void(std::string_view)> callback) const
+{
+    auto arena(arena_.lock());
+
+    for (size_t n = 0; n < arena->nrChunks; ++n) {
+        auto chunk = chunks[n].load(std::memory_order_relaxed);
+        for (size_t offset = alignment; offset < arena->chunkSizes[n]; ) {
+            auto & e = *reinterpret_cast<const SymbolEntry *>(chunk + offset);
+            callback({e.data, e.size});
+            offset += (sizeof(SymbolEntry) + e.size + 1 + alignment - 1) / alignment * alignment;
+        }
+    }
 }
 
 std::string DocComment::getInnerText(const PosTable & positions) const {
@@ -65,6 +65,12 @@ struct DocComment {
 struct AttrName
 {
     Symbol symbol;
+    /**
+     * An inline cache for attribute selections: the position of the
+     * attribute in the attribute set where it was last found. See
+     * `Bindings::get(Symbol, uint32_t &, bool &)`.
+     */
+    uint32_t cachedPos = 0;
     Expr * expr;
     AttrName(Symbol s) : symbol(s) {};
     AttrName(Expr * e) : expr(e) {};
@@ -213,6 +219,12 @@ struct ExprSelect : Expr
      */
     Symbol evalExceptFinalSelect(EvalState & state, Env & env, Value & attrs);
 
+    /**
+     * Select `attrPath` from `vAttrs`, the value of `e`, or evaluate
+     * `def`. `vAttrs` and `v` may be the same value.
+     */
+    void evalPath(EvalState & state, Env & env, Value & vAttrs, Value & v);
+
     COMMON_METHODS
 };
 
@@ -222,6 +234,13 @@ struct ExprOpHasAttr : Expr
     AttrPath attrPath;
     ExprOpHasAttr(Expr * e, AttrPath attrPath) : e(e), attrPath(std::move(attrPath)) { };
     PosIdx getPos() const override { return e->getPos(); }
+
+    /**
+     * Check whether `vAttrs`, the value of `e`, has `attrPath`. `vAttrs`
+     * and `v` may be the same value.
+     */
+    void evalPath(EvalState & state, Env & env, Value & vAttrs, Value & v);
+
     COMMON_METHODS
 };
 
@@ -405,6 +424,12 @@ struct ExprAssert : Expr
     Expr * cond, * body;
     ExprAssert(const PosIdx & pos, Expr * cond, Expr * body) : pos(pos), cond(cond), body(body) { };
     PosIdx getPos() const override { return pos; }
+
+    /**
+     * Throw the error for when `cond` is false.
+     */
+    [[noreturn]] void fail(EvalState & state, Env & env);
+
     COMMON_METHODS
 };
 
@@ -0,0 +1,166 @@
+#include "parallel-eval.hh"
+#include "eval-inline.hh"
+#include "eval-gc.hh"
+#include "finally.hh"
+
+namespace nix {
+
+/**
+ * Whether the current thread is running a work item of a
+ * `ParallelEval`. Nested `ParallelEval`s run their work items
+ * immediately, rather than creating another thread pool.
+ */
+static thread_local bool inParallelEval = false;
+
+ParallelEval::ParallelEval(EvalState & state)
+    : state(state)
+{
+    if (state.parallel && !state.debugRepl && !state.countCalls && !inParallelEval)
+        pool = std::make_unique<ThreadPool>(state.settings.evalCores);
+}
+
+ParallelEval::~ParallelEval()
+{
+}
+
+void ParallelEval::changeBusy(ptrdiff_t delta)
+{
+    auto & waiters = *state.thunkWaiters;
+
+    waiters.busy += delta;
+
+    if (delta < 0 && state.nrThunkWaiters) {
+        auto waitersState(waiters.state_.lock());
+        if (waitersState->blocked && waitersState->blocked >= waiters.busy) {
+            waitersState->deadlocks++;
+            waiters.wakeup.notify_all();
+        }
+    }
+}
+
+void ParallelEval::run(const std::function<void()> & item)
+{
+    registerGCThread();
+
+    inParallelEval = true;
+    changeBusy(1);
+    Finally done([&]() {
+        changeBusy(-1);
+        inParallelEval = false;
+    });
+
+    item();
+}
+
+void ParallelEval::enqueue(std::function<void()> item)
+{
+    if (!pool) {
+        item();
+        return;
+    }
+
+    try {
+        pool->enqueue([this, item{std::move(item)}]() { run(item); });
+    } catch (ThreadPoolShutDown &) {
+        /* A work item failed, so process() will rethrow its
+           exception. */
+    }
+}
+
+void ParallelEval::process()
+{
+    if (!pool) return;
+
+    /* While processing, this thread only evaluates things in work
+       items, which count themselves as busy. */
+    changeBusy(-1);
+    Finally restoreBusy([&]() { changeBusy(1); });
+
+    pool->process();
+}
+
+void EvalState::waitOnThunk(Value & v, const PosIdx pos)
+{
+    if (!parallel)
+        error<InfiniteRecursionError>("infinite recursion encountered").atPos(pos).debugThrow();
+
+    bool deadlock = false;
+
+    {
+        auto & waiters = *thunkWaiters;
+        auto waitersState(waiters.state_.lock());
+
+        bool waiting = false;
+
+        Finally stopWaiting([&]() {
+            if (!waiting) return;
+            auto [begin, end] = waitersState->waiting.equal_range(&v);
+            for (auto i = begin; i != end; ++i)
+                if (i->second == &waiting) {
+                    waitersState->waiting.erase(i);
+                    break;
+                }
+            waitersState->blocked--;
+            nrThunkWaiters--;
+        });
+
+        auto deadlocks = waitersState->deadlocks;
+
+        while (true) {
+            if (!waiting) {
+                waiting = true;
+                waitersState->waiting.emplace(&v, &waiting);
+                waitersState->blocked++;
+                nrThunkWaiters++;
+                /* Pairs with the fence in finishThunk(): either we see
+                   the final value, or the thread that finishes it sees
+                   us. */
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            }
+
+            if (v.getInternalTypeAtomic() != tPending) break;
+
+            /* If every thread that is evaluating something is waiting
+               for a value, none of those values will ever be
+               finished. In a single thread, this would have been an
+               infinite recursion. */
+            if (waitersState->deadlocks != deadlocks || waitersState->blocked >= waiters.busy) {
+                if (waitersState->deadlocks == deadlocks) {
+                    waitersState->deadlocks++;
+                    waiters.wakeup.notify_all();
+                }
+                deadlock = true;
+                break;
+            }
+
+            waitersState.wait(waiters.wakeup);
+        }
+    }
+
+    if (deadlock)
+        error<InfiniteRecursionError>("infinite recursion encountered").atPos(pos).debugThrow();
+
+    /* The value is either final, or was reset to a thunk because the
+       thread evaluating it failed, in which case we try ourselves. */
+    forceValue(v, pos);
+}
+
+void EvalState::wakeThunkWaiters(Value & v)
+{
+    auto & waiters = *thunkWaiters;
+    auto waitersState(waiters.state_.lock());
+
+    auto [begin, end] = waitersState->waiting.equal_range(&v);
+    if (begin == end) return;
+
+    for (auto i = begin; i != end; ++i) {
+        *i->second = false;
+        waitersState->blocked--;
+        nrThunkWaiters--;
+    }
+    waitersState->waiting.erase(begin, end);
+
+    waiters.wakeup.notify_all();
+}
+
+}
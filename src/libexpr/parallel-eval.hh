@@ -0,0 +1,97 @@
+#pragma once
+///@file
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "eval.hh"
+#include "thread-pool.hh"
+
+namespace nix {
+
+/**
+ * Runs evaluation work on up to `eval-cores` threads, using a
+ * work-stealing thread pool. Work items can enqueue further work
+ * items, and can force values that other work items are forcing at
+ * the same time; in that case, one of them waits for the other.
+ *
+ * If evaluation is not parallel (because `eval-cores` is 1, the
+ * debugger is enabled, or this is used from a work item of another
+ * `ParallelEval`), work items run in the calling thread as soon as
+ * they are enqueued.
+ */
+class ParallelEval
+{
+    EvalState & state;
+
+    std::unique_ptr<ThreadPool> pool;
+
+    void run(const std::function<void()> & item);
+
+    /**
+     * Change the number of busy threads, and wake up the waiting
+     * threads if they are now deadlocked.
+     */
+    void changeBusy(ptrdiff_t delta);
+
+public:
+
+    ParallelEval(EvalState & state);
+
+    ~ParallelEval();
+
+    /**
+     * Whether work items run on multiple threads.
+     */
+    bool isParallel() const
+    {
+        return (bool) pool;
+    }
+
+    void enqueue(std::function<void()> item);
+
+    /**
+     * Run work items until there are none left. If a work item
+     * throws an exception, stop the others and rethrow it.
+     */
+    void process();
+};
+
+struct EvalState::ThunkWaiters
+{
+    struct State
+    {
+        /**
+         * The values that threads are waiting for. The flag is
+         * cleared when the waiting thread is woken up.
+         */
+        std::multimap<Value *, bool *> waiting;
+
+        /**
+         * The number of threads waiting for a value.
+         */
+        size_t blocked = 0;
+
+        /**
+         * Incremented whenever every busy thread is blocked, which
+         * means that none of them can make progress.
+         */
+        uint64_t deadlocks = 0;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable wakeup;
+
+    /**
+     * The number of threads that are evaluating something: the
+     * running work items of a `ParallelEval`, plus the thread that
+     * uses the `EvalState` outside of them.
+     */
+    std::atomic<size_t> busy{1};
+};
+
+}
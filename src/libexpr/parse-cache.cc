@@ -0,0 +1,827 @@
+#include <atomic>
+#include <bit>
+#include <mutex>
+
+#include "parse-cache.hh"
+#include "parser-state.hh"
+#include "eval-settings.hh"
+#include "file-system.hh"
+#include "globals.hh"
+#include "users.hh"
+
+namespace nix {
+
+/**
+ * Increment this when the format of entries, or the meaning of the
+ * syntax tree, changes.
+ */
+static const unsigned int formatVersion = 2;
+
+static const std::string_view magic = "nix-parse-cache\n";
+
+enum class Tag : uint8_t {
+    Null,
+    Ref,
+    Int,
+    Float,
+    String,
+    Path,
+    Var,
+    InheritFrom,
+    Select,
+    OpHasAttr,
+    Attrs,
+    List,
+    Lambda,
+    Call,
+    Let,
+    With,
+    If,
+    Assert,
+    OpNot,
+    OpEq,
+    OpNEq,
+    OpAnd,
+    OpOr,
+    OpImpl,
+    OpUpdate,
+    OpConcatLists,
+    ConcatStrings,
+    Pos,
+};
+
+static Path cacheDir()
+{
+    return getCacheDir() + fmt("/parse-cache-v%d", formatVersion);
+}
+
+/**
+ * Entries that haven't been used for this long are deleted.
+ */
+static const time_t maxUnusedAge = 30 * 24 * 60 * 60;
+
+/**
+ * How often the last use of an entry, and the last eviction, are
+ * recorded.
+ */
+static const time_t touchInterval = 24 * 60 * 60;
+
+/**
+ * Delete the entries in `dir` that haven't been used recently. This
+ * runs at most once a day, recorded by the modification time of
+ * `dir/last-evicted`.
+ */
+static void evictUnused(const Path & dir)
+{
+    auto stampPath = dir + "/last-evicted";
+    auto now = time(nullptr);
+
+    try {
+        if (auto st = maybeLstat(stampPath); st && st->st_mtime >= now - touchInterval)
+            return;
+        writeFile(stampPath, "");
+
+        size_t nrDeleted = 0;
+        for (auto & entry : std::filesystem::directory_iterator{dir}) {
+            if (entry.path().filename() == "last-evicted") continue;
+            /* This also catches temporary files left behind by
+               processes that were killed while writing. */
+            auto st = maybeLstat(entry.path().string());
+            if (st && st->st_mtime < now - maxUnusedAge) {
+                deletePath(entry.path());
+                nrDeleted++;
+            }
+        }
+
+        debug("deleted %d unused parse cache entries", nrDeleted);
+    } catch (Error & e) {
+        debug("cannot evict parse cache entries: %s", e.msg());
+    } catch (std::filesystem::filesystem_error & e) {
+        debug("cannot evict parse cache entries: %s", e.what());
+    }
+}
+
+Hash ParseCache::key(std::string_view text, const EvalSettings & settings)
+{
+    HashSink sink(HashAlgorithm::SHA256);
+    /* `~/foo` paths expand to the home directory, and are rejected in
+       pure mode. Relative paths are stored as written, so the base
+       path doesn't matter. */
+    sink(fmt("%s\n%d\n%d\n%d\n%d\n%s\n",
+        nixVersion,
+        formatVersion,
+        settings.pureEval,
+        experimentalFeatureSettings.isEnabled(Xp::NoUrlLiterals),
+        experimentalFeatureSettings.isEnabled(Xp::PipeOperators),
+        getHome()));
+    sink(text);
+    return sink.finish().first;
+}
+
+namespace {
+
+struct Writer
+{
+    ParseCache & cache;
+    const PosTable::Origin & origin;
+    const PathLiteralMap & pathLiterals;
+
+    std::string out;
+
+    std::unordered_map<Symbol, uint64_t> symbolIds;
+    std::vector<Symbol> symbols;
+
+    std::unordered_map<const Expr *, uint64_t> exprIds;
+
+    void num(uint64_t n)
+    {
+        do {
+            uint8_t byte = n & 0x7f;
+            n >>= 7;
+            out.push_back(char(n ? byte | 0x80 : byte));
+        } while (n);
+    }
+
+    void tag(Tag t)
+    {
+        out.push_back(char(t));
+    }
+
+    void str(std::string_view s)
+    {
+        num(s.size());
+        out.append(s);
+    }
+
+    void sym(Symbol s)
+    {
+        if (!s) {
+            num(0);
+            return;
+        }
+        auto [i, inserted] = symbolIds.emplace(s, symbolIds.size() + 1);
+        if (inserted) symbols.push_back(s);
+        num(i->second);
+    }
+
+    void pos(PosIdx p)
+    {
+        if (!p) {
+            num(0);
+            return;
+        }
+        auto offset = origin.offsetOf(p);
+        if (offset > origin.size)
+            throw Error("expression refers to a position in another file");
+        num(uint64_t(offset) + 1);
+    }
+
+    void attrPath(const AttrPath & attrPath)
+    {
+        num(attrPath.size());
+        for (auto & name : attrPath) {
+            sym(name.symbol);
+            if (!name.symbol) expr(name.expr);
+        }
+    }
+
+    template<typename T>
+    bool binOp(Expr * e, Tag t)
+    {
+        auto e2 = dynamic_cast<T *>(e);
+        if (!e2) return false;
+        tag(t);
+        pos(e2->pos);
+        expr(e2->e1);
+        expr(e2->e2);
+        return true;
+    }
+
+    void expr(Expr * e)
+    {
+        if (!e) {
+            tag(Tag::Null);
+            return;
+        }
+
+        /* Expressions can be shared, e.g. the `ExprInheritFrom` of
+           `inherit (x) a b;`. */
+        if (auto i = exprIds.find(e); i != exprIds.end()) {
+            tag(Tag::Ref);
+            num(i->second);
+            return;
+        }
+        exprIds.emplace(e, exprIds.size());
+
+        if (auto e2 = dynamic_cast<ExprInt *>(e)) {
+            tag(Tag::Int);
+            num(uint64_t(e2->v.integer().value));
+        }
+
+        else if (auto e2 = dynamic_cast<ExprFloat *>(e)) {
+            tag(Tag::Float);
+            num(std::bit_cast<uint64_t>(e2->v.fpoint()));
+        }
+
+        else if (auto e2 = dynamic_cast<ExprString *>(e)) {
+            tag(Tag::String);
+            str(e2->s);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprPath *>(e)) {
+            tag(Tag::Path);
+            /* Relative paths are resolved again when reading, since
+               the file may be somewhere else by then. */
+            if (auto i = pathLiterals.find(e2); i != pathLiterals.end()) {
+                num(1);
+                str(i->second);
+            } else if (&*e2->accessor == &*cache.rootFS) {
+                num(0);
+                str(e2->s);
+            } else
+                throw Error("path expression has an unknown accessor");
+        }
+
+        else if (auto e2 = dynamic_cast<ExprInheritFrom *>(e)) {
+            tag(Tag::InheritFrom);
+            pos(e2->pos);
+            num(e2->displ);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprVar *>(e)) {
+            tag(Tag::Var);
+            pos(e2->pos);
+            sym(e2->name);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprSelect *>(e)) {
+            tag(Tag::Select);
+            pos(e2->pos);
+            expr(e2->e);
+            attrPath(e2->attrPath);
+            expr(e2->def);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpHasAttr *>(e)) {
+            tag(Tag::OpHasAttr);
+            expr(e2->e);
+            attrPath(e2->attrPath);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprAttrs *>(e)) {
+            tag(Tag::Attrs);
+            pos(e2->pos);
+            num(e2->recursive);
+            num(e2->attrs.size());
+            for (auto & [name, def] : e2->attrs) {
+                sym(name);
+                num(static_cast<uint64_t>(def.kind));
+                expr(def.e);
+                pos(def.pos);
+                num(def.displ);
+            }
+            num(e2->inheritFromExprs ? e2->inheritFromExprs->size() + 1 : 0);
+            if (e2->inheritFromExprs)
+                for (auto from : *e2->inheritFromExprs)
+                    expr(from);
+            num(e2->dynamicAttrs.size());
+            for (auto & def : e2->dynamicAttrs) {
+                expr(def.nameExpr);
+                expr(def.valueExpr);
+                pos(def.pos);
+            }
+        }
+
+        else if (auto e2 = dynamic_cast<ExprList *>(e)) {
+            tag(Tag::List);
+            num(e2->elems.size());
+            for (auto elem : e2->elems)
+                expr(elem);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprLambda *>(e)) {
+            tag(Tag::Lambda);
+            pos(e2->pos);
+            sym(e2->name);
+            sym(e2->arg);
+            num(!e2->formals ? 0 : e2->formals->ellipsis ? 2 : 1);
+            if (e2->formals) {
+                num(e2->formals->formals.size());
+                for (auto & formal : e2->formals->formals) {
+                    pos(formal.pos);
+                    sym(formal.name);
+                    expr(formal.def);
+                }
+            }
+            expr(e2->body);
+            pos(e2->docComment.begin);
+            pos(e2->docComment.end);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprCall *>(e)) {
+            tag(Tag::Call);
+            pos(e2->pos);
+            expr(e2->fun);
+            num(e2->args.size());
+            for (auto arg : e2->args)
+                expr(arg);
+            /* The parser only keeps this for calls it warned about. */
+            num(e2->cursedOrEndPos.has_value());
+            if (e2->cursedOrEndPos)
+                pos(*e2->cursedOrEndPos);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprLet *>(e)) {
+            tag(Tag::Let);
+            expr(e2->attrs);
+            expr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprWith *>(e)) {
+            tag(Tag::With);
+            pos(e2->pos);
+            expr(e2->attrs);
+            expr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprIf *>(e)) {
+            tag(Tag::If);
+            pos(e2->pos);
+            expr(e2->cond);
+            expr(e2->then);
+            expr(e2->else_);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprAssert *>(e)) {
+            tag(Tag::Assert);
+            pos(e2->pos);
+            expr(e2->cond);
+            expr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpNot *>(e)) {
+            tag(Tag::OpNot);
+            expr(e2->e);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprConcatStrings *>(e)) {
+            tag(Tag::ConcatStrings);
+            pos(e2->pos);
+            num(e2->forceString);
+            num(e2->es->size());
+            for (auto & [pos2, e3] : *e2->es) {
+                pos(pos2);
+                expr(e3);
+            }
+        }
+
+        else if (auto e2 = dynamic_cast<ExprPos *>(e)) {
+            tag(Tag::Pos);
+            pos(e2->pos);
+        }
+
+        else if (!binOp<ExprOpEq>(e, Tag::OpEq)
+            && !binOp<ExprOpNEq>(e, Tag::OpNEq)
+            && !binOp<ExprOpAnd>(e, Tag::OpAnd)
+            && !binOp<ExprOpOr>(e, Tag::OpOr)
+            && !binOp<ExprOpImpl>(e, Tag::OpImpl)
+            && !binOp<ExprOpUpdate>(e, Tag::OpUpdate)
+            && !binOp<ExprOpConcatLists>(e, Tag::OpConcatLists))
+            throw Error("cannot serialise expressions of type '%s'", typeid(*e).name());
+    }
+};
+
+struct Reader
+{
+    ParseCache & cache;
+    const PosTable::Origin & origin;
+    const SourcePath & basePath;
+
+    std::string_view in;
+
+    std::vector<Symbol> symbols;
+
+    std::vector<Expr *> exprs;
+
+    /**
+     * The calls that the parser warned about.
+     */
+    std::vector<ExprCall *> cursedOrs;
+
+    [[noreturn]] static void corrupt()
+    {
+        throw Error("parse cache entry is corrupt");
+    }
+
+    uint64_t num()
+    {
+        uint64_t n = 0;
+        for (unsigned int shift = 0; shift < 64; shift += 7) {
+            if (in.empty()) corrupt();
+            uint8_t byte = in[0];
+            in.remove_prefix(1);
+            n |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return n;
+        }
+        corrupt();
+    }
+
+    Tag tag()
+    {
+        if (in.empty()) corrupt();
+        auto t = Tag(in[0]);
+        in.remove_prefix(1);
+        return t;
+    }
+
+    std::string_view str()
+    {
+        auto size = num();
+        if (size > in.size()) corrupt();
+        auto s = in.substr(0, size);
+        in.remove_prefix(size);
+        return s;
+    }
+
+    Symbol sym()
+    {
+        auto id = num();
+        if (id > symbols.size()) corrupt();
+        return id ? symbols[id - 1] : Symbol();
+    }
+
+    PosIdx pos()
+    {
+        auto offset = num();
+        if (!offset) return noPos;
+        if (offset - 1 > origin.size) corrupt();
+        return cache.positions.add(origin, offset - 1);
+    }
+
+    AttrPath attrPath()
+    {
+        AttrPath attrPath;
+        auto size = num();
+        for (uint64_t n = 0; n < size; ++n) {
+            if (auto name = sym())
+                attrPath.emplace_back(name);
+            else
+                attrPath.emplace_back(expr());
+        }
+        return attrPath;
+    }
+
+    template<typename T>
+    Expr * binOp()
+    {
+        auto pos2 = pos();
+        auto e1 = expr();
+        auto e2 = expr();
+        return new T(pos2, e1, e2);
+    }
+
+    Expr * expr()
+    {
+        auto t = tag();
+
+        if (t == Tag::Null) return nullptr;
+
+        if (t == Tag::Ref) {
+            auto id = num();
+            if (id >= exprs.size() || !exprs[id]) corrupt();
+            return exprs[id];
+        }
+
+        /* Reserve the ID now, since that's where the writer assigned
+           it, but fill it in once the expression is complete. */
+        auto id = exprs.size();
+        exprs.push_back(nullptr);
+
+        Expr * e;
+
+        switch (t) {
+
+        case Tag::Int:
+            e = new ExprInt(NixInt::Inner(num()));
+            break;
+
+        case Tag::Float:
+            e = new ExprFloat(std::bit_cast<NixFloat>(num()));
+            break;
+
+        case Tag::String:
+            e = new ExprString(std::string(str()));
+            break;
+
+        case Tag::Path: {
+            auto kind = num();
+            if (kind > 1) corrupt();
+            e = kind == 0
+                ? new ExprPath(cache.rootFS, std::string(str()))
+                : new ExprPath(basePath.accessor, resolvePathLiteral(str(), basePath));
+            break;
+        }
+
+        case Tag::InheritFrom: {
+            auto pos2 = pos();
+            e = new ExprInheritFrom(pos2, num());
+            break;
+        }
+
+        case Tag::Var: {
+            auto pos2 = pos();
+            e = new ExprVar(pos2, sym());
+            break;
+        }
+
+        case Tag::Select: {
+            auto pos2 = pos();
+            auto e2 = expr();
+            auto attrPath2 = attrPath();
+            e = new ExprSelect(pos2, e2, std::move(attrPath2), expr());
+            break;
+        }
+
+        case Tag::OpHasAttr: {
+            auto e2 = expr();
+            e = new ExprOpHasAttr(e2, attrPath());
+            break;
+        }
+
+        case Tag::Attrs: {
+            auto e2 = new ExprAttrs(pos());
+            e2->recursive = num();
+            auto nrAttrs = num();
+            for (uint64_t n = 0; n < nrAttrs; ++n) {
+                auto name = sym();
+                auto kind = num();
+                if (kind > static_cast<uint64_t>(ExprAttrs::AttrDef::Kind::InheritedFrom)) corrupt();
+                auto value = expr();
+                auto pos2 = pos();
+                ExprAttrs::AttrDef def(value, pos2, static_cast<ExprAttrs::AttrDef::Kind>(kind));
+                def.displ = num();
+                e2->attrs.emplace(name, def);
+            }
+            if (auto nrFrom = num()) {
+                e2->inheritFromExprs = std::make_unique<std::vector<Expr *>>();
+                for (uint64_t n = 1; n < nrFrom; ++n)
+                    e2->inheritFromExprs->push_back(expr());
+            }
+            auto nrDynamic = num();
+            for (uint64_t n = 0; n < nrDynamic; ++n) {
+                auto nameExpr = expr();
+                auto valueExpr = expr();
+                e2->dynamicAttrs.emplace_back(nameExpr, valueExpr, pos());
+            }
+            e = e2;
+            break;
+        }
+
+        case Tag::List: {
+            auto e2 = new ExprList;
+            auto size = num();
+            for (uint64_t n = 0; n < size; ++n)
+                e2->elems.push_back(expr());
+            e = e2;
+            break;
+        }
+
+        case Tag::Lambda: {
+            auto pos2 = pos();
+            auto name = sym();
+            auto arg = sym();
+            Formals * formals = nullptr;
+            if (auto hasFormals = num()) {
+                formals = new Formals;
+                formals->ellipsis = hasFormals == 2;
+                auto size = num();
+                for (uint64_t n = 0; n < size; ++n) {
+                    auto formalPos = pos();
+                    auto formalName = sym();
+                    formals->formals.push_back(Formal{formalPos, formalName, expr()});
+                }
+            }
+            auto e2 = new ExprLambda(pos2, arg, formals, expr());
+            e2->name = name;
+            e2->docComment.begin = pos();
+            e2->docComment.end = pos();
+            e = e2;
+            break;
+        }
+
+        case Tag::Call: {
+            auto pos2 = pos();
+            auto fun = expr();
+            std::vector<Expr *> args;
+            auto size = num();
+            for (uint64_t n = 0; n < size; ++n)
+                args.push_back(expr());
+            auto e2 = new ExprCall(pos2, fun, std::move(args));
+            if (num()) {
+                e2->cursedOrEndPos = pos();
+                cursedOrs.push_back(e2);
+            }
+            e = e2;
+            break;
+        }
+
+        case Tag::Let: {
+            auto attrs = dynamic_cast<ExprAttrs *>(expr());
+            if (!attrs) corrupt();
+            e = new ExprLet(attrs, expr());
+            break;
+        }
+
+        case Tag::With: {
+            auto pos2 = pos();
+            auto attrs = expr();
+            e = new ExprWith(pos2, attrs, expr());
+            break;
+        }
+
+        case Tag::If: {
+            auto pos2 = pos();
+            auto cond = expr();
+            auto then = expr();
+            e = new ExprIf(pos2, cond, then, expr());
+            break;
+        }
+
+        case Tag::Assert: {
+            auto pos2 = pos();
+            auto cond = expr();
+            e = new ExprAssert(pos2, cond, expr());
+            break;
+        }
+
+        case Tag::OpNot:
+            e = new ExprOpNot(expr());
+            break;
+
+        case Tag::OpEq: e = binOp<ExprOpEq>(); break;
+        case Tag::OpNEq: e = binOp<ExprOpNEq>(); break;
+        case Tag::OpAnd: e = binOp<ExprOpAnd>(); break;
+        case Tag::OpOr: e = binOp<ExprOpOr>(); break;
+        case Tag::OpImpl: e = binOp<ExprOpImpl>(); break;
+        case Tag::OpUpdate: e = binOp<ExprOpUpdate>(); break;
+        case Tag::OpConcatLists: e = binOp<ExprOpConcatLists>(); break;
+
+        case Tag::ConcatStrings: {
+            auto pos2 = pos();
+            bool forceString = num();
+            auto es = new std::vector<std::pair<PosIdx, Expr *>>;
+            auto size = num();
+            for (uint64_t n = 0; n < size; ++n) {
+                auto pos3 = pos();
+                es->emplace_back(pos3, expr());
+            }
+            e = new ExprConcatStrings(pos2, forceString, es);
+            break;
+        }
+
+        case Tag::Pos:
+            e = new ExprPos(pos());
+            break;
+
+        /* Handled above. */
+        case Tag::Null:
+        case Tag::Ref:
+        default:
+            corrupt();
+        }
+
+        exprs[id] = e;
+        return e;
+    }
+};
+
+}
+
+std::string ParseCache::serialise(
+    Expr * e,
+    const PosTable::Origin & origin,
+    const PathLiteralMap & pathLiterals,
+    const DocCommentMap & docComments)
+{
+    Writer writer{*this, origin, pathLiterals};
+
+    writer.expr(e);
+
+    writer.num(docComments.size());
+    for (auto & [pos, docComment] : docComments) {
+        writer.pos(pos);
+        writer.pos(docComment.begin);
+        writer.pos(docComment.end);
+    }
+
+    /* The symbols are only known once everything else has been
+       written, but the reader needs them first. */
+    auto body = std::move(writer.out);
+
+    writer.out = magic;
+    writer.num(writer.symbols.size());
+    for (auto & sym : writer.symbols)
+        writer.str(symbols[sym]);
+
+    return writer.out + body;
+}
+
+Expr * ParseCache::deserialise(
+    std::string_view data,
+    const PosTable::Origin & origin,
+    const SourcePath & basePath,
+    DocCommentMap & docComments)
+{
+    if (!data.starts_with(magic))
+        Reader::corrupt();
+
+    Reader reader{*this, origin, basePath, data.substr(magic.size())};
+
+    auto nrSymbols = reader.num();
+    for (uint64_t n = 0; n < nrSymbols; ++n)
+        reader.symbols.push_back(symbols.create(reader.str()));
+
+    auto e = reader.expr();
+    if (!e) Reader::corrupt();
+
+    auto nrDocComments = reader.num();
+    for (uint64_t n = 0; n < nrDocComments; ++n) {
+        auto pos = reader.pos();
+        DocComment docComment;
+        docComment.begin = reader.pos();
+        docComment.end = reader.pos();
+        docComments.emplace(pos, docComment);
+    }
+
+    if (!reader.in.empty())
+        Reader::corrupt();
+
+    for (auto call : reader.cursedOrs)
+        call->warnIfCursedOr(symbols, positions);
+
+    return e;
+}
+
+Expr * ParseCache::read(
+    const Hash & key,
+    const PosTable::Origin & origin,
+    const SourcePath & basePath,
+    DocCommentMap & docComments)
+{
+    auto path = cacheDir() + "/" + key.to_string(HashFormat::Nix32, false);
+
+    try {
+        auto st = maybeLstat(path);
+        if (!st) return nullptr;
+        auto data = readFile(path);
+        DocCommentMap docComments2;
+        auto e = deserialise(data, origin, basePath, docComments2);
+        docComments.merge(docComments2);
+        debug("read parse cache entry '%s'", path);
+        /* Record that the entry is in use, but not on every hit. */
+        auto now = time(nullptr);
+        if (st->st_mtime < now - touchInterval) {
+            try {
+                setWriteTime(path, now, now, false);
+            } catch (...) {
+                ignoreExceptionExceptInterrupt(lvlDebug);
+            }
+        }
+        return e;
+    } catch (Error & e) {
+        debug("ignoring parse cache entry '%s': %s", path, e.msg());
+        return nullptr;
+    }
+}
+
+void ParseCache::write(
+    const Hash & key,
+    Expr * e,
+    const PosTable::Origin & origin,
+    const PathLiteralMap & pathLiterals,
+    const DocCommentMap & docComments)
+{
+    auto dir = cacheDir();
+    auto path = dir + "/" + key.to_string(HashFormat::Nix32, false);
+
+    try {
+        auto data = serialise(e, origin, pathLiterals, docComments);
+        createDirs(dir);
+        static std::once_flag evicted;
+        std::call_once(evicted, [&]() { evictUnused(dir); });
+        /* Other processes may be writing the same entry, so write it
+           atomically. */
+        static std::atomic<int> counter{0};
+        Path tmp = fmt("%s.tmp.%d.%d", path, getpid(), ++counter);
+        AutoDelete del(tmp, false);
+        writeFile(tmp, data);
+        std::filesystem::rename(tmp, path);
+        del.cancel();
+    } catch (Error & e) {
+        debug("not writing parse cache entry '%s': %s", path, e.msg());
+    } catch (std::filesystem::filesystem_error & e) {
+        debug("not writing parse cache entry '%s': %s", path, e.what());
+    }
+}
+
+}
@@ -0,0 +1,93 @@
+#pragma once
+///@file
+
+#include <optional>
+
+#include "hash.hh"
+#include "nixexpr.hh"
+#include "pos-table.hh"
+
+namespace nix {
+
+struct EvalSettings;
+
+typedef std::unordered_map<PosIdx, DocComment> DocCommentMap;
+typedef std::unordered_map<const Expr *, std::string> PathLiteralMap;
+
+/**
+ * An on-disk cache of parsed Nix files, in
+ * `~/.cache/nix/parse-cache-v2`. Each entry holds the abstract syntax
+ * tree of a file before variables are bound, along with the symbols it
+ * uses and its doc comments. Positions are stored relative to the start
+ * of the file, so they can be moved to wherever the file ends up in the
+ * `PosTable` of the process that reads the entry. Likewise, relative
+ * path literals are stored as written and resolved against the base
+ * path of the reader, so copies of a file in different places (such as
+ * different store paths) share an entry.
+ *
+ * Entries are keyed by the contents of the file and everything else the
+ * parser depends on (see `key()`), so they never become stale. Entries
+ * that haven't been used for 30 days are deleted.
+ */
+struct ParseCache
+{
+    SymbolTable & symbols;
+    PosTable & positions;
+    const ref<SourceAccessor> rootFS;
+
+    /**
+     * The key of the entry for parsing `text` (including the two
+     * terminating null bytes that the lexer requires). This covers the
+     * Nix version, and the settings and environment that affect
+     * parsing.
+     */
+    static Hash key(std::string_view text, const EvalSettings & settings);
+
+    /**
+     * Read the entry for `key`, if it exists. Its positions are placed
+     * in `origin`, which must have been created for the same text, and
+     * its relative paths are resolved against `basePath`. Corrupt
+     * entries are ignored.
+     */
+    Expr * read(
+        const Hash & key,
+        const PosTable::Origin & origin,
+        const SourcePath & basePath,
+        DocCommentMap & docComments);
+
+    /**
+     * Store the result of parsing a file in `origin`, with the relative
+     * path literals that the parser recorded in `pathLiterals`.
+     * Expressions that can't be cached (e.g. because they refer to
+     * positions in other origins) are silently skipped.
+     */
+    void write(
+        const Hash & key,
+        Expr * e,
+        const PosTable::Origin & origin,
+        const PathLiteralMap & pathLiterals,
+        const DocCommentMap & docComments);
+
+    /**
+     * Serialise an expression and its doc comments. Throws an `Error`
+     * if the expression can't be serialised.
+     */
+    std::string serialise(
+        Expr * e,
+        const PosTable::Origin & origin,
+        const PathLiteralMap & pathLiterals,
+        const DocCommentMap & docComments);
+
+    /**
+     * The inverse of `serialise()`. It repeats the warnings that the
+     * parser printed for the expression. Throws an `Error` if `data` is
+     * corrupt.
+     */
+    Expr * deserialise(
+        std::string_view data,
+        const PosTable::Origin & origin,
+        const SourcePath & basePath,
+        DocCommentMap & docComments);
+};
+
+}
@@ -73,6 +73,12 @@ struct LexerState
     PosIdx at(const ParserLocation & loc);
 };
 
+/**
+ * Maps path expressions to the relative path literals they were parsed
+ * from.
+ */
+typedef std::unordered_map<const Expr *, std::string> PathLiteralMap;
+
 struct ParserState
 {
     const LexerState & lexerState;
@@ -85,6 +91,11 @@ struct ParserState
     const Expr::AstSymbols & s;
     const EvalSettings & settings;
 
+    /**
+     * If set, where to record the relative path literals.
+     */
+    PathLiteralMap * pathLiterals;
+
     void dupAttr(const AttrPath & attrPath, const PosIdx pos, const PosIdx prevPos);
     void dupAttr(Symbol attr, const PosIdx pos, const PosIdx prevPos);
     void addAttr(ExprAttrs * attrs, AttrPath && attrPath, const ParserLocation & loc, Expr * e, const ParserLocation & exprLoc);
@@ -355,4 +366,16 @@ inline PosIdx ParserState::at(const ParserLocation & loc)
     return positions.add(origin, loc.beginOffset);
 }
 
+/**
+ * Resolve a path literal other than `~/...` against `basePath`.
+ */
+inline Path resolvePathLiteral(std::string_view literal, const SourcePath & basePath)
+{
+    Path path(absPath(literal, basePath.path.abs()));
+    /* add back in the trailing '/' to the first segment */
+    if (literal.size() > 1 && literal.back() == '/')
+        path += '/';
+    return path;
+}
+
 }
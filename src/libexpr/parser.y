@@ -62,14 +62,15 @@ typedef std::unordered_map<PosIdx, DocComment> DocCommentMap;
 Expr * parseExprFromBuf(
     char * text,
     size_t length,
-    Pos::Origin origin,
+    const PosTable::Origin & origin,
     const SourcePath & basePath,
     SymbolTable & symbols,
     const EvalSettings & settings,
     PosTable & positions,
     DocCommentMap & docComments,
     const ref<SourceAccessor> rootFS,
-    const Expr::AstSymbols & astSymbols);
+    const Expr::AstSymbols & astSymbols,
+    PathLiteralMap * pathLiterals);
 
 }
 
@@ -360,10 +361,7 @@ string_parts_interpolated
 path_start
   : PATH {
     std::string_view literal({$1.p, $1.l});
-    Path path(absPath(literal, state->basePath.path.abs()));
-    /* add back in the trailing '/' to the first segment */
-    if (literal.size() > 1 && literal.back() == '/')
-      path += '/';
+    Path path(resolvePathLiteral(literal, state->basePath));
     $$ =
         /* Absolute paths are always interpreted relative to the
            root filesystem accessor, rather than the accessor of the
@@ -371,6 +369,8 @@ path_start
         literal.front() == '/'
         ? new ExprPath(state->rootFS, std::move(path))
         : new ExprPath(state->basePath.accessor, std::move(path));
+    if (literal.front() != '/' && state->pathLiterals)
+      state->pathLiterals->emplace($$, literal);
   }
   | HPATH {
     if (state->settings.pureEval) {
@@ -522,20 +522,21 @@ namespace nix {
 Expr * parseExprFromBuf(
     char * text,
     size_t length,
-    Pos::Origin origin,
+    const PosTable::Origin & origin,
     const SourcePath & basePath,
     SymbolTable & symbols,
     const EvalSettings & settings,
     PosTable & positions,
     DocCommentMap & docComments,
     const ref<SourceAccessor> rootFS,
-    const Expr::AstSymbols & astSymbols)
+    const Expr::AstSymbols & astSymbols,
+    PathLiteralMap * pathLiterals)
 {
     yyscan_t scanner;
     LexerState lexerState {
         .positionToDocComment = docComments,
         .positions = positions,
-        .origin = positions.addOrigin(origin, length),
+        .origin = origin,
     };
     ParserState state {
         .lexerState = lexerState,
@@ -546,6 +547,7 @@ Expr * parseExprFromBuf(
         .rootFS = rootFS,
         .s = astSymbols,
         .settings = settings,
+        .pathLiterals = pathLiterals,
     };
 
     yylex_init_extra(&lexerState, &scanner);
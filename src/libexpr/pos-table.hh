@@ -35,7 +35,12 @@ public:
 private:
     using Lines = std::vector<uint32_t>;
 
-    std::map<uint32_t, Origin> origins;
+    /**
+     * Files may be parsed on several evaluator threads. Origins are
+     * never removed, so pointers to them remain valid after the lock
+     * is released.
+     */
+    SharedSync<std::map<uint32_t, Origin>> origins;
     mutable Sync<std::map<uint32_t, Lines>> lines;
 
     const Origin * resolve(PosIdx p) const
@@ -47,22 +52,24 @@ private:
         /* we want the last key <= idx, so we'll take prev(first key > idx).
             this is guaranteed to never rewind origin.begin because the first
             key is always 0. */
-        const auto pastOrigin = origins.upper_bound(idx);
+        auto origins(this->origins.readLock());
+        const auto pastOrigin = origins->upper_bound(idx);
         return &std::prev(pastOrigin)->second;
     }
 
 public:
     Origin addOrigin(Pos::Origin origin, size_t size)
     {
+        auto origins(this->origins.lock());
         uint32_t offset = 0;
-        if (auto it = origins.rbegin(); it != origins.rend())
+        if (auto it = origins->rbegin(); it != origins->rend())
             offset = it->first + it->second.size;
         // +1 because all PosIdx are offset by 1 to begin with, and
         // another +1 to ensure that all origins can point to EOF, eg
         // on (invalid) empty inputs.
         if (2 + offset + size < offset)
             return Origin{origin, offset, 0};
-        return origins.emplace(offset, Origin{origin, offset, size}).first->second;
+        return origins->emplace(offset, Origin{origin, offset, size}).first->second;
     }
 
     PosIdx add(const Origin & origin, size_t offset)
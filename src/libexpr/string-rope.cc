@@ -0,0 +1,143 @@
+#include "string-rope.hh"
+#include "eval.hh"
+#include "eval-inline.hh"
+
+#include <cstring>
+
+namespace nix {
+
+std::atomic<uint64_t> StringRope::nrRopes{0};
+std::atomic<uint64_t> StringRope::nrFlattened{0};
+
+static char * allocString(size_t size)
+{
+    auto s = (char *) GC_MALLOC_ATOMIC(size);
+    if (!s) throw std::bad_alloc();
+    return s;
+}
+
+char * StringRope::copyTo(char * dest) const
+{
+    if (auto s = flattened()) {
+        memcpy(dest, s, size);
+        return dest + size;
+    }
+
+    /* Ropes built by repeated concatenation are as deep as they are
+       long, so don't recurse. */
+    std::vector<std::pair<const StringRope *, size_t>> stack{{this, 0}};
+
+    while (!stack.empty()) {
+        auto [rope, n] = stack.back();
+        if (n == rope->nrParts) {
+            stack.pop_back();
+            continue;
+        }
+        stack.back().second++;
+        auto & part = rope->parts[n];
+        if (!part.rope) {
+            memcpy(dest, part.s, part.size);
+            dest += part.size;
+        } else if (auto s = part.rope->flattened()) {
+            memcpy(dest, s, part.size);
+            dest += part.size;
+        } else
+            stack.emplace_back(part.rope, 0);
+    }
+
+    return dest;
+}
+
+const char * StringRope::flatten() const
+{
+    auto s = allocString(size + 1);
+    *copyTo(s) = 0;
+
+    const char * expected = nullptr;
+    if (!std::atomic_ref(flat).compare_exchange_strong(expected, s, std::memory_order_acq_rel))
+        /* Another thread beat us to it. */
+        return expected;
+
+    nrFlattened++;
+    return s;
+}
+
+void StringRopeBuilder::add(const Value & v)
+{
+    StringRope::Part part;
+    if (auto rope = v.stringRope()) {
+        /* Refer to the contents of a flattened rope, so that its parts
+           can be freed. */
+        if (auto s = rope->flattened())
+            part = {.rope = nullptr, .s = s, .size = rope->size};
+        else
+            part = {.rope = rope, .s = nullptr, .size = rope->size};
+    } else {
+        auto s = v.c_str();
+        part = {.rope = nullptr, .s = s, .size = strlen(s)};
+    }
+
+    if (part.size) {
+        entries.push_back({part, false});
+        size_ += part.size;
+    }
+}
+
+void StringRopeBuilder::add(BackedStringView && s)
+{
+    std::string_view view = *s;
+    if (s.isOwned())
+        view = owned.emplace_back(std::move(s).toOwned());
+
+    if (!view.empty()) {
+        entries.push_back({{.rope = nullptr, .s = view.data(), .size = view.size()}, true});
+        size_ += view.size();
+    }
+}
+
+void StringRopeBuilder::finish(Value & v, const NixStringContext & context)
+{
+    if (entries.empty()) {
+        v.mkStringMove("", context);
+        return;
+    }
+
+    /* A single string value can be shared as is. */
+    if (entries.size() == 1 && !entries[0].temporary && !entries[0].part.rope) {
+        v.mkStringMove(entries[0].part.s, context);
+        return;
+    }
+
+    if (size_ < minRopeSize) {
+        auto s = allocString(size_ + 1);
+        auto p = s;
+        for (auto & entry : entries)
+            if (entry.part.rope)
+                p = entry.part.rope->copyTo(p);
+            else {
+                memcpy(p, entry.part.s, entry.part.size);
+                p += entry.part.size;
+            }
+        *p = 0;
+        v.mkStringMove(s, context);
+        return;
+    }
+
+    auto rope = new (allocBytes(sizeof(StringRope) + sizeof(StringRope::Part) * entries.size())) StringRope;
+    rope->size = size_;
+    rope->context = encodeContext(context);
+    rope->nrParts = entries.size();
+    for (size_t n = 0; n < entries.size(); ++n) {
+        auto & part = rope->parts[n] = entries[n].part;
+        if (entries[n].temporary) {
+            auto s = allocString(part.size);
+            memcpy(s, part.s, part.size);
+            part.s = s;
+        }
+    }
+
+    StringRope::nrRopes++;
+    v.mkStringRope(rope);
+}
+
+}
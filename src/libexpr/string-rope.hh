@@ -0,0 +1,67 @@
+#pragma once
+///@file
+
+#include <list>
+
+#include "gc-small-vector.hh"
+#include "value.hh"
+
+namespace nix {
+
+/**
+ * Concatenates strings into a string value. If the result is big
+ * enough, it becomes a `StringRope` that refers to the parts that are
+ * string values rather than copying them.
+ */
+class StringRopeBuilder
+{
+    struct Entry
+    {
+        StringRope::Part part;
+
+        /**
+         * Whether the part may not outlive the builder, so that it
+         * must be copied into a rope.
+         */
+        bool temporary;
+    };
+
+    SmallVector<Entry, 16> entries;
+
+    std::list<std::string> owned;
+
+    size_t size_ = 0;
+
+public:
+
+    /**
+     * The size of the smallest string that becomes a rope. Copying
+     * smaller strings is cheaper than creating and later flattening a
+     * rope.
+     */
+    static constexpr size_t minRopeSize = 1024;
+
+    /**
+     * Append the string value `v`. Its context is not copied.
+     */
+    void add(const Value & v);
+
+    /**
+     * Append a string that is only valid until the builder is
+     * destroyed.
+     */
+    void add(BackedStringView && s);
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    /**
+     * Set `v` to the concatenation of the parts, with context
+     * `context`.
+     */
+    void finish(Value & v, const NixStringContext & context);
+};
+
+}
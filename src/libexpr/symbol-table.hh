@@ -1,16 +1,27 @@
 #pragma once
 ///@file
 
-#include <list>
-#include <map>
-#include <unordered_map>
+#include <array>
+#include <atomic>
+#include <functional>
 
 #include "types.hh"
-#include "chunked-vector.hh"
 #include "error.hh"
+#include "sync.hh"
 
 namespace nix {
 
+/**
+ * The representation of a symbol in the symbol table's arena: its
+ * hash, its length and its NUL-terminated contents.
+ */
+struct SymbolEntry
+{
+    uint32_t hash;
+    uint32_t size;
+    char data[0];
+};
+
 /**
  * This class mainly exists to give us an operator<< for ostreams. We could also
  * return plain strings from SymbolTable, but then we'd have to wrap every
@@ -21,31 +32,31 @@ class SymbolStr
     friend class SymbolTable;
 
 private:
-    const std::string * s;
+    const SymbolEntry * s;
 
-    explicit SymbolStr(const std::string & symbol): s(&symbol) {}
+    explicit SymbolStr(const SymbolEntry & symbol): s(&symbol) {}
 
 public:
     bool operator == (std::string_view s2) const
     {
-        return *s == s2;
+        return std::string_view(*this) == s2;
     }
 
     const char * c_str() const
     {
-        return s->c_str();
+        return s->data;
     }
 
     operator const std::string_view () const
     {
-        return *s;
+        return {s->data, s->size};
     }
 
     friend std::ostream & operator <<(std::ostream & os, const SymbolStr & symbol);
 
     bool empty() const
     {
-        return s->empty();
+        return !s->size;
     }
 };
 
@@ -77,31 +88,108 @@ public:
 /**
  * Symbol table used by the parser and evaluator to represent and look
  * up identifiers and attributes efficiently.
+ *
+ * The strings are stored in an arena of large chunks, and a symbol's
+ * ID encodes the location of its string, so resolving a symbol takes
+ * no locks. Creating symbols is safe from multiple threads: the hash
+ * index is split into shards with a lock each, and lookups of
+ * existing symbols only take a shared lock.
  */
 class SymbolTable
 {
 private:
-    std::unordered_map<std::string_view, std::pair<const std::string *, uint32_t>> symbols;
-    ChunkedVector<std::string, 8192> store{16};
+    /**
+     * Symbol IDs consist of a chunk number and the offset in the
+     * chunk in units of `alignment` bytes.
+     */
+    static constexpr size_t offsetBits = 20;
+    static constexpr size_t alignment = 8;
+    static constexpr size_t chunkSize = alignment << offsetBits;
+    static constexpr size_t maxChunks = size_t(1) << (32 - offsetBits);
+
+    /**
+     * The chunks of the arena. Chunks are never moved or freed until
+     * the symbol table is destroyed. Symbols that don't fit in a
+     * chunk get a chunk of their own.
+     */
+    std::array<std::atomic<char *>, maxChunks> chunks{};
+
+    struct Arena
+    {
+        size_t nrChunks = 0;
+        /**
+         * The number of bytes used in every chunk, needed to iterate
+         * over them.
+         */
+        std::vector<size_t> chunkSizes;
+        size_t nrSymbols = 0;
+        size_t totalSize = 0;
+    };
+
+    mutable Sync<Arena> arena_;
+
+    struct Shard
+    {
+        /**
+         * An open addressing table of symbol IDs, with 0 denoting an
+         * empty slot. Its size is a power of two.
+         */
+        std::vector<uint32_t> ids = std::vector<uint32_t>(16, 0);
+        size_t count = 0;
+    };
+
+    static constexpr size_t nrShards = 64;
+
+    std::array<SharedSync<Shard>, nrShards> shards;
+
+    const SymbolEntry & entry(uint32_t id) const
+    {
+        return *reinterpret_cast<const SymbolEntry *>(
+            chunks[id >> offsetBits].load(std::memory_order_relaxed) + (id & ((1 << offsetBits) - 1)) * alignment);
+    }
+
+    uint32_t lookup(const Shard & shard, std::string_view s, uint32_t hash) const
+    {
+        auto mask = shard.ids.size() - 1;
+        for (auto i = hash & mask; shard.ids[i]; i = (i + 1) & mask) {
+            auto & e = entry(shard.ids[i]);
+            if (e.hash == hash && std::string_view(e.data, e.size) == s)
+                return shard.ids[i];
+        }
+        return 0;
+    }
+
+    /**
+     * Copy `s` into the arena and return its ID.
+     */
+    uint32_t store(std::string_view s, uint32_t hash);
+
+    [[gnu::noinline]] uint32_t insert(Shard & shard, std::string_view s, uint32_t hash);
 
 public:
 
+    SymbolTable() = default;
+    SymbolTable(const SymbolTable &) = delete;
+
+    ~SymbolTable();
+
     /**
      * converts a string into a symbol.
      */
     Symbol create(std::string_view s)
     {
-        // Most symbols are looked up more than once, so we trade off insertion performance
-        // for lookup performance.
-        // TODO: could probably be done more efficiently with transparent Hash and Equals
-        // on the original implementation using unordered_set
-        // FIXME: make this thread-safe.
-        auto it = symbols.find(s);
-        if (it != symbols.end()) return Symbol(it->second.second + 1);
-
-        const auto & [rawSym, idx] = store.add(std::string(s));
-        symbols.emplace(rawSym, std::make_pair(&rawSym, idx));
-        return Symbol(idx + 1);
+        /* The low bits select the shard, the others the slot in the
+           shard. */
+        auto h = std::hash<std::string_view>{}(s);
+        auto & shard = shards[h % nrShards];
+        uint32_t hash = h / nrShards;
+
+        if (auto id = lookup(*shard.readLock(), s, hash))
+            return Symbol(id);
+
+        /* Another thread may add the symbol in the meantime, so
+           insert() looks it up again. */
+        return Symbol(insert(*shard.lock(), s, hash));
     }
 
     std::vector<SymbolStr> resolve(const std::vector<Symbol> & symbols) const
@@ -115,23 +203,26 @@ public:
 
     SymbolStr operator[](Symbol s) const
     {
-        if (s.id == 0 || s.id > store.size())
+        if (s.id == 0)
             unreachable();
-        return SymbolStr(store[s.id - 1]);
+        return SymbolStr(entry(s.id));
     }
 
     size_t size() const
     {
-        return store.size();
+        return arena_.lock()->nrSymbols;
     }
 
-    size_t totalSize() const;
-
-    template<typename T>
-    void dump(T callback) const
+    size_t totalSize() const
     {
-        store.forEach(callback);
+        return arena_.lock()->totalSize;
     }
+
+    /**
+     * Call `callback` on every symbol, in the order in which they
+     * were created.
+     */
+    void dump(std::function<void(std::string_view)> callback) const;
 };
 
 }
@@ -0,0 +1,168 @@
+#include "temporary-arena.hh"
+#include "eval-gc.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace nix {
+
+std::atomic<uint64_t> TemporaryArena::nrBytes{0};
+std::atomic<uint64_t> TemporaryArena::nrChunkBytes{0};
+
+/**
+ * Every allocation is followed by a footer, so that freed allocations
+ * below the top can be found.
+ */
+struct Footer
+{
+    size_t start;
+    size_t freed;
+};
+
+struct TemporaryArena::Chunk
+{
+    Chunk * prev;
+
+    /**
+     * The size of the memory following this header.
+     */
+    size_t size;
+
+    /**
+     * The value of `top` when the arena moved on to the next chunk.
+     */
+    size_t used;
+
+    size_t padding;
+
+    char * data()
+    {
+        return reinterpret_cast<char *>(this + 1);
+    }
+};
+
+static constexpr size_t alignment = 16;
+
+static_assert(sizeof(Footer) % alignment == 0);
+
+/**
+ * The usual size of a chunk. Bigger allocations get a chunk of their
+ * own.
+ */
+static constexpr size_t chunkSize = 64 * 1024 - 64;
+
+static size_t alignUp(size_t n)
+{
+    return (n + alignment - 1) & ~(alignment - 1);
+}
+
+TemporaryArena & TemporaryArena::get()
+{
+    static thread_local TemporaryArena arena;
+    return arena;
+}
+
+TemporaryArena::~TemporaryArena()
+{
+    while (chunk) {
+        auto prev = chunk->prev;
+        freeChunk(chunk);
+        chunk = prev;
+    }
+    if (spare) {
+#if HAVE_BOEHMGC
+        GC_FREE(spare);
+#else
+        std::free(spare);
+#endif
+    }
+}
+
+void TemporaryArena::newChunk(size_t size)
+{
+    size = std::max(size, chunkSize);
+
+    Chunk * c;
+    if (spare && spare->size >= size) {
+        c = spare;
+        spare = nullptr;
+    } else {
+        /* The chunk is scanned for pointers to values, but not
+           collected. */
+#if HAVE_BOEHMGC
+        c = static_cast<Chunk *>(GC_MALLOC_UNCOLLECTABLE(sizeof(Chunk) + size));
+#else
+        c = static_cast<Chunk *>(std::calloc(1, sizeof(Chunk) + size));
+#endif
+        if (!c) throw std::bad_alloc();
+        c->size = size;
+        nrChunkBytes += sizeof(Chunk) + size;
+    }
+
+    if (chunk) chunk->used = top;
+    c->prev = chunk;
+    chunk = c;
+    top = 0;
+}
+
+void TemporaryArena::freeChunk(Chunk * c)
+{
+    if (!spare && c->size == chunkSize) {
+        spare = c;
+        return;
+    }
+#if HAVE_BOEHMGC
+    GC_FREE(c);
+#else
+    std::free(c);
+#endif
+}
+
+void * TemporaryArena::allocate(size_t size)
+{
+    size = alignUp(size);
+
+    if (!chunk || chunk->size - top < size + sizeof(Footer))
+        newChunk(size + sizeof(Footer));
+
+    auto p = chunk->data() + top;
+    top += size;
+    new (chunk->data() + top) Footer{.start = top - size, .freed = 0};
+    top += sizeof(Footer);
+
+    nrBytes.fetch_add(size, std::memory_order_relaxed);
+
+    return p;
+}
+
+void TemporaryArena::deallocate(void * p, size_t size)
+{
+    size = alignUp(size);
+
+    /* Don't keep the values it referred to alive. */
+    std::memset(p, 0, size);
+
+    auto footer = reinterpret_cast<Footer *>(static_cast<char *>(p) + size);
+    assert(!footer->freed);
+    footer->freed = 1;
+
+    /* Pop freed allocations off the top. */
+    while (chunk) {
+        if (!top) {
+            if (!chunk->prev) break;
+            auto prev = chunk->prev;
+            freeChunk(chunk);
+            chunk = prev;
+            top = chunk->used;
+            continue;
+        }
+        auto footer = reinterpret_cast<Footer *>(chunk->data() + top - sizeof(Footer));
+        if (!footer->freed) break;
+        top = footer->start;
+    }
+}
+
+}
@@ -0,0 +1,110 @@
+#pragma once
+///@file
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace nix {
+
+/**
+ * A bump allocator for temporaries of the evaluator, i.e. memory that
+ * is freed before the function that allocated it returns, such as
+ * the elements of a `SmallVector` that don't fit on the stack.
+ *
+ * Each thread has its own arena, and memory must be freed by the
+ * thread that allocated it. Freeing the most recent allocation makes
+ * its memory available again, along with any earlier allocations that
+ * have already been freed. So memory that isn't freed in reverse order
+ * of allocation is only reused once everything allocated after it has
+ * been freed, as is the case for temporaries of nested calls.
+ *
+ * The arena is scanned by the garbage collector, so temporaries may
+ * refer to values, but it is not garbage collected itself, so
+ * allocating from it doesn't take the collector's lock or trigger
+ * collections.
+ */
+class TemporaryArena
+{
+    struct Chunk;
+
+    /**
+     * The chunk that memory is allocated from. Earlier chunks are
+     * full.
+     */
+    Chunk * chunk = nullptr;
+
+    /**
+     * An empty chunk that is kept around, so that a thread that keeps
+     * crossing a chunk boundary doesn't keep allocating chunks.
+     */
+    Chunk * spare = nullptr;
+
+    /**
+     * The offset of the free memory in `chunk`.
+     */
+    size_t top = 0;
+
+    void newChunk(size_t size);
+
+    void freeChunk(Chunk * chunk);
+
+    TemporaryArena() = default;
+
+public:
+
+    ~TemporaryArena();
+
+    /**
+     * The number of bytes that have been allocated from all arenas
+     * rather than from the garbage-collected heap.
+     */
+    static std::atomic<uint64_t> nrBytes;
+
+    /**
+     * The number of bytes of memory that all arenas have allocated
+     * for themselves.
+     */
+    static std::atomic<uint64_t> nrChunkBytes;
+
+    /**
+     * The arena of the current thread.
+     */
+    static TemporaryArena & get();
+
+    void * allocate(size_t size);
+
+    /**
+     * Free memory returned by `allocate(size)`.
+     */
+    void deallocate(void * p, size_t size);
+};
+
+/**
+ * A standard allocator that allocates from the current thread's
+ * `TemporaryArena`.
+ */
+template<typename T>
+struct TemporaryAllocator
+{
+    using value_type = T;
+
+    TemporaryAllocator() = default;
+
+    template<typename U>
+    TemporaryAllocator(const TemporaryAllocator<U> &) { }
+
+    T * allocate(size_t n)
+    {
+        return static_cast<T *>(TemporaryArena::get().allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T * p, size_t n)
+    {
+        TemporaryArena::get().deallocate(p, n * sizeof(T));
+    }
+
+    bool operator == (const TemporaryAllocator &) const = default;
+};
+
+}
@@ -1,6 +1,8 @@
 #pragma once
 ///@file
 
+#include <atomic>
+#include <bit>
 #include <cassert>
 #include <span>
 
@@ -32,6 +34,7 @@ typedef enum {
     tListN,
     tThunk,
     tApp,
+    tPending,
     tLambda,
     tPrimOp,
     tPrimOpApp,
@@ -138,6 +141,12 @@ class ListBuilder
     const size_t size;
     Value * inlineElems[2] = {nullptr, nullptr};
 public:
+    /**
+     * Lists up to this size are stored inside the `Value`. This
+     * requires tagged pointers, so it's not done on 32-bit platforms.
+     */
+    static constexpr size_t maxInlineElems = sizeof(void *) == 8 ? 2 : 0;
+
     Value * * elems;
     ListBuilder(EvalState & state, size_t size);
 
@@ -146,7 +155,7 @@ public:
     ListBuilder(ListBuilder && x) noexcept
         : size(x.size)
         , inlineElems{x.inlineElems[0], x.inlineElems[1]}
-        , elems(size <= 2 ? inlineElems : x.elems)
+        , elems(size <= maxInlineElems ? inlineElems : x.elems)
     { }
 
     Value * & operator [](size_t n)
@@ -163,30 +172,231 @@ public:
 };
 
 
+/**
+ * A string that is the concatenation of other strings, which are only
+ * copied once its contents are needed. This makes repeated
+ * concatenation, as in `foldl' (s: x: s + x) "" xs`, take linear rather
+ * than quadratic time and memory. Ropes are created by
+ * `StringRopeBuilder`.
+ */
+struct StringRope
+{
+    struct Part
+    {
+        /**
+         * If set, this part is another rope, and `s` is null.
+         */
+        const StringRope * rope;
+        const char * s;
+        size_t size;
+    };
+
+    /**
+     * The number of ropes that have been created and flattened.
+     */
+    static std::atomic<uint64_t> nrRopes, nrFlattened;
+
+    /**
+     * The size of the contents.
+     */
+    size_t size;
+
+    /**
+     * The union of the contexts of the parts, in the format of
+     * `Value::context()`.
+     */
+    const char * * context;
+
+    size_t nrParts;
+
+    mutable const char * flat = nullptr;
+
+    Part parts[0];
+
+    /**
+     * Return the contents, or null if the rope hasn't been flattened
+     * yet.
+     */
+    const char * flattened() const
+    {
+        return std::atomic_ref(flat).load(std::memory_order_acquire);
+    }
+
+    /**
+     * Return the contents, flattening the rope if necessary.
+     */
+    const char * c_str() const
+    {
+        if (auto s = flattened())
+            return s;
+        return flatten();
+    }
+
+    /**
+     * Copy the contents to `dest` without flattening the rope, and
+     * return the end of the copy.
+     */
+    char * copyTo(char * dest) const;
+
+private:
+    const char * flatten() const;
+};
+
+
+/**
+ * A Nix value. This is 16 bytes (two 64-bit words), without a separate
+ * type field: the type is encoded in the low bits of pointers, which
+ * are always aligned to at least 8 bytes. On platforms with 32-bit
+ * pointers, each word has the pointer in its low half and the tag in
+ * its high half instead.
+ *
+ * The first word (`words[0]`) determines the type, through its tag:
+ *
+ * - 0: a type without pointers in the first word. Either the first
+ *   word is `type << 3` and the second word is the payload (integer,
+ *   Boolean, float, attribute set, primop or external value), or the
+ *   two words are the elements of a list of length 1 or 2 (the second
+ *   one being null for a list of length 1). These can be told apart
+ *   because pointers are never this small. A string whose first word
+ *   is `tString << 3` is a `StringRope` rather than a flat string.
+ * - 1: a string, with its context array in the first word and its
+ *   contents in the second.
+ * - 2: a path, with its accessor in the first word and the path in the
+ *   second.
+ * - 3: a list, with its element array in the first word and its size
+ *   in the second.
+ * - 4: a thunk, with its environment in the first word and its
+ *   expression in the second.
+ * - 5: a thunk or function application that is being evaluated, with
+ *   the payload it had before.
+ * - 6: a function application, with the function in the first word and
+ *   the argument in the second.
+ * - 7: a lambda (environment and `ExprLambda`) or partially applied
+ *   primop (function and argument), distinguished by the tag of the
+ *   second word.
+ *
+ * Since the garbage collector doesn't look for interior pointers, the
+ * tags are registered as displacements in `initGC()`.
+ */
 struct Value
 {
 private:
-    InternalType internalType = tUninitialized;
+    using Word = uint64_t;
+
+    static constexpr bool tagInPointer = sizeof(void *) == 8;
+
+    enum : unsigned {
+        pdSingle = 0,
+        pdString,
+        pdPath,
+        pdListN,
+        pdThunk,
+        pdPending,
+        pdApp,
+        pdPair,
+    };
+
+    /**
+     * Tags of the second word of `pdPair` values.
+     */
+    enum : unsigned {
+        pairLambda = 0,
+        pairPrimOpApp,
+    };
+
+    union
+    {
+        Word words[2] = {0, 0};
+        /**
+         * The elements of a list of length 1 or 2, which are stored
+         * inline on 64-bit platforms.
+         */
+        Value * smallList[2];
+    };
+
+    static Word tagged(const void * p, unsigned tag)
+    {
+        assert(!tagInPointer || !(reinterpret_cast<uintptr_t>(p) & 7));
+        return tagInPointer
+            ? Word(reinterpret_cast<uintptr_t>(p)) | tag
+            : Word(tag) << 32 | reinterpret_cast<uintptr_t>(p);
+    }
+
+    static unsigned tagOf(Word w)
+    {
+        return tagInPointer ? w & 7 : w >> 32;
+    }
+
+    template<typename T>
+    static T * untagged(Word w)
+    {
+        return reinterpret_cast<T *>(uintptr_t(tagInPointer ? w & ~Word(7) : w & 0xffffffff));
+    }
+
+    /**
+     * The largest value of the first word of a `pdSingle` value that
+     * encodes a type rather than a list element.
+     */
+    static constexpr Word maxSingleType = Word(tFloat) << 3;
+
+    static InternalType decodeType(Word w0, Word w1)
+    {
+        switch (tagOf(w0)) {
+        case pdSingle:
+            if (w0 <= maxSingleType) return InternalType(w0 >> 3);
+            return w1 ? tList2 : tList1;
+        case pdString: return tString;
+        case pdPath: return tPath;
+        case pdListN: return tListN;
+        case pdThunk: return tThunk;
+        case pdPending: return tPending;
+        case pdApp: return tApp;
+        default: return tagOf(w1) == pairLambda ? tLambda : tPrimOpApp;
+        }
+    }
+
+    /**
+     * Set the value. The first word is written last, with release
+     * semantics, to publish the value to threads that are waiting
+     * for it.
+     */
+    void set(Word w0, Word w1)
+    {
+        words[1] = w1;
+        std::atomic_ref(words[0]).store(w0, std::memory_order_release);
+    }
 
-    friend std::string showType(const Value & v);
+    void setSingle(InternalType type, Word payload)
+    {
+        set(tagged(reinterpret_cast<void *>(uintptr_t(type) << 3), pdSingle), payload);
+    }
 
 public:
 
     void print(EvalState &state, std::ostream &str, PrintOptions options = PrintOptions {});
 
+    /**
+     * Returns the internal type of the value. Most code should use
+     * `type()` instead.
+     */
+    inline InternalType getInternalType() const
+    {
+        return decodeType(words[0], words[1]);
+    }
+
     // Functions needed to distinguish the type
     // These should be removed eventually, by putting the functionality that's
     // needed by callers into methods of this type
 
     // type() == nThunk
-    inline bool isThunk() const { return internalType == tThunk; };
-    inline bool isApp() const { return internalType == tApp; };
-    inline bool isBlackhole() const;
+    inline bool isThunk() const { return tagOf(words[0]) == pdThunk; };
+    inline bool isApp() const { return tagOf(words[0]) == pdApp; };
+    inline bool isBlackhole() const { return tagOf(words[0]) == pdPending; };
 
     // type() == nFunction
-    inline bool isLambda() const { return internalType == tLambda; };
-    inline bool isPrimOp() const { return internalType == tPrimOp; };
-    inline bool isPrimOpApp() const { return internalType == tPrimOpApp; };
+    inline bool isLambda() const { return getInternalType() == tLambda; };
+    inline bool isPrimOp() const { return getInternalType() == tPrimOp; };
+    inline bool isPrimOpApp() const { return getInternalType() == tPrimOpApp; };
 
     /**
      * Strings in the evaluator carry a so-called `context` which
@@ -210,16 +420,6 @@ public:
 
      * For canonicity, the store paths should be in sorted order.
      */
-    struct StringWithContext {
-        const char * c_str;
-        const char * * context; // must be in sorted order
-    };
-
-    struct Path {
-        SourceAccessor * accessor;
-        const char * path;
-    };
-
     struct ClosureThunk {
         Env * env;
         Expr * expr;
@@ -234,32 +434,6 @@ public:
         ExprLambda * fun;
     };
 
-    using Payload = union
-    {
-        NixInt integer;
-        bool boolean;
-
-        StringWithContext string;
-
-        Path path;
-
-        Bindings * attrs;
-        struct {
-            size_t size;
-            Value * const * elems;
-        } bigList;
-        Value * smallList[2];
-        ClosureThunk thunk;
-        FunctionApplicationThunk app;
-        Lambda lambda;
-        PrimOp * primOp;
-        FunctionApplicationThunk primOpApp;
-        ExternalValueBase * external;
-        NixFloat fpoint;
-    };
-
-    Payload payload;
-
     /**
      * Returns the normal type of a Value. This only returns nThunk if
      * the Value hasn't been forceValue'd
@@ -269,7 +443,7 @@ public:
      */
     inline ValueType type(bool invalidIsThunk = false) const
     {
-        switch (internalType) {
+        switch (getInternalType()) {
             case tUninitialized: break;
             case tInt: return nInt;
             case tBool: return nBool;
@@ -281,7 +455,7 @@ public:
             case tLambda: case tPrimOp: case tPrimOpApp: return nFunction;
             case tExternal: return nExternal;
             case tFloat: return nFloat;
-            case tThunk: case tApp: return nThunk;
+            case tThunk: case tApp: case tPending: return nThunk;
         }
         if (invalidIsThunk)
             return nThunk;
@@ -289,10 +463,44 @@ public:
             unreachable();
     }
 
-    inline void finishValue(InternalType newType, Payload newPayload)
+    /**
+     * Get the internal type of a value that another thread may be
+     * finishing concurrently. If it is final, the payload is safe to
+     * read.
+     *
+     * Values are only ever copied after they have been forced, so
+     * other threads never see a value change, except from a thunk or
+     * function application to `tPending` and then to its final type.
+     * Since the first word is written last, it determines whether the
+     * value is final.
+     */
+    inline InternalType getInternalTypeAtomic()
+    {
+        auto w0 = std::atomic_ref(words[0]).load(std::memory_order_acquire);
+        switch (tagOf(w0)) {
+        case pdThunk: return tThunk;
+        case pdPending: return tPending;
+        case pdApp: return tApp;
+        default: return decodeType(w0, words[1]);
+        }
+    }
+
+    /**
+     * Mark a thunk or function application (`expected`) as being
+     * evaluated. If `atomic` is set, this fails if another thread got
+     * there first.
+     */
+    inline bool markPending(InternalType expected, bool atomic)
     {
-        payload = newPayload;
-        internalType = newType;
+        auto w0 = std::atomic_ref(words[0]).load(std::memory_order_relaxed);
+        if (tagOf(w0) != (expected == tThunk ? pdThunk : pdApp))
+            return false;
+        auto pending = tagged(untagged<void>(w0), pdPending);
+        if (!atomic) {
+            words[0] = pending;
+            return true;
+        }
+        return std::atomic_ref(words[0]).compare_exchange_strong(w0, pending, std::memory_order_acq_rel);
     }
 
     /**
@@ -302,7 +510,7 @@ public:
      */
     inline bool isValid() const
     {
-        return internalType != tUninitialized;
+        return getInternalType() != tUninitialized;
     }
 
     inline void mkInt(NixInt::Inner n)
@@ -312,17 +520,22 @@ public:
 
     inline void mkInt(NixInt n)
     {
-        finishValue(tInt, { .integer = n });
+        setSingle(tInt, Word(n.value));
     }
 
     inline void mkBool(bool b)
     {
-        finishValue(tBool, { .boolean = b });
+        setSingle(tBool, b);
     }
 
     inline void mkString(const char * s, const char * * context = 0)
     {
-        finishValue(tString, { .string = { .c_str = s, .context = context } });
+        set(tagged(context, pdString), reinterpret_cast<uintptr_t>(s));
+    }
+
+    inline void mkStringRope(const StringRope * rope)
+    {
+        setSingle(tString, reinterpret_cast<uintptr_t>(rope));
     }
 
     void mkString(std::string_view s);
@@ -341,44 +554,43 @@ public:
 
     inline void mkPath(SourceAccessor * accessor, const char * path)
     {
-        finishValue(tPath, { .path = { .accessor = accessor, .path = path } });
+        set(tagged(accessor, pdPath), reinterpret_cast<uintptr_t>(path));
     }
 
     inline void mkNull()
     {
-        finishValue(tNull, {});
+        setSingle(tNull, 0);
     }
 
     inline void mkAttrs(Bindings * a)
     {
-        finishValue(tAttrs, { .attrs = a });
+        setSingle(tAttrs, reinterpret_cast<uintptr_t>(a));
     }
 
     Value & mkAttrs(BindingsBuilder & bindings);
 
     void mkList(const ListBuilder & builder)
     {
-        if (builder.size == 1)
-            finishValue(tList1, { .smallList = { builder.inlineElems[0] } });
-        else if (builder.size == 2)
-            finishValue(tList2, { .smallList = { builder.inlineElems[0], builder.inlineElems[1] } });
-        else
-            finishValue(tListN, { .bigList = { .size = builder.size, .elems = builder.elems } });
+        if (builder.size >= 1 && builder.size <= ListBuilder::maxInlineElems) {
+            smallList[1] = builder.size == 2 ? builder.inlineElems[1] : nullptr;
+            std::atomic_ref(words[0]).store(reinterpret_cast<uintptr_t>(builder.inlineElems[0]), std::memory_order_release);
+        } else
+            set(tagged(builder.elems, pdListN), builder.size);
     }
 
     inline void mkThunk(Env * e, Expr * ex)
     {
-        finishValue(tThunk, { .thunk = { .env = e, .expr = ex } });
+        set(tagged(e, pdThunk), reinterpret_cast<uintptr_t>(ex));
     }
 
     inline void mkApp(Value * l, Value * r)
     {
-        finishValue(tApp, { .app = { .left = l, .right = r } });
+        set(tagged(l, pdApp), reinterpret_cast<uintptr_t>(r));
     }
 
     inline void mkLambda(Env * e, ExprLambda * f)
     {
-        finishValue(tLambda, { .lambda = { .env = e, .fun = f } });
+        set(tagged(e, pdPair), tagged(f, pairLambda));
     }
 
     inline void mkBlackhole();
@@ -387,7 +599,7 @@ public:
 
     inline void mkPrimOpApp(Value * l, Value * r)
     {
-        finishValue(tPrimOpApp, { .primOpApp = { .left = l, .right = r } });
+        set(tagged(l, pdPair), tagged(r, pairPrimOpApp));
     }
 
     /**
@@ -397,22 +609,23 @@ public:
 
     inline void mkExternal(ExternalValueBase * e)
     {
-        finishValue(tExternal, { .external = e });
+        setSingle(tExternal, reinterpret_cast<uintptr_t>(e));
     }
 
     inline void mkFloat(NixFloat n)
     {
-        finishValue(tFloat, { .fpoint = n });
+        setSingle(tFloat, std::bit_cast<Word>(n));
     }
 
     bool isList() const
     {
-        return internalType == tList1 || internalType == tList2 || internalType == tListN;
+        auto type = getInternalType();
+        return type == tList1 || type == tList2 || type == tListN;
     }
 
-    Value * const * listElems()
+    Value * const * listElems() const
     {
-        return internalType == tList1 || internalType == tList2 ? payload.smallList : payload.bigList.elems;
+        return tagOf(words[0]) == pdListN ? untagged<Value * const>(words[0]) : smallList;
     }
 
     std::span<Value * const> listItems() const
@@ -421,14 +634,9 @@ public:
         return std::span<Value * const>(listElems(), listSize());
     }
 
-    Value * const * listElems() const
-    {
-        return internalType == tList1 || internalType == tList2 ? payload.smallList : payload.bigList.elems;
-    }
-
     size_t listSize() const
     {
-        return internalType == tList1 ? 1 : internalType == tList2 ? 2 : payload.bigList.size;
+        return tagOf(words[0]) == pdListN ? words[1] : words[1] ? 2 : 1;
     }
 
     PosIdx determinePos(const PosIdx pos) const;
@@ -442,59 +650,98 @@ public:
 
     SourcePath path() const
     {
-        assert(internalType == tPath);
+        assert(getInternalType() == tPath);
         return SourcePath(
-            ref(payload.path.accessor->shared_from_this()),
-            CanonPath(CanonPath::unchecked_t(), payload.path.path));
+            ref(pathAccessor()->shared_from_this()),
+            CanonPath(CanonPath::unchecked_t(), pathStr()));
     }
 
     std::string_view string_view() const
     {
-        assert(internalType == tString);
-        return std::string_view(payload.string.c_str);
+        assert(getInternalType() == tString);
+        if (auto rope = stringRope())
+            return std::string_view(rope->c_str(), rope->size);
+        return std::string_view(c_str());
     }
 
+    /**
+     * The contents of a string. This flattens a rope.
+     */
     const char * c_str() const
     {
-        assert(internalType == tString);
-        return payload.string.c_str;
+        assert(getInternalType() == tString);
+        if (auto rope = stringRope())
+            return rope->c_str();
+        return reinterpret_cast<const char *>(uintptr_t(words[1]));
     }
 
     const char * * context() const
     {
-        return payload.string.context;
+        if (auto rope = stringRope())
+            return rope->context;
+        return untagged<const char *>(words[0]);
+    }
+
+    /**
+     * The rope of a string that was created by concatenation without
+     * copying its parts, or `nullptr` for a flat string.
+     */
+    const StringRope * stringRope() const
+    {
+        return words[0] == Word(tString) << 3
+            ? reinterpret_cast<const StringRope *>(uintptr_t(words[1]))
+            : nullptr;
     }
 
+    SourceAccessor * pathAccessor() const
+    { return untagged<SourceAccessor>(words[0]); }
+
+    const char * pathStr() const
+    { return reinterpret_cast<const char *>(uintptr_t(words[1])); }
+
     ExternalValueBase * external() const
-    { return payload.external; }
+    { return reinterpret_cast<ExternalValueBase *>(uintptr_t(words[1])); }
 
     const Bindings * attrs() const
-    { return payload.attrs; }
+    { return reinterpret_cast<const Bindings *>(uintptr_t(words[1])); }
 
     const PrimOp * primOp() const
-    { return payload.primOp; }
+    { return reinterpret_cast<const PrimOp *>(uintptr_t(words[1])); }
 
     bool boolean() const
-    { return payload.boolean; }
+    { return words[1]; }
 
     NixInt integer() const
-    { return payload.integer; }
+    { return NixInt(int64_t(words[1])); }
 
     NixFloat fpoint() const
-    { return payload.fpoint; }
+    { return std::bit_cast<NixFloat>(words[1]); }
+
+    /**
+     * The payload of a thunk, or of a black hole created by
+     * `mkBlackhole()`.
+     */
+    ClosureThunk thunk() const
+    { return {untagged<Env>(words[0]), reinterpret_cast<Expr *>(uintptr_t(words[1]))}; }
+
+    FunctionApplicationThunk app() const
+    { return {untagged<Value>(words[0]), reinterpret_cast<Value *>(uintptr_t(words[1]))}; }
+
+    Lambda lambda() const
+    { return {untagged<Env>(words[0]), untagged<ExprLambda>(words[1])}; }
+
+    FunctionApplicationThunk primOpApp() const
+    { return {untagged<Value>(words[0]), untagged<Value>(words[1])}; }
 };
 
+static_assert(sizeof(Value) == 16);
 
-extern ExprBlackHole eBlackHole;
 
-bool Value::isBlackhole() const
-{
-    return internalType == tThunk && payload.thunk.expr == (Expr*) &eBlackHole;
-}
+extern ExprBlackHole eBlackHole;
 
 void Value::mkBlackhole()
 {
-    mkThunk(nullptr, (Expr *) &eBlackHole);
+    set(tagged(nullptr, pdPending), reinterpret_cast<uintptr_t>(&eBlackHole));
 }
 
 
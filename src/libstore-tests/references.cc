@@ -1,4 +1,9 @@
 #include "references.hh"
+#include "path-references.hh"
+#include "file-system.hh"
+#include "posix-source-accessor.hh"
+#include "source-path.hh"
+#include "file-content-address.hh"
 
 #include <gtest/gtest.h>
 
@@ -42,4 +47,77 @@ TEST(references, scan)
     }
 }
 
+TEST(references, scanAllOffsets)
+{
+    std::string hash1 = "dc04vv14dak1c1r48qa0m23vr9jy8sm0";
+
+    /* Exercise references straddling the 64-byte blocks the scanner
+       classifies, in both binary and nix32-heavy surroundings. */
+    for (char filler : {'\0', 'x', '0'}) {
+        for (size_t offset = 0; offset < 200; ++offset) {
+            auto s = std::string(offset, filler) + hash1 + std::string(offset % 7, filler);
+            RefScanSink scanner(StringSet{hash1});
+            scanner(s);
+            ASSERT_EQ(scanner.getResult(), StringSet{hash1}) << "at offset " << offset;
+        }
+    }
+}
+
+TEST(references, scanRejectsNonNix32)
+{
+    std::string hash1 = "dc04vv14dak1c1r48qa0m23vr9jy8sm0";
+
+    {
+        /* 'e', 'o', 'u' and 't' are not part of the nix32 alphabet. */
+        RefScanSink scanner(StringSet{hash1});
+        auto s = "dc04vv14dak1c1r48qa0m23vr9jy8se0";
+        scanner(s);
+        ASSERT_EQ(scanner.getResult(), StringSet{});
+    }
+
+    {
+        /* Strings that cannot be a nix32 hash are never found. */
+        RefScanSink scanner(StringSet{"foo", "dc04vv14dak1c1r48qa0m23vr9jy8set"});
+        auto s = "foo dc04vv14dak1c1r48qa0m23vr9jy8set";
+        scanner(s);
+        ASSERT_EQ(scanner.getResult(), StringSet{});
+    }
+}
+
+TEST(references, scanOutput)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+
+    StorePath ref { "dc04vv14dak1c1r48qa0m23vr9jy8sm0-foo" };
+    StorePath other { "zc842j0rz61mjsp3h3wp5ly71ak6qgdn-bar" };
+
+    auto out = tmpDir + "/out";
+    createDirs(out + "/bin");
+    writeFile(out + "/bin/prog", "#! /nix/store/" + std::string(ref.to_string()) + "/bin/sh\n");
+    chmod((out + "/bin/prog").c_str(), 0555);
+    writeFile(out + "/data", std::string(100000, 'x'));
+    createSymlink("bin/prog", out + "/link");
+
+    auto hashOf = [](const Path & path) {
+        return hashPath(
+            PosixSourceAccessor::createAtRoot(path),
+            FileSerialisationMethod::NixArchive, HashAlgorithm::SHA256).first;
+    };
+
+    auto scan = scanOutput(out, StorePathSet{ref, other}, true);
+
+    ASSERT_EQ(scan.references, StorePathSet{ref});
+    ASSERT_EQ(scan.narHash.first, hashOf(out));
+    ASSERT_EQ(scan.fileHashes.size(), 3);
+    ASSERT_EQ(scan.fileHashes.at(CanonPath("bin/prog")), hashOf(out + "/bin/prog"));
+    ASSERT_EQ(scan.fileHashes.at(CanonPath("data")), hashOf(out + "/data"));
+    ASSERT_EQ(scan.fileHashes.at(CanonPath("link")), hashOf(out + "/link"));
+
+    auto scan2 = scanOutput(out, StorePathSet{ref, other}, false);
+    ASSERT_EQ(scan2.references, scan.references);
+    ASSERT_EQ(scan2.narHash, scan.narHash);
+    ASSERT_TRUE(scan2.fileHashes.empty());
+}
+
 }
@@ -24,6 +24,15 @@
 
 namespace nix {
 
+unsigned int WindowLogSetting::parse(const std::string & str) const
+{
+    auto n = BaseSetting<unsigned int>::parse(str);
+    if (n && (n < CompressionOptions::minWindowLog || n > CompressionOptions::maxWindowLog))
+        throw UsageError("setting '%s' must be 0 or between %d and %d",
+            name, CompressionOptions::minWindowLog, CompressionOptions::maxWindowLog);
+    return n;
+}
+
 BinaryCacheStore::BinaryCacheStore(const Params & params)
     : BinaryCacheStoreConfig(params)
     , Store(params)
@@ -147,7 +156,13 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
     {
     FdSink fileSink(fdTemp.get());
     TeeSink teeSinkCompressed { fileSink, fileHashSink };
-    auto compressionSink = makeCompressionSink(compression, teeSinkCompressed, parallelCompression, compressionLevel);
+    auto compressionSink = makeCompressionSink(compression, teeSinkCompressed, {
+        .level = compressionLevel,
+        .parallel = parallelCompression,
+        .threads = compressionThreads,
+        .windowLog = compressionWindowLog,
+        .longDistanceMatching = compressionLongDistanceMatching,
+    });
     TeeSink teeSinkUncompressed { *compressionSink, narHashSink };
     TeeSource teeSource { narSource, teeSinkUncompressed };
     narAccessor = makeNarAccessor(teeSource);
@@ -397,7 +412,9 @@ void BinaryCacheStore::narFromPath(const StorePath & storePath, Sink & sink)
     LengthSink narSize;
     TeeSink tee { sink, narSize };
 
-    auto decompressor = makeDecompressionSink(info->compression, tee);
+    /* Decompress on a separate thread, so that fetching the NAR,
+       decompressing it and unpacking it overlap. */
+    auto decompressor = makeDecompressionSink(info->compression, tee, true);
 
     try {
         getFile(info->url, *decompressor);
@@ -13,6 +13,25 @@ namespace nix {
 
 struct NarInfo;
 
+/**
+ * A `compression-window-log` value, which is checked when it is set
+ * rather than when compressing.
+ */
+struct WindowLogSetting : public BaseSetting<unsigned int>
+{
+    WindowLogSetting(Config * options,
+        unsigned int def,
+        const std::string & name,
+        const std::string & description,
+        const std::set<std::string> & aliases = {})
+        : BaseSetting<unsigned int>(def, true, name, description, aliases)
+    {
+        options->addSetting(this);
+    }
+
+    unsigned int parse(const std::string & str) const override;
+};
+
 struct BinaryCacheStoreConfig : virtual StoreConfig
 {
     using StoreConfig::StoreConfig;
@@ -38,6 +57,27 @@ struct BinaryCacheStoreConfig : virtual StoreConfig
     const Setting<bool> parallelCompression{this, false, "parallel-compression",
         "Enable multi-threaded compression of NARs. This is currently only available for `xz` and `zstd`."};
 
+    const Setting<unsigned int> compressionThreads{this, 0, "compression-threads",
+        R"(
+          The number of threads to use if `parallel-compression` is enabled.
+          `0` means the number of CPU cores.
+        )"};
+
+    const WindowLogSetting compressionWindowLog{this, 0, "compression-window-log",
+        R"(
+          The base-2 logarithm of the window size used when compressing NARs with `zstd`,
+          or of the dictionary size with `xz`. Larger windows find more redundancy in large
+          NARs at the cost of memory. `0` means the default of the compression level.
+          Otherwise it must be between 12 (4 KiB) and 27 (128 MiB), the largest window
+          that `zstd` decoders, including Nix's, accept by default.
+        )"};
+
+    const Setting<bool> compressionLongDistanceMatching{this, false, "compression-long-distance-matching",
+        R"(
+          Whether `zstd` should search the whole window for matches, which improves
+          compression of large NARs with distant repetitions.
+        )"};
+
     const Setting<int> compressionLevel{this, -1, "compression-level",
         R"(
           The *preset level* to be used when compressing NARs.
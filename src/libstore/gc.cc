@@ -809,12 +809,13 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                unreachable. We don't use readDirectory() here so that
                GCing can start faster. */
             auto linksName = baseNameOf(linksDir);
+            auto reflinksName = baseNameOf(reflinksDir);
             Paths entries;
             struct dirent * dirent;
             while (errno = 0, dirent = readdir(dir.get())) {
                 checkInterrupt();
                 std::string name = dirent->d_name;
-                if (name == "." || name == ".." || name == linksName) continue;
+                if (name == "." || name == ".." || name == linksName || name == reflinksName) continue;
 
                 if (auto storePath = maybeParseStorePath(storeDir + "/" + name))
                     deleteReferrersClosure(*storePath);
@@ -888,6 +889,42 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
         printInfo("note: currently hard linking saves %.2f MiB",
             ((unsharedSize - actualSize - overhead) / (1024.0 * 1024.0)));
+
+        /* Entries in /nix/store/.reflinks share their data with store
+           files instead of being hard links to them, so they are in
+           use as long as their data is still shared. */
+        AutoCloseDir reflinksDir_(opendir(reflinksDir.c_str()));
+        if (!reflinksDir_) throw SysError("opening directory '%1%'", reflinksDir);
+
+        int64_t reflinkedSize = 0;
+
+        while (errno = 0, dirent = readdir(reflinksDir_.get())) {
+            checkInterrupt();
+            std::string name = dirent->d_name;
+            if (name == "." || name == "..") continue;
+            Path path = reflinksDir + "/" + name;
+
+            /* Empty files hold no data, and may be clones that
+               optimisePath() is still creating. */
+            auto st = lstat(path);
+            if (!st.st_size) continue;
+
+            if (reflinkInUse(path)) {
+                reflinkedSize += st.st_size;
+                continue;
+            }
+
+            printMsg(lvlTalkative, "deleting unused reflink '%1%'", path);
+
+            if (unlink(path.c_str()) == -1)
+                throw SysError("deleting '%1%'", path);
+
+            /* As above, deletePath() already accounted for the data. */
+        }
+
+        if (reflinkedSize)
+            printInfo("note: currently %.2f MiB of file data is shared using reflinks",
+                reflinkedSize / (1024.0 * 1024.0));
     }
 
     /* While we're at it, vacuum the database. */
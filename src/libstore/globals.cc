@@ -297,6 +297,33 @@ template<> void BaseSetting<SandboxMode>::convertToArg(Args & args, const std::s
     });
 }
 
+NLOHMANN_JSON_SERIALIZE_ENUM(OptimiseMode, {
+    {OptimiseMode::omHardlink, "hardlink"},
+    {OptimiseMode::omReflink, "reflink"},
+    {OptimiseMode::omAuto, "auto"},
+});
+
+template<> OptimiseMode BaseSetting<OptimiseMode>::parse(const std::string & str) const
+{
+    if (str == "hardlink") return omHardlink;
+    else if (str == "reflink") return omReflink;
+    else if (str == "auto") return omAuto;
+    else throw UsageError("option '%s' has invalid value '%s'", name, str);
+}
+
+template<> struct BaseSetting<OptimiseMode>::trait
+{
+    static constexpr bool appendable = false;
+};
+
+template<> std::string BaseSetting<OptimiseMode>::to_string() const
+{
+    if (value == omHardlink) return "hardlink";
+    else if (value == omReflink) return "reflink";
+    else if (value == omAuto) return "auto";
+    else unreachable();
+}
+
 unsigned int MaxBuildJobsSetting::parse(const std::string & str) const
 {
     if (str == "auto") return std::max(1U, std::thread::hardware_concurrency());
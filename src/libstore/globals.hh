@@ -16,6 +16,8 @@ namespace nix {
 
 typedef enum { smEnabled, smRelaxed, smDisabled } SandboxMode;
 
+typedef enum { omHardlink, omReflink, omAuto } OptimiseMode;
+
 struct MaxBuildJobsSetting : public BaseSetting<unsigned int>
 {
     MaxBuildJobsSetting(Config * options,
@@ -571,6 +573,39 @@ public:
           duplicate files.
         )"};
 
+    Setting<OptimiseMode> optimiseMode{
+        this, omHardlink, "optimise-mode",
+        R"(
+          How to deduplicate identical files when optimising the store
+          (see [`auto-optimise-store`](#conf-auto-optimise-store)). The
+          following values are supported:
+
+          - `hardlink` (the default): replace duplicate files with hard
+            links to a single copy in `/nix/store/.links`.
+
+          - `reflink`: make duplicate files share their data extents
+            with a single copy in `/nix/store/.reflinks`, using the
+            `FIDEDUPERANGE` ioctl. Each file keeps its own inode, so
+            this is not subject to link count limits. This requires a
+            file system that supports it, such as Btrfs or XFS, and is
+            only available on Linux. On other file systems, files are
+            not deduplicated.
+
+          - `auto`: use `reflink` on file systems that support it and
+            `hardlink` elsewhere.
+        )"};
+
+    Setting<bool> optimiseIncremental{
+        this, true, "optimise-incremental",
+        R"(
+          If set to `true` (the default), `nix-store --optimise` and `nix
+          store optimise` only process store paths that they have not
+          processed before, so their run time depends on the amount of
+          data added since the previous run rather than on the size of
+          the store. Set it to `false` to process all store paths again,
+          e.g. after changing [`optimise-mode`](#conf-optimise-mode).
+        )"};
+
     Setting<bool> envKeepDerivations{
         this, false, "keep-env-derivations",
         R"(
@@ -93,6 +93,8 @@ struct LocalStore::State::Stmts {
     SQLiteStmt QueryValidPaths;
     SQLiteStmt QueryRealisationReferences;
     SQLiteStmt AddRealisationReference;
+    SQLiteStmt QueryUnoptimisedPaths;
+    SQLiteStmt MarkPathOptimised;
 };
 
 LocalStore::LocalStore(
@@ -106,6 +108,7 @@ LocalStore::LocalStore(
     , LocalFSStore(params)
     , dbDir(stateDir + "/db")
     , linksDir(realStoreDir + "/.links")
+    , reflinksDir(realStoreDir + "/.reflinks")
     , reservedPath(dbDir + "/reserved")
     , schemaPath(dbDir + "/schema")
     , tempRootsDir(stateDir + "/temproots")
@@ -123,6 +126,7 @@ LocalStore::LocalStore(
         makeStoreWritable();
     }
     createDirs(linksDir);
+    createDirs(reflinksDir);
     Path profilesDir = stateDir + "/profiles";
     createDirs(profilesDir);
     createDirs(tempRootsDir);
@@ -333,6 +337,12 @@ LocalStore::LocalStore(
     state->stmts->QueryPathFromHashPart.create(state->db,
         "select path from ValidPaths where path >= ? limit 1;");
     state->stmts->QueryValidPaths.create(state->db, "select path from ValidPaths");
+    if (!readOnly) {
+        state->stmts->QueryUnoptimisedPaths.create(state->db,
+            "select path from ValidPaths where id not in (select id from OptimisedPaths);");
+        state->stmts->MarkPathOptimised.create(state->db,
+            "insert or ignore into OptimisedPaths (id) select id from ValidPaths where path = ?;");
+    }
     if (experimentalFeatureSettings.isEnabled(Xp::CaDerivations)) {
         state->stmts->RegisterRealisedOutput.create(state->db,
             R"(
@@ -561,6 +571,15 @@ void LocalStore::upgradeDBSchema(State & state)
         schemaMigrations.insert(migrationName);
     };
 
+    /* The paths that `optimiseStore()` has processed, so it can skip
+       them next time. A read-only store can't be optimised anyway. */
+    if (!readOnly)
+        doUpgrade(
+            "20250301-optimised-paths",
+            "create table if not exists OptimisedPaths ("
+            " id integer primary key not null,"
+            " foreign key (id) references ValidPaths(id) on delete cascade);");
+
     if (experimentalFeatureSettings.isEnabled(Xp::CaDerivations))
         doUpgrade(
             "20220326-ca-derivations",
@@ -837,6 +856,30 @@ StorePathSet LocalStore::queryAllValidPaths()
 }
 
 
+StorePathSet LocalStore::queryUnoptimisedPaths()
+{
+    return retrySQLite<StorePathSet>([&]() {
+        auto state(_state.lock());
+        auto use(state->stmts->QueryUnoptimisedPaths.use());
+        StorePathSet res;
+        while (use.next()) res.insert(parseStorePath(use.getStr(0)));
+        return res;
+    });
+}
+
+
+void LocalStore::markPathsOptimised(const StorePathSet & paths)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        SQLiteTxn txn(state->db);
+        for (auto & path : paths)
+            state->stmts->MarkPathOptimised.use()(printStorePath(path)).exec();
+        txn.commit();
+    });
+}
+
+
 void LocalStore::queryReferrers(State & state, const StorePath & path, StorePathSet & referrers)
 {
     auto useQueryReferrers(state.stmts->QueryReferrers.use()(printStorePath(path)));
@@ -1295,7 +1338,7 @@ StorePath LocalStore::addToStoreFromDump(
             auto narHash = std::pair { dumpHash, size };
             if (dumpMethod != FileSerialisationMethod::NixArchive || hashAlgo != HashAlgorithm::SHA256) {
                 HashSink narSink { HashAlgorithm::SHA256 };
-                dumpPath(realPath, narSink);
+                dumpPathParallel(realPath, narSink);
                 narHash = narSink.finish();
             }
 
@@ -1384,7 +1427,8 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
 
         printInfo("checking link hashes...");
 
-        for (auto & link : std::filesystem::directory_iterator{linksDir}) {
+        for (auto & dir : {linksDir, reflinksDir})
+        for (auto & link : std::filesystem::directory_iterator{dir}) {
             checkInterrupt();
             auto name = link.path().filename();
             printMsg(lvlTalkative, "checking contents of '%s'", name);
@@ -1417,7 +1461,7 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
 
                 auto hashSink = HashSink(info->narHash.algo);
 
-                dumpPath(Store::toRealPath(i), hashSink);
+                dumpPathParallel(Store::toRealPath(i), hashSink);
                 auto current = hashSink.finish();
 
                 if (info->narHash != nullHash && info->narHash != current.first) {
@@ -6,6 +6,7 @@
 #include "pathlocks.hh"
 #include "store-api.hh"
 #include "indirect-root-store.hh"
+#include "path-references.hh"
 #include "sync.hh"
 
 #include <chrono>
@@ -120,10 +121,18 @@ private:
 
     Sync<State> _state;
 
+    /**
+     * Whether the file systems (by device number) on which we have
+     * tried to deduplicate files support sharing extents between
+     * files. See `optimise-mode`.
+     */
+    Sync<std::map<dev_t, bool>> reflinkSupport;
+
 public:
 
     const Path dbDir;
     const Path linksDir;
+    const Path reflinksDir;
     const Path reservedPath;
     const Path schemaPath;
     const Path tempRootsDir;
@@ -266,8 +275,12 @@ public:
     /**
      * Optimise a single store path. Optionally, test the encountered
      * symlinks for corruption.
+     *
+     * @param fileHashes If given, the hashes of the files in `path`
+     * (e.g. as computed by `scanOutput()`), so that they don't have to
+     * be read again. Files missing from it are hashed as usual.
      */
-    void optimisePath(const Path & path, RepairFlag repair);
+    void optimisePath(const Path & path, RepairFlag repair, const FileHashes * fileHashes = nullptr);
 
     bool verifyStore(bool checkContents, RepairFlag repair) override;
 
@@ -389,8 +402,44 @@ private:
     typedef std::unordered_set<ino_t> InodeHash;
 
     InodeHash loadInodeHash();
+
+    /**
+     * Return the valid paths that `optimiseStore()` has not processed
+     * yet.
+     */
+    StorePathSet queryUnoptimisedPaths();
+
+    /**
+     * Record that `optimiseStore()` has processed `paths`.
+     */
+    void markPathsOptimised(const StorePathSet & paths);
+
     Strings readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash);
-    void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, InodeHash & inodeHash, RepairFlag repair);
+    void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, InodeHash & inodeHash, RepairFlag repair,
+        const FileHashes * fileHashes = nullptr, const CanonPath & relPath = CanonPath::root);
+
+    /**
+     * Make the regular file `path` share its data with `linkPath`,
+     * creating the latter if necessary.
+     *
+     * @return false if the file system does not support this.
+     */
+    bool reflinkPath(Activity * act, OptimiseStats & stats, const Path & path,
+        const struct stat & st, const std::filesystem::path & linkPath);
+
+    /**
+     * Whether the file system containing the reflinks directory
+     * supports reflinks, found by cloning a temporary file.
+     */
+    bool canReflink();
+
+    /**
+     * Whether the entry `path` in the reflinks directory still shares
+     * its data with some other file. Unlike hard links, such entries
+     * have a link count of 1, so the garbage collector asks this
+     * instead.
+     */
+    static bool reflinkInUse(const Path & path);
 
     // Internal versions that are not wrapped in retry_sqlite.
     bool isValidPath_(State & state, const StorePath & path);
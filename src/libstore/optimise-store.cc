@@ -3,6 +3,8 @@
 #include "signals.hh"
 #include "posix-fs-canonicalise.hh"
 #include "posix-source-accessor.hh"
+#include "archive.hh"
+#include "finally.hh"
 
 #include <cstdlib>
 #include <cstring>
@@ -13,6 +15,13 @@
 #include <stdio.h>
 #include <regex>
 
+#if __linux__
+# include <fcntl.h>
+# include <sys/ioctl.h>
+# include <linux/fs.h>
+# include <linux/fiemap.h>
+#endif
+
 
 namespace nix {
 
@@ -89,8 +98,251 @@ Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHa
 }
 
 
+/**
+ * Compute the NAR hashes of the small regular files and symlinks
+ * among `names` in directory `path` that `optimisePath_()` would hash,
+ * keyed by `relPath / name`. Hashing them together is considerably
+ * faster than hashing them one by one.
+ */
+static void hashSmallFiles(const Path & path, const Strings & names,
+    const CanonPath & relPath, FileHashes & hashes)
+{
+    /* Larger files gain little from being hashed together. */
+    constexpr off_t maxFileSize = 64 * 1024;
+
+    /* Bound the memory used by a batch. */
+    constexpr size_t maxBatchSize = 4 * 1024 * 1024;
+
+    std::vector<std::pair<CanonPath, std::string>> batch;
+    size_t batchSize = 0;
+
+    auto flush = [&]() {
+        std::vector<std::string_view> nars;
+        for (auto & [_, nar] : batch)
+            nars.push_back(nar);
+        auto narHashes = hashStrings(HashAlgorithm::SHA256, nars);
+        for (size_t n = 0; n < batch.size(); ++n)
+            hashes.insert_or_assign(std::move(batch[n].first), std::move(narHashes[n]));
+        batch.clear();
+        batchSize = 0;
+    };
+
+    for (auto & name : names) {
+        checkInterrupt();
+
+        auto childPath = path + "/" + name;
+        auto st = lstat(childPath);
+
+        bool small = S_ISREG(st.st_mode) && !(st.st_mode & S_IWUSR) && st.st_size <= maxFileSize;
+#if CAN_LINK_SYMLINK
+        small = small || S_ISLNK(st.st_mode);
+#endif
+        if (!small) continue;
+
+        StringSink nar;
+        dumpPath(childPath, nar);
+        batchSize += nar.s.size();
+        batch.emplace_back(relPath / name, std::move(nar.s));
+
+        if (batchSize >= maxBatchSize) flush();
+    }
+
+    flush();
+}
+
+
+#if __linux__
+
+/**
+ * Whether the error from `FICLONE` or `FIDEDUPERANGE` means that the
+ * file system cannot share data between these files at all. `EINVAL`
+ * is not included, since it can also be specific to a file (e.g. a
+ * swap file) or to the range being shared.
+ */
+static bool reflinkUnsupported(int err)
+{
+    return err == EOPNOTSUPP || err == ENOTTY || err == EXDEV || err == ENOSYS;
+}
+
+
+/**
+ * Return the physical location of the first extent of `fd` if it is
+ * shared with some other file.
+ */
+static std::optional<uint64_t> firstSharedExtent(int fd)
+{
+    alignas(struct fiemap) char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+    auto & map = *reinterpret_cast<struct fiemap *>(buf);
+    map.fm_length = FIEMAP_MAX_OFFSET;
+    map.fm_extent_count = 1;
+
+    if (ioctl(fd, FS_IOC_FIEMAP, &map) == -1 || map.fm_mapped_extents != 1)
+        return std::nullopt;
+
+    auto & extent = map.fm_extents[0];
+    if (!(extent.fe_flags & FIEMAP_EXTENT_SHARED)
+        || (extent.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED)))
+        return std::nullopt;
+
+    return extent.fe_physical;
+}
+
+#endif
+
+
+bool LocalStore::canReflink()
+{
+#if __linux__
+    std::filesystem::path src = fmt("%1%/.tmp-reflink-%2%-%3%", reflinksDir, getpid(), rand());
+    std::filesystem::path dst = src.string() + "-clone";
+
+    Finally removeTemps([&]() {
+        std::error_code ec;
+        std::filesystem::remove(src, ec);
+        std::filesystem::remove(dst, ec);
+    });
+
+    AutoCloseFD srcFd = open(src.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (!srcFd) throw SysError("creating '%1%'", src);
+    /* Use a whole block, since some file systems store tiny files
+       inline, which may not be shareable. */
+    writeFull(srcFd.get(), std::string(4096, 'x'));
+
+    AutoCloseFD dstFd = open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (!dstFd) throw SysError("creating '%1%'", dst);
+
+    if (ioctl(dstFd.get(), FICLONE, srcFd.get()) == 0)
+        return true;
+    /* New, ordinary files can't be the reason for `EINVAL` here. */
+    if (reflinkUnsupported(errno) || errno == EINVAL)
+        return false;
+    throw SysError("cloning '%1%' to '%2%'", src, dst);
+#else
+    return false;
+#endif
+}
+
+
+bool LocalStore::reflinkPath(Activity * act, OptimiseStats & stats, const Path & path,
+    const struct stat & st, const std::filesystem::path & linkPath)
+{
+#if __linux__
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) throw SysError("opening '%1%'", path);
+
+    if (!std::filesystem::exists(std::filesystem::symlink_status(linkPath))) {
+        /* Create the link as a clone of this file, so that they share
+           their data from the start. */
+        std::filesystem::path tempLink = fmt("%1%/.tmp-link-%2%-%3%", reflinksDir, getpid(), rand());
+        AutoCloseFD linkFd = open(tempLink.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+            st.st_mode & S_IXUSR ? 0700 : 0600);
+        if (!linkFd) throw SysError("creating '%1%'", tempLink);
+
+        if (ioctl(linkFd.get(), FICLONE, fd.get()) == -1) {
+            auto err = errno;
+            linkFd.close();
+            std::filesystem::remove(tempLink);
+            if (reflinkUnsupported(err)) return false;
+            if (err == EINVAL) {
+                debug("cannot clone '%1%': %2%", path, strerror(err));
+                return true;
+            }
+            throw SysError(err, "cloning '%1%' to '%2%'", path, tempLink);
+        }
+
+        linkFd.close();
+        canonicaliseTimestampAndPermissions(tempLink.string());
+        std::filesystem::rename(tempLink, linkPath);
+        return true;
+    }
+
+    auto stLink = lstat(linkPath.string());
+    if (st.st_ino == stLink.st_ino) {
+        debug("'%1%' is already linked to '%2%'", path, linkPath);
+        return true;
+    }
+
+    AutoCloseFD linkFd = open(linkPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!linkFd) throw SysError("opening '%1%'", linkPath);
+
+    /* Asking the kernel to deduplicate files that already share their
+       data is harmless, but makes it read and compare both. */
+    if (auto extent = firstSharedExtent(fd.get()); extent && extent == firstSharedExtent(linkFd.get())) {
+        debug("'%1%' already shares its data with '%2%'", path, linkPath);
+        return true;
+    }
+
+    printMsg(lvlTalkative, "deduplicating '%1%' with '%2%'", path, linkPath);
+
+    /* The kernel compares the contents before sharing them, and may
+       do only part of the range per call. */
+    alignas(struct file_dedupe_range) char buf[sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info)];
+    auto & range = *reinterpret_cast<struct file_dedupe_range *>(buf);
+
+    uint64_t offset = 0;
+    while (offset < (uint64_t) st.st_size) {
+        checkInterrupt();
+
+        memset(buf, 0, sizeof(buf));
+        range.src_offset = offset;
+        range.src_length = st.st_size - offset;
+        range.dest_count = 1;
+        range.info[0].dest_fd = fd.get();
+        range.info[0].dest_offset = offset;
+
+        auto & info = range.info[0];
+        if (ioctl(linkFd.get(), FIDEDUPERANGE, &range) == -1)
+            info.status = -errno;
+
+        if (info.status == FILE_DEDUPE_RANGE_DIFFERS) {
+            warn("'%s' and '%s' have the same hash but different contents; not deduplicating them", path, linkPath);
+            return true;
+        }
+
+        if (info.status < 0) {
+            if (reflinkUnsupported(-info.status)) return false;
+            if (info.status == -EINVAL) {
+                debug("cannot deduplicate '%1%' with '%2%': %3%", path, linkPath, strerror(EINVAL));
+                break;
+            }
+            throw SysError(-info.status, "deduplicating '%1%' with '%2%'", path, linkPath);
+        }
+
+        if (!info.bytes_deduped) break;
+        offset += info.bytes_deduped;
+    }
+
+    /* Only count what the kernel actually shared. */
+    if (offset) {
+        stats.filesLinked++;
+        stats.bytesFreed += offset;
+
+        if (act)
+            act->result(resFileLinked, offset, st.st_blocks * offset / st.st_size);
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+bool LocalStore::reflinkInUse(const Path & path)
+{
+#if __linux__
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) throw SysError("opening '%1%'", path);
+    return firstSharedExtent(fd.get()).has_value();
+#else
+    return false;
+#endif
+}
+
+
 void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
-    const Path & path, InodeHash & inodeHash, RepairFlag repair)
+    const Path & path, InodeHash & inodeHash, RepairFlag repair,
+    const FileHashes * fileHashes, const CanonPath & relPath)
 {
     checkInterrupt();
 
@@ -112,8 +364,17 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
 
     if (S_ISDIR(st.st_mode)) {
         Strings names = readDirectoryIgnoringInodes(path, inodeHash);
-        for (auto & i : names)
-            optimisePath_(act, stats, path + "/" + i, inodeHash, repair);
+        FileHashes smallFileHashes;
+        if (!fileHashes)
+            hashSmallFiles(path, names, relPath, smallFileHashes);
+        for (auto & i : names) {
+            auto childRelPath = relPath / i;
+            optimisePath_(act, stats, path + "/" + i, inodeHash, repair,
+                fileHashes ? fileHashes
+                : smallFileHashes.count(childRelPath) ? &smallFileHashes
+                : nullptr,
+                childRelPath);
+        }
         return;
     }
 
@@ -147,8 +408,12 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
 
        Also note that if `path' is a symlink, then we're hashing the
        contents of the symlink (i.e. the result of readlink()), not
-       the contents of the target (which may not even exist). */
-    Hash hash = ({
+       the contents of the target (which may not even exist).
+
+       The caller may already have computed the hash while reading the
+       file for some other purpose. */
+    const Hash * knownHash = fileHashes ? get(*fileHashes, relPath) : nullptr;
+    Hash hash = knownHash ? *knownHash : ({
         hashPath(
             {make_ref<PosixSourceAccessor>(), CanonPath(path)},
             FileSerialisationMethod::NixArchive, HashAlgorithm::SHA256).first;
@@ -159,23 +424,65 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     std::filesystem::path linkPath = std::filesystem::path{linksDir} / hash.to_string(HashFormat::Nix32, false);
 
     /* Maybe delete the link, if it has been corrupted. */
-    if (std::filesystem::exists(std::filesystem::symlink_status(linkPath))) {
-        auto stLink = lstat(linkPath.string());
+    auto checkLink = [&](const std::filesystem::path & link) {
+        if (!std::filesystem::exists(std::filesystem::symlink_status(link))) return;
+        auto stLink = lstat(link.string());
         if (st.st_size != stLink.st_size
             || (repair && hash != ({
                 hashPath(
-                    PosixSourceAccessor::createAtRoot(linkPath),
+                    PosixSourceAccessor::createAtRoot(link),
                     FileSerialisationMethod::NixArchive, HashAlgorithm::SHA256).first;
            })))
         {
-            // XXX: Consider overwriting linkPath with our valid version.
-            warn("removing corrupted link %s", linkPath);
+            // XXX: Consider overwriting the link with our valid version.
+            warn("removing corrupted link %s", link);
             warn("There may be more corrupted paths."
                  "\nYou should run `nix-store --verify --check-contents --repair` to fix them all");
-            std::filesystem::remove(linkPath);
+            std::filesystem::remove(link);
+        }
+    };
+
+    if (settings.optimiseMode != omHardlink) {
+        /* Decide per device before handling its first file, so that
+           the outcome doesn't depend on the order in which files are
+           visited. */
+        auto unsupported = [&]() {
+            if (settings.optimiseMode == omReflink)
+                warn("the file system containing '%s' does not support reflinks; not deduplicating files on it", path);
+        };
+
+        bool supported = ({
+            auto reflinkSupport_(reflinkSupport.lock());
+            auto p = get(*reflinkSupport_, st.st_dev);
+            if (!p) {
+                p = &reflinkSupport_->insert_or_assign(st.st_dev, canReflink()).first->second;
+                if (!*p) unsupported();
+            }
+            *p;
+        });
+
+        /* Empty files and symlinks have no data to share. Reflinked
+           copies live in their own directory, since the garbage
+           collector can't tell from their link count whether they are
+           still in use. */
+        if (supported && S_ISREG(st.st_mode) && st.st_size) {
+            auto reflinkPath_ = std::filesystem::path{reflinksDir} / linkPath.filename();
+            checkLink(reflinkPath_);
+            if (!reflinkPath(act, stats, path, st, reflinkPath_)) {
+                supported = false;
+                reflinkSupport.lock()->insert_or_assign(st.st_dev, false);
+                unsupported();
+            }
         }
+
+        /* Fall back to hard links where reflinks are not supported,
+           if allowed. */
+        if (supported || settings.optimiseMode == omReflink)
+            return;
     }
 
+    checkLink(linkPath);
+
     if (!std::filesystem::exists(std::filesystem::symlink_status(linkPath))) {
         /* Nope, create a hard link in the links directory. */
         try {
@@ -272,23 +579,46 @@ void LocalStore::optimiseStore(OptimiseStats & stats)
 {
     Activity act(*logger, actOptimiseStore);
 
-    auto paths = queryAllValidPaths();
-    InodeHash inodeHash = loadInodeHash();
+    /* Store paths are immutable, so there is no point in looking at
+       the ones we have already processed again. */
+    auto paths = settings.optimiseIncremental && !readOnly ? queryUnoptimisedPaths() : queryAllValidPaths();
 
     act.progress(0, paths.size());
 
+    if (paths.empty()) return;
+
+    /* Only hard links need the inode table. */
+    InodeHash inodeHash = settings.optimiseMode == omReflink ? InodeHash() : loadInodeHash();
+
     uint64_t done = 0;
 
-    for (auto & i : paths) {
-        addTempRoot(i);
-        if (!isValidPath(i)) continue; /* path was GC'ed, probably */
-        {
-            Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", printStorePath(i)));
-            optimisePath_(&act, stats, realStoreDir + "/" + std::string(i.to_string()), inodeHash, NoRepair);
+    /* Record progress in batches, so that an interrupted run doesn't
+       have to start over. */
+    StorePathSet optimised;
+    auto flush = [&]() {
+        if (!readOnly) markPathsOptimised(optimised);
+        optimised.clear();
+    };
+
+    try {
+        for (auto & i : paths) {
+            addTempRoot(i);
+            if (!isValidPath(i)) continue; /* path was GC'ed, probably */
+            {
+                Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", printStorePath(i)));
+                optimisePath_(&act, stats, realStoreDir + "/" + std::string(i.to_string()), inodeHash, NoRepair);
+            }
+            optimised.insert(i);
+            if (optimised.size() >= 1000) flush();
+            done++;
+            act.progress(done, paths.size());
         }
-        done++;
-        act.progress(done, paths.size());
+    } catch (...) {
+        flush();
+        throw;
     }
+
+    flush();
 }
 
 void LocalStore::optimiseStore()
@@ -297,17 +627,18 @@ void LocalStore::optimiseStore()
 
     optimiseStore(stats);
 
-    printInfo("%s freed by hard-linking %d files",
+    printInfo("%s freed by %s %d files",
         showBytes(stats.bytesFreed),
+        settings.optimiseMode == omHardlink ? "hard-linking" : "deduplicating",
         stats.filesLinked);
 }
 
-void LocalStore::optimisePath(const Path & path, RepairFlag repair)
+void LocalStore::optimisePath(const Path & path, RepairFlag repair, const FileHashes * fileHashes)
 {
     OptimiseStats stats;
     InodeHash inodeHash;
 
-    if (settings.autoOptimiseStore) optimisePath_(nullptr, stats, path, inodeHash, repair);
+    if (settings.autoOptimiseStore) optimisePath_(nullptr, stats, path, inodeHash, repair, fileHashes);
 }
 
 
@@ -1,6 +1,8 @@
 #include "path-references.hh"
 #include "hash.hh"
 #include "archive.hh"
+#include "posix-source-accessor.hh"
+#include "sync.hh"
 
 #include <map>
 #include <cstdlib>
@@ -55,6 +57,94 @@ std::pair<StorePathSet, HashResult> scanForReferences(
     return std::pair<StorePathSet, HashResult>(found, hash);
 }
 
+namespace {
+
+/**
+ * A `PosixSourceAccessor` that, as a side effect of serving file
+ * contents and symlink targets, computes the NAR hash of each
+ * regular file and symlink under `top`. Files may be read
+ * concurrently by `dumpPathParallel()`.
+ */
+struct FileHashingAccessor : PosixSourceAccessor
+{
+    CanonPath top;
+
+    Sync<FileHashes> fileHashes;
+
+    FileHashingAccessor(std::filesystem::path && root, CanonPath top)
+        : PosixSourceAccessor(std::move(root))
+        , top(std::move(top))
+    { }
+
+    void readFile(
+        const CanonPath & path,
+        Sink & sink,
+        std::function<void(uint64_t)> sizeCallback) override
+    {
+        /* This must produce the same NAR as `dumpPath()` on the file
+           itself. */
+        HashSink fileSink { HashAlgorithm::SHA256 };
+        fileSink << narVersionMagic1 << "(" << "type" << "regular";
+        /* Not `lstat(path)`, which isn't thread-safe. */
+        if (nix::lstat(getPhysicalPath(path)->string()).st_mode & S_IXUSR)
+            fileSink << "executable" << "";
+        fileSink << "contents";
+
+        TeeSink tee { sink, fileSink };
+        std::optional<uint64_t> size;
+        PosixSourceAccessor::readFile(path, tee, [&](uint64_t _size) {
+            size = _size;
+            fileSink << _size;
+            sizeCallback(_size);
+        });
+        assert(size);
+        writePadding(*size, fileSink);
+        fileSink << ")";
+
+        fileHashes.lock()->insert_or_assign(path.removePrefix(top), fileSink.finish().first);
+    }
+
+    std::string readLink(const CanonPath & path) override
+    {
+        auto target = PosixSourceAccessor::readLink(path);
+
+        HashSink fileSink { HashAlgorithm::SHA256 };
+        fileSink << narVersionMagic1 << "(" << "type" << "symlink" << "target" << target << ")";
+        fileHashes.lock()->insert_or_assign(path.removePrefix(top), fileSink.finish().first);
+
+        return target;
+    }
+};
+
+}
+
+OutputScan scanOutput(
+    const Path & path,
+    const StorePathSet & refs,
+    bool hashFiles)
+{
+    PathRefScanSink refsSink = PathRefScanSink::fromPaths(refs);
+    HashSink narSink { HashAlgorithm::SHA256 };
+    TeeSink sink { refsSink, narSink };
+
+    FileHashes fileHashes;
+
+    if (hashFiles) {
+        std::filesystem::path path2 = absPath(path);
+        CanonPath top { path2.relative_path().string() };
+        auto accessor = make_ref<FileHashingAccessor>(path2.root_path(), top);
+        dumpPathParallel(*accessor, top, sink);
+        fileHashes = std::move(*accessor->fileHashes.lock());
+    } else
+        dumpPathParallel(path, sink);
+
+    return OutputScan {
+        .references = refsSink.getResultPaths(),
+        .narHash = narSink.finish(),
+        .fileHashes = std::move(fileHashes),
+    };
+}
+
 StorePathSet scanForReferences(
     Sink & toTee,
     const Path & path,
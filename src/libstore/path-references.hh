@@ -3,6 +3,7 @@
 
 #include "references.hh"
 #include "path.hh"
+#include "canon-path.hh"
 
 namespace nix {
 
@@ -10,6 +11,39 @@ std::pair<StorePathSet, HashResult> scanForReferences(const Path & path, const S
 
 StorePathSet scanForReferences(Sink & toTee, const Path & path, const StorePathSet & refs);
 
+/**
+ * NAR hashes (SHA-256) of the regular files and symlinks in a file
+ * system object, keyed by their path relative to it. These are the
+ * hashes `LocalStore::optimisePath()` uses to find identical files.
+ */
+typedef std::map<CanonPath, Hash> FileHashes;
+
+/**
+ * The result of `scanOutput()`.
+ */
+struct OutputScan
+{
+    StorePathSet references;
+
+    /**
+     * SHA-256 hash and size of the NAR serialisation of the path.
+     */
+    HashResult narHash;
+
+    /**
+     * Only filled in if requested.
+     */
+    FileHashes fileHashes;
+};
+
+/**
+ * Compute everything output registration needs to know about the
+ * contents of `path` in a single traversal that reads each file
+ * once: its references (a subset of `refs`), its NAR hash and,
+ * if `hashFiles` is set, the hashes of its files.
+ */
+OutputScan scanOutput(const Path & path, const StorePathSet & refs, bool hashFiles);
+
 class PathRefScanSink : public RefScanSink
 {
     std::map<std::string, StorePath> backMap;
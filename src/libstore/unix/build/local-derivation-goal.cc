@@ -2326,6 +2326,10 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
     struct PerhapsNeedToRegister { StorePathSet refs; };
     std::map<std::string, std::variant<AlreadyRegistered, PerhapsNeedToRegister>> outputReferencesIfUnregistered;
     std::map<std::string, struct stat> outputStats;
+    /* The NAR hash and file hashes computed while scanning for
+       references. They remain valid as long as the output isn't
+       rewritten. */
+    std::map<std::string, OutputScan> outputScans;
     for (auto & [outputName, _] : drv->outputs) {
         auto scratchOutput = get(scratchOutputs, outputName);
         if (!scratchOutput)
@@ -2386,21 +2390,25 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
             discardReferences = *udr;
         }
 
-        StorePathSet references;
         if (discardReferences)
             debug("discarding references of output '%s'", outputName);
-        else {
+        else
             debug("scanning for references for output '%s' in temp location '%s'", outputName, actualPath);
 
-            /* Pass blank Sink as we are not ready to hash data at this stage. */
-            NullSink blank;
-            references = scanForReferences(blank, actualPath, referenceablePaths);
-        }
+        /* Read the output only once: along with the references, compute
+           the NAR hash and (if we're going to optimise the output) the
+           per-file hashes, which we can use below unless the output
+           needs to be rewritten. */
+        auto scan = scanOutput(
+            actualPath,
+            discardReferences ? StorePathSet {} : referenceablePaths,
+            settings.autoOptimiseStore);
 
         outputReferencesIfUnregistered.insert_or_assign(
             outputName,
-            PerhapsNeedToRegister { .refs = references });
+            PerhapsNeedToRegister { .refs = scan.references });
         outputStats.insert_or_assign(outputName, std::move(st));
+        outputScans.insert_or_assign(outputName, std::move(scan));
     }
 
     auto sortedOutputNames = topoSort(outputsToSort,
@@ -2470,10 +2478,25 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
             continue;
         auto references = *referencesOpt;
 
+        auto scan = get(outputScans, outputName);
+        assert(scan);
+
+        /* Whether the contents of the output changed since `scan` was
+           computed. */
+        bool rewritten = false;
+
+        auto narHashOfOutput = [&]() -> HashResult {
+            if (!rewritten) return scan->narHash;
+            return hashPath(
+                {getFSSourceAccessor(), CanonPath(actualPath)},
+                FileSerialisationMethod::NixArchive, HashAlgorithm::SHA256);
+        };
+
         auto rewriteOutput = [&](const StringMap & rewrites) {
             /* Apply hash rewriting if necessary. */
             if (!rewrites.empty()) {
                 debug("rewriting hashes in '%1%'; cross fingers", actualPath);
+                rewritten = true;
 
                 /* FIXME: Is this actually streaming? */
                 auto source = sinkToSource([&](Sink & nextSink) {
@@ -2579,9 +2602,7 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
             }
 
             {
-                HashResult narHashAndSize = hashPath(
-                    {getFSSourceAccessor(), CanonPath(actualPath)},
-                    FileSerialisationMethod::NixArchive, HashAlgorithm::SHA256);
+                HashResult narHashAndSize = narHashOfOutput();
                 newInfo0.narHash = narHashAndSize.first;
                 newInfo0.narSize = narHashAndSize.second;
             }
@@ -2602,9 +2623,7 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
                         std::string { scratchPath->hashPart() },
                         std::string { requiredFinalPath.hashPart() });
                 rewriteOutput(outputRewrites);
-                HashResult narHashAndSize = hashPath(
-                    {getFSSourceAccessor(), CanonPath(actualPath)},
-                    FileSerialisationMethod::NixArchive, HashAlgorithm::SHA256);
+                HashResult narHashAndSize = narHashOfOutput();
                 ValidPathInfo newInfo0 { requiredFinalPath, narHashAndSize.first };
                 newInfo0.narSize = narHashAndSize.second;
                 auto refs = rewriteRefs();
@@ -2761,7 +2780,7 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
                 debug("unreferenced input: '%1%'", worker.store.printStorePath(i));
         }
 
-        localStore.optimisePath(actualPath, NoRepair); // FIXME: combine with scanForReferences()
+        localStore.optimisePath(actualPath, NoRepair, rewritten ? nullptr : &scan->fileHashes);
         worker.markContentsGood(newInfo.path);
 
         newInfo.deriver = drvPath;
@@ -0,0 +1,143 @@
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <thread>
+
+#include "archive.hh"
+#include "file-descriptor.hh"
+#include "file-system.hh"
+#include "posix-source-accessor.hh"
+#include "source-path.hh"
+#include "strings.hh"
+
+namespace nix {
+
+static std::string dumpSerial(const Path & path)
+{
+    StringSink sink;
+    dumpPath(path, sink);
+    return std::move(sink.s);
+}
+
+static std::string dumpParallel(const Path & path)
+{
+    StringSink sink;
+    dumpPathParallel(path, sink);
+    return std::move(sink.s);
+}
+
+TEST(dumpPathParallel, sameAsDumpPath)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+
+    auto top = tmpDir + "/top";
+    createDirs(top + "/empty");
+    for (int i = 0; i < 50; ++i) {
+        auto dir = fmt("%s/dir-%d", top, i % 7);
+        createDirs(dir);
+        writeFile(fmt("%s/file-%d", dir, i), std::string(i * 1000 + i % 8, 'a' + i % 26));
+    }
+    writeFile(top + "/large", std::string(9 * 1024 * 1024 + 3, 'x'));
+    writeFile(top + "/exe", "#! /bin/sh\n");
+    chmod((top + "/exe").c_str(), 0755);
+    createSymlink("dir-1/file-1", top + "/link");
+
+    ASSERT_EQ(dumpParallel(top), dumpSerial(top));
+    ASSERT_EQ(dumpParallel(top + "/exe"), dumpSerial(top + "/exe"));
+    ASSERT_EQ(dumpParallel(top + "/link"), dumpSerial(top + "/link"));
+}
+
+TEST(dumpPathParallel, concurrentCalls)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+
+    for (int i = 0; i < 200; ++i)
+        writeFile(fmt("%s/file-%d", tmpDir, i), std::string(i * 100, 'a' + i % 26));
+
+    auto expected = dumpSerial(tmpDir);
+
+    /* Calls that find the read-ahead threads in use by others fall
+       back to dumping on their own thread. */
+    std::vector<std::thread> threads;
+    std::vector<std::string> results(16);
+    for (auto & result : results)
+        threads.emplace_back([&]() { result = dumpParallel(tmpDir); });
+    for (auto & thread : threads)
+        thread.join();
+
+    for (auto & result : results)
+        ASSERT_EQ(result, expected);
+}
+
+#ifndef _WIN32
+
+/**
+ * Restore a NAR straight from a file descriptor, which lets
+ * `restorePath` move file contents inside the kernel.
+ */
+TEST(restorePath, fromFd)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+
+    auto top = tmpDir + "/top";
+    createDirs(top + "/dir");
+    writeFile(top + "/small", "small");
+    writeFile(top + "/dir/medium", std::string(70 * 1024 + 5, 'm'));
+    writeFile(top + "/large", std::string(3 * 1024 * 1024 + 1, 'l'));
+    writeFile(top + "/exe", std::string(100 * 1024, 'e'));
+    chmod((top + "/exe").c_str(), 0755);
+    createSymlink("small", top + "/link");
+
+    auto nar = dumpSerial(top);
+    writeFile(tmpDir + "/nar", nar);
+
+    {
+        AutoCloseFD fd = open((tmpDir + "/nar").c_str(), O_RDONLY | O_CLOEXEC);
+        ASSERT_TRUE(fd);
+        FdSource source(fd.get());
+        restorePath(tmpDir + "/from-file", source);
+        ASSERT_EQ(source.read, nar.size());
+    }
+    ASSERT_EQ(dumpSerial(tmpDir + "/from-file"), nar);
+
+    {
+        Pipe pipe;
+        pipe.create();
+        std::thread writer([&]() {
+            writeFull(pipe.writeSide.get(), nar);
+            pipe.writeSide.close();
+        });
+        FdSource source(pipe.readSide.get());
+        restorePath(tmpDir + "/from-pipe", source);
+        writer.join();
+        ASSERT_EQ(source.read, nar.size());
+    }
+    ASSERT_EQ(dumpSerial(tmpDir + "/from-pipe"), nar);
+}
+
+#endif
+
+TEST(dumpPathParallel, filter)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+
+    createDirs(tmpDir + "/a");
+    writeFile(tmpDir + "/a/keep", "keep");
+    writeFile(tmpDir + "/a/drop", "drop");
+
+    PathFilter filter = [](const Path & path) { return !hasSuffix(path, "/drop"); };
+
+    StringSink serial, parallel;
+    auto [accessor, path] = PosixSourceAccessor::createAtRoot(tmpDir);
+    accessor->dumpPath(path, serial, filter);
+    dumpPathParallel(*accessor, path, parallel, filter);
+
+    ASSERT_EQ(parallel.s, serial.s);
+    ASSERT_EQ(parallel.s.find("drop"), std::string::npos);
+}
+
+}
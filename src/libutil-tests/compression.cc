@@ -59,6 +59,38 @@ namespace nix {
         ASSERT_EQ(o, str);
     }
 
+    TEST(decompress, decompressNativeCompressed) {
+        std::string str;
+        for (int i = 0; i < 100000; ++i)
+            str += std::to_string(i);
+
+        for (auto method : {"xz", "zstd", "lz4"}) {
+            auto compressed = compress(method, str);
+            ASSERT_EQ(decompress(method, compressed), str);
+
+            for (bool parallel : {false, true}) {
+                /* Feed the compressed data in small pieces. */
+                StringSink strSink;
+                auto sink = makeDecompressionSink(method, strSink, parallel);
+                for (size_t pos = 0; pos < compressed.size(); pos += 1000)
+                    (*sink)(std::string_view(compressed).substr(pos, 1000));
+                sink->finish();
+                ASSERT_EQ(strSink.s, str);
+            }
+
+            auto truncated = compressed.substr(0, compressed.size() / 2);
+            ASSERT_THROW(decompress(method, truncated), CompressionError);
+        }
+    }
+
+    TEST(decompress, decompressFrameEndingOnBufferBoundary) {
+        /* Decompresses to a multiple of the decoder's buffer size. */
+        std::string str(1024 * 1024, 'x');
+
+        for (auto method : {"xz", "zstd", "lz4"})
+            ASSERT_EQ(decompress(method, compress(method, str)), str);
+    }
+
     TEST(decompress, decompressInvalidInputThrowsCompressionError) {
         auto method = "bzip2";
         auto str = "this is a string that does not qualify as valid bzip2 data";
@@ -66,6 +98,15 @@ namespace nix {
         ASSERT_THROW(decompress(method, str), CompressionError);
     }
 
+    TEST(decompress, decompressParallelInvalidInputThrowsCompressionError) {
+        StringSink strSink;
+        auto sink = makeDecompressionSink("zstd", strSink, true);
+        ASSERT_THROW({
+            (*sink)("this is a string that does not qualify as valid zstd data");
+            sink->finish();
+        }, CompressionError);
+    }
+
     /* ----------------------------------------------------------------------------
      * compression sinks
      * --------------------------------------------------------------------------*/
@@ -93,4 +134,45 @@ namespace nix {
         ASSERT_STREQ(strSink.s.c_str(), inputString);
     }
 
+    TEST(makeCompressionSink, compressWithOptions) {
+        std::string input;
+        for (int i = 0; input.size() < 1024 * 1024; ++i)
+            input += std::to_string(i * 7919 % 100003) + (i % 3 ? " " : "\n");
+
+        for (auto method : {"xz", "zstd"}) {
+            for (auto & options : {
+                CompressionOptions{},
+                CompressionOptions{.level = 1, .parallel = true, .threads = 4},
+                CompressionOptions{.parallel = true, .windowLog = 20, .longDistanceMatching = true},
+            }) {
+                StringSink compressed;
+                auto sink = makeCompressionSink(method, compressed, options);
+                (*sink)(input);
+                sink->finish();
+
+                ASSERT_LT(compressed.s.size(), input.size());
+                ASSERT_EQ(decompress(method, compressed.s), input);
+            }
+        }
+    }
+
+    TEST(makeCompressionSink, windowLogBounds) {
+        std::string input(1024 * 1024, 'x');
+
+        /* Our own decoder must accept the largest window. */
+        for (auto [method, windowLog] : {std::pair{"xz", 12U}, {"zstd", 12U}, {"zstd", 27U}}) {
+            StringSink compressed;
+            auto sink = makeCompressionSink(method, compressed, {.windowLog = windowLog});
+            (*sink)(input);
+            sink->finish();
+            ASSERT_EQ(decompress(method, compressed.s), input);
+        }
+
+        for (auto method : {"xz", "zstd"})
+            for (auto windowLog : {11U, 28U}) {
+                StringSink compressed;
+                ASSERT_THROW(makeCompressionSink(method, compressed, {.windowLog = windowLog}), CompressionError);
+            }
+    }
+
 }
@@ -2,6 +2,7 @@
 
 #include <gtest/gtest.h>
 
+#include "finally.hh"
 #include "hash.hh"
 
 namespace nix {
@@ -52,6 +53,117 @@ private:
                 "blake3:83a2de1ee6f4e6ab686889248f4ec0cf4cc5709446a682ffd1cbb4d6165181e2");
     }
 
+    /**
+     * The input of the official BLAKE3 test vectors, which repeats the
+     * bytes 0 to 250.
+     */
+    static std::string blake3TestInput(size_t size)
+    {
+        std::string s(size, 0);
+        for (size_t i = 0; i < size; ++i)
+            s[i] = i % 251;
+        return s;
+    }
+
+    TEST_F(BLAKE3HashTest, testKnownBLAKE3Hashes4) {
+        // values taken from: https://github.com/BLAKE3-team/BLAKE3/blob/master/test_vectors/test_vectors.json
+        /* These cover inputs of up to 8 chunks of 1024 bytes, with
+           and without a partial last chunk. */
+        std::pair<size_t, std::string> vectors[] = {
+            {0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262"},
+            {1, "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213"},
+            {2, "7b7015bb92cf0b318037702a6cdd81dee41224f734684c2c122cd6359cb1ee63"},
+            {3, "e1be4d7a8ab5560aa4199eea339849ba8e293d55ca0a81006726d184519e647f"},
+            {4, "f30f5ab28fe047904037f77b6da4fea1e27241c5d132638d8bedce9d40494f32"},
+            {5, "b40b44dfd97e7a84a996a91af8b85188c66c126940ba7aad2e7ae6b385402aa2"},
+            {6, "06c4e8ffb6872fad96f9aaca5eee1553eb62aed0ad7198cef42e87f6a616c844"},
+            {7, "3f8770f387faad08faa9d8414e9f449ac68e6ff0417f673f602a646a891419fe"},
+            {8, "2351207d04fc16ade43ccab08600939c7c1fa70a5c0aaca76063d04c3228eaeb"},
+            {63, "e9bc37a594daad83be9470df7f7b3798297c3d834ce80ba85d6e207627b7db7b"},
+            {64, "4eed7141ea4a5cd4b788606bd23f46e212af9cacebacdc7d1f4c6dc7f2511b98"},
+            {65, "de1e5fa0be70df6d2be8fffd0e99ceaa8eb6e8c93a63f2d8d1c30ecb6b263dee"},
+            {127, "d81293fda863f008c09e92fc382a81f5a0b4a1251cba1634016a0f86a6bd640d"},
+            {128, "f17e570564b26578c33bb7f44643f539624b05df1a76c81f30acd548c44b45ef"},
+            {129, "683aaae9f3c5ba37eaaf072aed0f9e30bac0865137bae68b1fde4ca2aebdcb12"},
+            {1023, "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11"},
+            {1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7"},
+            {1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444"},
+            {2048, "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a"},
+            {2049, "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030"},
+            {3072, "b98cb0ff3623be03326b373de6b9095218513e64f1ee2edd2525c7ad1e5cffd2"},
+            {3073, "7124b49501012f81cc7f11ca069ec9226cecb8a2c850cfe644e327d22d3e1cd3"},
+            {4096, "015094013f57a5277b59d8475c0501042c0b642e531b0a1c8f58d2163229e969"},
+            {4097, "9b4052b38f1c5fc8b1f9ff7ac7b27cd242487b3d890d15c96a1c25b8aa0fb995"},
+            {5120, "9cadc15fed8b5d854562b26a9536d9707cadeda9b143978f319ab34230535833"},
+            {5121, "628bd2cb2004694adaab7bbd778a25df25c47b9d4155a55f8fbd79f2fe154cff"},
+            {6144, "3e2e5b74e048f3add6d21faab3f83aa44d3b2278afb83b80b3c35164ebeca205"},
+            {6145, "f1323a8631446cc50536a9f705ee5cb619424d46887f3c376c695b70e0f0507f"},
+            {7168, "61da957ec2499a95d6b8023e2b0e604ec7f6b50e80a9678b89d2628e99ada77a"},
+            {7169, "a003fc7a51754a9b3c7fae0367ab3d782dccf28855a03d435f8cfe74605e7817"},
+            {8192, "aae792484c8efe4f19e2ca7d371d8c467ffb10748d8a5a1ae579948f718a2a63"},
+            {8193, "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b"},
+            {16384, "f875d6646de28985646f34ee13be9a576fd515f76b5b0a26bb324735041ddde4"},
+            {31744, "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47"},
+            {102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085"},
+        };
+        for (auto & [size, hash] : vectors)
+            ASSERT_EQ(hashString(HashAlgorithm::BLAKE3, blake3TestInput(size), mockXpSettings).to_string(HashFormat::Base16, false), hash)
+                << "input size " << size;
+    }
+
+    /**
+     * A `HashSink` that hashes each write on a fixed number of threads.
+     */
+    struct ThreadedHashSink : HashSink
+    {
+        ThreadedHashSink(unsigned int threads)
+            : HashSink(HashAlgorithm::BLAKE3)
+        {
+            this->threads = threads;
+        }
+    };
+
+    TEST_F(BLAKE3HashTest, testKnownBLAKE3HashesThreaded) {
+        /* Computed with a straightforward implementation of the
+           specification, for inputs around the 256 KiB per thread
+           below which no threads are used, and beyond the 16 MiB that
+           are hashed in one batch. */
+        std::pair<size_t, std::string> vectors[] = {
+            {524287, "f73390a9be0df966471208839aeb0402a93a45e056fa02998b6eee97bf96a04e"},
+            {524288, "b467afa334cd7dedd76e3a9a4b0e8a5ed278713f2f4e220a682aa30c7fcd140b"},
+            {524289, "7978ac1ee80f7f7c115d25551f9c54cb3a2974cfcb8f5ab93de706350d143286"},
+            {1048576, "74cb441fd087764ca9c3694da742ebe30cbeb3060a17009ca81825c7a8d10343"},
+            {3145745, "26003c63117013de5d02be76e5e32a2f75bfbc075f17180fd5f9f0b4752d2bfe"},
+            {16782341, "c3599e71f2b6ddf4095aa3b72292bfb262842a37803024f71696de34bb2812cf"},
+        };
+        /* `HashSink` checks the global settings. */
+        auto & features = experimentalFeatureSettings.experimentalFeatures.get();
+        bool enabled = !features.insert(Xp::BLAKE3Hashes).second;
+        Finally restoreFeatures([&]() {
+            if (!enabled) features.erase(Xp::BLAKE3Hashes);
+        });
+
+        for (auto & [size, hash] : vectors) {
+            auto input = blake3TestInput(size);
+
+            ASSERT_EQ(hashString(HashAlgorithm::BLAKE3, input, mockXpSettings).to_string(HashFormat::Base16, false), hash)
+                << "input size " << size;
+
+            /* Writes that don't start or end on a chunk boundary. */
+            for (unsigned int threads : {1, 2, 4, 64}) {
+                ThreadedHashSink sink(threads);
+                size_t pos = 0;
+                for (size_t n = 0; pos < size; ++n) {
+                    auto piece = std::min(size - pos, n % 2 ? size_t(1000) : size / 3 + 1);
+                    sink({input.data() + pos, piece});
+                    pos += piece;
+                }
+                ASSERT_EQ(sink.finish().first.to_string(HashFormat::Base16, false), hash)
+                    << "input size " << size << ", " << threads << " threads";
+            }
+        }
+    }
+
     TEST(hashString, testKnownMD5Hashes1) {
         // values taken from: https://tools.ietf.org/html/rfc1321
         auto s1 = "";
@@ -117,6 +229,54 @@ private:
                 "c7d329eeb6dd26545e96e55b874be909");
     }
 
+    /* ----------------------------------------------------------------------------
+     * hashStrings
+     * --------------------------------------------------------------------------*/
+
+    TEST(hashStrings, sameAsHashString) {
+        /* Different sizes in a different order, so that messages with
+           different numbers of blocks are hashed together. */
+        std::vector<std::string> inputs;
+        for (size_t i = 0; i < 50; ++i)
+            inputs.push_back(std::string((i * 37) % 300, 'a' + i % 26));
+
+        std::vector<std::string_view> views(inputs.begin(), inputs.end());
+
+        for (auto ha : {HashAlgorithm::SHA256, HashAlgorithm::SHA512, HashAlgorithm::SHA1}) {
+            auto hashes = hashStrings(ha, views);
+            ASSERT_EQ(hashes.size(), inputs.size());
+            for (size_t i = 0; i < inputs.size(); ++i)
+                ASSERT_EQ(hashes[i], hashString(ha, inputs[i]));
+        }
+
+        ASSERT_TRUE(hashStrings(HashAlgorithm::SHA256, {}).empty());
+    }
+
+    TEST(hashStrings, paddingAndCounts) {
+        /* Messages of 55 bytes are the longest whose padding fits in
+           their last block, and those of 64 bytes the shortest that
+           need a block of padding only. */
+        std::vector<std::string> inputs;
+        for (size_t size = 55; size <= 64; ++size)
+            inputs.push_back(std::string(size, 'a' + size % 26));
+        for (size_t size = 119; size <= 128; ++size)
+            inputs.push_back(std::string(size, 'A' + size % 26));
+        inputs.push_back("");
+
+        /* Any number of messages, each in the right place. */
+        for (size_t count = 1; count <= 2 * inputs.size(); ++count) {
+            std::vector<std::string_view> views;
+            for (size_t i = 0; i < count; ++i)
+                views.push_back(inputs[i % inputs.size()]);
+
+            auto hashes = hashStrings(HashAlgorithm::SHA256, views);
+            ASSERT_EQ(hashes.size(), count);
+            for (size_t i = 0; i < count; ++i)
+                ASSERT_EQ(hashes[i], hashString(HashAlgorithm::SHA256, views[i]))
+                    << count << " messages, size " << views[i].size();
+        }
+    }
+
     /* ----------------------------------------------------------------------------
      * parseHashFormat, parseHashFormatOpt, printHashFormat
      * --------------------------------------------------------------------------*/
@@ -0,0 +1,135 @@
+#include "thread-pool.hh"
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    /* ----------------------------------------------------------------------------
+     * ThreadPool
+     * --------------------------------------------------------------------------*/
+
+    TEST(ThreadPool, processesNestedItems) {
+        /* Many threads and many tiny items, to exercise the queues
+           under contention. */
+        ThreadPool pool(64);
+        std::atomic<size_t> done{0};
+
+        std::function<void(size_t)> work = [&](size_t depth) {
+            done++;
+            if (depth < 4)
+                for (int i = 0; i < 8; ++i)
+                    pool.enqueue(std::bind(work, depth + 1));
+        };
+
+        for (int i = 0; i < 16; ++i)
+            pool.enqueue(std::bind(work, 0));
+
+        pool.process();
+
+        ASSERT_EQ(done, 16 * (1 + 8 + 64 + 512 + 4096));
+    }
+
+    TEST(ThreadPool, propagatesExceptions) {
+        ThreadPool pool(4);
+
+        try {
+            for (int i = 0; i < 100; ++i)
+                pool.enqueue([i]() { if (i == 42) throw Error("item %d failed", i); });
+        } catch (ThreadPoolShutDown &) {
+            /* Workers may already have hit the failing item. */
+        }
+
+        ASSERT_THROW(pool.process(), Error);
+        ASSERT_THROW(pool.enqueue([]() {}), ThreadPoolShutDown);
+    }
+
+    TEST(ThreadPool, returnsResults) {
+        ThreadPool pool(4);
+
+        std::vector<std::future<int>> results;
+        for (int i = 0; i < 100; ++i)
+            results.push_back(pool.enqueueWithResult([i]() { return i * i; }));
+        auto failed = pool.enqueueWithResult([]() -> int { throw Error("failed"); });
+
+        pool.process();
+
+        for (int i = 0; i < 100; ++i)
+            ASSERT_EQ(results[i].get(), i * i);
+        ASSERT_THROW(failed.get(), Error);
+    }
+
+    TEST(ThreadPool, startsHigherPrioritiesFirst) {
+        /* With a single thread, items run in order of priority, and
+           otherwise in the order they were enqueued. */
+        ThreadPool pool(1);
+        std::vector<std::string> order;
+
+        pool.enqueue([&]() { order.push_back("low"); }, ThreadPool::Priority::Low);
+        pool.enqueue([&]() { order.push_back("normal 1"); });
+        pool.enqueue([&]() {
+            order.push_back("high");
+            pool.enqueue([&]() { order.push_back("normal 3"); });
+        }, ThreadPool::Priority::High);
+        pool.enqueue([&]() { order.push_back("normal 2"); });
+
+        pool.process();
+
+        ASSERT_EQ(order, (std::vector<std::string>{"high", "normal 1", "normal 2", "normal 3", "low"}));
+    }
+
+    /* ----------------------------------------------------------------------------
+     * processGraph
+     * --------------------------------------------------------------------------*/
+
+    TEST(processGraph, respectsDependencies) {
+        /* A large synthetic DAG in which node i depends on a few
+           nodes with a lower number. */
+        const size_t nrNodes = 100000;
+
+        std::set<size_t> nodes;
+        for (size_t i = 0; i < nrNodes; ++i)
+            nodes.insert(i);
+
+        auto edges = [](size_t i) {
+            std::set<size_t> refs;
+            for (size_t step : {1, 7, 1000})
+                if (i >= step) refs.insert(i - step);
+            /* Self-references and unknown nodes are ignored. */
+            refs.insert(i);
+            refs.insert(nrNodes + i);
+            return refs;
+        };
+
+        std::vector<std::atomic<bool>> done(nrNodes);
+        std::atomic<size_t> nrProcessed{0};
+
+        processGraph<size_t>(
+            nodes,
+            edges,
+            [&](const size_t & i) {
+                for (auto ref : edges(i))
+                    if (ref != i && ref < nrNodes && !done[ref])
+                        throw Error("node %d processed before its dependency %d", i, ref);
+                done[i] = true;
+                nrProcessed++;
+            });
+
+        ASSERT_EQ(nrProcessed, nrNodes);
+    }
+
+    TEST(processGraph, detectsCycles) {
+        std::set<int> nodes{1, 2, 3, 4};
+
+        std::set<int> processed;
+        std::mutex mutex;
+
+        ASSERT_THROW(
+            processGraph<int>(
+                nodes,
+                [](const int & i) { return i == 4 ? std::set<int>{} : std::set<int>{i % 3 + 1}; },
+                [&](const int & i) { std::lock_guard<std::mutex> lock(mutex); processed.insert(i); }),
+            Error);
+
+        ASSERT_EQ(processed, std::set<int>{4});
+    }
+
+}
@@ -2,6 +2,8 @@
 #include <algorithm>
 #include <vector>
 #include <map>
+#include <deque>
+#include <thread>
 
 #include <strings.h> // for strcasecmp
 
@@ -10,7 +12,9 @@
 #include "posix-source-accessor.hh"
 #include "source-path.hh"
 #include "file-system.hh"
+#include "finally.hh"
 #include "signals.hh"
+#include "sync.hh"
 
 namespace nix {
 
@@ -24,6 +28,21 @@ struct ArchiveSettings : Config
         #endif
         "use-case-hack",
         "Whether to enable a macOS-specific hack for dealing with file name case collisions."};
+
+    Setting<unsigned int> narDumpThreads{this, 0, "nar-dump-threads",
+        R"(
+          The number of threads used when serialising a directory tree
+          to a Nix archive, e.g. to compute its hash when adding it to
+          the store, verifying it or registering a build output. One
+          thread walks the tree, the others read files ahead of the
+          thread producing the archive. `0` means the number of CPU
+          cores, up to 8. `1` disables this.
+
+          This limits the threads of all archives that are serialised
+          concurrently (e.g. by several daemon connections or
+          substitutions): archives started while the threads are in use
+          by others are serialised by the calling thread alone.
+        )"};
 };
 
 static ArchiveSettings archiveSettings;
@@ -33,47 +52,42 @@ static GlobalConfig::Register rArchiveSettings(&archiveSettings);
 PathFilter defaultPathFilter = [](const Path &) { return true; };
 
 
-void SourceAccessor::dumpPath(
+/**
+ * The traversal behind `SourceAccessor::dumpPath()`. Everything
+ * following the "contents" tag of a regular file (i.e. its size,
+ * contents and padding) is left to `dumpContents`.
+ */
+static void dumpPathWith(
+    SourceAccessor & accessor,
     const CanonPath & path,
     Sink & sink,
-    PathFilter & filter)
+    PathFilter & filter,
+    std::function<void(const CanonPath & path)> dumpContents)
 {
-    auto dumpContents = [&](const CanonPath & path)
-    {
-        sink << "contents";
-        std::optional<uint64_t> size;
-        readFile(path, sink, [&](uint64_t _size)
-        {
-            size = _size;
-            sink << _size;
-        });
-        assert(size);
-        writePadding(*size, sink);
-    };
-
     std::function<void(const CanonPath & path)> dump;
 
     dump = [&](const CanonPath & path) {
         checkInterrupt();
 
-        auto st = lstat(path);
+        auto st = accessor.lstat(path);
 
         sink << "(";
 
-        if (st.type == tRegular) {
+        if (st.type == SourceAccessor::tRegular) {
             sink << "type" << "regular";
             if (st.isExecutable)
                 sink << "executable" << "";
+            sink << "contents";
             dumpContents(path);
         }
 
-        else if (st.type == tDirectory) {
+        else if (st.type == SourceAccessor::tDirectory) {
             sink << "type" << "directory";
 
             /* If we're on a case-insensitive system like macOS, undo
                the case hack applied by restorePath(). */
             std::map<std::string, std::string> unhacked;
-            for (auto & i : readDirectory(path))
+            for (auto & i : accessor.readDirectory(path))
                 if (archiveSettings.useCaseHack) {
                     std::string name(i.first);
                     size_t pos = i.first.find(caseHackSuffix);
@@ -96,8 +110,8 @@ void SourceAccessor::dumpPath(
                 }
         }
 
-        else if (st.type == tSymlink)
-            sink << "type" << "symlink" << "target" << readLink(path);
+        else if (st.type == SourceAccessor::tSymlink)
+            sink << "type" << "symlink" << "target" << accessor.readLink(path);
 
         else throw Error("file '%s' has an unsupported type", path);
 
@@ -109,6 +123,252 @@ void SourceAccessor::dumpPath(
 }
 
 
+void SourceAccessor::dumpPath(
+    const CanonPath & path,
+    Sink & sink,
+    PathFilter & filter)
+{
+    dumpPathWith(*this, path, sink, filter, [&](const CanonPath & path)
+    {
+        std::optional<uint64_t> size;
+        readFile(path, sink, [&](uint64_t _size)
+        {
+            size = _size;
+            sink << _size;
+        });
+        assert(size);
+        writePadding(*size, sink);
+    });
+}
+
+
+void dumpPathParallel(
+    SourceAccessor & accessor,
+    const CanonPath & path,
+    Sink & sink,
+    PathFilter & filter)
+{
+    size_t threads = archiveSettings.narDumpThreads;
+    if (!threads)
+        threads = std::min(std::max(std::thread::hardware_concurrency(), 1U), 8U);
+
+    /* Read-ahead doesn't buy anything for a single file. */
+    if (threads <= 1 || accessor.lstat(path).type != SourceAccessor::tDirectory) {
+        accessor.dumpPath(path, sink, filter);
+        return;
+    }
+
+    /* Take as many threads as the other calls have left over, so that
+       concurrent calls don't multiply them. Read-ahead needs at least
+       a walker and one reader. */
+    static Sync<size_t> threadsInUse;
+
+    {
+        auto inUse(threadsInUse.lock());
+        threads = *inUse < threads ? threads - *inUse : 0;
+        if (threads < 2) threads = 0;
+        *inUse += threads;
+    }
+
+    Finally releaseThreads([&]() {
+        *threadsInUse.lock() -= threads;
+    });
+
+    if (!threads) {
+        accessor.dumpPath(path, sink, filter);
+        return;
+    }
+
+    /* Upper bound on the file contents that have been read ahead
+       but not yet written to `sink`. */
+    constexpr uint64_t maxBytesInFlight = 64 * 1024 * 1024;
+
+    /* Files larger than this are not read ahead, but streamed to
+       `sink` by the calling thread. */
+    constexpr uint64_t maxReadAhead = 8 * 1024 * 1024;
+
+    /* Upper bound on the number of files the walker may get ahead of
+       the calling thread. */
+    constexpr size_t maxQueued = 65536;
+
+    /* The NAR is cut into items, each consisting of the NAR data up to
+       and including the "contents" tag of a regular file, and that
+       file. The last item has no file. */
+    struct Item
+    {
+        std::string framing;
+        std::optional<CanonPath> path;
+        /* The size reported by lstat(), only used to decide whether
+           and when to read the file ahead. */
+        uint64_t sizeHint = 0;
+        std::optional<std::string> contents;
+    };
+
+    struct State
+    {
+        /* Items in NAR order; `base` is the index of the first. */
+        std::deque<Item> items;
+        size_t base = 0;
+        size_t nextToRead = 0;
+        uint64_t bytesInFlight = 0;
+        bool walkDone = false;
+        bool quit = false;
+        std::exception_ptr exception;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+
+    auto fail = [&](std::exception_ptr e) {
+        auto state(state_.lock());
+        if (!state->exception) state->exception = e;
+        state->quit = true;
+        wakeup.notify_all();
+    };
+
+    struct Quit { };
+
+    auto walk = [&]() {
+        try {
+            StringSink framing;
+
+            auto push = [&](Item && item) {
+                auto state(state_.lock());
+                while (state->items.size() >= maxQueued && !state->quit)
+                    state.wait(wakeup);
+                if (state->quit) throw Quit();
+                state->items.push_back(std::move(item));
+                wakeup.notify_all();
+            };
+
+            dumpPathWith(accessor, path, framing, filter, [&](const CanonPath & path) {
+                push(Item {
+                    .framing = std::move(framing.s),
+                    .path = path,
+                    .sizeHint = accessor.lstat(path).fileSize.value_or(0),
+                });
+                framing.s.clear();
+            });
+
+            push(Item { .framing = std::move(framing.s) });
+
+            auto state(state_.lock());
+            state->walkDone = true;
+            wakeup.notify_all();
+        } catch (Quit &) {
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    };
+
+    auto readAhead = [&]() {
+        try {
+            while (true) {
+                size_t index;
+                CanonPath path = CanonPath::root;
+                {
+                    auto state(state_.lock());
+                    while (true) {
+                        if (state->quit) return;
+                        state->nextToRead = std::max(state->nextToRead, state->base);
+                        if (state->nextToRead < state->base + state->items.size()) {
+                            auto & item = state->items[state->nextToRead - state->base];
+                            if (!item.path || item.sizeHint > maxReadAhead) {
+                                state->nextToRead++;
+                                continue;
+                            }
+                            if (!state->bytesInFlight || state->bytesInFlight + item.sizeHint <= maxBytesInFlight) {
+                                index = state->nextToRead++;
+                                path = *item.path;
+                                state->bytesInFlight += item.sizeHint;
+                                break;
+                            }
+                        } else if (state->walkDone)
+                            return;
+                        state.wait(wakeup);
+                    }
+                }
+
+                auto contents = accessor.readFile(path);
+
+                auto state(state_.lock());
+                /* The calling thread waits for this item, so it cannot
+                   have been consumed yet. */
+                assert(index >= state->base);
+                state->items[index - state->base].contents = std::move(contents);
+                wakeup.notify_all();
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    };
+
+    std::vector<std::thread> workers;
+
+    Finally joinWorkers([&]() {
+        {
+            auto state(state_.lock());
+            state->quit = true;
+            wakeup.notify_all();
+        }
+        for (auto & thr : workers)
+            thr.join();
+    });
+
+    workers.emplace_back(walk);
+    for (size_t n = 1; n < threads; ++n)
+        workers.emplace_back(readAhead);
+
+    while (true) {
+        checkInterrupt();
+
+        Item item;
+        {
+            auto state(state_.lock());
+            while (true) {
+                if (state->exception)
+                    std::rethrow_exception(state->exception);
+                if (!state->items.empty()) {
+                    auto & front = state->items.front();
+                    if (!front.path || front.sizeHint > maxReadAhead || front.contents) break;
+                }
+                state.wait(wakeup);
+            }
+            item = std::move(state->items.front());
+            state->items.pop_front();
+            state->base++;
+            if (item.contents)
+                state->bytesInFlight -= item.sizeHint;
+            wakeup.notify_all();
+        }
+
+        sink(item.framing);
+
+        if (!item.path) break;
+
+        uint64_t size;
+        if (item.contents) {
+            size = item.contents->size();
+            sink << size;
+            sink(*item.contents);
+        } else
+            accessor.readFile(*item.path, sink, [&](uint64_t _size)
+            {
+                size = _size;
+                sink << _size;
+            });
+        writePadding(size, sink);
+    }
+}
+
+
+void dumpPathParallel(const Path & path, Sink & sink, PathFilter & filter)
+{
+    auto path2 = PosixSourceAccessor::createAtRoot(path);
+    dumpPathParallel(*path2.accessor, path2.path, sink, filter);
+}
+
+
 time_t dumpPathAndGetMtime(const Path & path, Sink & sink, PathFilter & filter)
 {
     auto path2 = PosixSourceAccessor::createAtRoot(path);
@@ -142,6 +402,19 @@ static void parseContents(CreateRegularFileSink & sink, Source & source)
     sink.preallocateContents(size);
 
     uint64_t left = size;
+
+    /* If the NAR comes straight from a file descriptor, pass on what
+       has already been buffered and let the kernel move the rest, if
+       it can. Small files are not worth the extra system calls. */
+    if (auto fdSource = dynamic_cast<FdSource *>(&source); fdSource && left >= 65536) {
+        auto buffered = fdSource->readBuffered(left);
+        if (!buffered.empty()) sink(buffered);
+        left -= buffered.size();
+        auto n = sink.receiveFromFd(fdSource->fd, left);
+        fdSource->read += n;
+        left -= n;
+    }
+
     std::array<char, 65536> buf;
 
     while (left) {
@@ -60,6 +60,25 @@ namespace nix {
 void dumpPath(const Path & path, Sink & sink,
     PathFilter & filter = defaultPathFilter);
 
+/**
+ * Same as `SourceAccessor::dumpPath()`, but walks the tree and reads
+ * regular files ahead on separate threads (see the `nar-dump-threads`
+ * setting), while the calling thread writes the archive to `sink` in
+ * the usual order. Files are read ahead only within a bounded memory
+ * budget, and large files are streamed as usual.
+ *
+ * @note `accessor` must support concurrent calls to `readFile()` while
+ * being traversed.
+ */
+void dumpPathParallel(SourceAccessor & accessor, const CanonPath & path, Sink & sink,
+    PathFilter & filter = defaultPathFilter);
+
+/**
+ * `dumpPathParallel()` for a path in the local file system.
+ */
+void dumpPathParallel(const Path & path, Sink & sink,
+    PathFilter & filter = defaultPathFilter);
+
 /**
  * Same as dumpPath(), but returns the last modified date of the path.
  */
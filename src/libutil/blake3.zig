@@ -0,0 +1,413 @@
+//! BLAKE3 in hash mode, for `hash.zig`.
+//!
+//! Unlike `std.crypto.hash.Blake3`, whole chunks are hashed several at
+//! a time using SIMD, and `updateParallel()` additionally splits large
+//! inputs into subtrees that are hashed on separate threads. The
+//! chaining values needed to combine such subtrees are not exposed by
+//! the standard library.
+
+const std = @import("std");
+
+const chunk_len = 1024;
+const block_len = 64;
+
+const chunk_start: u8 = 1 << 0;
+const chunk_end: u8 = 1 << 1;
+const parent: u8 = 1 << 2;
+const root: u8 = 1 << 3;
+
+const iv = [8]u32{
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+/// The message word order of each of the seven rounds.
+const msg_schedule = blk: {
+    const permutation = [16]u8{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 };
+    var s: [7][16]u8 = undefined;
+    for (0..16) |i| s[0][i] = @intCast(i);
+    for (1..7) |r| {
+        for (0..16) |i| s[r][i] = s[r - 1][permutation[i]];
+    }
+    break :blk s;
+};
+
+/// Number of chunks hashed at once by `hashChunksWide()`.
+const lanes = 8;
+const V = @Vector(lanes, u32);
+
+/// The largest subtree, in log2 chunks, hashed as a unit by
+/// `updateParallel()`.
+const max_subtree_log2 = 6;
+
+/// Inputs shorter than this per thread are not worth spawning threads
+/// for.
+const min_len_per_thread = 256 * 1024;
+
+/// Inputs shorter than this are hashed on the calling thread anyway.
+pub const min_parallel_len = 2 * min_len_per_thread;
+
+const max_threads = 64;
+
+/// Maximum depth of the tree, enough for 2^64 bytes.
+const max_depth = 54;
+
+/// The log2 of a number of chunks in a subtree, which can shift a
+/// `usize` even on 32-bit platforms.
+const Log2Chunks = std.math.Log2Int(usize);
+
+inline fn g(comptime T: type, v: *[16]T, comptime a: usize, comptime b: usize, comptime c: usize, comptime d: usize, x: T, y: T) void {
+    v[a] +%= v[b] +% x;
+    v[d] = std.math.rotr(T, v[d] ^ v[a], 16);
+    v[c] +%= v[d];
+    v[b] = std.math.rotr(T, v[b] ^ v[c], 12);
+    v[a] +%= v[b] +% y;
+    v[d] = std.math.rotr(T, v[d] ^ v[a], 8);
+    v[c] +%= v[d];
+    v[b] = std.math.rotr(T, v[b] ^ v[c], 7);
+}
+
+/// The rounds of the compression function, on either a single state
+/// (`T == u32`) or one state per lane (`T == V`).
+inline fn rounds(comptime T: type, v: *[16]T, m: *const [16]T) void {
+    inline for (msg_schedule) |s| {
+        g(T, v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+        g(T, v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+        g(T, v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+        g(T, v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+        g(T, v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+        g(T, v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        g(T, v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+        g(T, v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+}
+
+fn compress(cv: [8]u32, block: *const [block_len]u8, counter: u64, len: u32, flags: u8) [16]u32 {
+    var m: [16]u32 = undefined;
+    for (0..16) |i| m[i] = std.mem.readInt(u32, block[i * 4 ..][0..4], .little);
+
+    var v: [16]u32 = undefined;
+    for (0..8) |i| v[i] = cv[i];
+    for (0..4) |i| v[8 + i] = iv[i];
+    v[12] = @truncate(counter);
+    v[13] = @truncate(counter >> 32);
+    v[14] = len;
+    v[15] = flags;
+
+    rounds(u32, &v, &m);
+
+    for (0..8) |i| {
+        v[i] ^= v[i + 8];
+        v[i + 8] ^= cv[i];
+    }
+    return v;
+}
+
+/// Computes the chaining values of `lanes` consecutive full chunks,
+/// the first of which has index `counter`.
+fn hashChunksWide(input: *const [lanes * chunk_len]u8, counter: u64, out: *[lanes][8]u32) void {
+    var cv: [8]V = undefined;
+    for (0..8) |i| cv[i] = @splat(iv[i]);
+
+    var counter_lo: [lanes]u32 = undefined;
+    var counter_hi: [lanes]u32 = undefined;
+    for (0..lanes) |l| {
+        const c = counter + @as(u64, @intCast(l));
+        counter_lo[l] = @truncate(c);
+        counter_hi[l] = @truncate(c >> 32);
+    }
+
+    for (0..chunk_len / block_len) |b| {
+        var m: [16]V = undefined;
+        for (0..16) |i| {
+            var w: [lanes]u32 = undefined;
+            for (0..lanes) |l|
+                w[l] = std.mem.readInt(u32, input[l * chunk_len + b * block_len + i * 4 ..][0..4], .little);
+            m[i] = w;
+        }
+
+        var flags: u32 = 0;
+        if (b == 0) flags |= chunk_start;
+        if (b == chunk_len / block_len - 1) flags |= chunk_end;
+
+        var v: [16]V = undefined;
+        for (0..8) |i| v[i] = cv[i];
+        for (0..4) |i| v[8 + i] = @splat(iv[i]);
+        v[12] = counter_lo;
+        v[13] = counter_hi;
+        v[14] = @splat(@as(u32, block_len));
+        v[15] = @splat(flags);
+
+        rounds(V, &v, &m);
+
+        for (0..8) |i| cv[i] = v[i] ^ v[i + 8];
+    }
+
+    for (0..8) |i| {
+        const w: [lanes]u32 = cv[i];
+        for (0..lanes) |l| out[l][i] = w[l];
+    }
+}
+
+/// The input of a compression whose output is not yet known to be a
+/// chaining value or the root.
+const Output = struct {
+    cv: [8]u32,
+    block: [block_len]u8,
+    counter: u64,
+    len: u32,
+    flags: u8,
+
+    fn chainingValue(self: *const Output) [8]u32 {
+        const words = compress(self.cv, &self.block, self.counter, self.len, self.flags);
+        return words[0..8].*;
+    }
+
+    fn rootBytes(self: *const Output, out: []u8) void {
+        const words = compress(self.cv, &self.block, 0, self.len, self.flags | root);
+        var bytes: [32]u8 = undefined;
+        for (0..8) |i| std.mem.writeInt(u32, bytes[i * 4 ..][0..4], words[i], .little);
+        @memcpy(out, bytes[0..out.len]);
+    }
+};
+
+fn parentOutput(left: [8]u32, right: [8]u32) Output {
+    var block: [block_len]u8 = undefined;
+    for (0..8) |i| {
+        std.mem.writeInt(u32, block[i * 4 ..][0..4], left[i], .little);
+        std.mem.writeInt(u32, block[32 + i * 4 ..][0..4], right[i], .little);
+    }
+    return .{ .cv = iv, .block = block, .counter = 0, .len = block_len, .flags = parent };
+}
+
+fn parentCv(left: [8]u32, right: [8]u32) [8]u32 {
+    return parentOutput(left, right).chainingValue();
+}
+
+const ChunkState = struct {
+    cv: [8]u32 = iv,
+    counter: u64,
+    buf: [block_len]u8 = [_]u8{0} ** block_len,
+    buf_len: u8 = 0,
+    blocks_compressed: u8 = 0,
+
+    fn len(self: *const ChunkState) usize {
+        return @as(usize, block_len) * self.blocks_compressed + self.buf_len;
+    }
+
+    fn startFlag(self: *const ChunkState) u8 {
+        return if (self.blocks_compressed == 0) chunk_start else 0;
+    }
+
+    fn update(self: *ChunkState, input: []const u8) void {
+        var in = input;
+        while (in.len > 0) {
+            if (self.buf_len == block_len) {
+                const words = compress(self.cv, &self.buf, self.counter, block_len, self.startFlag());
+                self.cv = words[0..8].*;
+                self.blocks_compressed += 1;
+                @memset(&self.buf, 0);
+                self.buf_len = 0;
+            }
+            const take: usize = @min(block_len - self.buf_len, in.len);
+            @memcpy(self.buf[self.buf_len..][0..take], in[0..take]);
+            self.buf_len += @intCast(take);
+            in = in[take..];
+        }
+    }
+
+    fn output(self: *const ChunkState) Output {
+        return .{
+            .cv = self.cv,
+            .block = self.buf,
+            .counter = self.counter,
+            .len = self.buf_len,
+            .flags = self.startFlag() | chunk_end,
+        };
+    }
+};
+
+/// Computes the chaining value of the subtree consisting of
+/// `input.len / chunk_len` (a power of two) full chunks, the first of
+/// which has index `counter`.
+fn subtreeCv(input: []const u8, counter: u64) [8]u32 {
+    const chunks = input.len / chunk_len;
+    std.debug.assert(chunks > 0 and std.math.isPowerOfTwo(chunks) and input.len % chunk_len == 0);
+
+    var stack: [max_depth][8]u32 = undefined;
+    var stack_len: usize = 0;
+
+    var done: usize = 0;
+    while (done < chunks) {
+        var cvs: [lanes][8]u32 = undefined;
+        const batch: usize = @min(lanes, chunks - done);
+        if (batch == lanes) {
+            hashChunksWide(input[done * chunk_len ..][0 .. lanes * chunk_len], counter + @as(u64, @intCast(done)), &cvs);
+        } else {
+            for (0..batch) |i| {
+                var chunk = ChunkState{ .counter = counter + @as(u64, @intCast(done + i)) };
+                chunk.update(input[(done + i) * chunk_len ..][0..chunk_len]);
+                cvs[i] = chunk.output().chainingValue();
+            }
+        }
+
+        for (cvs[0..batch]) |chunk_cv| {
+            done += 1;
+            var cv = chunk_cv;
+            var t = done;
+            while (t & 1 == 0) : (t >>= 1) {
+                stack_len -= 1;
+                cv = parentCv(stack[stack_len], cv);
+            }
+            stack[stack_len] = cv;
+            stack_len += 1;
+        }
+    }
+
+    std.debug.assert(stack_len == 1);
+    return stack[0];
+}
+
+/// A subtree of the input of `updateParallel()`.
+const Subtree = struct {
+    offset: usize,
+    counter: u64,
+    log2_chunks: Log2Chunks,
+    cv: [8]u32 = undefined,
+};
+
+fn hashSubtrees(input: []const u8, subtrees: []Subtree, first: usize, stride: usize) void {
+    var i = first;
+    while (i < subtrees.len) : (i += stride) {
+        const s = &subtrees[i];
+        s.cv = subtreeCv(input[s.offset..][0 .. @as(usize, chunk_len) << s.log2_chunks], s.counter);
+    }
+}
+
+pub const Blake3 = struct {
+    pub const digest_length = 32;
+
+    pub const Options = struct {};
+
+    chunk: ChunkState,
+    /// Chaining values of the completed subtrees to the left of
+    /// `chunk`, one for each bit set in `chunk.counter`.
+    cv_stack: [max_depth][8]u32 = undefined,
+    cv_stack_len: u8 = 0,
+
+    pub fn init(_: Options) Blake3 {
+        return .{ .chunk = .{ .counter = 0 } };
+    }
+
+    /// Adds the chaining value of a subtree of 2^`log2_chunks` chunks,
+    /// after which `total_chunks` chunks have been hashed, merging the
+    /// completed subtrees.
+    fn pushCv(self: *Blake3, subtree_cv: [8]u32, log2_chunks: u6, total_chunks: u64) void {
+        var cv = subtree_cv;
+        var t = total_chunks >> log2_chunks;
+        while (t & 1 == 0) : (t >>= 1) {
+            self.cv_stack_len -= 1;
+            cv = parentCv(self.cv_stack[self.cv_stack_len], cv);
+        }
+        self.cv_stack[self.cv_stack_len] = cv;
+        self.cv_stack_len += 1;
+    }
+
+    /// Hashes `input`, which consists of whole chunks following those
+    /// hashed so far, as a sequence of aligned subtrees.
+    fn updateChunks(self: *Blake3, input: []const u8, threads: usize) void {
+        std.debug.assert(self.chunk.len() == 0 and input.len % chunk_len == 0);
+
+        const n_threads = @min(threads, max_threads, input.len / min_len_per_thread);
+
+        var subtrees: [256]Subtree = undefined;
+        var offset: usize = 0;
+        var counter = self.chunk.counter;
+
+        while (offset < input.len) {
+            // Split the input into the largest subtrees allowed by
+            // their alignment, up to 2^max_subtree_log2 chunks.
+            var n: usize = 0;
+            const batch_start = offset;
+            while (offset < input.len and n < subtrees.len) : (n += 1) {
+                var log2: Log2Chunks = max_subtree_log2;
+                const align_log2 = @ctz(counter);
+                if (align_log2 < log2) log2 = @intCast(align_log2);
+                while ((@as(usize, chunk_len) << log2) > input.len - offset) log2 -= 1;
+                subtrees[n] = .{ .offset = offset - batch_start, .counter = counter, .log2_chunks = log2 };
+                offset += @as(usize, chunk_len) << log2;
+                counter += @as(u64, 1) << log2;
+            }
+
+            const batch = input[batch_start..offset];
+
+            if (n_threads <= 1) {
+                hashSubtrees(batch, subtrees[0..n], 0, 1);
+            } else {
+                var workers: [max_threads]?std.Thread = undefined;
+                for (1..n_threads) |t|
+                    workers[t] = std.Thread.spawn(.{}, hashSubtrees, .{ batch, subtrees[0..n], t, n_threads }) catch null;
+                hashSubtrees(batch, subtrees[0..n], 0, n_threads);
+                for (1..n_threads) |t| {
+                    if (workers[t]) |w|
+                        w.join()
+                    else
+                        hashSubtrees(batch, subtrees[0..n], t, n_threads);
+                }
+            }
+
+            for (subtrees[0..n]) |s|
+                self.pushCv(s.cv, s.log2_chunks, s.counter + (@as(u64, 1) << s.log2_chunks));
+        }
+
+        self.chunk = .{ .counter = counter };
+    }
+
+    fn updateWith(self: *Blake3, input: []const u8, threads: usize) void {
+        var in = input;
+
+        // Complete the current chunk.
+        if (self.chunk.len() > 0) {
+            const take: usize = @min(chunk_len - self.chunk.len(), in.len);
+            self.chunk.update(in[0..take]);
+            in = in[take..];
+        }
+
+        // Now that it's known not to be the root, finish it.
+        if (in.len > 0 and self.chunk.len() == chunk_len) {
+            const total = self.chunk.counter + 1;
+            self.pushCv(self.chunk.output().chainingValue(), 0, total);
+            self.chunk = .{ .counter = total };
+        }
+
+        // Hash all remaining whole chunks but the last one, which
+        // might be the root.
+        if (in.len > chunk_len) {
+            const whole = (in.len - 1) / chunk_len * chunk_len;
+            self.updateChunks(in[0..whole], threads);
+            in = in[whole..];
+        }
+
+        self.chunk.update(in);
+    }
+
+    pub fn update(self: *Blake3, input: []const u8) void {
+        self.updateWith(input, 1);
+    }
+
+    /// Same as `update()`, but hashes large inputs on up to `threads`
+    /// threads.
+    pub fn updateParallel(self: *Blake3, input: []const u8, threads: usize) void {
+        self.updateWith(input, threads);
+    }
+
+    pub fn final(self: *const Blake3, out: []u8) void {
+        var output = self.chunk.output();
+        var i = self.cv_stack_len;
+        while (i > 0) {
+            i -= 1;
+            output = parentOutput(self.cv_stack[i], output.chainingValue());
+        }
+        output.rootBytes(out);
+    }
+};
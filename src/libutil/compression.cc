@@ -3,6 +3,7 @@
 #include "tarfile.hh"
 #include "finally.hh"
 #include "logging.hh"
+#include "sync.hh"
 
 #include <archive.h>
 #include <archive_entry.h>
@@ -12,6 +13,13 @@
 #include <brotli/decode.h>
 #include <brotli/encode.h>
 
+#include <lz4frame.h>
+#include <lzma.h>
+#include <zstd.h>
+
+#include <deque>
+#include <thread>
+
 namespace nix {
 
 static const int COMPRESSION_LEVEL_DEFAULT = -1;
@@ -204,6 +212,315 @@ struct BrotliDecompressionSink : ChunkedCompressionSink
     }
 };
 
+/**
+ * Size of the output buffers of the native decompressors. Large
+ * buffers mean fewer, larger writes to the next sink.
+ */
+static constexpr size_t decompressionBufferSize = 256 * 1024;
+
+struct ZstdDecompressionSink : FinishSink
+{
+    Sink & nextSink;
+    ZSTD_DCtx * ctx;
+    std::vector<char> outbuf;
+
+    /**
+     * The last result of `ZSTD_decompressStream()`, which is non-zero
+     * in the middle of a frame.
+     */
+    size_t pending = 0;
+
+    ZstdDecompressionSink(Sink & nextSink)
+        : nextSink(nextSink)
+        , outbuf(decompressionBufferSize)
+    {
+        ctx = ZSTD_createDCtx();
+        if (!ctx)
+            throw CompressionError("unable to initialise zstd decoder");
+    }
+
+    ~ZstdDecompressionSink()
+    {
+        ZSTD_freeDCtx(ctx);
+    }
+
+    void operator () (std::string_view data) override
+    {
+        ZSTD_inBuffer in{data.data(), data.size(), 0};
+
+        /* A full output buffer means there may be more to flush,
+           unless the frame just ended. */
+        bool full;
+        do {
+            checkInterrupt();
+
+            ZSTD_outBuffer out{outbuf.data(), outbuf.size(), 0};
+            pending = ZSTD_decompressStream(ctx, &out, &in);
+            if (ZSTD_isError(pending))
+                throw CompressionError("error while decompressing zstd file: %s", ZSTD_getErrorName(pending));
+
+            if (out.pos)
+                nextSink({outbuf.data(), out.pos});
+
+            full = out.pos == out.size;
+        } while (in.pos < in.size || (full && pending));
+    }
+
+    void finish() override
+    {
+        if (pending)
+            throw CompressionError("zstd file is truncated");
+    }
+};
+
+struct XzDecompressionSink : FinishSink
+{
+    Sink & nextSink;
+    lzma_stream strm = LZMA_STREAM_INIT;
+    std::vector<uint8_t> outbuf;
+
+    XzDecompressionSink(Sink & nextSink)
+        : nextSink(nextSink)
+        , outbuf(decompressionBufferSize)
+    {
+        if (lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+            throw CompressionError("unable to initialise xz decoder");
+    }
+
+    ~XzDecompressionSink()
+    {
+        lzma_end(&strm);
+    }
+
+    void operator () (std::string_view data) override
+    {
+        decompress(data, LZMA_RUN);
+    }
+
+    void finish() override
+    {
+        decompress({}, LZMA_FINISH);
+    }
+
+    void decompress(std::string_view data, lzma_action action)
+    {
+        strm.next_in = (const uint8_t *) data.data();
+        strm.avail_in = data.size();
+
+        while (true) {
+            checkInterrupt();
+
+            strm.next_out = outbuf.data();
+            strm.avail_out = outbuf.size();
+
+            auto ret = lzma_code(&strm, action);
+            if (ret == LZMA_BUF_ERROR && action == LZMA_FINISH)
+                throw CompressionError("xz file is truncated");
+            if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+                throw CompressionError("error while decompressing xz file (error %d)", ret);
+
+            if (strm.avail_out < outbuf.size())
+                nextSink({(const char *) outbuf.data(), outbuf.size() - strm.avail_out});
+
+            if (ret == LZMA_STREAM_END || (action == LZMA_RUN && !strm.avail_in && strm.avail_out))
+                break;
+        }
+    }
+};
+
+struct Lz4DecompressionSink : FinishSink
+{
+    Sink & nextSink;
+    LZ4F_dctx * ctx;
+    std::vector<char> outbuf;
+
+    /**
+     * The last result of `LZ4F_decompress()`, which is non-zero in the
+     * middle of a frame.
+     */
+    size_t pending = 0;
+
+    Lz4DecompressionSink(Sink & nextSink)
+        : nextSink(nextSink)
+        , outbuf(decompressionBufferSize)
+    {
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)))
+            throw CompressionError("unable to initialise lz4 decoder");
+    }
+
+    ~Lz4DecompressionSink()
+    {
+        LZ4F_freeDecompressionContext(ctx);
+    }
+
+    void operator () (std::string_view data) override
+    {
+        bool full;
+        do {
+            checkInterrupt();
+
+            size_t outSize = outbuf.size();
+            size_t inSize = data.size();
+            pending = LZ4F_decompress(ctx, outbuf.data(), &outSize, data.data(), &inSize, nullptr);
+            if (LZ4F_isError(pending))
+                throw CompressionError("error while decompressing lz4 file: %s", LZ4F_getErrorName(pending));
+
+            if (outSize)
+                nextSink({outbuf.data(), outSize});
+
+            data.remove_prefix(inSize);
+            full = outSize == outbuf.size();
+        } while (!data.empty() || (full && pending));
+    }
+
+    void finish() override
+    {
+        if (pending)
+            throw CompressionError("lz4 file is truncated");
+    }
+};
+
+/**
+ * Run a decompression sink on a separate thread, so that producing
+ * the compressed data, decompressing it and consuming the result can
+ * overlap. `nextSink` is only called from the thread that calls this
+ * sink.
+ */
+struct ThreadedDecompressionSink : FinishSink
+{
+    /**
+     * Upper bound on the data buffered in each direction.
+     */
+    static constexpr size_t maxBuffered = 8 * 1024 * 1024;
+
+    Sink & nextSink;
+
+    struct State
+    {
+        std::deque<std::string> input, output;
+        size_t inputSize = 0, outputSize = 0;
+        bool inputDone = false, outputDone = false, quit = false;
+        std::exception_ptr exception;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+    std::thread thread;
+
+    struct Quit { };
+
+    ThreadedDecompressionSink(const std::string & method, Sink & nextSink)
+        : nextSink(nextSink)
+    {
+        thread = std::thread([this, method]() {
+            try {
+                LambdaSink queue([&](std::string_view data) {
+                    auto state(state_.lock());
+                    while (state->outputSize >= maxBuffered && !state->quit)
+                        state.wait(wakeup);
+                    if (state->quit) throw Quit();
+                    state->output.emplace_back(data);
+                    state->outputSize += data.size();
+                    wakeup.notify_all();
+                });
+
+                auto decompressor = makeDecompressionSink(method, queue);
+
+                while (true) {
+                    std::string data;
+                    {
+                        auto state(state_.lock());
+                        while (state->input.empty() && !state->inputDone && !state->quit)
+                            state.wait(wakeup);
+                        if (state->quit) return;
+                        if (state->input.empty()) break;
+                        data = std::move(state->input.front());
+                        state->input.pop_front();
+                        state->inputSize -= data.size();
+                        wakeup.notify_all();
+                    }
+                    (*decompressor)(data);
+                }
+
+                decompressor->finish();
+            } catch (Quit &) {
+                return;
+            } catch (...) {
+                auto state(state_.lock());
+                state->exception = std::current_exception();
+            }
+
+            auto state(state_.lock());
+            state->outputDone = true;
+            wakeup.notify_all();
+        });
+    }
+
+    ~ThreadedDecompressionSink()
+    {
+        {
+            auto state(state_.lock());
+            state->quit = true;
+            wakeup.notify_all();
+        }
+        thread.join();
+    }
+
+    /**
+     * Pass decompressed data to `nextSink`. If `until` is given, wait
+     * for data until it returns true.
+     */
+    void drain(std::function<bool(State &)> until = {})
+    {
+        while (true) {
+            checkInterrupt();
+
+            std::deque<std::string> output;
+            {
+                auto state(state_.lock());
+                while (state->output.empty() && until && !until(*state) && !state->outputDone)
+                    state.wait(wakeup);
+                if (state->exception)
+                    std::rethrow_exception(state->exception);
+                if (state->output.empty()) return;
+                output = std::move(state->output);
+                state->output.clear();
+                state->outputSize = 0;
+                wakeup.notify_all();
+            }
+
+            for (auto & data : output)
+                nextSink(data);
+        }
+    }
+
+    void operator () (std::string_view data) override
+    {
+        /* Make room for the data, consuming output while we wait. */
+        drain([](State & state) { return state.inputSize < maxBuffered; });
+
+        {
+            auto state(state_.lock());
+            state->input.emplace_back(data);
+            state->inputSize += data.size();
+            wakeup.notify_all();
+        }
+
+        drain();
+    }
+
+    void finish() override
+    {
+        {
+            auto state(state_.lock());
+            state->inputDone = true;
+            wakeup.notify_all();
+        }
+
+        drain([](State & state) { return false; });
+    }
+};
+
 std::string decompress(const std::string & method, std::string_view in)
 {
     StringSink ssink;
@@ -213,12 +530,20 @@ std::string decompress(const std::string & method, std::string_view in)
     return std::move(ssink.s);
 }
 
-std::unique_ptr<FinishSink> makeDecompressionSink(const std::string & method, Sink & nextSink)
+std::unique_ptr<FinishSink> makeDecompressionSink(const std::string & method, Sink & nextSink, bool parallel)
 {
     if (method == "none" || method == "")
         return std::make_unique<NoneSink>(nextSink);
+    else if (parallel)
+        return std::make_unique<ThreadedDecompressionSink>(method, nextSink);
     else if (method == "br")
         return std::make_unique<BrotliDecompressionSink>(nextSink);
+    else if (method == "zstd")
+        return std::make_unique<ZstdDecompressionSink>(nextSink);
+    else if (method == "xz")
+        return std::make_unique<XzDecompressionSink>(nextSink);
+    else if (method == "lz4")
+        return std::make_unique<Lz4DecompressionSink>(nextSink);
     else
         return sourceToSink([method, &nextSink](Source & source) {
             auto decompressionSource = std::make_unique<ArchiveDecompressionSource>(source, method);
@@ -283,12 +608,194 @@ struct BrotliCompressionSink : ChunkedCompressionSink
     }
 };
 
+static unsigned int checkWindowLog(unsigned int windowLog)
+{
+    if (windowLog < CompressionOptions::minWindowLog || windowLog > CompressionOptions::maxWindowLog)
+        throw CompressionError("compression window log %d is not between %d and %d",
+            windowLog, CompressionOptions::minWindowLog, CompressionOptions::maxWindowLog);
+    return windowLog;
+}
+
+static unsigned int compressionThreads(const CompressionOptions & options)
+{
+    if (!options.parallel) return 1;
+    if (options.threads) return options.threads;
+    return std::max(1U, std::thread::hardware_concurrency());
+}
+
+/**
+ * Unlike libarchive's zstd filter, this runs zstd's own worker threads
+ * and supports long-distance matching.
+ */
+struct ZstdCompressionSink : CompressionSink
+{
+    Sink & nextSink;
+    ZSTD_CCtx * ctx;
+    std::vector<char> outbuf;
+
+    ZstdCompressionSink(Sink & nextSink, const CompressionOptions & options)
+        : nextSink(nextSink)
+        , outbuf(ZSTD_CStreamOutSize())
+    {
+        ctx = ZSTD_createCCtx();
+        if (!ctx)
+            throw CompressionError("unable to initialise zstd encoder");
+
+        if (options.level != COMPRESSION_LEVEL_DEFAULT)
+            check(ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, options.level));
+        if (options.windowLog)
+            check(ZSTD_CCtx_setParameter(ctx, ZSTD_c_windowLog, checkWindowLog(options.windowLog)));
+        if (options.longDistanceMatching)
+            check(ZSTD_CCtx_setParameter(ctx, ZSTD_c_enableLongDistanceMatching, 1));
+
+        /* This fails if zstd was built without thread support, in
+           which case we just compress on this thread. */
+        if (auto threads = compressionThreads(options); threads > 1
+            && ZSTD_isError(ZSTD_CCtx_setParameter(ctx, ZSTD_c_nbWorkers, threads)))
+            debug("zstd does not support multi-threaded compression");
+    }
+
+    ~ZstdCompressionSink()
+    {
+        ZSTD_freeCCtx(ctx);
+    }
+
+    size_t check(size_t res)
+    {
+        if (ZSTD_isError(res))
+            throw CompressionError("zstd compression failed: %s", ZSTD_getErrorName(res));
+        return res;
+    }
+
+    void finish() override
+    {
+        flush();
+        compress({}, ZSTD_e_end);
+    }
+
+    void writeUnbuffered(std::string_view data) override
+    {
+        compress(data, ZSTD_e_continue);
+    }
+
+    void compress(std::string_view data, ZSTD_EndDirective mode)
+    {
+        ZSTD_inBuffer in{data.data(), data.size(), 0};
+
+        while (true) {
+            checkInterrupt();
+
+            ZSTD_outBuffer out{outbuf.data(), outbuf.size(), 0};
+            auto remaining = check(ZSTD_compressStream2(ctx, &out, &in, mode));
+
+            if (out.pos)
+                nextSink({outbuf.data(), out.pos});
+
+            if (mode == ZSTD_e_end ? !remaining : in.pos == in.size)
+                break;
+        }
+    }
+};
+
+/**
+ * Unlike libarchive's xz filter, this supports setting the dictionary
+ * size and the number of threads.
+ */
+struct XzCompressionSink : CompressionSink
+{
+    Sink & nextSink;
+    lzma_stream strm = LZMA_STREAM_INIT;
+    uint8_t outbuf[BUFSIZ];
+
+    XzCompressionSink(Sink & nextSink, const CompressionOptions & options)
+        : nextSink(nextSink)
+    {
+        uint32_t preset = options.level == COMPRESSION_LEVEL_DEFAULT ? LZMA_PRESET_DEFAULT : options.level;
+
+        lzma_options_lzma lzmaOptions;
+        if (lzma_lzma_preset(&lzmaOptions, preset))
+            throw CompressionError("unsupported xz compression level %d", options.level);
+        if (options.windowLog)
+            lzmaOptions.dict_size = uint32_t(1) << checkWindowLog(options.windowLog);
+
+        lzma_filter filters[] = {
+            {.id = LZMA_FILTER_LZMA2, .options = &lzmaOptions},
+            {.id = LZMA_VLI_UNKNOWN, .options = nullptr},
+        };
+
+        /* The multi-threaded encoder splits the input into blocks
+           that are compressed independently. It is unavailable if
+           liblzma was built without thread support. */
+        lzma_ret ret = LZMA_PROG_ERROR;
+        if (auto threads = compressionThreads(options); threads > 1) {
+            lzma_mt mt{};
+            mt.threads = threads;
+            mt.filters = filters;
+            mt.check = LZMA_CHECK_CRC64;
+            ret = lzma_stream_encoder_mt(&strm, &mt);
+        }
+        if (ret != LZMA_OK)
+            ret = lzma_stream_encoder(&strm, filters, LZMA_CHECK_CRC64);
+
+        if (ret != LZMA_OK)
+            throw CompressionError("unable to initialise xz encoder (error %d)", ret);
+    }
+
+    ~XzCompressionSink()
+    {
+        lzma_end(&strm);
+    }
+
+    void finish() override
+    {
+        flush();
+        compress({}, LZMA_FINISH);
+    }
+
+    void writeUnbuffered(std::string_view data) override
+    {
+        compress(data, LZMA_RUN);
+    }
+
+    void compress(std::string_view data, lzma_action action)
+    {
+        strm.next_in = (const uint8_t *) data.data();
+        strm.avail_in = data.size();
+
+        while (true) {
+            checkInterrupt();
+
+            strm.next_out = outbuf;
+            strm.avail_out = sizeof(outbuf);
+
+            auto ret = lzma_code(&strm, action);
+            if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+                throw CompressionError("xz compression failed (error %d)", ret);
+
+            if (strm.avail_out < sizeof(outbuf))
+                nextSink({(const char *) outbuf, sizeof(outbuf) - strm.avail_out});
+
+            if (action == LZMA_FINISH ? ret == LZMA_STREAM_END : !strm.avail_in)
+                break;
+        }
+    }
+};
+
 ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel, int level)
 {
+    return makeCompressionSink(method, nextSink, CompressionOptions{.level = level, .parallel = parallel});
+}
+
+ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const CompressionOptions & options)
+{
+    if (method == "zstd")
+        return make_ref<ZstdCompressionSink>(nextSink, options);
+    if (method == "xz")
+        return make_ref<XzCompressionSink>(nextSink, options);
     std::vector<std::string> la_supports = {
-        "bzip2", "compress", "grzip", "gzip", "lrzip", "lz4", "lzip", "lzma", "lzop", "xz", "zstd"};
+        "bzip2", "compress", "grzip", "gzip", "lrzip", "lz4", "lzip", "lzma", "lzop"};
     if (std::find(la_supports.begin(), la_supports.end(), method) != la_supports.end()) {
-        return make_ref<ArchiveCompressionSink>(nextSink, method, parallel, level);
+        return make_ref<ArchiveCompressionSink>(nextSink, method, options.parallel, options.level);
     }
     if (method == "none")
         return make_ref<NoneSink>(nextSink);
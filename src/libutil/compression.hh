@@ -18,13 +18,73 @@ struct CompressionSink : BufferedSink, FinishSink
 
 std::string decompress(const std::string & method, std::string_view in);
 
-std::unique_ptr<FinishSink> makeDecompressionSink(const std::string & method, Sink & nextSink);
+/**
+ * Return a sink that decompresses its input and writes the result to
+ * `nextSink`.
+ *
+ * @param parallel Decompress on a separate thread, so that producing
+ * the input, decompressing it and consuming the output can overlap.
+ * `nextSink` is still only called from the calling thread.
+ */
+std::unique_ptr<FinishSink> makeDecompressionSink(const std::string & method, Sink & nextSink, bool parallel = false);
+
+/**
+ * Options for `makeCompressionSink()`. Methods ignore the options they
+ * don't support.
+ */
+struct CompressionOptions
+{
+    /**
+     * The compression level, or -1 for the method's default.
+     */
+    int level = -1;
+
+    /**
+     * Whether to compress on several threads.
+     */
+    bool parallel = false;
+
+    /**
+     * The number of threads to use if `parallel` is set, or 0 for
+     * the number of cores. (`xz`, `zstd`)
+     */
+    unsigned int threads = 0;
+
+    /**
+     * The base-2 logarithm of the window or dictionary size, or 0 for
+     * the level's default. (`xz`, `zstd`) Must be between
+     * `minWindowLog` and `maxWindowLog`.
+     */
+    unsigned int windowLog = 0;
+
+    /**
+     * The smallest dictionary that `xz` supports is 4 KiB.
+     */
+    static constexpr unsigned int minWindowLog = 12;
+
+    /**
+     * zstd decoders, including ours and libarchive's, refuse windows
+     * larger than this (`ZSTD_WINDOWLOG_LIMIT_DEFAULT`) unless told
+     * otherwise, so larger windows would produce NARs that Nix can't
+     * decompress.
+     */
+    static constexpr unsigned int maxWindowLog = 27;
+
+    /**
+     * Whether to look for matches across the whole window, which
+     * helps for large inputs with distant repetitions. (`zstd`)
+     */
+    bool longDistanceMatching = false;
+};
 
 std::string compress(const std::string & method, std::string_view in, const bool parallel = false, int level = -1);
 
 ref<CompressionSink>
 makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel = false, int level = -1);
 
+ref<CompressionSink>
+makeCompressionSink(const std::string & method, Sink & nextSink, const CompressionOptions & options);
+
 MakeError(UnknownCompressionMethod, Error);
 
 MakeError(CompressionError, Error);
@@ -106,6 +106,21 @@ void drainFD(
 #endif
     );
 
+#ifndef _WIN32
+/**
+ * Move up to `len` bytes from `from` to `to` without copying them
+ * through user space, using `copy_file_range()`, `splice()` or
+ * `sendfile()` depending on what the kernel supports for this pair of
+ * file descriptors. Both file offsets are advanced.
+ *
+ * @return The number of bytes moved. This is less than `len` if the
+ * kernel cannot move data between these descriptors or `from` reaches
+ * end-of-file; the caller should then fall back to `read()` and
+ * `write()` for the rest.
+ */
+uint64_t copyFdRange(Descriptor from, Descriptor to, uint64_t len);
+#endif
+
 /**
  * Get [Standard Input](https://en.wikipedia.org/wiki/Standard_streams#Standard_input_(stdin))
  */
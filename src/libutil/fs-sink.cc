@@ -102,6 +102,7 @@ struct RestoreRegularFile : CreateRegularFileSink {
     void operator () (std::string_view data) override;
     void isExecutable() override;
     void preallocateContents(uint64_t size) override;
+    uint64_t receiveFromFd(Descriptor fd, uint64_t len) override;
 };
 
 void RestoreSink::createRegularFile(const CanonPath & path, std::function<void(CreateRegularFileSink &)> func)
@@ -157,6 +158,15 @@ void RestoreRegularFile::operator () (std::string_view data)
     writeFull(fd.get(), data);
 }
 
+uint64_t RestoreRegularFile::receiveFromFd(Descriptor from, uint64_t len)
+{
+#ifndef _WIN32
+    return copyFdRange(from, fd.get(), len);
+#else
+    return 0;
+#endif
+}
+
 void RestoreSink::createSymlink(const CanonPath & path, const std::string & target)
 {
     auto p = append(dstPath, path);
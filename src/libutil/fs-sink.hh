@@ -20,6 +20,15 @@ struct CreateRegularFileSink : Sink
      * An optimization. By default, do nothing.
      */
     virtual void preallocateContents(uint64_t size) { };
+
+    /**
+     * Another optimization: write up to `len` bytes read directly from
+     * `fd`, without going through user space. By default, do nothing.
+     *
+     * @return The number of bytes written. The caller must supply the
+     * remaining bytes through `operator ()` as usual.
+     */
+    virtual uint64_t receiveFromFd(Descriptor fd, uint64_t len) { return 0; };
 };
 
 
@@ -271,6 +271,32 @@ void dumpTree(const Tree & entries, Sink & sink,
 }
 
 
+/**
+ * Dump the regular file or symlink `path`, whose `lstat()` result is
+ * `st`, as a blob.
+ */
+static Mode dumpBlob(
+    const SourcePath & path,
+    const SourceAccessor::Stat & st,
+    Sink & sink,
+    const ExperimentalFeatureSettings & xpSettings)
+{
+    if (st.type == SourceAccessor::tSymlink) {
+        auto target = path.readLink();
+        dumpBlobPrefix(target.size(), sink, xpSettings);
+        sink(target);
+        return Mode::Symlink;
+    }
+
+    path.readFile(sink, [&](uint64_t size) {
+        dumpBlobPrefix(size, sink, xpSettings);
+    });
+    return st.isExecutable
+        ? Mode::Executable
+        : Mode::Regular;
+}
+
+
 Mode dump(
     const SourcePath & path,
     Sink & sink,
@@ -282,14 +308,8 @@ Mode dump(
 
     switch (st.type) {
     case SourceAccessor::tRegular:
-    {
-        path.readFile(sink, [&](uint64_t size) {
-            dumpBlobPrefix(size, sink, xpSettings);
-        });
-        return st.isExecutable
-            ? Mode::Executable
-            : Mode::Regular;
-    }
+    case SourceAccessor::tSymlink:
+        return dumpBlob(path, st, sink, xpSettings);
 
     case SourceAccessor::tDirectory:
     {
@@ -310,14 +330,6 @@ Mode dump(
         return Mode::Directory;
     }
 
-    case SourceAccessor::tSymlink:
-    {
-        auto target = path.readLink();
-        dumpBlobPrefix(target.size(), sink, xpSettings);
-        sink(target);
-        return Mode::Symlink;
-    }
-
     case SourceAccessor::tChar:
     case SourceAccessor::tBlock:
     case SourceAccessor::tSocket:
@@ -329,13 +341,99 @@ Mode dump(
 }
 
 
+/**
+ * Compute the blob hashes of the small regular files and symlinks in
+ * directory `path` together, which is considerably faster than
+ * hashing them one by one. The types of the other entries are stored
+ * in `types`, so that they don't have to be looked up again.
+ */
+static void hashSmallBlobs(
+    HashAlgorithm ha,
+    const SourcePath & path,
+    PathFilter & filter,
+    std::map<SourcePath, TreeEntry> & entries,
+    std::map<SourcePath, SourceAccessor::Type> & types)
+{
+    /* Larger files gain little from being hashed together. */
+    constexpr uint64_t maxFileSize = 64 * 1024;
+
+    /* Bound the memory used by a batch. */
+    constexpr size_t maxBatchSize = 4 * 1024 * 1024;
+
+    std::vector<std::pair<SourcePath, Mode>> batch;
+    std::vector<std::string> blobs;
+    size_t batchSize = 0;
+
+    auto flush = [&]() {
+        auto hashes = hashStrings(ha, {blobs.begin(), blobs.end()});
+        for (size_t n = 0; n < batch.size(); ++n)
+            entries.insert_or_assign(std::move(batch[n].first), TreeEntry {
+                .mode = batch[n].second,
+                .hash = std::move(hashes[n]),
+            });
+        batch.clear();
+        blobs.clear();
+        batchSize = 0;
+    };
+
+    for (auto & [name, type] : path.readDirectory()) {
+        auto child = path / name;
+        if (!filter(child.path.abs())) continue;
+
+        if (type && *type != SourceAccessor::tRegular && *type != SourceAccessor::tSymlink) {
+            types.insert_or_assign(std::move(child), *type);
+            continue;
+        }
+
+        auto st = child.lstat();
+        if (!(st.type == SourceAccessor::tRegular && st.fileSize.value_or(0) <= maxFileSize)
+            && st.type != SourceAccessor::tSymlink)
+        {
+            types.insert_or_assign(std::move(child), st.type);
+            continue;
+        }
+
+        StringSink blob;
+        auto mode = dumpBlob(child, st, blob, experimentalFeatureSettings);
+        batchSize += blob.s.size();
+        batch.emplace_back(std::move(child), mode);
+        blobs.push_back(std::move(blob.s));
+
+        if (batchSize >= maxBatchSize) flush();
+    }
+
+    flush();
+}
+
+
 TreeEntry dumpHash(
     HashAlgorithm ha,
     const SourcePath & path,
     PathFilter & filter)
 {
+    /* Entries hashed ahead of time by hashSmallBlobs(). */
+    std::map<SourcePath, TreeEntry> small;
+
+    /* The types of the other entries it has seen. */
+    std::map<SourcePath, SourceAccessor::Type> types;
+
     std::function<DumpHook> hook;
     hook = [&](const SourcePath & path) -> TreeEntry {
+        if (auto i = small.find(path); i != small.end()) {
+            auto entry = std::move(i->second);
+            small.erase(i);
+            return entry;
+        }
+
+        std::optional<SourceAccessor::Type> type;
+        if (auto i = types.find(path); i != types.end()) {
+            type = i->second;
+            types.erase(i);
+        }
+
+        if ((type ? *type : path.lstat().type) == SourceAccessor::tDirectory)
+            hashSmallBlobs(ha, path, filter, small, types);
+
         auto hashSink = HashSink(ha);
         auto mode = dump(path, hashSink, hook, filter);
         auto hash = hashSink.finish().first;
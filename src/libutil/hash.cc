@@ -1,5 +1,7 @@
 #include <iostream>
 #include <cstring>
+#include <thread>
+#include <algorithm>
 
 #include "args.hh"
 #include "hash.hh"
@@ -284,9 +286,12 @@ Hash newHashAllowEmpty(std::string_view hashStr, std::optional<HashAlgorithm> ha
 
 struct Ctx {};
 
-extern "C" Ctx* nix_libutil_hash_create(HashAlgorithm type);
+extern "C" Ctx* nix_libutil_hash_init(void* storage, HashAlgorithm type);
 extern "C" void nix_libutil_hash_update(Ctx* ctx, const void* data, size_t size);
+extern "C" void nix_libutil_hash_update_parallel(Ctx* ctx, const void* data, size_t size, unsigned int threads);
 extern "C" void nix_libutil_hash_finish(Ctx* ctx, uint8_t* hash);
+extern "C" void nix_libutil_hash_many(HashAlgorithm type, size_t count,
+    const char* const* datas, const size_t* sizes, uint8_t* const* hashes);
 
 static void update(Ctx* ctx,
                    std::string_view data)
@@ -294,20 +299,49 @@ static void update(Ctx* ctx,
     nix_libutil_hash_update(ctx, data.data(), data.size());
 }
 
+static unsigned int hashThreads()
+{
+    return std::max(std::thread::hardware_concurrency(), 1U);
+}
+
 Hash hashString(
     HashAlgorithm ha, std::string_view s, const ExperimentalFeatureSettings & xpSettings)
 {
-    Ctx* ctx = nix_libutil_hash_create(ha);
+    alignas(hashCtxAlign) std::byte storage[hashCtxSize];
+    Ctx* ctx = nix_libutil_hash_init(storage, ha);
     Hash hash(ha, xpSettings);
-    update(ctx, s);
+    nix_libutil_hash_update_parallel(ctx, s.data(), s.size(), hashThreads());
     nix_libutil_hash_finish(ctx, &hash.hash[0]);
-    delete ctx;
     return hash;
 }
 
+std::vector<Hash> hashStrings(
+    HashAlgorithm ha,
+    const std::vector<std::string_view> & inputs,
+    const ExperimentalFeatureSettings & xpSettings)
+{
+    std::vector<Hash> hashes(inputs.size(), Hash(ha, xpSettings));
+
+    std::vector<const char *> datas;
+    std::vector<size_t> sizes;
+    std::vector<uint8_t *> outs;
+    datas.reserve(inputs.size());
+    sizes.reserve(inputs.size());
+    outs.reserve(inputs.size());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        datas.push_back(inputs[i].data());
+        sizes.push_back(inputs[i].size());
+        outs.push_back(&hashes[i].hash[0]);
+    }
+
+    nix_libutil_hash_many(ha, inputs.size(), datas.data(), sizes.data(), outs.data());
+
+    return hashes;
+}
+
 Hash hashFile(HashAlgorithm ha, const Path & path)
 {
-    HashSink sink(ha);
+    ParallelHashSink sink(ha);
     readFile(path, sink);
     return sink.finish().first;
 }
@@ -315,20 +349,37 @@ Hash hashFile(HashAlgorithm ha, const Path & path)
 
 HashSink::HashSink(HashAlgorithm ha) : ha(ha)
 {
-    ctx = nix_libutil_hash_create(ha);
+    ctx = nix_libutil_hash_init(ctxStorage, ha);
     bytes = 0;
 }
 
+HashSink::HashSink(HashAlgorithm ha, size_t bufSize)
+    : BufferedSink(bufSize)
+    , ha(ha)
+{
+    ctx = nix_libutil_hash_init(ctxStorage, ha);
+    bytes = 0;
+}
+
+ParallelHashSink::ParallelHashSink(HashAlgorithm ha)
+    : HashSink(ha, ha == HashAlgorithm::BLAKE3 ? 16 * 1024 * 1024 : 32 * 1024)
+{
+    if (ha == HashAlgorithm::BLAKE3)
+        threads = hashThreads();
+}
+
 HashSink::~HashSink()
 {
     bufPos = 0;
-    delete ctx;
 }
 
 void HashSink::writeUnbuffered(std::string_view data)
 {
     bytes += data.size();
-    update(ctx, data);
+    if (threads > 1)
+        nix_libutil_hash_update_parallel(ctx, data.data(), data.size(), threads);
+    else
+        update(ctx, data);
 }
 
 HashResult HashSink::finish()
@@ -156,10 +156,22 @@ Hash newHashAllowEmpty(std::string_view hashStr, std::optional<HashAlgorithm> ha
 std::string printHash16or32(const Hash & hash);
 
 /**
- * Compute the hash of the given string.
+ * Compute the hash of the given string. Large BLAKE3 inputs are hashed
+ * on several threads.
  */
 Hash hashString(HashAlgorithm ha, std::string_view s, const ExperimentalFeatureSettings & xpSettings = experimentalFeatureSettings);
 
+/**
+ * Compute the hashes of several independent inputs at once. This is
+ * faster than calling `hashString()` on each of them when the inputs
+ * are small, e.g. the contents of small files, as it crosses into the
+ * hashing backend only once.
+ */
+std::vector<Hash> hashStrings(
+    HashAlgorithm ha,
+    const std::vector<std::string_view> & inputs,
+    const ExperimentalFeatureSettings & xpSettings = experimentalFeatureSettings);
+
 /**
  * Compute the hash of the given file, hashing its contents directly.
  *
@@ -213,6 +225,13 @@ std::string_view printHashAlgo(HashAlgorithm ha);
 
 struct Ctx;
 
+/**
+ * The size and alignment of the storage for a `Ctx`, which its users
+ * provide so that hashing doesn't allocate. Must match
+ * `ctx_storage_size` and `ctx_storage_align` in `hash.zig`.
+ */
+constexpr size_t hashCtxSize = 2048, hashCtxAlign = 16;
+
 struct AbstractHashSink : virtual Sink
 {
     virtual HashResult finish() = 0;
@@ -222,9 +241,18 @@ class HashSink : public BufferedSink, public AbstractHashSink
 {
 private:
     HashAlgorithm ha;
+    alignas(hashCtxAlign) std::byte ctxStorage[hashCtxSize];
     Ctx * ctx;
     uint64_t bytes;
 
+protected:
+    /**
+     * The number of threads each write may be hashed on.
+     */
+    unsigned int threads = 1;
+
+    HashSink(HashAlgorithm ha, size_t bufSize);
+
 public:
     HashSink(HashAlgorithm ha);
     HashSink(const HashSink & h);
@@ -234,5 +262,17 @@ public:
     HashResult currentHash();
 };
 
+/**
+ * A `HashSink` for large inputs such as big files. For BLAKE3, whose
+ * tree structure allows it, it buffers its input in large blocks and
+ * hashes each of them on all cores. Other algorithms are hashed as by
+ * `HashSink`.
+ */
+class ParallelHashSink : public HashSink
+{
+public:
+    ParallelHashSink(HashAlgorithm ha);
+};
+
 
 }
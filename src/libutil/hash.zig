@@ -1,4 +1,48 @@
 const std = @import("std");
+const blake3 = @import("blake3.zig");
+
+/// BLAKE3 as in the standard library, except that large inputs passed
+/// to `updateParallel()` at the start are hashed with the multi-threaded
+/// tree hash from `blake3.zig` instead.
+const Blake3 = struct {
+    pub const digest_length = std.crypto.hash.Blake3.digest_length;
+
+    state: union(enum) {
+        serial: std.crypto.hash.Blake3,
+        parallel: blake3.Blake3,
+    },
+    /// Whether no input has been hashed yet, so that the state can
+    /// still be switched.
+    empty: bool = true,
+
+    pub fn init(options: std.crypto.hash.Blake3.Options) Blake3 {
+        return .{ .state = .{ .serial = std.crypto.hash.Blake3.init(options) } };
+    }
+
+    pub fn update(self: *Blake3, input: []const u8) void {
+        switch (self.state) {
+            inline else => |*h| h.update(input),
+        }
+        if (input.len > 0) self.empty = false;
+    }
+
+    pub fn updateParallel(self: *Blake3, input: []const u8, threads: usize) void {
+        if (self.empty and threads > 1 and input.len >= blake3.min_parallel_len)
+            self.state = .{ .parallel = blake3.Blake3.init(.{}) };
+
+        switch (self.state) {
+            .serial => |*h| h.update(input),
+            .parallel => |*h| h.updateParallel(input, threads),
+        }
+        if (input.len > 0) self.empty = false;
+    }
+
+    pub fn final(self: *const Blake3, out: []u8) void {
+        switch (self.state) {
+            inline else => |*h| h.final(out),
+        }
+    }
+};
 
 pub const HashAlgorithm = enum(c_char) {
     md5 = 42,
@@ -13,7 +57,7 @@ pub const Ctx = union(HashAlgorithm) {
     sha1: std.crypto.hash.Sha1,
     sha256: std.crypto.hash.sha2.Sha256,
     sha512: std.crypto.hash.sha2.Sha512,
-    blake3: std.crypto.hash.Blake3,
+    blake3: Blake3,
 
     pub const Extern = opaque {};
 
@@ -26,8 +70,20 @@ pub const Ctx = union(HashAlgorithm) {
     }
 };
 
-pub fn create(t: HashAlgorithm) callconv(.C) *Ctx.Extern {
-    const self = std.heap.c_allocator.create(Ctx) catch @panic("OOM");
+/// The size and alignment of the storage that callers provide for a
+/// `Ctx`. Must match `hashCtxSize` and `hashCtxAlign` in `hash.hh`.
+const ctx_storage_size = 2048;
+const ctx_storage_align = 16;
+
+comptime {
+    if (@sizeOf(Ctx) > ctx_storage_size or @alignOf(Ctx) > ctx_storage_align)
+        @compileError("Ctx does not fit the storage provided by callers");
+}
+
+/// Initialises a `Ctx` in caller-provided `storage`, so that hashing
+/// doesn't allocate.
+pub fn init(storage: *anyopaque, t: HashAlgorithm) callconv(.C) *Ctx.Extern {
+    const self: *Ctx = @ptrCast(@alignCast(storage));
     inline for (comptime std.meta.fields(Ctx)) |field| {
         const v = comptime std.meta.stringToEnum(HashAlgorithm, field.name) orelse unreachable;
         if (v == t) {
@@ -54,6 +110,17 @@ pub fn update(e: *Ctx.Extern, raw_data: [*]const u8, size: usize) callconv(.C) v
     unreachable;
 }
 
+/// Same as `update()`, but BLAKE3 hashes large inputs on up to
+/// `threads` threads.
+pub fn updateParallel(e: *Ctx.Extern, raw_data: [*]const u8, size: usize, threads: c_uint) callconv(.C) void {
+    const self = Ctx.fromExtern(e);
+
+    switch (self.*) {
+        .blake3 => |*h| h.updateParallel(raw_data[0..size], threads),
+        else => update(e, raw_data, size),
+    }
+}
+
 pub fn finish(e: *Ctx.Extern, raw_hash: [*:0]u8) callconv(.C) void {
     const self = Ctx.fromExtern(e);
 
@@ -72,8 +139,21 @@ pub fn finish(e: *Ctx.Extern, raw_hash: [*:0]u8) callconv(.C) void {
     unreachable;
 }
 
+/// Hashes `count` independent inputs, writing the hash of
+/// `datas[i][0..sizes[i]]` to `hashes[i]`.
+pub fn hashMany(t: HashAlgorithm, count: usize, datas: [*]const [*]const u8, sizes: [*]const usize, hashes: [*]const [*]u8) callconv(.C) void {
+    for (0..count) |i| {
+        var storage: Ctx = undefined;
+        const e = init(&storage, t);
+        update(e, datas[i], sizes[i]);
+        finish(e, @ptrCast(hashes[i]));
+    }
+}
+
 comptime {
-    @export(&create, .{ .name = "nix_libutil_hash_create" });
+    @export(&init, .{ .name = "nix_libutil_hash_init" });
     @export(&update, .{ .name = "nix_libutil_hash_update" });
+    @export(&updateParallel, .{ .name = "nix_libutil_hash_update_parallel" });
     @export(&finish, .{ .name = "nix_libutil_hash_finish" });
+    @export(&hashMany, .{ .name = "nix_libutil_hash_many" });
 }
@@ -7,7 +7,10 @@
   brotli,
   libarchive,
   libsodium,
+  lz4,
   nlohmann_json,
+  xz,
+  zstd,
 
   # Configuration Options
 
@@ -45,6 +48,9 @@ mkMesonLibrary (finalAttrs: {
   buildInputs = [
     brotli
     libsodium
+    lz4
+    xz
+    zstd
   ];
 
   propagatedBuildInputs = [
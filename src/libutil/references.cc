@@ -3,61 +3,310 @@
 #include "archive.hh"
 
 #include <map>
+#include <bit>
 #include <cstdlib>
-#include <mutex>
+#include <cstring>
 #include <algorithm>
 
+#if defined(__x86_64__)
+#  include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#  include <arm_neon.h>
+#endif
+
 
 namespace nix {
 
 
-static size_t refLength = 32; /* characters */
+/* The scanner works on 64-byte blocks. For each block a "classifier"
+   produces a mask in which bit `i` is set if byte `i` of the block may
+   be a nix32 character. The classifiers below are interchangeable and
+   selected once at runtime based on the capabilities of the CPU. They
+   only test for [0-9a-z], which is cheaper than excluding the four
+   letters nix32 omits; `decodeNix32()` rejects the false
+   positives. */
+typedef void (* Classifier)(const unsigned char * p, size_t blocks, uint64_t * masks);
+
+static constexpr size_t blockSize = 64;
+
+static constexpr std::array<unsigned char, 256> nix32Values = []() {
+    std::array<unsigned char, 256> values{};
+    for (auto & v : values) v = 0xff;
+    /* Keep in sync with `nix32Chars` (which is not constexpr). */
+    const char chars[] = "0123456789abcdfghijklmnpqrsvwxyz";
+    for (unsigned char i = 0; i < 32; ++i)
+        values[(unsigned char) chars[i]] = i;
+    return values;
+}();
 
 
-static void search(
-    std::string_view s,
-    StringSet & hashes,
-    StringSet & seen)
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+
+static inline uint64_t classifySse2x16(const unsigned char * p)
 {
-    static std::once_flag initialised;
-    static bool isBase32[256];
-    std::call_once(initialised, [](){
-        for (unsigned int i = 0; i < 256; ++i) isBase32[i] = false;
-        for (unsigned int i = 0; i < nix32Chars.size(); ++i)
-            isBase32[(unsigned char) nix32Chars[i]] = true;
-    });
+    auto v = _mm_loadu_si128((const __m128i *) p);
+    auto digit = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    auto isDigit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+    auto lower = _mm_sub_epi8(v, _mm_set1_epi8('a'));
+    auto isLower = _mm_cmpeq_epi8(_mm_min_epu8(lower, _mm_set1_epi8(25)), lower);
+    return (uint16_t) _mm_movemask_epi8(_mm_or_si128(isDigit, isLower));
+}
+
+/* SSE2 is part of the x86-64 baseline, so this needs no runtime check. */
+static void classifySse2(const unsigned char * p, size_t blocks, uint64_t * masks)
+{
+    for (size_t i = 0; i < blocks; ++i, p += blockSize)
+        masks[i] = classifySse2x16(p)
+            | classifySse2x16(p + 16) << 16
+            | classifySse2x16(p + 32) << 32
+            | classifySse2x16(p + 48) << 48;
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t classifyAvx2x32(const unsigned char * p)
+{
+    auto v = _mm256_loadu_si256((const __m256i *) p);
+    auto digit = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+    auto isDigit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+    auto lower = _mm256_sub_epi8(v, _mm256_set1_epi8('a'));
+    auto isLower = _mm256_cmpeq_epi8(_mm256_min_epu8(lower, _mm256_set1_epi8(25)), lower);
+    return (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(isDigit, isLower));
+}
+
+__attribute__((target("avx2")))
+static void classifyAvx2(const unsigned char * p, size_t blocks, uint64_t * masks)
+{
+    for (size_t i = 0; i < blocks; ++i, p += blockSize)
+        masks[i] = classifyAvx2x32(p) | classifyAvx2x32(p + 32) << 32;
+}
+
+static Classifier selectClassifier()
+{
+    /* Required since this runs from a static initialiser. */
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return classifyAvx2;
+    return classifySse2;
+}
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+
+static inline uint8x16_t classifyNeonx16(const unsigned char * p)
+{
+    auto v = vld1q_u8(p);
+    auto isDigit = vcleq_u8(vsubq_u8(v, vdupq_n_u8('0')), vdupq_n_u8(9));
+    auto isLower = vcleq_u8(vsubq_u8(v, vdupq_n_u8('a')), vdupq_n_u8(25));
+    return vorrq_u8(isDigit, isLower);
+}
+
+/* NEON is mandatory on AArch64, so this needs no runtime check. */
+static void classifyNeon(const unsigned char * p, size_t blocks, uint64_t * masks)
+{
+    /* NEON has no movemask; fold the byte masks into bits by
+       weighting each lane and adding pairwise. */
+    static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    auto w = vld1q_u8(weights);
+    for (size_t i = 0; i < blocks; ++i, p += blockSize) {
+        auto s0 = vpaddq_u8(vandq_u8(classifyNeonx16(p), w), vandq_u8(classifyNeonx16(p + 16), w));
+        auto s1 = vpaddq_u8(vandq_u8(classifyNeonx16(p + 32), w), vandq_u8(classifyNeonx16(p + 48), w));
+        auto s = vpaddq_u8(s0, s1);
+        s = vpaddq_u8(s, s);
+        masks[i] = vgetq_lane_u64(vreinterpretq_u64_u8(s), 0);
+    }
+}
+
+static Classifier selectClassifier()
+{
+    return classifyNeon;
+}
+
+#else
+
+/* No vectorised classifier; `scan()` falls back to a scalar skip
+   loop. */
+static Classifier selectClassifier()
+{
+    return nullptr;
+}
+
+#endif
+
+
+static const Classifier classify = selectClassifier();
+
+
+static bool decodeNix32(const char * s, RefScanSink::RawHash & raw)
+{
+    /* The inverse of `printHash32()`: the last character holds the
+       lowest 5 bits. Since 32 nix32 characters encode exactly 160 bits,
+       every such string has a unique decoding. Decode 8 characters
+       (i.e. 5 bytes) at a time. */
+    unsigned char invalid = 0;
+    for (size_t group = 0; group < RefScanSink::refLength / 8; ++group) {
+        uint64_t bits = 0;
+        for (size_t n = 0; n < 8; ++n) {
+            auto digit = nix32Values[(unsigned char) s[RefScanSink::refLength - 1 - group * 8 - n]];
+            invalid |= digit;
+            bits |= (uint64_t) digit << (n * 5);
+        }
+        for (size_t i = 0; i < 5; ++i)
+            raw[group * 5 + i] = bits >> (i * 8);
+    }
+    return !(invalid & 0xe0);
+}
 
-    for (size_t i = 0; i + refLength <= s.size(); ) {
-        int j;
-        bool match = true;
-        for (j = refLength - 1; j >= 0; --j)
-            if (!isBase32[(unsigned char) s[i + j]]) {
-                i += j + 1;
-                match = false;
+
+static size_t slotOf(const RefScanSink::RawHash & raw)
+{
+    /* The hashes are (truncated) cryptographic hashes, so any part of
+       them is as good an index as any other. */
+    uint64_t h;
+    memcpy(&h, raw.data(), sizeof(h));
+    return h;
+}
+
+
+RefScanSink::RefScanSink(StringSet && hashes)
+{
+    for (auto & hash : hashes) {
+        Entry entry;
+        /* Anything that isn't a valid nix32 hash can never be found
+           by the scanner, so there is no point in tracking it. */
+        if (hash.size() != refLength || !decodeNix32(hash.data(), entry.raw))
+            continue;
+        entry.hash = hash;
+        entries.push_back(std::move(entry));
+    }
+
+    size_t size = 16;
+    while (size < entries.size() * 2) size *= 2;
+    slots.resize(size, 0);
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        for (size_t slot = slotOf(entries[i].raw) & (size - 1); ; slot = (slot + 1) & (size - 1))
+            if (!slots[slot]) {
+                slots[slot] = i + 1;
                 break;
             }
-        if (!match) continue;
-        std::string ref(s.substr(i, refLength));
-        if (hashes.erase(ref)) {
-            debug("found reference to '%1%' at offset '%2%'", ref, i);
-            seen.insert(ref);
+    }
+
+    remaining = entries.size();
+}
+
+
+void RefScanSink::lookup(const char * candidate, size_t offset)
+{
+    RawHash raw;
+    if (!decodeNix32(candidate, raw)) return;
+
+    auto mask = slots.size() - 1;
+    for (size_t slot = slotOf(raw) & mask; slots[slot]; slot = (slot + 1) & mask) {
+        auto & entry = entries[slots[slot] - 1];
+        if (entry.raw != raw) continue;
+        if (!entry.found) {
+            debug("found reference to '%1%' at offset '%2%'", entry.hash, offset);
+            entry.found = true;
+            seen.insert(entry.hash);
+            remaining--;
+        }
+        return;
+    }
+}
+
+
+/**
+ * Set bit `j` of a classifier mask iff bits `j - 31` to `j` are all
+ * set, treating bits below 0 as unset.
+ */
+static inline uint64_t windowEnds(uint64_t mask)
+{
+    static_assert(RefScanSink::refLength == 32);
+    mask &= mask << 1;
+    mask &= mask << 2;
+    mask &= mask << 4;
+    mask &= mask << 8;
+    mask &= mask << 16;
+    return mask;
+}
+
+
+void RefScanSink::scan(std::string_view s)
+{
+    if (!classify) {
+        for (size_t i = 0; i + refLength <= s.size() && remaining; ) {
+            int j;
+            bool match = true;
+            for (j = refLength - 1; j >= 0; --j)
+                if (nix32Values[(unsigned char) s[i + j]] == 0xff) {
+                    i += j + 1;
+                    match = false;
+                    break;
+                }
+            if (!match) continue;
+            lookup(s.data() + i, i);
+            ++i;
+        }
+        return;
+    }
+
+    auto p = (const unsigned char *) s.data();
+
+    /* Classify in batches so that the classifier runs as a tight
+       loop. */
+    constexpr size_t batchBlocks = 64;
+    uint64_t masks[batchBlocks];
+
+    /* Mask of the previous block, needed to detect windows that
+       straddle two blocks. */
+    uint64_t prev = 0;
+
+    for (size_t batch = 0; batch < s.size() && remaining; batch += batchBlocks * blockSize) {
+        auto blocks = std::min(batchBlocks, (s.size() - batch) / blockSize);
+        classify(p + batch, blocks, masks);
+
+        /* Pad the trailing partial block. */
+        if (blocks < batchBlocks && batch + blocks * blockSize < s.size()) {
+            unsigned char block[blockSize] = {};
+            memcpy(block, p + batch + blocks * blockSize, s.size() - batch - blocks * blockSize);
+            classify(block, 1, &masks[blocks++]);
+        }
+
+        for (size_t i = 0; i < blocks && remaining; ++i) {
+            auto cur = masks[i];
+
+            /* Set bit `j` iff bytes `j - 31` to `j` (relative to the
+               current block) are all candidate characters, i.e. iff a
+               candidate window ends there. Windows ending at `j >= 31`
+               lie within the current block; the others start in the
+               previous one, so look at the upper half of its mask
+               followed by the lower half of the current one. */
+            uint64_t ends = windowEnds(cur) | windowEnds(prev >> 32 | cur << 32) >> 32;
+
+            auto off = batch + i * blockSize;
+            while (ends && remaining) {
+                size_t start = off + std::countr_zero(ends) + 1 - refLength;
+                lookup(s.data() + start, start);
+                ends &= ends - 1;
+            }
+
+            prev = cur;
         }
-        ++i;
     }
 }
 
 
 void RefScanSink::operator () (std::string_view data)
 {
+    if (!remaining) return;
+
     /* It's possible that a reference spans the previous and current
        fragment, so search in the concatenation of the tail of the
        previous fragment and the start of the current fragment. */
     auto s = tail;
     auto tailLen = std::min(data.size(), refLength);
     s.append(data.data(), tailLen);
-    search(s, hashes, seen);
+    scan(s);
 
-    search(data, hashes, seen);
+    scan(data);
 
     auto rest = refLength - tailLen;
     if (rest < tail.size())
@@ -3,19 +3,64 @@
 
 #include "hash.hh"
 
+#include <array>
+
 namespace nix {
 
+/**
+ * Scans a byte stream for occurrences of a set of 32-character nix32
+ * hashes (i.e. store path hash parts).
+ *
+ * The hashes are decoded to their 20-byte binary form and kept in a
+ * flat open-addressing table, so a candidate can be looked up without
+ * allocating. Candidate windows (runs of at least 32 nix32 characters)
+ * are located by classifying the input in 64-byte blocks, using SIMD
+ * where the CPU supports it.
+ */
 class RefScanSink : public Sink
 {
-    StringSet hashes;
+public:
+
+    /**
+     * Length in characters of the hashes this sink looks for.
+     */
+    static constexpr size_t refLength = 32;
+
+    /**
+     * A `refLength`-character nix32 string decoded to binary.
+     */
+    typedef std::array<unsigned char, refLength * 5 / 8> RawHash;
+
+private:
+
+    struct Entry
+    {
+        RawHash raw;
+        std::string hash;
+        bool found = false;
+    };
+
+    std::vector<Entry> entries;
+
+    /**
+     * Open-addressing index into `entries`, offset by one so that 0
+     * denotes an empty slot. Its size is a power of two.
+     */
+    std::vector<uint32_t> slots;
+
+    size_t remaining = 0;
+
     StringSet seen;
 
     std::string tail;
 
+    void scan(std::string_view s);
+
+    void lookup(const char * candidate, size_t offset);
+
 public:
 
-    RefScanSink(StringSet && hashes) : hashes(hashes)
-    { }
+    RefScanSink(StringSet && hashes);
 
     StringSet & getResult()
     { return seen; }
@@ -43,7 +88,7 @@ struct RewritingSink : Sink
 
 struct HashModuloSink : AbstractHashSink
 {
-    HashSink hashSink;
+    ParallelHashSink hashSink;
     RewritingSink rewritingSink;
 
     HashModuloSink(HashAlgorithm ha, const std::string & modulus);
@@ -132,6 +132,16 @@ bool BufferedSource::hasData()
 }
 
 
+std::string_view BufferedSource::readBuffered(size_t len)
+{
+    size_t n = std::min(len, bufPosIn - bufPosOut);
+    std::string_view data(buffer.get() + bufPosOut, n);
+    bufPosOut += n;
+    if (bufPosIn == bufPosOut) bufPosIn = bufPosOut = 0;
+    return data;
+}
+
+
 size_t FdSource::readUnbuffered(char * data, size_t len)
 {
 #ifdef _WIN32
@@ -110,6 +110,13 @@ struct BufferedSource : Source
      */
     bool hasData();
 
+    /**
+     * Consume up to `len` bytes that have already been read into the
+     * buffer, without reading anything more. The result is only valid
+     * until the next read.
+     */
+    std::string_view readBuffered(size_t len);
+
 protected:
     /**
      * Underlying read call, to be overridden.
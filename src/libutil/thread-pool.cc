@@ -1,9 +1,16 @@
 #include "thread-pool.hh"
 #include "signals.hh"
 #include "util.hh"
+#include "finally.hh"
 
 namespace nix {
 
+/**
+ * The pool and queue of the current thread, if it is running
+ * `ThreadPool::doWork()`.
+ */
+static thread_local std::pair<ThreadPool *, size_t> currentQueue{nullptr, 0};
+
 ThreadPool::ThreadPool(size_t _maxThreads)
     : maxThreads(_maxThreads)
 {
@@ -12,6 +19,9 @@ ThreadPool::ThreadPool(size_t _maxThreads)
         if (!maxThreads) maxThreads = 1;
     }
 
+    for (size_t i = 0; i < maxThreads; ++i)
+        queues.push_back(std::make_unique<Queue>());
+
     debug("starting pool of %d threads", maxThreads - 1);
 }
 
@@ -39,16 +49,34 @@ void ThreadPool::shutdown()
         thr.join();
 }
 
-void ThreadPool::enqueue(const work_t & t)
+void ThreadPool::enqueue(const work_t & t, Priority priority)
 {
-    auto state(state_.lock());
     if (quit)
         throw ThreadPoolShutDown("cannot enqueue a work item while the thread pool is shutting down");
-    state->pending.push(t);
+
+    auto & queue = *queues[currentQueue.first == this ? currentQueue.second : 0];
+    auto p = static_cast<size_t>(priority);
+
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.items[p].push_back(t);
+        queue.sizes[p]++;
+        pending++;
+    }
+
     /* Note: process() also executes items, so count it as a worker. */
-    if (state->pending.size() > state->workers.size() + 1 && state->workers.size() + 1 < maxThreads)
-        state->workers.emplace_back(&ThreadPool::doWork, this, false);
-    work.notify_one();
+    if (pending > nrWorkers + 1 && nrWorkers + 1 < maxThreads) {
+        auto state(state_.lock());
+        if (!quit && pending > nrWorkers + 1 && nrWorkers + 1 < maxThreads)
+            state->workers.emplace_back(&ThreadPool::doWork, this, ++nrWorkers);
+    }
+
+    /* A sleeping thread checks `pending` after registering in
+       `sleepers`, so it either sees this item or gets woken up. */
+    if (sleepers) {
+        auto state(state_.lock());
+        work.notify_one();
+    }
 }
 
 void ThreadPool::process()
@@ -57,7 +85,7 @@ void ThreadPool::process()
 
     /* Do work until no more work is pending or active. */
     try {
-        doWork(true);
+        doWork(0);
 
         auto state(state_.lock());
 
@@ -77,87 +105,113 @@ void ThreadPool::process()
     }
 }
 
-void ThreadPool::doWork(bool mainThread)
+bool ThreadPool::pop(size_t self, work_t & w)
+{
+    /* Take the highest-priority item available, looking at our own
+       queue first. We take our own most recent item, which is likely
+       related to what we just did, but steal the oldest items of
+       others. Queue 0 is FIFO since it holds the items enqueued from
+       outside. */
+    for (size_t p = 0; p < nrPriorities; ++p) {
+        for (size_t n = 0; n < maxThreads; ++n) {
+            auto i = (self + n) % maxThreads;
+            auto & queue = *queues[i];
+            if (!queue.sizes[p]) continue;
+
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            auto & items = queue.items[p];
+            if (items.empty()) continue;
+
+            if (i == self && self != 0) {
+                w = std::move(items.back());
+                items.pop_back();
+            } else {
+                w = std::move(items.front());
+                items.pop_front();
+            }
+            queue.sizes[p]--;
+            pending--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ThreadPool::doWork(size_t self)
 {
     ReceiveInterrupts receiveInterrupts;
 
 #ifndef _WIN32 // Does Windows need anything similar for async exit handling?
-    if (!mainThread)
+    if (self)
         unix::interruptCheck = [&]() { return (bool) quit; };
 #endif
 
-    bool didWork = false;
-    std::exception_ptr exc;
+    auto prevQueue = currentQueue;
+    currentQueue = {this, self};
+    Finally restoreQueue([&]() { currentQueue = prevQueue; });
 
     while (true) {
+        /* Count ourselves as active before taking an item, so that
+           `pending` and `active` are never both zero while an item is
+           in flight. */
+        active++;
+
         work_t w;
-        {
-            auto state(state_.lock());
-
-            if (didWork) {
-                assert(state->active);
-                state->active--;
-
-                if (exc) {
-
-                    if (!state->exception) {
-                        state->exception = exc;
-                        // Tell the other workers to quit.
-                        quit = true;
-                        work.notify_all();
-                    } else {
-                        /* Print the exception, since we can't
-                           propagate it. */
-                        try {
-                            std::rethrow_exception(exc);
-                        } catch (const Interrupted &) {
-                            // The interrupted state may be picked up by multiple
-                            // workers, which is expected, so we should ignore
-                            // it silently and let the first one bubble up,
-                            // rethrown via the original state->exception.
-                        } catch (const ThreadPoolShutDown &) {
-                            // Similarly expected.
-                        } catch (std::exception & e) {
-                            ignoreExceptionExceptInterrupt();
-                        }
+        if (!quit && pop(self, w)) {
+            try {
+                w();
+            } catch (...) {
+                auto exc = std::current_exception();
+                auto state(state_.lock());
+                if (!state->exception) {
+                    state->exception = exc;
+                    // Tell the other workers to quit.
+                    quit = true;
+                    work.notify_all();
+                } else {
+                    /* Print the exception, since we can't
+                       propagate it. */
+                    try {
+                        std::rethrow_exception(exc);
+                    } catch (const Interrupted &) {
+                        // The interrupted state may be picked up by multiple
+                        // workers, which is expected, so we should ignore
+                        // it silently and let the first one bubble up,
+                        // rethrown via the original state->exception.
+                    } catch (const ThreadPoolShutDown &) {
+                        // Similarly expected.
+                    } catch (std::exception & e) {
+                        ignoreExceptionExceptInterrupt();
                     }
                 }
             }
+            w = nullptr;
+            active--;
+            continue;
+        }
 
-            /* Wait until a work item is available or we're asked to
-               quit. */
-            while (true) {
-                if (quit) return;
-
-                if (!state->pending.empty()) break;
-
-                /* If there are no active or pending items, and the
-                   main thread is running process(), then no new items
-                   can be added. So exit. */
-                if (!state->active && state->draining) {
-                    quit = true;
-                    work.notify_all();
-                    return;
-                }
+        active--;
 
-                state.wait(work);
-            }
+        /* Wait until a work item is available or we're asked to
+           quit. */
+        auto state(state_.lock());
 
-            w = std::move(state->pending.front());
-            state->pending.pop();
-            state->active++;
-        }
+        if (quit) return;
 
-        try {
-            w();
-        } catch (...) {
-            exc = std::current_exception();
+        /* If there are no active or pending items, and the main
+           thread is running process(), then no new items can be
+           added. So exit. */
+        if (!pending && !active && state->draining) {
+            quit = true;
+            work.notify_all();
+            return;
         }
 
-        didWork = true;
+        sleepers++;
+        if (!pending) state.wait(work);
+        sleepers--;
     }
 }
 
 }
-
-
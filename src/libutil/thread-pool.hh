@@ -4,10 +4,14 @@
 #include "error.hh"
 #include "sync.hh"
 
-#include <queue>
+#include <algorithm>
+#include <array>
+#include <deque>
 #include <functional>
+#include <future>
 #include <thread>
 #include <map>
+#include <optional>
 #include <atomic>
 
 namespace nix {
@@ -15,8 +19,13 @@ namespace nix {
 MakeError(ThreadPoolShutDown, Error);
 
 /**
- * A simple thread pool that executes a queue of work items
- * (lambdas).
+ * A thread pool that executes work items (lambdas).
+ *
+ * Each thread has its own queue. Items enqueued by a work item go to
+ * the queue of the thread running it, and idle threads steal items
+ * from the queues of the others. This keeps related items on the same
+ * thread and avoids contention on a single queue when there are many
+ * threads.
  */
 class ThreadPool
 {
@@ -28,15 +37,37 @@ public:
 
     /**
      * An individual work item.
-     *
-     * \todo use std::packaged_task?
      */
     typedef std::function<void()> work_t;
 
+    /**
+     * Pending work items of a higher priority are started before
+     * those of a lower priority.
+     */
+    enum class Priority { High, Normal, Low };
+
     /**
      * Enqueue a function to be executed by the thread pool.
      */
-    void enqueue(const work_t & t);
+    void enqueue(const work_t & t, Priority priority = Priority::Normal);
+
+    /**
+     * Enqueue a function to be executed by the thread pool, and
+     * return a future for its result. Unlike with `enqueue()`, an
+     * exception thrown by the function does not stop the pool, but
+     * is stored in the future.
+     *
+     * \note The result is not available before the item has been
+     * started, which may not happen before `process()` is called.
+     */
+    template<typename F>
+    std::future<std::invoke_result_t<F>> enqueueWithResult(F && f, Priority priority = Priority::Normal)
+    {
+        auto task = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(std::forward<F>(f));
+        auto future = task->get_future();
+        enqueue([task]() { (*task)(); }, priority);
+        return future;
+    }
 
     /**
      * Execute work items until the queue is empty.
@@ -54,12 +85,47 @@ public:
 
 private:
 
+    static constexpr size_t nrPriorities = 3;
+
     size_t maxThreads;
 
+    /**
+     * The queue of a thread. Queue 0 belongs to the thread calling
+     * `process()` and also receives the items enqueued from outside
+     * the pool; queue `i > 0` belongs to the `i`th worker thread.
+     */
+    struct Queue
+    {
+        std::mutex mutex;
+        std::array<std::deque<work_t>, nrPriorities> items;
+
+        /**
+         * The sizes of `items`, for checking without locking.
+         */
+        std::array<std::atomic<size_t>, nrPriorities> sizes{};
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+
+    /**
+     * The number of items that have been enqueued but not started.
+     */
+    std::atomic<size_t> pending{0};
+
+    /**
+     * The number of threads running an item or looking for one.
+     */
+    std::atomic<size_t> active{0};
+
+    /**
+     * The number of threads waiting for `work`.
+     */
+    std::atomic<size_t> sleepers{0};
+
+    std::atomic<size_t> nrWorkers{0};
+
     struct State
     {
-        std::queue<work_t> pending;
-        size_t active = 0;
         std::exception_ptr exception;
         std::vector<std::thread> workers;
         bool draining = false;
@@ -71,7 +137,9 @@ private:
 
     std::condition_variable work;
 
-    void doWork(bool mainThread);
+    bool pop(size_t self, work_t & w);
+
+    void doWork(size_t self);
 
     void shutdown();
 };
@@ -87,72 +155,99 @@ void processGraph(
     std::function<std::set<T>(const T &)> getEdges,
     std::function<void(const T &)> processNode)
 {
-    struct Graph {
-        std::set<T> left;
-        std::map<T, std::set<T>> refs, rrefs;
+    /* Nodes are identified by their position in `nodes`. Since the
+       set is sorted, we can find the index of a node by binary search
+       in a flat array that is never modified, so lookups don't need a
+       lock. */
+    std::vector<const T *> index;
+    index.reserve(nodes.size());
+    for (auto & node : nodes)
+        index.push_back(&node);
+
+    auto find = [&](const T & node) -> std::optional<size_t> {
+        auto i = std::lower_bound(index.begin(), index.end(), &node,
+            [](const T * a, const T * b) { return *a < *b; });
+        if (i == index.end() || node < **i) return std::nullopt;
+        return i - index.begin();
+    };
+
+    struct Node {
+        /**
+         * The number of dependencies that haven't been processed
+         * yet, plus one while the dependencies are being registered.
+         */
+        std::atomic<size_t> refs{1};
+
+        /**
+         * Whether this node has been processed. Protected by the
+         * node's shard lock, as is `rrefs`.
+         */
+        bool done = false;
+
+        /**
+         * The nodes that are waiting for this node.
+         */
+        std::vector<size_t> rrefs;
     };
 
-    Sync<Graph> graph_(Graph{nodes, {}, {}});
+    std::vector<Node> graph(nodes.size());
 
-    std::function<void(const T &)> worker;
+    /* Per-node locks would be wasteful for big graphs, and a single
+       lock would be contended, so use a fixed number of shards. */
+    constexpr size_t nrShards = 64;
+    std::array<std::mutex, nrShards> shards;
+
+    std::atomic<size_t> nrDone{0};
+
+    std::function<void(size_t)> worker;
 
     /* Create pool last to ensure threads are stopped before other destructors
      * run */
     ThreadPool pool;
 
-    worker = [&](const T & node) {
+    worker = [&](size_t n) {
+        auto & node = graph[n];
+
+        /* The first time a node is visited, register it with its
+           unprocessed dependencies. The last dependency to finish
+           will enqueue it again. */
+        if (node.refs == 1) {
+            auto refs = getEdges(*index[n]);
+
+            for (auto & ref : refs) {
+                auto r = find(ref);
+                if (!r || *r == n) continue;
+                std::lock_guard<std::mutex> lock(shards[*r % nrShards]);
+                if (graph[*r].done) continue;
+                node.refs++;
+                graph[*r].rrefs.push_back(n);
+            }
 
-        {
-            auto graph(graph_.lock());
-            auto i = graph->refs.find(node);
-            if (i == graph->refs.end())
-                goto getRefs;
-            goto doWork;
+            if (--node.refs) return;
         }
 
-    getRefs:
+        processNode(*index[n]);
+
+        std::vector<size_t> rrefs;
         {
-            auto refs = getEdges(node);
-            refs.erase(node);
-
-            {
-                auto graph(graph_.lock());
-                for (auto & ref : refs)
-                    if (graph->left.count(ref)) {
-                        graph->refs[node].insert(ref);
-                        graph->rrefs[ref].insert(node);
-                    }
-                if (graph->refs[node].empty())
-                    goto doWork;
-            }
+            std::lock_guard<std::mutex> lock(shards[n % nrShards]);
+            node.done = true;
+            std::swap(rrefs, node.rrefs);
         }
 
-        return;
-
-    doWork:
-        processNode(node);
+        nrDone++;
 
         /* Enqueue work for all nodes that were waiting on this one
-           and have no unprocessed dependencies. */
-        {
-            auto graph(graph_.lock());
-            for (auto & rref : graph->rrefs[node]) {
-                auto & refs(graph->refs[rref]);
-                auto i = refs.find(node);
-                assert(i != refs.end());
-                refs.erase(i);
-                if (refs.empty())
-                    pool.enqueue(std::bind(worker, rref));
-            }
-            graph->left.erase(node);
-            graph->refs.erase(node);
-            graph->rrefs.erase(node);
-        }
+           and have no unprocessed dependencies. Finish what has been
+           started before starting something new. */
+        for (auto rref : rrefs)
+            if (--graph[rref].refs == 0)
+                pool.enqueue(std::bind(worker, rref), ThreadPool::Priority::High);
     };
 
-    for (auto & node : nodes) {
+    for (size_t n = 0; n < nodes.size(); ++n) {
         try {
-            pool.enqueue(std::bind(worker, std::ref(node)));
+            pool.enqueue(std::bind(worker, n));
         } catch (ThreadPoolShutDown &) {
             /* Stop if the thread pool is shutting down. It means a
                previous work item threw an exception, so process()
@@ -163,7 +258,7 @@ void processGraph(
 
     pool.process();
 
-    if (!graph_.lock()->left.empty())
+    if (nrDone != nodes.size())
         throw Error("graph processing incomplete (cyclic reference?)");
 }
 
@@ -6,6 +6,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#ifdef __linux__
+# include <sys/sendfile.h>
+#endif
+
 namespace nix {
 
 std::string readFile(int fd)
@@ -105,6 +109,60 @@ void drainFD(int fd, Sink & sink, bool block)
     }
 }
 
+
+uint64_t copyFdRange(int from, int to, uint64_t len)
+{
+    /* Try each mechanism in turn. One that doesn't support this pair
+       of file descriptors fails without consuming any input, so we
+       can move on to the next one, and ultimately leave the rest to
+       the caller. */
+    enum Method { CopyFileRange, Splice, SendFile, None } method = CopyFileRange;
+    uint64_t done = 0;
+
+    while (done < len && method != None) {
+        checkInterrupt();
+        size_t chunk = std::min<uint64_t>(len - done, 16 * 1024 * 1024);
+        ssize_t n = -1;
+        errno = ENOSYS;
+
+        switch (method) {
+        case CopyFileRange:
+#if HAVE_COPY_FILE_RANGE
+            n = copy_file_range(from, nullptr, to, nullptr, chunk, 0);
+#endif
+            break;
+        case Splice:
+#if HAVE_SPLICE
+            n = splice(from, nullptr, to, nullptr, chunk, SPLICE_F_MOVE);
+#endif
+            break;
+        case SendFile:
+#ifdef __linux__
+            n = sendfile(to, from, nullptr, chunk);
+#endif
+            break;
+        case None:
+            break;
+        }
+
+        if (n > 0)
+            done += n;
+        else if (n == 0 || errno == EAGAIN || errno == EWOULDBLOCK)
+            /* End-of-file or no data yet; let the caller's read()
+               deal with it. */
+            break;
+        else if (errno == EINTR)
+            continue;
+        else if (errno == EINVAL || errno == EXDEV || errno == ENOSYS
+            || errno == EOPNOTSUPP || errno == EBADF || errno == ESPIPE)
+            method = static_cast<Method>(method + 1);
+        else
+            throw SysError("copying data between file descriptors");
+    }
+
+    return done;
+}
+
 //////////////////////////////////////////////////////////////////////
 
 void Pipe::create()
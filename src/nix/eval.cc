@@ -5,6 +5,7 @@
 #include "eval.hh"
 #include "eval-inline.hh"
 #include "value-to-json.hh"
+#include "parallel-eval.hh"
 #include "progress-bar.hh"
 
 #include <nlohmann/json.hpp>
@@ -56,6 +57,41 @@ struct CmdEval : MixJSON, InstallableValueCommand, MixReadOnlyOption
 
     Category category() override { return catSecondary; }
 
+    /**
+     * Force the parts of `v` that will be printed using multiple
+     * threads, if `eval-cores` allows it. Like the printers, this
+     * doesn't descend into derivations. Errors are ignored here, so
+     * that printing reports them with the usual context.
+     */
+    void forceParallel(EvalState & state, Value & v)
+    {
+        ParallelEval parallelEval(state);
+        if (!parallelEval.isParallel()) return;
+
+        std::function<void(Value & v)> recurse;
+
+        recurse = [&](Value & v)
+        {
+            try {
+                state.forceValue(v, noPos);
+                if (v.type() == nAttrs) {
+                    if (state.isDerivation(v)) return;
+                    for (auto & attr : *v.attrs())
+                        parallelEval.enqueue([&recurse, v2{attr.value}]() { recurse(*v2); });
+                }
+                else if (v.type() == nList) {
+                    for (auto v2 : v.listItems())
+                        parallelEval.enqueue([&recurse, v2]() { recurse(*v2); });
+                }
+            } catch (Error &) {
+            }
+        };
+
+        recurse(v);
+
+        parallelEval.process();
+    }
+
     void run(ref<Store> store, ref<InstallableValue> installable) override
     {
         if (raw && json)
@@ -119,10 +155,12 @@ struct CmdEval : MixJSON, InstallableValueCommand, MixReadOnlyOption
         }
 
         else if (json) {
+            forceParallel(*state, *v);
             logger->cout("%s", printValueAsJSON(*state, true, *v, pos, context, false));
         }
 
         else {
+            forceParallel(*state, *v);
             logger->cout(
                 "%s",
                 ValuePrinter(
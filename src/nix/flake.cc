@@ -15,6 +15,7 @@
 #include "fetchers.hh"
 #include "registry.hh"
 #include "eval-cache.hh"
+#include "parallel-eval.hh"
 #include "markdown.hh"
 #include "users.hh"
 #include "fetch-to-store.hh"
@@ -370,7 +371,7 @@ struct CmdFlakeCheck : FlakeCommand
         auto flake = lockFlake();
         auto localSystem = std::string(settings.thisSystem.get());
 
-        bool hasErrors = false;
+        std::atomic<bool> hasErrors = false;
         auto reportError = [&](const Error & e) {
             try {
                 throw e;
@@ -441,7 +442,7 @@ struct CmdFlakeCheck : FlakeCommand
             return std::nullopt;
         };
 
-        std::vector<DerivedPath> drvPaths;
+        Sync<std::vector<DerivedPath>> drvPaths_;
 
         auto checkApp = [&](const std::string & attrPath, Value & v, const PosIdx pos) {
             try {
@@ -492,8 +493,8 @@ struct CmdFlakeCheck : FlakeCommand
                 if (!v.isLambda()) {
                     throw Error("overlay is not a function, but %s instead", showType(v));
                 }
-                if (v.payload.lambda.fun->hasFormals()
-                    || !argHasName(v.payload.lambda.fun->arg, "final"))
+                if (v.lambda().fun->hasFormals()
+                    || !argHasName(v.lambda().fun->arg, "final"))
                     throw Error("overlay does not take an argument named 'final'");
                 // FIXME: if we have a 'nixpkgs' input, use it to
                 // evaluate the overlay.
@@ -620,6 +621,12 @@ struct CmdFlakeCheck : FlakeCommand
                     try {
                         evalSettings.enableImportFromDerivation.setDefault(name != "hydraJobs");
 
+                        /* Derivations and apps are checked in parallel.
+                           This is finished before the next output,
+                           since that may allow import-from-derivation
+                           differently. */
+                        ParallelEval parallelEval(*state);
+
                         state->forceValue(vOutput, pos);
 
                         std::string_view replacement =
@@ -642,16 +649,18 @@ struct CmdFlakeCheck : FlakeCommand
                                 if (checkSystemType(attr_name, attr.pos)) {
                                     state->forceAttrs(*attr.value, attr.pos, "");
                                     for (auto & attr2 : *attr.value->attrs()) {
-                                        auto drvPath = checkDerivation(
-                                            fmt("%s.%s.%s", name, attr_name, state->symbols[attr2.name]),
-                                            *attr2.value, attr2.pos);
-                                        if (drvPath && attr_name == settings.thisSystem.get()) {
-                                            auto path = DerivedPath::Built {
-                                                .drvPath = makeConstantStorePathRef(*drvPath),
-                                                .outputs = OutputsSpec::All { },
-                                            };
-                                            drvPaths.push_back(std::move(path));
-                                        }
+                                        parallelEval.enqueue([&, attr_name, attr2]() {
+                                            auto drvPath = checkDerivation(
+                                                fmt("%s.%s.%s", name, attr_name, state->symbols[attr2.name]),
+                                                *attr2.value, attr2.pos);
+                                            if (drvPath && attr_name == settings.thisSystem.get()) {
+                                                auto path = DerivedPath::Built {
+                                                    .drvPath = makeConstantStorePathRef(*drvPath),
+                                                    .outputs = OutputsSpec::All { },
+                                                };
+                                                drvPaths_.lock()->push_back(std::move(path));
+                                            }
+                                        });
                                     }
                                 }
                             }
@@ -678,9 +687,11 @@ struct CmdFlakeCheck : FlakeCommand
                                 if (checkSystemType(attr_name, attr.pos)) {
                                     state->forceAttrs(*attr.value, attr.pos, "");
                                     for (auto & attr2 : *attr.value->attrs())
-                                        checkDerivation(
-                                            fmt("%s.%s.%s", name, attr_name, state->symbols[attr2.name]),
-                                            *attr2.value, attr2.pos);
+                                        parallelEval.enqueue([&, attr_name, attr2]() {
+                                            checkDerivation(
+                                                fmt("%s.%s.%s", name, attr_name, state->symbols[attr2.name]),
+                                                *attr2.value, attr2.pos);
+                                        });
                                 };
                             }
                         }
@@ -693,9 +704,11 @@ struct CmdFlakeCheck : FlakeCommand
                                 if (checkSystemType(attr_name, attr.pos)) {
                                     state->forceAttrs(*attr.value, attr.pos, "");
                                     for (auto & attr2 : *attr.value->attrs())
-                                        checkApp(
-                                            fmt("%s.%s.%s", name, attr_name, state->symbols[attr2.name]),
-                                            *attr2.value, attr2.pos);
+                                        parallelEval.enqueue([&, attr_name, attr2]() {
+                                            checkApp(
+                                                fmt("%s.%s.%s", name, attr_name, state->symbols[attr2.name]),
+                                                *attr2.value, attr2.pos);
+                                        });
                                 };
                             }
                         }
@@ -822,6 +835,8 @@ struct CmdFlakeCheck : FlakeCommand
                         else
                             warn("unknown flake output '%s'", name);
 
+                        parallelEval.process();
+
                     } catch (Error & e) {
                         e.addTrace(resolve(pos), HintFmt("while checking flake output '%s'", name));
                         reportError(e);
@@ -829,6 +844,8 @@ struct CmdFlakeCheck : FlakeCommand
                 });
         }
 
+        auto drvPaths(std::move(*drvPaths_.lock()));
+
         if (build && !drvPaths.empty()) {
             Activity act(*logger, lvlInfo, actUnknown,
                 fmt("running %d flake checks", drvPaths.size()));
@@ -85,7 +85,7 @@ struct CmdHashBase : Command
                 if (modulus)
                     return std::make_unique<HashModuloSink>(hashAlgo, *modulus);
                 else
-                    return std::make_unique<HashSink>(hashAlgo);
+                    return std::make_unique<ParallelHashSink>(hashAlgo);
             };
 
             auto makeSourcePath = [&]() -> SourcePath {
@@ -111,7 +111,7 @@ struct CmdHashBase : Command
             {
                 auto sourcePath = makeSourcePath();
                 auto hashSink = makeSink();
-                dumpPath(sourcePath, *hashSink, (FileSerialisationMethod) mode);
+                dumpPathParallel(*sourcePath.accessor, sourcePath.path, *hashSink);
                 h = hashSink->finish().first;
                 break;
             }
@@ -8,6 +8,7 @@
 #include "common-args.hh"
 #include "shared.hh"
 #include "eval-cache.hh"
+#include "parallel-eval.hh"
 #include "attr-path.hh"
 #include "hilite.hh"
 #include "strings-inline.hh"
@@ -87,10 +88,12 @@ struct CmdSearch : InstallableValueCommand, MixJSON
 
         auto state = getEvalState();
 
-        std::optional<nlohmann::json> jsonOut;
-        if (json) jsonOut = json::object();
+        Sync<std::optional<nlohmann::json>> jsonOut;
+        if (json) *jsonOut.lock() = json::object();
 
-        uint64_t results = 0;
+        std::atomic<uint64_t> results = 0;
+
+        ParallelEval parallelEval(*state);
 
         std::function<void(eval_cache::AttrCursor & cursor, const std::vector<Symbol> & attrPath, bool initialRecurse)> visit;
 
@@ -107,7 +110,9 @@ struct CmdSearch : InstallableValueCommand, MixJSON
                         auto cursor2 = cursor.getAttr(state->symbols[attr]);
                         auto attrPath2(attrPath);
                         attrPath2.push_back(attr);
-                        visit(*cursor2, attrPath2, false);
+                        parallelEval.enqueue([&visit, cursor2, attrPath2]() {
+                            visit(*cursor2, attrPath2, false);
+                        });
                     }
                 };
 
@@ -153,22 +158,26 @@ struct CmdSearch : InstallableValueCommand, MixJSON
 
                     if (found)
                     {
-                        results++;
+                        auto n = ++results;
                         if (json) {
-                            (*jsonOut)[attrPath2] = {
+                            (**jsonOut.lock())[attrPath2] = {
                                 {"pname", name.name},
                                 {"version", name.version},
                                 {"description", description},
                             };
                         } else {
-                            if (results > 1) logger->cout("");
-                            logger->cout(
-                                "* %s%s",
+                            /* Print each result with a single call, so
+                               that results found by different threads
+                               don't get mixed up. */
+                            auto out = fmt(
+                                "%s* %s%s",
+                                n > 1 ? "\n" : "",
                                 wrap("\e[0;1m", hiliteMatches(attrPath2, attrPathMatches, ANSI_GREEN, "\e[0;1m")),
                                 name.version != "" ? " (" + name.version + ")" : "");
                             if (description != "")
-                                logger->cout(
-                                    "  %s", hiliteMatches(description, descriptionMatches, ANSI_GREEN, ANSI_NORMAL));
+                                out += fmt(
+                                    "\n  %s", hiliteMatches(description, descriptionMatches, ANSI_GREEN, ANSI_NORMAL));
+                            logger->cout(out);
                         }
                     }
                 }
@@ -197,8 +206,10 @@ struct CmdSearch : InstallableValueCommand, MixJSON
         for (auto & cursor : installable->getCursors(*state))
             visit(*cursor, cursor->getAttrPath(), true);
 
+        parallelEval.process();
+
         if (json)
-            logger->cout("%s", *jsonOut);
+            logger->cout("%s", **jsonOut.lock());
 
         if (!json && !results)
             throw Error("no results for the given search term(s)!");
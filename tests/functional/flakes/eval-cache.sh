@@ -37,3 +37,14 @@ expect 1 nix build "$flake1Dir#foo.bar" 2>&1 | grepQuiet 'error: breaks'
 expect 1 nix build "$flake1Dir#ifd" --option allow-import-from-derivation false 2>&1 \
   | grepQuiet 'error: cannot build .* during evaluation because the option '\''allow-import-from-derivation'\'' is disabled'
 nix build --no-link "$flake1Dir#ifd"
+
+# Concurrent evaluations share the cache
+pids=()
+for i in $(seq 4); do
+    nix build --no-link "$flake1Dir#drv" &
+    pids+=($!)
+done
+for pid in "${pids[@]}"; do
+    wait "$pid"
+done
+nix build --no-link "$flake1Dir#drv" --debug 2>&1 | grepQuiet "using cached string attribute 'drv.drvPath'"
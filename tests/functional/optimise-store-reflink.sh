@@ -0,0 +1,63 @@
+#!/usr/bin/env bash
+
+source common.sh
+
+TODO_NixOS
+
+clearStoreIfPossible
+
+echo x > "$NIX_STORE_DIR/.reflink-probe"
+if ! cp --reflink=always "$NIX_STORE_DIR/.reflink-probe" "$TEST_ROOT/reflink-probe" 2> /dev/null; then
+    rm -f "$NIX_STORE_DIR/.reflink-probe"
+    skipTest "the file system does not support reflinks"
+fi
+rm -f "$NIX_STORE_DIR/.reflink-probe"
+
+# Use enough data that file systems don't store it inline.
+build() {
+    echo 'with import '"${config_nix}"'; mkDerivation { name = "'"$1"'"; builder = builtins.toFile "builder" "mkdir $out; yes hello | head -c 65536 > $out/foo"; }' \
+        | nix-build - "${@:2}"
+}
+
+outPath1=$(build foo1 -o "$TEST_ROOT/result1")
+outPath2=$(build foo2 --no-out-link)
+
+NIX_REMOTE="" nix-store --optimise --option optimise-mode reflink 2>&1 | grepQuiet "deduplicating 1 files"
+
+# Each file keeps its own inode.
+if [ "$(stat --format=%i "$outPath1/foo")" = "$(stat --format=%i "$outPath2/foo")" ]; then
+    echo "inodes match unexpectedly"
+    exit 1
+fi
+
+# The reflinked copy is still in use by the first path, so the garbage
+# collector must not delete it, even though its link count is 1.
+nix-store --gc
+
+if [ -e "$outPath2" ]; then
+    echo "$outPath2 should have been garbage collected"
+    exit 1
+fi
+
+if [ -z "$(ls "$NIX_STORE_DIR/.reflinks")" ]; then
+    echo ".reflinks directory empty after GC"
+    exit 1
+fi
+
+# New files are still deduplicated against it.
+outPath3=$(build foo3 --no-out-link)
+
+NIX_REMOTE="" nix-store --optimise --option optimise-mode reflink 2>&1 | grepQuiet "deduplicating 1 files"
+
+if [ "$(stat --format=%i "$outPath1/foo")" = "$(stat --format=%i "$outPath3/foo")" ]; then
+    echo "inodes match unexpectedly"
+    exit 1
+fi
+
+rm "$TEST_ROOT/result1"
+nix-store --gc
+
+if [ -n "$(ls "$NIX_STORE_DIR/.reflinks")" ]; then
+    echo ".reflinks directory not empty after GC"
+    exit 1
+fi
@@ -41,6 +41,19 @@ if [ "$inode1" != "$inode3" ]; then
     exit 1
 fi
 
+# A second run only has to look at paths added since the first one.
+outPath4=$(echo 'with import '"${config_nix}"'; mkDerivation { name = "foo4"; builder = builtins.toFile "builder" "mkdir $out; echo hello > $out/foo"; }' | nix-build - --no-out-link)
+
+NIX_REMOTE="" nix-store --optimise
+
+inode4="$(stat --format=%i $outPath4/foo)"
+if [ "$inode1" != "$inode4" ]; then
+    echo "inodes do not match"
+    exit 1
+fi
+
+NIX_REMOTE="" nix-store --optimise --option optimise-incremental false
+
 nix-store --gc
 
 if [ -n "$(ls $NIX_STORE_DIR/.links)" ]; then